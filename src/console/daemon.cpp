@@ -0,0 +1,1077 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "daemon.h"
+#include "nfo_renderer_export.h"
+#include "util.h"
+#include <json.hpp>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+using json = nlohmann::json;
+
+#ifdef _WIN32
+#define _DAEMON_READ(FD, BUF, LEN) _read(FD, BUF, static_cast<unsigned int>(LEN))
+#define _DAEMON_WRITE(FD, BUF, LEN) _write(FD, BUF, static_cast<unsigned int>(LEN))
+#else
+#define _DAEMON_READ(FD, BUF, LEN) read(FD, BUF, LEN)
+#define _DAEMON_WRITE(FD, BUF, LEN) write(FD, BUF, LEN)
+#endif
+
+
+/************************************************************************/
+/* Messages and files                                                   */
+/************************************************************************/
+
+static bool _ReadAll(int a_fd, void* a_buf, size_t a_len)
+{
+	char* l_buf = static_cast<char*>(a_buf);
+
+	while (a_len > 0)
+	{
+		const auto l_read = _DAEMON_READ(a_fd, l_buf, std::min<size_t>(a_len, 1 << 20));
+
+		if (l_read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (l_read <= 0)
+		{
+			return false;
+		}
+
+		l_buf += l_read;
+		a_len -= static_cast<size_t>(l_read);
+	}
+
+	return true;
+}
+
+
+static bool _WriteAll(int a_fd, const void* a_buf, size_t a_len)
+{
+	const char* l_buf = static_cast<const char*>(a_buf);
+
+	while (a_len > 0)
+	{
+		const auto l_written = _DAEMON_WRITE(a_fd, l_buf, std::min<size_t>(a_len, 1 << 20));
+
+		if (l_written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (l_written <= 0)
+		{
+			return false;
+		}
+
+		l_buf += l_written;
+		a_len -= static_cast<size_t>(l_written);
+	}
+
+	return true;
+}
+
+
+static bool _WriteMessage(int a_fd, const std::string& a_message)
+{
+	const uint32_t l_len = static_cast<uint32_t>(a_message.size());
+	const unsigned char l_header[4] = {
+		static_cast<unsigned char>(l_len >> 24), static_cast<unsigned char>(l_len >> 16),
+		static_cast<unsigned char>(l_len >> 8), static_cast<unsigned char>(l_len)
+	};
+
+	return _WriteAll(a_fd, l_header, sizeof(l_header)) && _WriteAll(a_fd, a_message.data(), a_message.size());
+}
+
+
+bool CRenderDaemon::ReadMessage(int a_fd, std::string& ar_message, bool& ar_tooLarge)
+{
+	unsigned char l_header[4];
+
+	ar_tooLarge = false;
+
+	if (!_ReadAll(a_fd, l_header, sizeof(l_header)))
+	{
+		return false;
+	}
+
+	const size_t l_len = (static_cast<size_t>(l_header[0]) << 24) | (static_cast<size_t>(l_header[1]) << 16)
+		| (static_cast<size_t>(l_header[2]) << 8) | l_header[3];
+
+	if (l_len > MAX_MESSAGE_SIZE)
+	{
+		ar_tooLarge = true;
+		return false;
+	}
+
+	ar_message.resize(l_len);
+
+	return _ReadAll(a_fd, &ar_message[0], l_len);
+}
+
+
+static std::string _ReplyJSON(const std::string& a_id, json a_reply)
+{
+	if (!a_id.empty())
+	{
+		a_reply["id"] = json::parse(a_id);
+	}
+
+	return a_reply.dump();
+}
+
+
+std::string CRenderDaemon::ErrorJSON(const std::string& a_id, const std::string& a_error)
+{
+	return _ReplyJSON(a_id, { { "ok", false }, { "error", a_error } });
+}
+
+
+static std::_tstring _OsPath(const std::string& a_utf8Path)
+{
+#ifdef _WIN32
+	return CUtil::ToWideStr(a_utf8Path, CP_UTF8);
+#else
+	return a_utf8Path;
+#endif
+}
+
+
+static FILE* _OpenFile(const std::_tstring& a_path, const TCHAR* a_mode)
+{
+#ifdef _WIN32
+	FILE* l_file = nullptr;
+
+	return (_tfopen_s(&l_file, a_path.c_str(), a_mode) == 0 ? l_file : nullptr);
+#else
+	return fopen(a_path.c_str(), a_mode);
+#endif
+}
+
+
+static bool _ReadFile(const std::_tstring& a_path, std::string& ar_contents)
+{
+	FILE* l_file = _OpenFile(a_path, _T("rb"));
+
+	if (!l_file)
+	{
+		return false;
+	}
+
+	char l_buf[64 * 1024];
+	size_t l_read;
+
+	ar_contents.clear();
+
+	while ((l_read = fread(l_buf, 1, sizeof(l_buf), l_file)) > 0)
+	{
+		ar_contents.append(l_buf, l_read);
+	}
+
+	const bool l_success = (ferror(l_file) == 0);
+
+	fclose(l_file);
+
+	return l_success;
+}
+
+
+static bool _WriteFile(const std::_tstring& a_path, const std::string& a_contents)
+{
+	FILE* l_file = _OpenFile(a_path, _T("wb"));
+
+	if (!l_file)
+	{
+		return false;
+	}
+
+	bool l_success = (fwrite(a_contents.data(), 1, a_contents.size(), l_file) == a_contents.size());
+
+	l_success = (fclose(l_file) == 0) && l_success;
+
+	return l_success;
+}
+
+
+static bool _MakeTempFile(std::_tstring& ar_path)
+{
+#ifdef _WIN32
+	wchar_t l_dir[MAX_PATH + 1], l_name[MAX_PATH + 1];
+
+	if (!GetTempPathW(MAX_PATH + 1, l_dir) || !GetTempFileNameW(l_dir, L"nfo", 0, l_name))
+	{
+		return false;
+	}
+
+	ar_path = l_name;
+#else
+	const char* l_dir = getenv("TMPDIR");
+	std::string l_template = std::string(l_dir && *l_dir ? l_dir : "/tmp") + "/infekt-XXXXXX";
+
+	const int l_fd = mkstemp(&l_template[0]);
+
+	if (l_fd < 0)
+	{
+		return false;
+	}
+
+	close(l_fd);
+
+	ar_path = l_template;
+#endif
+
+	return true;
+}
+
+
+static void _RemoveFile(const std::_tstring& a_path)
+{
+#ifdef _WIN32
+	_wremove(a_path.c_str());
+#else
+	remove(a_path.c_str());
+#endif
+}
+
+
+static bool _GetFileStamp(const std::string& a_utf8Path, int64_t& ar_mtime, int64_t& ar_size)
+{
+#ifdef _WIN32
+	struct _stat64 l_st;
+
+	if (_wstat64(CUtil::ToWideStr(a_utf8Path, CP_UTF8).c_str(), &l_st) != 0)
+#else
+	struct stat l_st;
+
+	if (stat(a_utf8Path.c_str(), &l_st) != 0)
+#endif
+	{
+		return false;
+	}
+
+	ar_mtime = static_cast<int64_t>(l_st.st_mtime);
+	ar_size = static_cast<int64_t>(l_st.st_size);
+
+	return true;
+}
+
+
+/************************************************************************/
+/* CDaemonClient                                                        */
+/************************************************************************/
+
+CDaemonClient::CDaemonClient(int a_inFd, int a_outFd, bool a_ownsFds)
+	: m_inFd(a_inFd)
+	, m_outFd(a_outFd)
+	, m_ownsFds(a_ownsFds)
+{
+}
+
+
+bool CDaemonClient::Reply(const std::string& a_json, const std::string* a_data)
+{
+	std::lock_guard<std::mutex> l_lock(m_writeLock);
+
+	return _WriteMessage(m_outFd, a_json) && (!a_data || _WriteMessage(m_outFd, *a_data));
+}
+
+
+CDaemonClient::~CDaemonClient()
+{
+#ifndef _WIN32
+	if (m_ownsFds)
+	{
+		close(m_inFd);
+
+		if (m_outFd != m_inFd)
+		{
+			close(m_outFd);
+		}
+	}
+#endif
+}
+
+
+/************************************************************************/
+/* CRenderDaemon                                                        */
+/************************************************************************/
+
+CRenderDaemon::CRenderDaemon(const CNFORenderSettings& a_defaults, bool a_artColorSet, bool a_gaussColorSet, size_t a_numWorkers)
+	: m_defaults(a_defaults)
+	, m_artColorSet(a_artColorSet)
+	, m_gaussColorSet(a_gaussColorSet)
+	, m_numWorkers(std::max<size_t>(a_numWorkers, 1))
+	, m_numActive(0)
+	, m_stopping(false)
+	, m_documentHits(0)
+	, m_documentMisses(0)
+	, m_nextLatency(0)
+	, m_numServed(0)
+	, m_numFailed(0)
+	, m_shutdownRequested(false)
+	, m_listenFd(-1)
+{
+	m_latencies.reserve(MAX_LATENCY_SAMPLES);
+}
+
+
+void CRenderDaemon::StartWorkers()
+{
+	m_stopping = false;
+
+	for (size_t i = 0; i < m_numWorkers; i++)
+	{
+		m_workers.emplace_back([this] { WorkerThreadProc(); });
+	}
+}
+
+
+/**
+ * Returns once all queued jobs have been served.
+ **/
+void CRenderDaemon::StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> l_lock(m_queueLock);
+
+		m_stopping = true;
+	}
+
+	m_queueCondition.notify_all();
+
+	for (std::thread& l_worker : m_workers)
+	{
+		l_worker.join();
+	}
+
+	m_workers.clear();
+}
+
+
+void CRenderDaemon::WorkerThreadProc()
+{
+	for (;;)
+	{
+		SJob l_job;
+
+		{
+			std::unique_lock<std::mutex> l_lock(m_queueLock);
+
+			m_queueCondition.wait(l_lock, [this] { return m_stopping || !m_queue.empty(); });
+
+			if (m_queue.empty())
+			{
+				return;
+			}
+
+			l_job = std::move(m_queue.front());
+			m_queue.pop_front();
+
+			m_numActive++;
+		}
+
+		ProcessJob(l_job);
+
+		std::lock_guard<std::mutex> l_lock(m_queueLock);
+
+		m_numActive--;
+	}
+}
+
+
+bool CRenderDaemon::ServeStdio()
+{
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#else
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	// the protocol owns stdout from here on:
+	fflush(stdout);
+
+	StartWorkers();
+
+	const bool l_success = ServeClient(std::make_shared<CDaemonClient>(_fileno(stdin), _fileno(stdout), false));
+
+	StopWorkers();
+
+	return l_success;
+}
+
+
+#ifndef _WIN32
+bool CRenderDaemon::ServeSocket(const std::string& a_path)
+{
+	struct sockaddr_un l_addr {};
+
+	if (a_path.size() >= sizeof(l_addr.sun_path))
+	{
+		fprintf(stderr, "ERROR: The socket path is too long.\n");
+		return false;
+	}
+
+	l_addr.sun_family = AF_UNIX;
+	strncpy(l_addr.sun_path, a_path.c_str(), sizeof(l_addr.sun_path) - 1);
+
+	// a socket left behind by an earlier instance would make bind() fail, but never delete anything else:
+	struct stat l_st;
+	if (lstat(a_path.c_str(), &l_st) == 0 && S_ISSOCK(l_st.st_mode))
+	{
+		unlink(a_path.c_str());
+	}
+
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	// clients can make us read and write any file we have access to, so keep it to our own user.
+	// The umask makes bind() create the socket that way, a chmod afterwards would leave a window:
+	const mode_t l_oldMask = umask(S_IRWXG | S_IRWXO);
+	const bool l_bound = (m_listenFd >= 0 && bind(m_listenFd, reinterpret_cast<struct sockaddr*>(&l_addr), sizeof(l_addr)) == 0);
+	const int l_bindError = errno;
+
+	umask(l_oldMask);
+	errno = l_bindError;
+
+	if (!l_bound || chmod(a_path.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(m_listenFd, SOMAXCONN) != 0)
+	{
+		fprintf(stderr, "ERROR: Unable to listen on `%s` (error %d).\n", a_path.c_str(), errno);
+
+		if (m_listenFd >= 0)
+		{
+			close(m_listenFd);
+			m_listenFd = -1;
+		}
+
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	StartWorkers();
+
+	while (!m_shutdownRequested)
+	{
+		const int l_fd = accept(m_listenFd, nullptr, nullptr);
+
+		if (l_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+
+			// shut down, or something is really wrong:
+			break;
+		}
+
+		PDaemonClient l_client = std::make_shared<CDaemonClient>(l_fd, l_fd, true);
+
+		{
+			std::lock_guard<std::mutex> l_lock(m_clientsLock);
+
+			m_clients.insert(l_client);
+		}
+
+		std::thread([this, l_client] {
+			ServeClient(l_client);
+
+			std::lock_guard<std::mutex> l_lock(m_clientsLock);
+
+			m_clients.erase(l_client);
+			m_clientsCondition.notify_all();
+		}).detach();
+	}
+
+	// wake up the readers, replies can still be written:
+	{
+		std::unique_lock<std::mutex> l_lock(m_clientsLock);
+
+		for (const PDaemonClient& l_client : m_clients)
+		{
+			shutdown(l_client->GetInFd(), SHUT_RD);
+		}
+
+		m_clientsCondition.wait(l_lock, [this] { return m_clients.empty(); });
+	}
+
+	StopWorkers();
+
+	close(m_listenFd);
+	m_listenFd = -1;
+
+	unlink(a_path.c_str());
+
+	return true;
+}
+#endif
+
+
+bool CRenderDaemon::ServeClient(const PDaemonClient& a_client)
+{
+	std::string l_message;
+	bool l_tooLarge;
+
+	while (!m_shutdownRequested && ReadMessage(a_client->GetInFd(), l_message, l_tooLarge))
+	{
+		if (!HandleRequest(a_client, l_message))
+		{
+			return false;
+		}
+	}
+
+	if (l_tooLarge)
+	{
+		// the payload is still pending, so the stream can't be resynced:
+		a_client->Reply(ErrorJSON("", "Message too large."));
+		return false;
+	}
+
+	return true;
+}
+
+
+/************************************************************************/
+/* Requests                                                             */
+/************************************************************************/
+
+static bool _ParseSettings(const json& a_settings, CNFORenderSettings& ar_settings, bool& ar_artColorSet, bool& ar_gaussColorSet, std::string& ar_error)
+{
+	if (!a_settings.is_object())
+	{
+		ar_error = "settings must be an object.";
+		return false;
+	}
+
+	// keys are named after the command line options, but the flags
+	// state what's on rather than what's off: "glow" and "link-underl"
+	// correspond to --no-glow and --no-link-underl with inverted polarity,
+	// "hilight-links" to --hilight-links. Limits are the command line's:
+	static const struct { const char* name; S_COLOR_T CNFORenderSettings::* member; } s_colors[] = {
+		{ "text-color", &CNFORenderSettings::cTextColor },
+		{ "back-color", &CNFORenderSettings::cBackColor },
+		{ "block-color", &CNFORenderSettings::cArtColor },
+		{ "glow-color", &CNFORenderSettings::cGaussColor },
+		{ "link-color", &CNFORenderSettings::cHyperlinkColor },
+	};
+
+	static const struct { const char* name; bool CNFORenderSettings::* member; } s_flags[] = {
+		{ "glow", &CNFORenderSettings::bGaussShadow },
+		{ "hilight-links", &CNFORenderSettings::bHilightHyperlinks },
+		{ "link-underl", &CNFORenderSettings::bUnderlineHyperlinks },
+	};
+
+	for (const auto& l_color : s_colors)
+	{
+		if (a_settings.contains(l_color.name))
+		{
+			S_COLOR_T l_value;
+
+			if (!CNFORenderer::ParseColor(a_settings[l_color.name].get<std::string>().c_str(), &l_value))
+			{
+				ar_error = std::string("Invalid or unsupported ") + l_color.name + ".";
+				return false;
+			}
+
+			ar_settings.*l_color.member = l_value;
+
+			ar_artColorSet = ar_artColorSet || (l_color.member == &CNFORenderSettings::cArtColor);
+			ar_gaussColorSet = ar_gaussColorSet || (l_color.member == &CNFORenderSettings::cGaussColor);
+		}
+	}
+
+	for (const auto& l_flag : s_flags)
+	{
+		if (a_settings.contains(l_flag.name))
+		{
+			ar_settings.*l_flag.member = a_settings[l_flag.name].get<bool>();
+		}
+	}
+
+	const int l_blockWidth = a_settings.value("block-width", static_cast<int>(ar_settings.uBlockWidth)),
+		l_blockHeight = a_settings.value("block-height", static_cast<int>(ar_settings.uBlockHeight)),
+		l_glowRadius = a_settings.value("glow-radius", static_cast<int>(ar_settings.uGaussBlurRadius));
+
+	if (l_blockWidth < 3 || l_blockWidth > 100)
+	{
+		ar_error = "Invalid or unsupported block-width.";
+	}
+	else if (l_blockHeight < 3 || l_blockHeight > 170)
+	{
+		ar_error = "Invalid or unsupported block-height.";
+	}
+	else if (l_glowRadius < 1 || l_glowRadius > 1000)
+	{
+		ar_error = "Invalid or unsupported glow-radius.";
+	}
+	else
+	{
+		ar_settings.uBlockWidth = static_cast<size_t>(l_blockWidth);
+		ar_settings.uBlockHeight = static_cast<size_t>(l_blockHeight);
+		ar_settings.uGaussBlurRadius = static_cast<unsigned int>(l_glowRadius);
+
+		return true;
+	}
+
+	return false;
+}
+
+
+static bool _IsSupportedFormat(const std::string& a_format)
+{
+	static const char* const s_formats[] = {
+		"png", "png-classic", "html", "html-canvas", "json", "utf-8", "cp-437",
+#ifdef CAIRO_HAS_PDF_SURFACE
+		"pdf", "pdf-din",
+#endif
+	};
+
+	for (const char* l_format : s_formats)
+	{
+		if (a_format == l_format)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ * Queues render requests, and answers everything else right away.
+ * Returns false if the client can't be understood any longer.
+ **/
+bool CRenderDaemon::HandleRequest(const PDaemonClient& a_client, const std::string& a_message)
+{
+	const auto l_received = std::chrono::steady_clock::now();
+	const json l_request = json::parse(a_message, nullptr, false);
+
+	if (!l_request.is_object())
+	{
+		a_client->Reply(ErrorJSON("", "Malformed request."));
+		return false;
+	}
+
+	const std::string l_id = (l_request.contains("id") ? l_request["id"].dump() : "");
+
+	// has to be picked up even if the request turns out to be invalid:
+	std::string l_inputData;
+	bool l_tooLarge;
+	const auto l_inputFollows = l_request.find("input-follows");
+
+	if (l_inputFollows != l_request.end() && l_inputFollows->is_boolean() && l_inputFollows->get<bool>()
+		&& !ReadMessage(a_client->GetInFd(), l_inputData, l_tooLarge))
+	{
+		if (l_tooLarge)
+		{
+			a_client->Reply(ErrorJSON(l_id, "Input too large."));
+		}
+
+		return false;
+	}
+
+	SJob l_job;
+	std::string l_error;
+
+	try
+	{
+		const std::string l_cmd = l_request.value("cmd", std::string("render"));
+
+		if (l_cmd == "stats")
+		{
+			return a_client->Reply(GetStatsJSON(l_id));
+		}
+		else if (l_cmd == "shutdown")
+		{
+			m_shutdownRequested = true;
+
+#ifndef _WIN32
+			if (m_listenFd >= 0)
+			{
+				// wakes up accept():
+				shutdown(m_listenFd, SHUT_RDWR);
+			}
+#endif
+
+			a_client->Reply(_ReplyJSON(l_id, { { "ok", true } }));
+
+			return true;
+		}
+		else if (l_cmd != "render")
+		{
+			return a_client->Reply(ErrorJSON(l_id, "Unknown cmd."));
+		}
+
+		l_job.client = a_client;
+		l_job.id = l_id;
+		l_job.format = l_request.value("format", std::string("png"));
+		l_job.inputPath = l_request.value("input", std::string());
+		l_job.inputData = std::move(l_inputData);
+		l_job.outputPath = l_request.value("output", std::string());
+		l_job.textOnly = l_request.value("text-only", false);
+		l_job.wrap = l_request.value("wrap", false);
+		l_job.compoundWhitespace = l_request.value("compound-whitespace", false);
+		l_job.settings = m_defaults;
+		l_job.artColorSet = m_artColorSet;
+		l_job.gaussColorSet = m_gaussColorSet;
+		l_job.received = l_received;
+
+		if (!_IsSupportedFormat(l_job.format))
+		{
+			l_error = "Unsupported format.";
+		}
+		else if (l_job.inputPath.empty() == l_job.inputData.empty())
+		{
+			l_error = "Specify either an input path or input-follows.";
+		}
+		else if (l_request.contains("settings"))
+		{
+			_ParseSettings(l_request["settings"], l_job.settings, l_job.artColorSet, l_job.gaussColorSet, l_error);
+		}
+	}
+	catch (const json::exception& ex)
+	{
+		l_error = std::string("Invalid request: ") + ex.what();
+	}
+
+	if (!l_error.empty())
+	{
+		return a_client->Reply(ErrorJSON(l_id, l_error));
+	}
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_queueLock);
+
+		m_queue.push_back(std::move(l_job));
+	}
+
+	m_queueCondition.notify_one();
+
+	return true;
+}
+
+
+void CRenderDaemon::ProcessJob(const SJob& a_job)
+{
+	std::string l_output, l_error;
+
+	const bool l_success = Render(a_job, l_output, l_error);
+
+	// before replying, so that a stats request right after the reply sees it:
+	RecordLatency(a_job, l_success);
+
+	if (!l_success)
+	{
+		a_job.client->Reply(ErrorJSON(a_job.id, l_error));
+	}
+	else if (a_job.outputPath.empty())
+	{
+		a_job.client->Reply(_ReplyJSON(a_job.id, { { "ok", true }, { "size", l_output.size() } }), &l_output);
+	}
+	else
+	{
+		a_job.client->Reply(_ReplyJSON(a_job.id, { { "ok", true }, { "output", a_job.outputPath } }));
+	}
+}
+
+
+/**
+ * Parsed documents are shared between requests, until the file changes.
+ **/
+PNFOData CRenderDaemon::GetDocument(const SJob& a_job, std::string& ar_error)
+{
+	const bool l_fromFile = !a_job.inputPath.empty();
+	std::string l_key = std::string(a_job.textOnly ? "t" : "-") + (a_job.wrap ? "w" : "-");
+	int64_t l_mtime = 0, l_size = 0;
+
+	if (l_fromFile)
+	{
+		if (!_GetFileStamp(a_job.inputPath, l_mtime, l_size))
+		{
+			ar_error = "Unable to open input file.";
+			return nullptr;
+		}
+
+		l_key += "file:" + a_job.inputPath;
+	}
+	else
+	{
+		l_key += "data:" + std::to_string(std::hash<std::string>()(a_job.inputData));
+	}
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_documentsLock);
+
+		for (auto it = m_documents.begin(); it != m_documents.end(); ++it)
+		{
+			if (it->key == l_key && it->mtime == l_mtime && it->size == l_size && (l_fromFile || it->data == a_job.inputData))
+			{
+				m_documents.splice(m_documents.begin(), m_documents, it);
+				m_documentHits++;
+
+				return m_documents.front().nfo;
+			}
+		}
+
+		m_documentMisses++;
+	}
+
+	auto l_nfo = std::make_shared<CNFOData>();
+	l_nfo->SetWrapLines(a_job.wrap && !a_job.textOnly);
+
+	if (l_fromFile ? !l_nfo->LoadFromFileUtf8(a_job.inputPath)
+		: !l_nfo->LoadFromMemory(reinterpret_cast<const unsigned char*>(a_job.inputData.data()), a_job.inputData.size()))
+	{
+		ar_error = l_nfo->GetLastErrorDescription();
+		return nullptr;
+	}
+
+	if (a_job.textOnly)
+	{
+		auto l_stripped = std::make_shared<CNFOData>();
+		l_stripped->SetWrapLines(a_job.wrap);
+
+		if (!l_stripped->LoadStripped(*l_nfo))
+		{
+			ar_error = l_nfo->GetLastErrorDescription();
+			return nullptr;
+		}
+
+		l_nfo = l_stripped;
+	}
+
+	// built on first use otherwise, which is not safe once several workers share the document:
+	l_nfo->GetTextUtf8();
+
+	std::lock_guard<std::mutex> l_lock(m_documentsLock);
+
+	m_documents.remove_if([&l_key](const SCachedDocument& a_doc) { return a_doc.key == l_key; });
+	m_documents.push_front(SCachedDocument{ l_key, l_mtime, l_size, (l_fromFile ? std::string() : a_job.inputData), l_nfo });
+
+	while (m_documents.size() > MAX_CACHED_DOCUMENTS)
+	{
+		m_documents.pop_back();
+	}
+
+	return l_nfo;
+}
+
+
+bool CRenderDaemon::Render(const SJob& a_job, std::string& ar_output, std::string& ar_error)
+{
+	PNFOData l_nfo = GetDocument(a_job, ar_error);
+
+	if (!l_nfo)
+	{
+		return false;
+	}
+
+	const std::string& l_format = a_job.format;
+
+	if (l_format == "html" || l_format == "html-canvas" || l_format == "json")
+	{
+		std::string l_utf8;
+
+		if (l_format == "html")
+		{
+			CNFOToHTML l_exporter(l_nfo);
+			l_exporter.SetSettings(a_job.settings);
+
+			l_utf8 = CUtil::FromWideStr(l_exporter.GetHTML(), CP_UTF8);
+		}
+		else
+		{
+			CNFOToHTMLCanvas l_exporter;
+
+			l_exporter.AssignNFO(l_nfo);
+			l_exporter.InjectSettings(a_job.settings);
+
+			l_utf8 = (l_format == "json" ? l_exporter.GetRenderJSONString() : l_exporter.GetFullHTML());
+		}
+
+		if (a_job.outputPath.empty())
+		{
+			ar_output.swap(l_utf8);
+		}
+		else if (!_WriteFile(_OsPath(a_job.outputPath), l_utf8))
+		{
+			ar_error = "Unable to write output file.";
+			return false;
+		}
+
+		return true;
+	}
+
+	// the other exporters only write files, so output that is sent back takes a detour:
+	const bool l_sendBack = a_job.outputPath.empty();
+	std::_tstring l_filePath;
+
+	if (!l_sendBack)
+	{
+		l_filePath = _OsPath(a_job.outputPath);
+	}
+	else if (!_MakeTempFile(l_filePath))
+	{
+		ar_error = "Unable to create a temporary file.";
+		return false;
+	}
+
+	bool l_success = false;
+
+	if (l_format == "png" || l_format == "png-classic")
+	{
+		const bool l_classic = (l_format == "png-classic");
+		CNFOToPNG l_exporter(l_classic);
+
+		l_exporter.InjectSettings(a_job.settings);
+
+		if (!l_classic)
+		{
+			if (!a_job.artColorSet)
+			{
+				l_exporter.SetArtColor(l_exporter.GetTextColor());
+			}
+
+			if (!a_job.gaussColorSet && l_exporter.GetEnableGaussShadow())
+			{
+				l_exporter.SetGaussColor(l_exporter.GetArtColor());
+			}
+		}
+
+		l_exporter.AssignNFO(l_nfo);
+
+		l_success = l_exporter.SavePNG(l_filePath);
+	}
+#ifdef CAIRO_HAS_PDF_SURFACE
+	else if (l_format == "pdf" || l_format == "pdf-din")
+	{
+		CNFOToPDF l_exporter(false);
+		l_exporter.SetUseDINSizes(l_format == "pdf-din");
+		l_exporter.AssignNFO(l_nfo);
+		l_exporter.InjectSettings(a_job.settings);
+
+		l_success = l_exporter.SavePDF(l_filePath);
+	}
+#endif
+	else if (l_format == "cp-437")
+	{
+		size_t l_inconvertible;
+
+		l_success = l_nfo->SaveToCP437File(l_filePath, l_inconvertible, a_job.compoundWhitespace);
+	}
+	else
+	{
+		l_success = l_nfo->SaveToUnicodeFile(l_filePath, true, a_job.compoundWhitespace);
+	}
+
+	if (l_sendBack)
+	{
+		l_success = l_success && _ReadFile(l_filePath, ar_output);
+
+		_RemoveFile(l_filePath);
+	}
+
+	if (!l_success)
+	{
+		ar_error = "Unable to render or write output file.";
+	}
+
+	return l_success;
+}
+
+
+/************************************************************************/
+/* Statistics                                                           */
+/************************************************************************/
+
+void CRenderDaemon::RecordLatency(const SJob& a_job, bool a_success)
+{
+	const double l_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - a_job.received).count();
+
+	std::lock_guard<std::mutex> l_lock(m_statsLock);
+
+	if (m_latencies.size() < MAX_LATENCY_SAMPLES)
+	{
+		m_latencies.push_back(l_ms);
+	}
+	else
+	{
+		m_latencies[m_nextLatency] = l_ms;
+		m_nextLatency = (m_nextLatency + 1) % MAX_LATENCY_SAMPLES;
+	}
+
+	(a_success ? m_numServed : m_numFailed)++;
+}
+
+
+/**
+ * Latencies cover the last MAX_LATENCY_SAMPLES requests, from receiving them until the reply is sent.
+ **/
+std::string CRenderDaemon::GetStatsJSON(const std::string& a_id)
+{
+	json l_reply = { { "ok", true }, { "workers", m_numWorkers } };
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_queueLock);
+
+		l_reply["queued"] = m_queue.size();
+		l_reply["active"] = m_numActive;
+	}
+
+	std::vector<double> l_samples;
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_statsLock);
+
+		l_samples = m_latencies;
+		l_reply["served"] = m_numServed;
+		l_reply["failed"] = m_numFailed;
+	}
+
+	std::sort(l_samples.begin(), l_samples.end());
+
+	// nearest-rank:
+	auto l_percentile = [&l_samples](double a_p) {
+		return l_samples.empty() ? 0.0 : l_samples[static_cast<size_t>(std::ceil(a_p * l_samples.size())) - 1];
+	};
+
+	l_reply["latency-ms"] = {
+		{ "samples", l_samples.size() },
+		{ "p50", l_percentile(0.5) },
+		{ "p90", l_percentile(0.9) },
+		{ "p99", l_percentile(0.99) },
+		{ "max", l_samples.empty() ? 0.0 : l_samples.back() },
+	};
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_documentsLock);
+
+		l_reply["documents"] = { { "cached", m_documents.size() }, { "hits", m_documentHits }, { "misses", m_documentMisses } };
+	}
+
+	return _ReplyJSON(a_id, l_reply);
+}
+
+
+CRenderDaemon::~CRenderDaemon()
+{
+	StopWorkers();
+}
@@ -0,0 +1,156 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include "nfo_data.h"
+#include "nfo_renderer.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+
+
+/**
+ * One client of the daemon. The descriptors are closed once the last
+ * pending reply has been written, unless they belong to stdin/stdout.
+ **/
+class CDaemonClient
+{
+public:
+	CDaemonClient(int a_inFd, int a_outFd, bool a_ownsFds);
+	virtual ~CDaemonClient();
+
+	int GetInFd() const { return m_inFd; }
+
+	// writes a JSON reply, followed by a_data as a message of its own if given:
+	bool Reply(const std::string& a_json, const std::string* a_data = nullptr);
+
+protected:
+	int m_inFd, m_outFd;
+	bool m_ownsFds;
+	std::mutex m_writeLock;
+
+private:
+	// disallow copies:
+	CDaemonClient(const CDaemonClient&) = delete;
+	CDaemonClient& operator=(const CDaemonClient&) = delete;
+};
+
+typedef std::shared_ptr<CDaemonClient> PDaemonClient;
+
+
+/**
+ * Serves render requests from a long-running process, so that the font,
+ * glyph and document caches stay warm between them.
+ * Every message is a 32 bit big endian byte count followed by that many
+ * bytes. Requests and replies are UTF-8 JSON objects, input and output
+ * data travel as raw messages of their own right after them.
+ * Replies may arrive out of order if there is more than one worker,
+ * they carry the request's "id".
+ **/
+class CRenderDaemon
+{
+public:
+	// a_defaults: used for everything a request doesn't specify:
+	CRenderDaemon(const CNFORenderSettings& a_defaults, bool a_artColorSet, bool a_gaussColorSet, size_t a_numWorkers);
+	virtual ~CRenderDaemon();
+
+	// serves requests from stdin, replies go to stdout. Returns at EOF:
+	bool ServeStdio();
+#ifndef _WIN32
+	// listens on a Unix domain socket until a "shutdown" request arrives:
+	bool ServeSocket(const std::string& a_path);
+#endif
+
+	static const size_t MAX_MESSAGE_SIZE = 256 * 1024 * 1024;
+	static const size_t MAX_CACHED_DOCUMENTS = 16;
+	static const size_t MAX_LATENCY_SAMPLES = 1024;
+
+protected:
+	typedef struct
+	{
+		PDaemonClient client;
+		std::string id; // serialized JSON, echoed back
+		std::string format;
+		std::string inputPath, inputData; // UTF-8 path, or the file contents
+		std::string outputPath; // empty: the output is sent back
+		bool textOnly, wrap, compoundWhitespace;
+		CNFORenderSettings settings;
+		bool artColorSet, gaussColorSet;
+		std::chrono::steady_clock::time_point received;
+	} SJob;
+
+	typedef struct
+	{
+		std::string key;
+		int64_t mtime, size; // for files
+		std::string data; // for documents that have been sent in
+		PNFOData nfo;
+	} SCachedDocument;
+
+	CNFORenderSettings m_defaults;
+	bool m_artColorSet, m_gaussColorSet;
+	size_t m_numWorkers;
+
+	std::mutex m_queueLock;
+	std::condition_variable m_queueCondition;
+	std::deque<SJob> m_queue;
+	size_t m_numActive;
+	bool m_stopping;
+	std::vector<std::thread> m_workers;
+
+	std::mutex m_documentsLock;
+	std::list<SCachedDocument> m_documents; // most recently used first
+	uint64_t m_documentHits, m_documentMisses;
+
+	std::mutex m_statsLock;
+	std::vector<double> m_latencies; // milliseconds, ring buffer
+	size_t m_nextLatency;
+	uint64_t m_numServed, m_numFailed;
+
+	std::atomic<bool> m_shutdownRequested;
+	int m_listenFd;
+
+	// connected to the socket, see ServeSocket:
+	std::mutex m_clientsLock;
+	std::condition_variable m_clientsCondition;
+	std::set<PDaemonClient> m_clients;
+
+	void StartWorkers();
+	void StopWorkers();
+	void WorkerThreadProc();
+
+	// reads requests until the client goes away, false on protocol errors:
+	bool ServeClient(const PDaemonClient& a_client);
+	bool HandleRequest(const PDaemonClient& a_client, const std::string& a_message);
+
+	void ProcessJob(const SJob& a_job);
+	bool Render(const SJob& a_job, std::string& ar_output, std::string& ar_error);
+	PNFOData GetDocument(const SJob& a_job, std::string& ar_error);
+
+	void RecordLatency(const SJob& a_job, bool a_success);
+	std::string GetStatsJSON(const std::string& a_id);
+
+	// ar_tooLarge: set if the message exceeds MAX_MESSAGE_SIZE and wasn't read:
+	static bool ReadMessage(int a_fd, std::string& ar_message, bool& ar_tooLarge);
+	static std::string ErrorJSON(const std::string& a_id, const std::string& a_error);
+
+private:
+	// disallow copies:
+	CRenderDaemon(const CRenderDaemon&) = delete;
+	CRenderDaemon& operator=(const CRenderDaemon&) = delete;
+};
+
+#endif /* !_DAEMON_H */
@@ -18,6 +18,8 @@
 #include "nfo_renderer_export.h"
 #include "util.h"
 #include "getopt.h"
+#include "daemon.h"
+#include "font_cache.h"
 
 /************************************************************************/
 /* DEFINE COMMAND LINE ARGUMENTS/OPTIONS                                */
@@ -42,6 +44,9 @@ static const struct ::option g_longOpts[] = {
 	{ _T("pdf"),			no_argument,		0,	'd' },
 	{ _T("pdf-din"),		no_argument,		0,	'D' },
 #endif
+	{ _T("ansimation"),		no_argument,		0,	'a' },
+	{ _T("frame-sequence"),	no_argument,		0,	's' },
+	{ _T("thumbnail"),		required_argument,	0,	'N' },
 	{ _T("out-file"),		required_argument,	0,	'O' },
 
 	{ _T("text-color"),		required_argument,	0,	'T' },
@@ -57,6 +62,11 @@ static const struct ::option g_longOpts[] = {
 	{ _T("glow-radius"),	required_argument,	0,	'R' },
 	{ _T("compound-whitespace"), no_argument,	0,	'c' },
 	{ _T("wrap"),			no_argument,		0,	'w' },
+	{ _T("frame-interval"),	required_argument,	0,	'i' },
+	{ _T("frame-delay"),	required_argument,	0,	'y' },
+
+	{ _T("daemon"),			required_argument,	0,	'X' },
+	{ _T("daemon-workers"),	required_argument,	0,	'x' },
 
 	{0}
 };
@@ -91,6 +101,10 @@ static void _OutputHelp(const char* a_exeNameA, const wchar_t* a_exeNameW)
 	printf("  -d, --pdf                   Makes a PDF document.\n");
 	printf("  -D, --pdf-din               Makes a PDF document (DIN size).\n");
 #endif
+	printf("  -a, --ansimation            Renders an animated PNG from an ANSImation.\n");
+	printf("  -s, --frame-sequence        Renders an ANSImation into one PNG file per frame.\n");
+	printf("  -N, --thumbnail <W>x<H>     Renders a PNG thumbnail that fits into W by H pixels, for every\n");
+	printf("                              input file given. Combine with -p for a classic thumbnail.\n");
 	printf("  -O, --out-file <PATH>       Output filename. Default: input name plus extension.\n");
 
 	printf("Render settings:\n");
@@ -110,6 +124,20 @@ static void _OutputHelp(const char* a_exeNameA, const wchar_t* a_exeNameW)
 	printf("  -c, --compound-whitespace   Add whitespace so that all lines have the same length.\n");
 	printf("  -w, --wrap                  Wrap long lines.\n");
 
+	printf("ANSImation settings:\n");
+	printf("  -i, --frame-interval <N>    Take a frame every N escape sequences. Defaults to 100.\n");
+	printf("  -y, --frame-delay <MS>      Display each frame for MS milliseconds. Defaults to 40.\n");
+	printf("  ANSImations are always rendered without the glow effect.\n");
+
+	printf("Daemon mode:\n");
+#ifdef _WIN32
+	printf("  -X, --daemon -              Serve render requests on stdin/stdout instead of rendering a file.\n");
+#else
+	printf("  -X, --daemon <SOCKET>       Serve render requests on a Unix domain socket instead of rendering\n");
+	printf("                              a file. Use - for stdin/stdout. Render settings become the defaults.\n");
+#endif
+	printf("  -x, --daemon-workers <N>    Render up to N requests at once. Defaults to 2.\n");
+
 	// :TODO: option for input charset.
 }
 
@@ -131,6 +159,67 @@ static void _OutputHelp(const char* a_exeNameA, const wchar_t* a_exeNameW)
 	break;
 
 
+/**
+ * Font calibration results are kept across runs, next to the GUI's on Windows
+ * and in $XDG_CACHE_HOME/infekt elsewhere. Saved when main() returns, this
+ * includes the daemon modes.
+ **/
+class CFontMetricsFile
+{
+public:
+	CFontMetricsFile()
+	{
+#ifdef _WIN32
+		const std::wstring l_dir = CUtilWin32::GetAppDataDir(true, L"iNFekt");
+
+		if (!l_dir.empty())
+		{
+			m_path = l_dir + L"font_metrics.txt";
+		}
+#else
+		const char* l_cacheHome = getenv("XDG_CACHE_HOME");
+		const char* l_home = getenv("HOME");
+		std::string l_dir;
+
+		if (l_cacheHome && l_cacheHome[0] == '/')
+		{
+			l_dir = l_cacheHome;
+		}
+		else if (l_home && l_home[0] == '/')
+		{
+			l_dir = std::string(l_home) + "/.cache";
+		}
+
+		if (!l_dir.empty())
+		{
+			mkdir(l_dir.c_str(), 0700); // usually exists already
+		}
+
+		if (!l_dir.empty() && (mkdir((l_dir + "/infekt").c_str(), 0700) == 0 || errno == EEXIST))
+		{
+			m_path = l_dir + "/infekt/font_metrics.txt";
+		}
+#endif
+
+		if (!m_path.empty())
+		{
+			CFontMetricsCache::GetInstance().LoadFromFile(m_path);
+		}
+	}
+
+	~CFontMetricsFile()
+	{
+		if (!m_path.empty())
+		{
+			CFontMetricsCache::GetInstance().SaveToFile(m_path);
+		}
+	}
+
+protected:
+	std::_tstring m_path;
+};
+
+
 /************************************************************************/
 /* main()                                                               */
 /************************************************************************/
@@ -146,7 +235,13 @@ int main(int argc, char* argv[])
 		l_htmlOut = false, l_makePdf = false, l_pdfDin = false,
 		l_htmlCanvas = false, l_jsonRenderGrid = false,
 		l_textCp437 = false, l_compoundWhitespace = false,
-		l_textOnly = false, l_wrap = false;
+		l_textOnly = false, l_wrap = false,
+		l_ansimation = false, l_frameSequence = false;
+	size_t l_frameInterval = 100;
+	unsigned int l_frameDelay = 40;
+	std::_tstring l_daemonSocket;
+	size_t l_daemonWorkers = 2;
+	int l_thumbWidth = 0, l_thumbHeight = 0;
 
 #ifdef _WIN32
 	CUtilWin32::HardenHeap();
@@ -173,7 +268,7 @@ int main(int argc, char* argv[])
 	// Parse/process command line options:
 	int l_arg, l_optIdx = -1;
 
-	while ((l_arg = getopt_long(argc, argv, _T("hvT:B:A:gG:W:H:R:LuU:O:pPftmdDceSwMJ"), g_longOpts, &l_optIdx)) != -1)
+	while ((l_arg = getopt_long(argc, argv, _T("hvT:B:A:gG:W:H:R:LuU:O:pPftmdDceSwMJasi:y:X:x:N:"), g_longOpts, &l_optIdx)) != -1)
 	{
 		S_COLOR_T l_color;
 		int l_int;
@@ -272,6 +367,57 @@ int main(int argc, char* argv[])
 		case 'w':
 			l_wrap = true;
 			break;
+		case 'a':
+			l_makePng = false; l_ansimation = true; l_frameSequence = false;
+			break;
+		case 's':
+			l_makePng = false; l_ansimation = true; l_frameSequence = true;
+			break;
+		case 'i':
+			l_int = _tstoi(::optarg);
+			if (l_int < 1 || l_int > 1000000)
+			{
+				fprintf(stderr, "ERROR: Invalid or unsupported frame-interval.\n");
+				return 1;
+			}
+			l_frameInterval = l_int;
+			break;
+		case 'y':
+			l_int = _tstoi(::optarg);
+			if (l_int < 1 || l_int > 65535)
+			{
+				fprintf(stderr, "ERROR: Invalid or unsupported frame-delay.\n");
+				return 1;
+			}
+			l_frameDelay = l_int;
+			break;
+		case 'N':
+		{
+			const std::_tstring l_size = ::optarg;
+			const size_t l_pos = l_size.find(_T('x'));
+
+			l_thumbWidth = _tstoi(l_size.substr(0, l_pos).c_str());
+			l_thumbHeight = (l_pos != std::_tstring::npos ? _tstoi(l_size.c_str() + l_pos + 1) : 0);
+
+			if (l_thumbWidth < 1 || l_thumbWidth > 4096 || l_thumbHeight < 1 || l_thumbHeight > 4096)
+			{
+				fprintf(stderr, "ERROR: Invalid or unsupported thumbnail size.\n");
+				return 1;
+			}
+			break;
+		}
+		case 'X':
+			l_daemonSocket = ::optarg;
+			break;
+		case 'x':
+			l_int = _tstoi(::optarg);
+			if (l_int < 1 || l_int > 256)
+			{
+				fprintf(stderr, "ERROR: Invalid or unsupported daemon-workers.\n");
+				return 1;
+			}
+			l_daemonWorkers = l_int;
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "Try --help.\n");
@@ -279,6 +425,25 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	CFontMetricsFile l_fontMetrics;
+
+	if (!l_daemonSocket.empty())
+	{
+		CRenderDaemon l_daemon(l_pngSettings, l_setBlockColor, l_setGlowColor, l_daemonWorkers);
+
+		if (l_daemonSocket == _T("-"))
+		{
+			return (l_daemon.ServeStdio() ? 0 : 1);
+		}
+
+#ifdef _WIN32
+		fprintf(stderr, "ERROR: Only - (stdin/stdout) is supported for --daemon on Windows.\n");
+		return 1;
+#else
+		return (l_daemon.ServeSocket(l_daemonSocket) ? 0 : 1);
+#endif
+	}
+
 	std::_tstring l_nfoFileName;
 
 	// the file name has to be the last argument:
@@ -303,10 +468,92 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (l_thumbWidth > 0)
+	{
+		// one renderer for all files, so that fonts and glyphs are only set up once:
+		CNFOThumbnailer l_thumbnailer(l_classic);
+
+		l_thumbnailer.InjectSettings(l_pngSettings);
+
+		if (!l_classic)
+		{
+			if (!l_setBlockColor)
+			{
+				l_thumbnailer.SetArtColor(l_thumbnailer.GetTextColor());
+			}
+
+			if (!l_setGlowColor && l_thumbnailer.GetEnableGaussShadow())
+			{
+				l_thumbnailer.SetGaussColor(l_thumbnailer.GetArtColor());
+			}
+		}
+
+		const bool l_singleFile = (::optind == argc - 1);
+		size_t l_failed = 0;
+
+		for (int i = ::optind; i < argc; i++)
+		{
+			const std::_tstring l_inFileName = argv[i];
+			std::_tstring l_thumbFileName = l_inFileName;
+
+			if (l_singleFile && !l_outFileName.empty())
+			{
+				l_thumbFileName = l_outFileName;
+			}
+			else
+			{
+				size_t l_pos = l_inFileName.rfind(_T(".nfo"));
+				if (l_pos != std::string::npos && l_pos == l_inFileName.size() - 4)
+				{
+					l_thumbFileName.erase(l_inFileName.size() - 4);
+				}
+
+				l_thumbFileName += _T("-thumb.png");
+			}
+
+			auto l_thumbData = std::make_shared<CNFOData>();
+			l_thumbData->SetWrapLines(l_wrap && !l_textOnly);
+
+			bool l_loaded = l_thumbData->LoadFromFile(l_inFileName);
+
+			if (l_loaded && l_textOnly)
+			{
+				auto l_stripped = std::make_shared<CNFOData>();
+				l_stripped->SetWrapLines(l_wrap);
+
+				l_loaded = l_stripped->LoadStripped(*l_thumbData);
+				l_thumbData = l_stripped;
+			}
+
+			if (!l_loaded)
+			{
+				_ftprintf(stderr, _T("ERROR: Unable to load `%s`: "), l_inFileName.c_str());
+				fprintf(stderr, "%s\n", l_thumbData->GetLastErrorDescription().c_str());
+				l_failed++;
+			}
+			else if (!l_thumbnailer.AssignNFO(l_thumbData) || !l_thumbnailer.SaveThumbnail(l_thumbFileName, l_thumbWidth, l_thumbHeight))
+			{
+				_ftprintf(stderr, _T("ERROR: Unable to write to `%s`.\n"), l_thumbFileName.c_str());
+				l_failed++;
+			}
+			else
+			{
+				_tprintf(_T("Saved `%s` to `%s`!\n"), l_inFileName.c_str(), l_thumbFileName.c_str());
+			}
+		}
+
+		return (l_failed == 0 ? 0 : 1);
+	}
+
 	// open+load the NFO file:
 	auto l_nfoData = std::make_shared<CNFOData>();
 	l_nfoData->SetWrapLines(l_wrap && !l_textOnly);
 
+	if (l_ansimation)
+	{
+		l_nfoData->SetAnsiFrameCapture(l_frameInterval);
+	}
+
 	if (!l_nfoData->LoadFromFile(l_nfoFileName))
 	{
 		fwprintf(stderr, L"ERROR: Unable to load NFO file: %ls\n", l_nfoData->GetLastErrorDescription().c_str());
@@ -338,7 +585,7 @@ int main(int argc, char* argv[])
 			l_outFileName.erase(l_nfoFileName.size() - 4);
 		}
 
-		if (l_makePng)
+		if (l_makePng || l_ansimation)
 		{
 			l_outFileName += _T(".png");
 		}
@@ -394,6 +641,28 @@ int main(int argc, char* argv[])
 
 		l_exportSuccess = l_exporter.SavePNG(l_outFileName);
 	}
+	else if (l_ansimation)
+	{
+		if (l_nfoData->GetAnsiFrames().empty())
+		{
+			fprintf(stderr, "ERROR: The input file is not an ANSI file, or it contains no frames.\n");
+			return 1;
+		}
+
+		CNFOToANSImation l_exporter;
+
+		l_exporter.InjectSettings(l_pngSettings);
+
+		if (!l_setBlockColor)
+		{
+			l_exporter.SetArtColor(l_exporter.GetTextColor());
+		}
+
+		l_exporter.SetFrameDelay(l_frameDelay);
+		l_exporter.AssignNFO(l_nfoData);
+
+		l_exportSuccess = (l_frameSequence ? l_exporter.SaveFrameSequence(l_outFileName) : l_exporter.SaveAPNG(l_outFileName));
+	}
 	else if (l_makePdf)
 	{
 #ifdef CAIRO_HAS_PDF_SURFACE
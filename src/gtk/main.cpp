@@ -14,6 +14,7 @@
 
 #include "stdafx.h"
 #include "main_window.h"
+#include "font_cache.h"
 #include <gtkmm/main.h>
 
 
@@ -32,6 +33,16 @@ int main (int argc, char* argv[])
 	CMainWindow* pMainWindow = NULL;
 	refBuilder->get_widget_derived("wndMain", pMainWindow);
 
+	// font calibration results are kept across runs:
+	const std::string l_cacheDir = Glib::build_filename(Glib::get_user_cache_dir(), "infekt");
+	const std::string l_metricsPath = Glib::build_filename(l_cacheDir, "font_metrics.txt");
+	const bool l_haveCacheDir = (g_mkdir_with_parents(l_cacheDir.c_str(), 0700) == 0);
+
+	if(l_haveCacheDir)
+	{
+		CFontMetricsCache::GetInstance().LoadFromFile(l_metricsPath);
+	}
+
 	if(pMainWindow)
 	{
 		kit.run(*pMainWindow);
@@ -39,6 +50,11 @@ int main (int argc, char* argv[])
 
 	delete pMainWindow;
 
+	if(l_haveCacheDir)
+	{
+		CFontMetricsCache::GetInstance().SaveToFile(l_metricsPath);
+	}
+
 	return 0;
 }
 
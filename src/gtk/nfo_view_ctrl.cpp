@@ -26,13 +26,17 @@ CGtkNfoViewCtrl::CGtkNfoViewCtrl(BaseObjectType* cobject, const Glib::RefPtr<Gtk
 	m_classicRenderer(true),
 	m_textOnlyRenderer(true)
 {
-	m_pNfoTextOnly = m_pNfo = NULL;
 	m_centerNfo = true;
 	m_mode = NFO_VIEW_RENDERED;
+	m_lastScrollTop = 0;
 
 #ifndef GLIBMM_DEFAULT_SIGNAL_HANDLERS_ENABLED
 	signal_expose_event().connect(sigc::mem_fun(*this, &CGtkNfoViewCtrl::on_expose_event), false);
 #endif
+
+	// a scrolled window replaces our adjustments, keep following the vertical one:
+	signal_set_scroll_adjustments().connect(sigc::mem_fun(*this, &CGtkNfoViewCtrl::OnSetScrollAdjustments), true);
+	OnSetScrollAdjustments(get_hadjustment(), get_vadjustment());
 }
 
 
@@ -43,11 +47,11 @@ bool CGtkNfoViewCtrl::OpenFile(const std::string& a_filePath)
 	m_classicRenderer.UnAssignNFO();
 	m_textOnlyRenderer.UnAssignNFO();
 
-	delete m_pNfo;
-	delete m_pNfoTextOnly;
+	m_pNfoTextOnly.reset();
+	m_lastScrollTop = 0;
 
 	// load new file:
-	m_pNfo = new CNFOData();
+	m_pNfo = std::make_shared<CNFOData>();
 
 	if(m_pNfo->LoadFromFile(a_filePath))
 	{
@@ -56,8 +60,7 @@ bool CGtkNfoViewCtrl::OpenFile(const std::string& a_filePath)
 	}
 
 	// if loading failed, clean up:
-	delete m_pNfo;
-	m_pNfo = NULL;
+	m_pNfo.reset();
 
 	return false;
 }
@@ -68,7 +71,7 @@ void CGtkNfoViewCtrl::SwitchView(ENfoViewMode a_newMode)
 	ENfoViewMode l_oldMode = m_mode;
 	m_mode = a_newMode;
 
-	CNFORenderer* l_pRenderer = GetRenderer();
+	CGtkNfoRenderer* l_pRenderer = GetRenderer();
 
 	if(!l_pRenderer->HasNfoData() && m_pNfo)
 	{
@@ -82,14 +85,11 @@ void CGtkNfoViewCtrl::SwitchView(ENfoViewMode a_newMode)
 		{
 			// generate text-only data
 
-			const std::string l_stripped = CNFOData::GetStrippedTextUtf8(m_pNfo->GetTextWide());
-			m_pNfoTextOnly = new CNFOData();
-			m_pNfoTextOnly->SetCharsetToTry(NFOC_UTF8);
+			m_pNfoTextOnly = std::make_shared<CNFOData>();
 
-			if(!m_pNfoTextOnly->LoadFromMemory((const unsigned char*)l_stripped.c_str(), l_stripped.size()))
+			if(!m_pNfoTextOnly->LoadStripped(*m_pNfo))
 			{
-				delete m_pNfoTextOnly;
-				m_pNfoTextOnly = NULL;
+				m_pNfoTextOnly.reset();
 			}
 			else
 			{
@@ -100,12 +100,16 @@ void CGtkNfoViewCtrl::SwitchView(ENfoViewMode a_newMode)
 
 	this->set_size(l_pRenderer->GetWidth(), l_pRenderer->GetHeight()); // from Gtk::Layout
 
+	// the new view has to know where the user is looking before it pre-renders anything:
+	OnVScroll();
+
 	ForceRedraw();
 }
 
 
 /**
- * Layout's expose event: Drawing from the "backbuffer" to the screen happens here.
+ * Layout's expose event: only the exposed area gets rendered (if it's not
+ * been rendered yet) and drawn, the rest of the NFO follows in the background.
  **/
 bool CGtkNfoViewCtrl::on_expose_event(GdkEventExpose* event)
 {
@@ -125,7 +129,7 @@ bool CGtkNfoViewCtrl::on_expose_event(GdkEventExpose* event)
 			l_cr->clip();
 		}
 
-		CNFORenderer* l_pRenderer = GetRenderer();
+		CGtkNfoRenderer* l_pRenderer = GetRenderer();
 
 		// paint the background (important for where the control is not covered by the NFO contents):
 		l_cr->set_source_rgb(S_COLOR_T_CAIRO(l_pRenderer->GetBackColor()));
@@ -140,7 +144,32 @@ bool CGtkNfoViewCtrl::on_expose_event(GdkEventExpose* event)
 			if(GetCenterNfo() && l_nfoWidth < l_visibleWidth)
 				l_destx = (l_visibleWidth - l_nfoWidth) / 2;
 
-			l_pRenderer->DrawToClippedHandle(l_cr->cobj(), l_destx, 0);
+			// the part of the NFO that has been exposed, in bin window coordinates:
+			int l_left = l_destx, l_top = 0, l_right = l_destx + l_nfoWidth, l_bottom = l_nfoHeight;
+
+			if(event)
+			{
+				l_left = std::max(l_left, event->area.x);
+				l_top = std::max(l_top, event->area.y);
+				l_right = std::min(l_right, event->area.x + event->area.width);
+				l_bottom = std::min(l_bottom, event->area.y + event->area.height);
+			}
+
+			if(l_right > l_left && l_bottom > l_top)
+			{
+				cairo_surface_t* l_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, l_right - l_left, l_bottom - l_top);
+
+				if(l_pRenderer->DrawToSurface(l_surface, 0, 0, l_left - l_destx, l_top, l_right - l_left, l_bottom - l_top))
+				{
+					cairo_set_source_surface(l_cr->cobj(), l_surface, l_left, l_top);
+					cairo_paint(l_cr->cobj());
+				}
+
+				cairo_surface_destroy(l_surface);
+			}
+
+			// (re-)start pre-rendering after opening a file or switching views, no-op if it's running already:
+			l_pRenderer->PreRender();
 		}
 	}
 
@@ -168,10 +197,51 @@ void CGtkNfoViewCtrl::ForceRedraw()
 }
 
 
+/**
+ * Follows the vertical adjustment that a scrolled window gives us.
+ **/
+void CGtkNfoViewCtrl::OnSetScrollAdjustments(Gtk::Adjustment* a_hadj, Gtk::Adjustment* a_vadj)
+{
+	m_vScrollConnection.disconnect();
+
+	if(a_vadj)
+	{
+		m_vScrollConnection = a_vadj->signal_value_changed().connect(sigc::mem_fun(*this, &CGtkNfoViewCtrl::OnVScroll));
+	}
+}
+
+
+/**
+ * Tells the renderer where the user is looking and where they are going,
+ * so pre-rendering starts there.
+ **/
+void CGtkNfoViewCtrl::OnVScroll()
+{
+	Gtk::Adjustment* l_vadj = this->get_vadjustment();
+	CGtkNfoRenderer* l_pRenderer = GetRenderer();
+
+	if(!l_vadj || !l_pRenderer->HasNfoData() || l_pRenderer->GetBlockHeight() == 0)
+	{
+		return;
+	}
+
+	const size_t l_blockHeight = l_pRenderer->GetBlockHeight();
+	const double l_top = l_vadj->get_value();
+
+	l_pRenderer->SetViewportHint(static_cast<size_t>(l_top) / l_blockHeight,
+		static_cast<size_t>(l_top + l_vadj->get_page_size()) / l_blockHeight,
+		static_cast<int>((l_top - m_lastScrollTop) / static_cast<double>(l_blockHeight)));
+
+	m_lastScrollTop = l_top;
+
+	l_pRenderer->PreRender();
+}
+
+
 /**
  * Returns CNFORenderer instance based on m_mode (view mode).
  **/
-CNFORenderer* CGtkNfoViewCtrl::GetRenderer()
+CGtkNfoRenderer* CGtkNfoViewCtrl::GetRenderer()
 {
 	switch(m_mode)
 	{
@@ -189,6 +259,7 @@ CNFORenderer* CGtkNfoViewCtrl::GetRenderer()
  **/
 CGtkNfoViewCtrl::~CGtkNfoViewCtrl()
 {
+	m_vScrollConnection.disconnect();
 }
 
 
@@ -17,6 +17,7 @@
 
 #include <gtkmm/builder.h>
 #include <gtkmm/layout.h>
+#include <gtkmm/adjustment.h>
 
 #include "nfo_data.h"
 #include "nfo_renderer.h"
@@ -32,6 +33,24 @@ typedef enum _nfo_view_mode_t
 } ENfoViewMode;
 
 
+/**
+ * Renders on demand, like the Windows view: exposed stripes are rendered
+ * right away, the others in the background, starting where the user looks.
+ **/
+class CGtkNfoRenderer : public CNFORenderer
+{
+public:
+	CGtkNfoRenderer(bool a_classicMode = false) : CNFORenderer(a_classicMode)
+	{
+		m_onDemandRendering = true;
+		SetTiledRendering(true);
+	}
+
+	// the view starts pre-rendering once it has drawn something:
+	using CNFORenderer::PreRender;
+};
+
+
 class CGtkNfoViewCtrl : public Gtk::Layout
 {
 public:
@@ -45,25 +64,31 @@ public:
 protected:
 	/* GTK stuff */
 	virtual bool on_expose_event(GdkEventExpose* event);
+	void OnSetScrollAdjustments(Gtk::Adjustment* a_hadj, Gtk::Adjustment* a_vadj);
+	void OnVScroll();
 
 	Glib::RefPtr<Gtk::Builder> m_refGlade;
 
 	/* helper methods */
-	CNFORenderer* GetRenderer();
+	CGtkNfoRenderer* GetRenderer();
 	bool GetCenterNfo() const { return m_centerNfo && m_mode != NFO_VIEW_TEXTONLY; }
 	void ForceRedraw();
 
 	/* NFO data and renderer stuff */
-	CNFOData* m_pNfo;
-	CNFOData* m_pNfoTextOnly;
+	PNFOData m_pNfo;
+	PNFOData m_pNfoTextOnly;
 
-	CNFORenderer m_renderer;
-	CNFORenderer m_classicRenderer;
-	CNFORenderer m_textOnlyRenderer;
+	CGtkNfoRenderer m_renderer;
+	CGtkNfoRenderer m_classicRenderer;
+	CGtkNfoRenderer m_textOnlyRenderer;
 
 	/* settings/flags */
 	ENfoViewMode m_mode;
 	bool m_centerNfo;
+
+	/* last scroll position, for the renderer's viewport hint */
+	double m_lastScrollTop;
+	sigc::connection m_vScrollConnection;
 };
 
 #endif /* _NFO_VIEW_CTRL_H */
@@ -24,7 +24,18 @@ CAnsiArt::CAnsiArt(size_t a_widthLimit, size_t a_heightLimit, size_t a_hintWidth
 	m_heightLimit(a_heightLimit),
 	m_hintWidth(a_hintWidth),
 	m_hintHeight(a_hintHeight),
-	m_commands(),
+	m_screen(),
+	m_screenRows(0),
+	m_screenStride(0),
+	m_sgrParams(),
+	m_frameInterval(0),
+	m_screenFore(),
+	m_screenBack(),
+	m_currentFore(FRAME_DEFAULT_COLOR),
+	m_currentBack(FRAME_DEFAULT_COLOR),
+	m_dirtyRowFirst(0), m_dirtyRowEnd(0),
+	m_dirtyColFirst(0), m_dirtyColEnd(0),
+	m_frames(),
 	m_lines(),
 	m_maxLineLength(),
 	m_colorMap()
@@ -32,367 +43,533 @@ CAnsiArt::CAnsiArt(size_t a_widthLimit, size_t a_heightLimit, size_t a_hintWidth
 }
 
 
-bool CAnsiArt::Parse(const wstring& a_text)
+template<typename T> static void _ReGrid(std::vector<T>& a_cells, size_t a_rows, size_t a_oldStride, size_t a_newStride, T a_fill)
 {
-	m_commands.clear();
+	std::vector<T> l_new(a_rows * a_newStride, a_fill);
 
-	enum class PS {
-		PARSERERROR = -1,
-		ANYTEXT = 1,
-		ESC_CHAR,
-		ESC_BRACKET,
-		ESC_DATA,
-		ESC_COMMAND,
-	};
+	for (size_t row = 0; row < a_rows; ++row)
+	{
+		std::copy_n(a_cells.begin() + row * a_oldStride, a_oldStride, l_new.begin() + row * a_newStride);
+	}
 
-	PS parser_state = PS::ANYTEXT;
-	wstring data;
+	a_cells.swap(l_new);
+}
 
-	for (wchar_t c : a_text)
+
+bool CAnsiArt::ReserveScreen(size_t a_rows, size_t a_cols)
+{
+	if (a_rows > m_heightLimit || a_cols > m_widthLimit)
 	{
-		if (c == L'\x2190')
-		{
-			if (parser_state != PS::ANYTEXT)
-			{
-				parser_state = PS::PARSERERROR;
-				break;
-			}
+		return false;
+	}
 
-			if (!data.empty())
-			{
-				m_commands.emplace_back(ansi_command_t{ 0, data });
-				data.clear();
-			}
+	if (a_cols > m_screenStride)
+	{
+		// grow geometrically, but never beyond what the limits allow:
+		const size_t l_newStride = std::max(a_cols, std::min(m_screenStride * 2, m_widthLimit));
 
-			parser_state = PS::ESC_BRACKET;
-		}
-		else if (c == L'[' && parser_state == PS::ESC_BRACKET)
-		{
-			parser_state = PS::ESC_DATA;
-		}
-		else if (parser_state == PS::ESC_DATA)
-		{
-			if (iswdigit(c) || c == L';' || c == L'?')
-			{
-				data += c;
-			}
-			else if (iswalpha(c))
-			{
-				m_commands.emplace_back(ansi_command_t{ c, data });
-				data.clear();
+		_ReGrid<wchar_t>(m_screen, m_screenRows, m_screenStride, l_newStride, L' ');
 
-				parser_state = PS::ANYTEXT;
-			}
-			else if (iswspace(c))
-			{
-				// ignore sequences terminated with space instead of alpha character.
-				data.clear();
-				parser_state = PS::ANYTEXT;
-			}
-			else
-			{
-				parser_state = PS::PARSERERROR;
-				break;
-			}
-		}
-		else if (parser_state == PS::ANYTEXT)
+		if (m_frameInterval > 0)
 		{
-			data += c;
-		}
-		else
-		{
-			parser_state = PS::PARSERERROR;
-			break;
+			_ReGrid<uint32_t>(m_screenFore, m_screenRows, m_screenStride, l_newStride, FRAME_DEFAULT_COLOR);
+			_ReGrid<uint32_t>(m_screenBack, m_screenRows, m_screenStride, l_newStride, FRAME_DEFAULT_COLOR);
 		}
+
+		m_screenStride = l_newStride;
 	}
 
-	if (parser_state == PS::ANYTEXT)
+	if (a_rows > m_screenRows)
 	{
-		if (!data.empty())
+		m_screenRows = std::max(a_rows, std::min(m_screenRows * 2, m_heightLimit));
+		m_screen.resize(m_screenRows * m_screenStride, L' ');
+
+		if (m_frameInterval > 0)
 		{
-			m_commands.emplace_back(ansi_command_t{ 0, data });
+			m_screenFore.resize(m_screen.size(), FRAME_DEFAULT_COLOR);
+			m_screenBack.resize(m_screen.size(), FRAME_DEFAULT_COLOR);
 		}
 	}
-	else
-	{
-		parser_state = PS::PARSERERROR;
-	}
 
-	return (parser_state != PS::PARSERERROR && !m_commands.empty());
+	return true;
 }
 
 
-bool CAnsiArt::Process()
+// Escape sequences are applied while they are being read, there is no
+// intermediate list of commands. Numeric parameters are accumulated
+// digit by digit, matching what wcstol did with each ;-separated field.
+bool CAnsiArt::Interpret(const wstring& a_text)
 {
-	if (m_commands.empty())
-	{
-		// handle empty files...? naaah
-		return false;
-	}
+	enum class PS {
+		ANYTEXT = 1,
+		ESC_BRACKET,
+		ESC_DATA,
+	};
+
+	constexpr long FIELD_VALUE_MAX = 1000000000l;
 
 	m_colorMap = std::make_shared<CNFOColorMap>();
+	m_screen.clear();
+	m_screenFore.clear();
+	m_screenBack.clear();
+	m_screenRows = m_screenStride = 0;
+	m_currentFore = m_currentBack = FRAME_DEFAULT_COLOR;
+	m_dirtyRowFirst = m_dirtyRowEnd = m_dirtyColFirst = m_dirtyColEnd = 0;
+	m_frames.clear();
+	m_lines.clear();
+	m_maxLineLength = 0;
 
-	TwoDimVector<wchar_t> screen(
-		(m_hintHeight ? m_hintHeight : 100),
-		m_hintWidth,
-		L' ');
+	if (!ReserveScreen(std::min<size_t>((m_hintHeight ? m_hintHeight : 100), m_heightLimit), std::min(m_hintWidth, m_widthLimit)))
+	{
+		return false;
+	}
 
 	std::stack<std::pair<long, long>> saved_positions;
 	long x = 0, y = 0;
 
-	for (const ansi_command_t& cmd : m_commands)
-	{
-		long x_delta = 0, y_delta = 0;
-		long n = 0, m = 0;
+	PS parser_state = PS::ANYTEXT;
+	bool any_commands = false;
 
-		if (cmd.cmd != 0 && cmd.cmd != L'm')
-		{
-			// this could be done somewhat nicer, but okay for now:
-			wstring::size_type pos;
+	// current text run:
+	bool in_text = false;
+	size_t used_x_start = 0, used_x = 0;
 
-			n = std::max(CUtil::StringToLong(cmd.data), 1l);
+	// current escape sequence:
+	size_t num_fields = 0;
+	long field_value = 0, first_value = 0, second_value = 0;
+	bool field_digits = true;
 
-			if ((pos = cmd.data.find(L';')) != wstring::npos)
-			{
-				m = std::max(CUtil::StringToLong(cmd.data.substr(pos + 1)), 1l);
-			}
-			else
+	size_t commands_since_frame = 0;
+
+	const auto end_command = [&]()
+	{
+		if (m_frameInterval > 0 && ++commands_since_frame >= m_frameInterval)
+		{
+			if (m_frames.size() < FRAMES_LIMIT)
 			{
-				m = 1;
+				// when the limit is hit, changes pile up for the final frame.
+				CaptureFrame();
 			}
+
+			commands_since_frame = 0;
+		}
+	};
+
+	const auto end_field = [&]()
+	{
+		if (num_fields == 0)
+		{
+			first_value = field_value;
+		}
+		else if (num_fields == 1)
+		{
+			second_value = field_value;
 		}
 
-		switch (cmd.cmd)
+		if (field_value >= 0 && field_value <= 255)
 		{
-		case 0: { // put text to current position
-			size_t used_x_start = x, used_x = 0;
+			m_sgrParams.push_back(static_cast<uint8_t>(field_value));
+		}
+
+		++num_fields;
+		field_value = 0;
+		field_digits = true;
+	};
 
-			for (wchar_t c : cmd.data)
+	for (wchar_t c : a_text)
+	{
+		if (parser_state == PS::ANYTEXT)
+		{
+			if (c == L'\x2190')
 			{
-				if (c == L'\r')
+				if (in_text && used_x > 0)
 				{
-					// ignore CR
+					m_colorMap->PushUsedSection(y, used_x_start, used_x);
 				}
-				else if (c == L'\n' || (m_hintWidth != 0 && x == m_hintWidth - 1))
+
+				if (in_text)
 				{
-					if (y >= screen.GetRows() - 1)
-					{
-						size_t new_rows = screen.GetRows() + std::max<size_t>(50, y - (screen.GetRows() - 1));
+					end_command();
+				}
 
-						if (new_rows > m_heightLimit || new_rows < screen.GetRows() /* overflow safeguard */)
-						{
-							return false;
-						}
+				in_text = false;
+				parser_state = PS::ESC_BRACKET;
 
-						screen.Extend(new_rows, screen.GetCols(), L' ');
-					}
+				continue;
+			}
 
-					if (c != L'\n')
-					{
-						// when line wrapping, do not forget this character!
-						screen[y][x] = c;
+			if (!in_text)
+			{
+				// put text to current position
+				in_text = true;
+				any_commands = true;
 
-						++used_x;
-					}
+				used_x_start = x;
+				used_x = 0;
+			}
 
-					if (used_x > 0)
+			if (c == L'\r')
+			{
+				// ignore CR
+			}
+			else if (c == L'\n' || (m_hintWidth != 0 && x == m_hintWidth - 1))
+			{
+				if (static_cast<size_t>(y) + 1 >= m_heightLimit)
+				{
+					return false;
+				}
+
+				if (c != L'\n')
+				{
+					// when line wrapping, do not forget this character!
+					if (!ReserveScreen(y + 1, x + 1))
 					{
-						m_colorMap->PushUsedSection(y, used_x_start, used_x);
+						return false;
 					}
 
-					++y;
-					x = 0;
+					PutChar(y, x, c);
 
-					used_x_start = 0;
-					used_x = 0;
+					++used_x;
 				}
-				else
+
+				if (used_x > 0)
 				{
-					if (x >= screen.GetCols() - 1)
-					{
-						size_t new_cols = screen.GetCols() + std::max<size_t>(50, x - (screen.GetCols() - 1));
+					m_colorMap->PushUsedSection(y, used_x_start, used_x);
+				}
 
-						if (new_cols > m_widthLimit || new_cols < screen.GetCols() /* overflow safeguard */)
-						{
-							return false;
-						}
+				++y;
+				x = 0;
 
-						screen.Extend(screen.GetRows(), new_cols, L' ');
-					}
+				used_x_start = 0;
+				used_x = 0;
+			}
+			else
+			{
+				if (!ReserveScreen(y + 1, x + 1))
+				{
+					return false;
+				}
 
-					screen[y][x] = c;
-					++x;
+				PutChar(y, x, c);
+				++x;
 
-					++used_x;
-				}
+				++used_x;
 			}
-
-			if (used_x > 0)
+		}
+		else if (parser_state == PS::ESC_BRACKET)
+		{
+			if (c != L'[')
 			{
-				m_colorMap->PushUsedSection(y, used_x_start, used_x);
+				return false;
 			}
-			break;
-		}
-		case L'A': { // cursor up
-			y_delta = -n;
-			break;
-		}
-		case L'B': { // cursor down
-			y_delta = n;
-			break;
-		}
-		case L'C': { // cursor forward
-			x_delta = n;
-			break;
-		}
-		case L'D': { // cursor back
-			x_delta = -n;
-			break;
-		}
-		case L'E': { // cursor to beginning of next line
-			y_delta = n;
-			x = 0;
-			break;
-		}
-		case L'F': { // cursor to beginning of previous line
-			y_delta = -n;
-			x = 0;
-			break;
-		}
-		case L'G': { // move to given column
-			x = n - 1;
-			break;
-		}
-		case L'H':
-		case L'f': { // moves the cursor to row n, column m
-			y = n - 1;
-			x = m - 1;
-			break;
+
+			m_sgrParams.clear();
+			num_fields = 0;
+			field_value = first_value = second_value = 0;
+			field_digits = true;
+
+			parser_state = PS::ESC_DATA;
 		}
-		case L'J': { // erase display
-			// only cursor pos change is supported, ignoring erase command:
-			if (n == 2)
+		else if (iswdigit(c))
+		{
+			if (field_digits)
 			{
-				x = y = 0;
+				field_value = std::min(field_value * 10 + (c - L'0'), FIELD_VALUE_MAX);
 			}
-			break;
 		}
-		case L'K': { // erase in line
-			// unsupported
-			break;
+		else if (c == L';')
+		{
+			end_field();
 		}
-		case L's': { // save cursor pos
-			saved_positions.emplace(x, y);
-			break;
+		else if (c == L'?')
+		{
+			// a field's value ends at the first non-digit:
+			field_digits = false;
 		}
-		case L'u': { // restore cursor pos
-			if (!saved_positions.empty()) {
-				x = saved_positions.top().first;
-				y = saved_positions.top().second;
-				saved_positions.pop();
-			}
-			break;
+		else if (iswspace(c))
+		{
+			// ignore sequences terminated with space instead of alpha character.
+			parser_state = PS::ANYTEXT;
+
+			end_command();
+		}
+		else if (c == L'\x2190' || !iswalpha(c))
+		{
+			return false;
 		}
-		case L'm': { // rainbows and stuff!
-			std::vector<uint8_t> params;
+		else
+		{
+			end_field();
+
+			any_commands = true;
+			parser_state = PS::ANYTEXT;
 
-			for (const wstring& s : CUtil::StrSplit(cmd.data, L";"))
+			const long n = std::max(first_value, 1l);
+			const long m = (num_fields > 1 ? std::max(second_value, 1l) : 1l);
+			long x_delta = 0, y_delta = 0;
+
+			switch (c)
 			{
-				long n = CUtil::StringToLong(s);
+			case L'A': { // cursor up
+				y_delta = -n;
+				break;
+			}
+			case L'B': { // cursor down
+				y_delta = n;
+				break;
+			}
+			case L'C': { // cursor forward
+				x_delta = n;
+				break;
+			}
+			case L'D': { // cursor back
+				x_delta = -n;
+				break;
+			}
+			case L'E': { // cursor to beginning of next line
+				y_delta = n;
+				x = 0;
+				break;
+			}
+			case L'F': { // cursor to beginning of previous line
+				y_delta = -n;
+				x = 0;
+				break;
+			}
+			case L'G': { // move to given column
+				x = n - 1;
+				break;
+			}
+			case L'H':
+			case L'f': { // moves the cursor to row n, column m
+				y = n - 1;
+				x = m - 1;
+				break;
+			}
+			case L'J': { // erase display
+				// only cursor pos change is supported, ignoring erase command:
+				if (n == 2)
+				{
+					x = y = 0;
+				}
+				break;
+			}
+			case L'K': { // erase in line
+				// unsupported
+				break;
+			}
+			case L's': { // save cursor pos
+				saved_positions.emplace(x, y);
+				break;
+			}
+			case L'u': { // restore cursor pos
+				if (!saved_positions.empty()) {
+					x = saved_positions.top().first;
+					y = saved_positions.top().second;
+					saved_positions.pop();
+				}
+				break;
+			}
+			case L'm': { // rainbows and stuff!
+				if (!m_sgrParams.empty())
+				{
+					m_colorMap->PushGraphicRendition(y, x, m_sgrParams);
 
-				if (n >= 0 && n <= 255)
+					UpdateCurrentColors();
+				}
+				break;
+			}
+			case L'h': // Changes the screen width or type
+				if (n == 7)
 				{
-					params.emplace_back(static_cast<uint8_t>(n));
+					// enable line wrapping
 				}
+				break;
+			case L'l': // Reset screen width or type
+				if (n == 7)
+				{
+					// disable line wrapping
+				}
+				break;
+				// some more info about h + l: http://ascii-table.com/ansi-escape-sequences.php
+			case L'S': // scroll up
+			case L'T': // scroll down
+			case L'n': // report cursor position
+				// unsupported, ignore
+				break;
+			default:
+				// unknown
+				_ASSERT(false);
 			}
 
-			if (!params.empty())
+			if (y_delta < 0 && std::abs(y_delta) <= y)
 			{
-				m_colorMap->PushGraphicRendition(y, x, params);
+				y += y_delta;
 			}
-			break;
-		}
-		case L'h': // Changes the screen width or type
-			if (n == 7)
+			else if (y_delta > 0)
 			{
-				// enable line wrapping
+				y += y_delta;
 			}
-			break;
-		case L'l': // Reset screen width or type
-			if (n == 7)
+			else if (y_delta != 0)
 			{
-				// disable line wrapping
+				// out of bounds, confine to screen
+				y = 0;
 			}
-			break;
-			// some more info about h + l: http://ascii-table.com/ansi-escape-sequences.php
-		case L'S': // scroll up
-		case L'T': // scroll down
-		case L'n': // report cursor position
-			// unsupported, ignore
-			break;
-		default:
-			// unknown
-			_ASSERT(false);
-		}
-
-		if (y_delta < 0 && std::abs(y_delta) <= y)
-		{
-			y += y_delta;
-		}
-		else if (y_delta > 0)
-		{
-			y += y_delta;
-		}
-		else if (y_delta != 0)
-		{
-			// out of bounds, confine to screen
-			y = 0;
-		}
 
-		if (x_delta < 0 && std::abs(x_delta) <= x)
-		{
-			x += x_delta;
-		}
-		else if (x_delta > 0)
-		{
-			x += x_delta;
-		}
-		else if (x_delta != 0)
-		{
-			// out of bounds, confine to screen
-			x = 0;
-		}
+			if (x_delta < 0 && std::abs(x_delta) <= x)
+			{
+				x += x_delta;
+			}
+			else if (x_delta > 0)
+			{
+				x += x_delta;
+			}
+			else if (x_delta != 0)
+			{
+				// out of bounds, confine to screen
+				x = 0;
+			}
 
-		if (x >= screen.GetCols() || y >= screen.GetRows())
-		{
-			if (x >= m_widthLimit || y >= m_heightLimit)
+			if (static_cast<size_t>(x) >= m_widthLimit || static_cast<size_t>(y) >= m_heightLimit)
 			{
 				return false;
 			}
 
-			screen.Extend(static_cast<size_t>(y) + 1, static_cast<size_t>(x) + 1, L' ');
+			end_command();
 		}
 	}
 
-	// and finally read lines from "screen" into internal structures:
+	if (parser_state != PS::ANYTEXT || !any_commands)
+	{
+		// handle empty files...? naaah
+		return false;
+	}
+
+	if (in_text && used_x > 0)
+	{
+		m_colorMap->PushUsedSection(y, used_x_start, used_x);
+	}
+
+	if (m_frameInterval > 0)
+	{
+		// whatever has changed after the last snapshot:
+		CaptureFrame();
+	}
+
+	ReadLinesFromScreen();
+
+	return true;
+}
+
+
+void CAnsiArt::PutChar(size_t a_row, size_t a_col, wchar_t a_char)
+{
+	const size_t l_index = a_row * m_screenStride + a_col;
+
+	if (m_frameInterval == 0)
+	{
+		m_screen[l_index] = a_char;
+		return;
+	}
+
+	if (m_screen[l_index] == a_char && m_screenFore[l_index] == m_currentFore && m_screenBack[l_index] == m_currentBack)
+	{
+		// redrawn, but unchanged.
+		return;
+	}
+
+	m_screen[l_index] = a_char;
+	m_screenFore[l_index] = m_currentFore;
+	m_screenBack[l_index] = m_currentBack;
+
+	if (m_dirtyRowFirst >= m_dirtyRowEnd)
+	{
+		m_dirtyRowFirst = a_row;
+		m_dirtyRowEnd = a_row + 1;
+		m_dirtyColFirst = a_col;
+		m_dirtyColEnd = a_col + 1;
+	}
+	else
+	{
+		m_dirtyRowFirst = std::min(m_dirtyRowFirst, a_row);
+		m_dirtyRowEnd = std::max(m_dirtyRowEnd, a_row + 1);
+		m_dirtyColFirst = std::min(m_dirtyColFirst, a_col);
+		m_dirtyColEnd = std::max(m_dirtyColEnd, a_col + 1);
+	}
+}
+
+
+void CAnsiArt::UpdateCurrentColors()
+{
+	if (m_frameInterval == 0)
+	{
+		return;
+	}
+
+	if (!m_colorMap->GetCurrentForegroundColor(m_currentFore))
+	{
+		m_currentFore = FRAME_DEFAULT_COLOR;
+	}
+
+	if (!m_colorMap->GetCurrentBackgroundColor(m_currentBack))
+	{
+		m_currentBack = FRAME_DEFAULT_COLOR;
+	}
+}
+
+
+// copy the dirty rectangle into a new frame and reset it:
+void CAnsiArt::CaptureFrame()
+{
+	if (m_dirtyRowFirst >= m_dirtyRowEnd)
+	{
+		// nothing has changed, don't bother.
+		return;
+	}
 
+	SFrame l_frame;
+
+	l_frame.row = m_dirtyRowFirst;
+	l_frame.col = m_dirtyColFirst;
+	l_frame.rows = m_dirtyRowEnd - m_dirtyRowFirst;
+	l_frame.cols = m_dirtyColEnd - m_dirtyColFirst;
+
+	l_frame.chars.reserve(l_frame.rows * l_frame.cols);
+	l_frame.foreColors.reserve(l_frame.rows * l_frame.cols);
+	l_frame.backColors.reserve(l_frame.rows * l_frame.cols);
+
+	for (size_t row = m_dirtyRowFirst; row < m_dirtyRowEnd; ++row)
+	{
+		const size_t l_from = row * m_screenStride + m_dirtyColFirst, l_to = l_from + l_frame.cols;
+
+		l_frame.chars.insert(l_frame.chars.end(), m_screen.begin() + l_from, m_screen.begin() + l_to);
+		l_frame.foreColors.insert(l_frame.foreColors.end(), m_screenFore.begin() + l_from, m_screenFore.begin() + l_to);
+		l_frame.backColors.insert(l_frame.backColors.end(), m_screenBack.begin() + l_from, m_screenBack.begin() + l_to);
+	}
+
+	m_frames.push_back(std::move(l_frame));
+
+	m_dirtyRowFirst = m_dirtyRowEnd = m_dirtyColFirst = m_dirtyColEnd = 0;
+}
+
+
+// read lines from "screen" into internal structures:
+void CAnsiArt::ReadLinesFromScreen()
+{
 	m_maxLineLength = 0;
 	m_lines.clear();
 
-	for (size_t row = 0; row < screen.GetRows(); ++row)
+	for (size_t row = 0; row < m_screenRows; ++row)
 	{
-		size_t line_used = 0;
+		const wchar_t* const line_start = &m_screen[row * m_screenStride];
+		size_t line_used = m_screenStride;
 
-		for (size_t col = screen.GetCols() - 1; col >= 0 && col < screen.GetCols(); col--)
+		while (line_used > 0 && line_start[line_used - 1] == L' ')
 		{
-			if (screen[row][col] != L' ')
-			{
-				line_used = col + 1;
-				break;
-			}
+			--line_used;
 		}
 
-		m_lines.emplace_back(wstring(screen[row].begin(), screen[row].begin() + line_used));
+		m_lines.emplace_back(line_start, line_used);
 
 		if (line_used > m_maxLineLength)
 		{
@@ -411,8 +588,6 @@ bool CAnsiArt::Process()
 
 		m_lines.pop_back();
 	}
-
-	return true;
 }
 
 
@@ -18,6 +18,7 @@
 #include "nfo_colormap.h"
 #include <string>
 #include <list>
+#include <vector>
 
 // combined processing for ANSI files
 // reference: http://en.wikipedia.org/wiki/ANSI_escape_code
@@ -26,11 +27,25 @@ class CAnsiArt
 public:
 	typedef std::list<std::wstring> TLineContainer;
 
+	// colors in frames are stored as RGBA words, this marks the renderer's default color:
+	static constexpr uint32_t FRAME_DEFAULT_COLOR = 0;
+
+	// cells that have changed since the previous frame, row by row:
+	typedef struct
+	{
+		size_t row, col; // top left corner of the dirty rectangle
+		size_t rows, cols;
+		std::vector<wchar_t> chars;
+		std::vector<uint32_t> foreColors;
+		std::vector<uint32_t> backColors;
+	} SFrame;
+
+	typedef std::vector<SFrame> TFrameContainer;
+
 public:
 	CAnsiArt(size_t a_widthLimit, size_t a_heightLimit, size_t a_hintWidth, size_t a_hintHeight);
 
-	bool Parse(const std::wstring& a_text);
-	bool Process();
+	bool Interpret(const std::wstring& a_text);
 
 	const TLineContainer GetLines() const { return m_lines; }
 	size_t GetMaxLineLength() const { return m_maxLineLength; }
@@ -48,6 +63,11 @@ public:
 	std::wstring GetAsClassicText() const;
 	PNFOColorMap GetColorMap() const { return m_colorMap; }
 
+	// ANSImations: take a snapshot every a_commandInterval escape sequences/text runs, 0 = off.
+	void SetFrameCapture(size_t a_commandInterval) { m_frameInterval = a_commandInterval; }
+	const TFrameContainer& GetFrames() const { return m_frames; }
+	void TakeFrames(TFrameContainer& ar_frames) { ar_frames.swap(m_frames); m_frames.clear(); }
+
 protected:
 	size_t m_widthLimit;
 	size_t m_heightLimit;
@@ -55,16 +75,33 @@ protected:
 	size_t m_hintWidth;
 	size_t m_hintHeight;
 
-	// this is filled by Parse():
-
-	typedef struct {
-		wchar_t cmd; // \0 = regular text
-		std::wstring data;
-	} ansi_command_t;
-
-	std::list<ansi_command_t> m_commands;
-
-	// this is filled by Process():
+	// screen buffer used by Interpret(), grows geometrically in both directions:
+	std::vector<wchar_t> m_screen;
+	size_t m_screenRows;
+	size_t m_screenStride;
+	std::vector<uint8_t> m_sgrParams;
+
+	bool ReserveScreen(size_t a_rows, size_t a_cols);
+	wchar_t& ScreenAt(size_t a_row, size_t a_col) { return m_screen[a_row * m_screenStride + a_col]; }
+	void ReadLinesFromScreen();
+
+	static const size_t FRAMES_LIMIT = 20000;
+
+	// frame capture state, the color buffers are parallel to m_screen:
+	size_t m_frameInterval;
+	std::vector<uint32_t> m_screenFore;
+	std::vector<uint32_t> m_screenBack;
+	uint32_t m_currentFore;
+	uint32_t m_currentBack;
+	size_t m_dirtyRowFirst, m_dirtyRowEnd;
+	size_t m_dirtyColFirst, m_dirtyColEnd;
+	TFrameContainer m_frames;
+
+	void PutChar(size_t a_row, size_t a_col, wchar_t a_char);
+	void UpdateCurrentColors();
+	void CaptureFrame();
+
+	// this is filled by Interpret():
 
 	TLineContainer m_lines;
 	size_t m_maxLineLength;
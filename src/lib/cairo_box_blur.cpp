@@ -19,152 +19,258 @@
 #include <omp.h>
 
 
- // the CPU fallback for non-MSVC compilers is largely based on
- // http://mxr.mozilla.org/mozilla1.9.2/source/gfx/thebes/src/gfxBlur.cpp
- // (GPL v2)
-
-#ifndef M_PI
-#define M_PI 3.141592653589793238462643
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BOX_BLUR_SSE
+#include <xmmintrin.h>
 #endif
 
-// mozilla code stuff
-typedef int32_t PRInt32;
-#define PR_MAX(a, b) ((a) > (b) ? (a) : (b))
-#define PR_MIN(a, b) ((a) < (b) ? (a) : (b))
-#define NS_ASSERTION(a, b) _ASSERT(a)
 
+// the blur is a lot wider than a pixel of the reduced mask then, so bilinear scaling is smooth enough:
+#define MIN_REDUCED_SIGMA 2.0f
 
-CCairoBoxBlur::CCairoBoxBlur(int a_width, int a_height, int a_blurRadius, bool a_useGPU) :
-	m_blurRadius(a_blurRadius),
+
+CCairoBoxBlur::CCairoBoxBlur(int a_width, int a_height, int a_blurRadius, bool a_useGPU, int a_downscale) :
+	m_allowFallback(true),
 	m_width(a_width),
 	m_height(a_height),
-	m_allowFallback(true)
+	m_blurRadius(a_blurRadius),
+	m_downscale(1)
 {
 	m_useFallback = !a_useGPU || !IsGPUUsable();
 
-	m_imgSurface = cairo_image_surface_create(m_useFallback ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_ARGB32, a_width, a_height);
+	if (m_useFallback && a_downscale > 1)
+	{
+		m_downscale = a_downscale;
+	}
+
+	m_imgSurface = cairo_image_surface_create(m_useFallback ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_ARGB32,
+		(a_width + m_downscale - 1) / m_downscale, (a_height + m_downscale - 1) / m_downscale);
 	m_context = cairo_create(m_imgSurface);
+
+	if (m_downscale > 1)
+	{
+		cairo_scale(m_context, 1.0 / m_downscale, 1.0 / m_downscale);
+	}
+}
+
+
+// same as on the GPU, where it's clamped in gaussian_filter_amp:
+static float GetGaussSigma(int a_blurRadius)
+{
+	return std::min(a_blurRadius / 5.0f + 2, 22.0f);
+}
+
+
+/*static*/ int CCairoBoxBlur::GetMaxDownscale(int a_blurRadius)
+{
+	return std::max(static_cast<int>(GetGaussSigma(a_blurRadius) / MIN_REDUCED_SIGMA), 1);
 }
 
 
 /**
- * Box blur involves looking at one pixel, and setting its value to the average
- * of its neighbouring pixels.
- * @param aInput The input buffer.
- * @param aOutput The output buffer.
- * @param aLeftLobe The number of pixels to blend on the left.
- * @param aRightLobe The number of pixels to blend on the right.
- * @param aStride The stride of the buffers.
- * @param aRows The number of rows in the buffers.
- */
-static void
-BoxBlurHorizontal(unsigned char* aInput,
-	unsigned char* aOutput,
-	PRInt32 aLeftLobe,
-	PRInt32 aRightLobe,
-	PRInt32 aStride,
-	PRInt32 aRows)
+ * The CPU fallback is the same recursive (IIR) Gaussian filter as the GPU
+ * version in win32-amp/gaussian_blur.cpp, so glow looks the same everywhere.
+ * Each pixel costs the same, no matter how large the radius is.
+ * Four lines (rows or columns) are filtered at once, one per SIMD lane.
+ **/
+
+typedef struct
 {
-	PRInt32 boxSize = aLeftLobe + aRightLobe + 1;
-
-#pragma omp parallel for
-	for (PRInt32 y = 0; y < aRows; y++) {
-		PRInt32 alphaSum = 0;
-		for (PRInt32 i = 0; i < boxSize; i++) {
-			PRInt32 pos = i - aLeftLobe;
-			pos = PR_MAX(pos, 0);
-			pos = PR_MIN(pos, aStride - 1);
-			alphaSum += aInput[aStride * y + pos];
-		}
-		for (PRInt32 x = 0; x < aStride; x++) {
-			PRInt32 tmp = x - aLeftLobe;
-			PRInt32 last = PR_MAX(tmp, 0);
-			PRInt32 next = PR_MIN(tmp + boxSize, aStride - 1);
+	float a0, a1, a2, a3, b1, b2, coefp, coefn;
+} SGaussCoefficients;
+
+static SGaussCoefficients ComputeGaussCoefficients(float a_sigma)
+{
+	// same clamping as on the GPU:
+	if (a_sigma > 22)
+		a_sigma = 22;
+	else if (a_sigma < 0.1f)
+		a_sigma = 0.1f;
+
+	// formula is from NViDiA CUDA SDK samples:
+	const float
+		alpha = 1.695f / a_sigma,
+		ema = std::exp(-alpha),
+		ema2 = std::exp(-2 * alpha),
+		b1 = -2 * ema,
+		b2 = ema2,
+		k = (1 - ema) * (1 - ema) / (1 + 2 * alpha * ema - ema2),
+		a0 = k,
+		a1 = k * (alpha - 1) * ema,
+		a2 = k * (alpha + 1) * ema,
+		a3 = -k * ema2;
+
+	return SGaussCoefficients{ a0, a1, a2, a3, b1, b2,
+		(a0 + a1) / (1 + b1 + b2), (a2 + a3) / (1 + b1 + b2) };
+}
 
-			aOutput[aStride * y + x] = alphaSum / boxSize;
 
-			alphaSum += aInput[aStride * y + next] -
-				aInput[aStride * y + last];
-		}
+#ifdef BOX_BLUR_SSE
+typedef struct _SLanes
+{
+	__m128 v;
+
+	_SLanes() {}
+	_SLanes(__m128 a_v) : v(a_v) {}
+	explicit _SLanes(float a_value) : v(_mm_set1_ps(a_value)) {}
+
+	static _SLanes Load(const float* a_values) { return _mm_loadu_ps(a_values); }
+	void Store(float* ar_values) const { _mm_storeu_ps(ar_values, v); }
+
+	_SLanes operator+(const _SLanes& o) const { return _mm_add_ps(v, o.v); }
+	_SLanes operator-(const _SLanes& o) const { return _mm_sub_ps(v, o.v); }
+	_SLanes operator*(const _SLanes& o) const { return _mm_mul_ps(v, o.v); }
+} SLanes;
+#else
+typedef struct _SLanes
+{
+	float v[4];
+
+	_SLanes() {}
+	explicit _SLanes(float a_value) { v[0] = v[1] = v[2] = v[3] = a_value; }
+
+	static _SLanes Load(const float* a_values) { _SLanes r; memcpy(r.v, a_values, sizeof(r.v)); return r; }
+	void Store(float* ar_values) const { memcpy(ar_values, v, sizeof(v)); }
+
+	_SLanes operator+(const _SLanes& o) const { _SLanes r; for (int i = 0; i < 4; i++) r.v[i] = v[i] + o.v[i]; return r; }
+	_SLanes operator-(const _SLanes& o) const { _SLanes r; for (int i = 0; i < 4; i++) r.v[i] = v[i] - o.v[i]; return r; }
+	_SLanes operator*(const _SLanes& o) const { _SLanes r; for (int i = 0; i < 4; i++) r.v[i] = v[i] * o.v[i]; return r; }
+} SLanes;
+#endif
+
+template<typename T> static inline SLanes LoadLanes(const T* a_data, const ptrdiff_t a_lanes[4], ptrdiff_t a_pos)
+{
+	const float l_values[4] = { static_cast<float>(a_data[a_lanes[0] + a_pos]), static_cast<float>(a_data[a_lanes[1] + a_pos]),
+		static_cast<float>(a_data[a_lanes[2] + a_pos]), static_cast<float>(a_data[a_lanes[3] + a_pos]) };
+
+	return SLanes::Load(l_values);
+}
+
+static inline void StoreLane(float* ar_data, float a_value) { *ar_data = a_value; }
+static inline void StoreLane(unsigned char* ar_data, float a_value) { *ar_data = static_cast<unsigned char>(std::min(std::max(a_value + 0.5f, 0.0f), 255.0f)); }
+
+template<typename T> static inline void StoreLanes(T* ar_data, const ptrdiff_t a_lanes[4], ptrdiff_t a_pos, const SLanes& a_values)
+{
+	float l_values[4];
+	a_values.Store(l_values);
+
+	for (int i = 0; i < 4; i++)
+	{
+		StoreLane(&ar_data[a_lanes[i] + a_pos], l_values[i]);
 	}
 }
 
 /**
- * Identical to BoxBlurHorizontal, except it blurs top and bottom instead of
- * left and right.
+ * Filters four lines of a_length samples each. Lanes may point to the same
+ * line if there are less than four left.
+ * @param a_inLanes Offsets of the first sample of each line in a_in.
+ * @param a_inStep Distance between two samples of a line in a_in.
+ * @param ar_forward Temporary storage for a_length * 4 floats.
  */
-static void
-BoxBlurVertical(unsigned char* aInput,
-	unsigned char* aOutput,
-	PRInt32 aTopLobe,
-	PRInt32 aBottomLobe,
-	PRInt32 aStride,
-	PRInt32 aRows)
+template<typename TIn, typename TOut> static void
+RecursiveGaussianLines(const TIn* a_in, const ptrdiff_t a_inLanes[4], ptrdiff_t a_inStep,
+	TOut* ar_out, const ptrdiff_t a_outLanes[4], ptrdiff_t a_outStep,
+	int a_length, const SGaussCoefficients& c, float* ar_forward)
 {
-	PRInt32 boxSize = aTopLobe + aBottomLobe + 1;
-
-#pragma omp parallel for
-	for (PRInt32 x = 0; x < aStride; x++) {
-		PRInt32 alphaSum = 0;
-		for (PRInt32 i = 0; i < boxSize; i++) {
-			PRInt32 pos = i - aTopLobe;
-			pos = PR_MAX(pos, 0);
-			pos = PR_MIN(pos, aRows - 1);
-			alphaSum += aInput[aStride * pos + x];
-		}
-		for (PRInt32 y = 0; y < aRows; y++) {
-			PRInt32 tmp = y - aTopLobe;
-			PRInt32 last = PR_MAX(tmp, 0);
-			PRInt32 next = PR_MIN(tmp + boxSize, aRows - 1);
+	const SLanes a0(c.a0), a1(c.a1), a2(c.a2), a3(c.a3), b1(c.b1), b2(c.b2);
 
-			aOutput[aStride * y + x] = alphaSum / boxSize;
+	// forward pass, clamping to the edge:
+	SLanes xp = LoadLanes(a_in, a_inLanes, 0);
+	SLanes yp = xp * SLanes(c.coefp), yb = yp;
 
-			alphaSum += aInput[aStride * next + x] -
-				aInput[aStride * last + x];
-		}
+	for (int j = 0; j < a_length; j++)
+	{
+		const SLanes xc = LoadLanes(a_in, a_inLanes, j * a_inStep);
+		const SLanes yc = a0 * xc + a1 * xp - b1 * yp - b2 * yb;
+
+		yc.Store(&ar_forward[j * 4]);
+
+		xp = xc; yb = yp; yp = yc;
+	}
+
+	// reverse pass, ensures the response is symmetrical:
+	SLanes xn = LoadLanes(a_in, a_inLanes, (a_length - 1) * a_inStep), xa = xn;
+	SLanes yn = xn * SLanes(c.coefn), ya = yn;
+
+	for (int j = a_length - 1; j >= 0; j--)
+	{
+		const SLanes xc = LoadLanes(a_in, a_inLanes, j * a_inStep);
+		const SLanes yc = a2 * xn + a3 * xa - b1 * yn - b2 * ya;
+
+		StoreLanes(ar_out, a_outLanes, j * a_outStep, SLanes::Load(&ar_forward[j * 4]) + yc);
+
+		xa = xn; xn = xc; ya = yn; yn = yc;
 	}
 }
 
-static void ComputeLobes(const PRInt32 aRadius, PRInt32 aLobes[3][2])
+/**
+ * Blurs an 8 bit alpha image in place: columns first (into a float buffer), then rows.
+ * Returns false if a_isCancelled said so, the image is garbage then.
+ */
+static bool RecursiveGaussianA8(unsigned char* ar_data, int a_width, int a_height, int a_stride, float a_sigma,
+	const std::function<bool()>& a_isCancelled)
 {
-	PRInt32 major = 0, minor = 0, final = 0;
-
-	/* See http://www.w3.org/TR/SVG/filters.html#feGaussianBlur for
-	 * some notes about approximating the Gaussian blur with box-blurs.
-	 * The comments below are in the terminology of that page.
-	 */
-	PRInt32 z = aRadius / 3;
-	switch (aRadius % 3) {
-	case 0:
-		// aRadius = z*3; choose d = 2*z + 1
-		major = minor = final = z;
-		break;
-	case 1:
-		// aRadius = z*3 + 1
-		// This is a tricky case since there is no value of d which will
-		// yield a radius of exactly aRadius. If d is odd, i.e. d=2*k + 1
-		// for some integer k, then the radius will be 3*k. If d is even,
-		// i.e. d=2*k, then the radius will be 3*k - 1.
-		// So we have to choose values that don't match the standard
-		// algorithm.
-		major = z + 1;
-		minor = final = z;
-		break;
-	case 2:
-		// aRadius = z*3 + 2; choose d = 2*z + 2
-		major = final = z + 1;
-		minor = z;
-		break;
+	if (a_width < 1 || a_height < 1)
+	{
+		return true;
 	}
-	NS_ASSERTION(major + minor + final == aRadius,
-		"Lobes don't sum to the right length");
-
-	aLobes[0][0] = major;
-	aLobes[0][1] = minor;
-	aLobes[1][0] = minor;
-	aLobes[1][1] = major;
-	aLobes[2][0] = final;
-	aLobes[2][1] = final;
+
+	// polled every this many lines:
+	const int l_cancelCheckLines = 64;
+	std::atomic<bool> l_cancelled(false);
+
+	const SGaussCoefficients l_coeffs = ComputeGaussCoefficients(a_sigma);
+
+	std::vector<float> l_columns(static_cast<size_t>(a_width) * a_height);
+	float* l_colData = l_columns.data();
+
+#pragma omp parallel
+	{
+		std::vector<float> l_forward(static_cast<size_t>(std::max(a_width, a_height)) * 4);
+
+#pragma omp for
+		for (int x = 0; x < a_width; x += 4)
+		{
+			ptrdiff_t l_lanes[4];
+
+			if (l_cancelled.load(std::memory_order_relaxed) ||
+				(a_isCancelled && x % l_cancelCheckLines == 0 && a_isCancelled()))
+			{
+				l_cancelled = true;
+				continue;
+			}
+
+			for (int i = 0; i < 4; i++)
+				l_lanes[i] = std::min(x + i, a_width - 1);
+
+			RecursiveGaussianLines(ar_data, l_lanes, a_stride, l_colData, l_lanes, a_width, a_height, l_coeffs, l_forward.data());
+		}
+
+#pragma omp for
+		for (int y = 0; y < a_height; y += 4)
+		{
+			ptrdiff_t l_inLanes[4], l_outLanes[4];
+
+			if (l_cancelled.load(std::memory_order_relaxed) ||
+				(a_isCancelled && y % l_cancelCheckLines == 0 && a_isCancelled()))
+			{
+				l_cancelled = true;
+				continue;
+			}
+
+			for (int i = 0; i < 4; i++)
+			{
+				const ptrdiff_t l_row = std::min(y + i, a_height - 1);
+
+				l_inLanes[i] = l_row * a_width;
+				l_outLanes[i] = l_row * a_stride;
+			}
+
+			RecursiveGaussianLines(static_cast<const float*>(l_colData), l_inLanes, 1, ar_data, l_outLanes, 1, a_width, l_coeffs, l_forward.data());
+		}
+	}
+
+	return !l_cancelled;
 }
 
 
@@ -216,25 +322,15 @@ bool CCairoBoxBlur::Paint(cairo_t* a_destination)
 #endif /* _WIN32 */
 		if (IsFallbackAllowed())
 		{
-			// fallback.
-
-			const PRInt32 l_stride = cairo_image_surface_get_stride(m_imgSurface);
-			const PRInt32 l_rows = cairo_image_surface_get_height(m_imgSurface);
-
-			PRInt32 l_lobes[3][2];
-			ComputeLobes(m_blurRadius, l_lobes);
-
-			unsigned char* l_tmpData = new unsigned char[l_stride * l_rows];
-
-			BoxBlurHorizontal(l_boxData, l_tmpData, l_lobes[0][0], l_lobes[0][1], l_stride, l_rows);
-			BoxBlurHorizontal(l_tmpData, l_boxData, l_lobes[1][0], l_lobes[1][1], l_stride, l_rows);
-			BoxBlurHorizontal(l_boxData, l_tmpData, l_lobes[2][0], l_lobes[2][1], l_stride, l_rows);
-
-			BoxBlurVertical(l_tmpData, l_boxData, l_lobes[0][0], l_lobes[0][1], l_stride, l_rows);
-			BoxBlurVertical(l_boxData, l_tmpData, l_lobes[1][0], l_lobes[1][1], l_stride, l_rows);
-			BoxBlurVertical(l_tmpData, l_boxData, l_lobes[2][0], l_lobes[2][1], l_stride, l_rows);
-
-			delete[] l_tmpData;
+			// fallback:
+			if (!RecursiveGaussianA8(l_boxData,
+				cairo_image_surface_get_width(m_imgSurface),
+				cairo_image_surface_get_height(m_imgSurface),
+				cairo_image_surface_get_stride(m_imgSurface),
+				GetGaussSigma(m_blurRadius) / m_downscale, m_isCancelled))
+			{
+				return false;
+			}
 		}
 		else
 		{
@@ -243,7 +339,22 @@ bool CCairoBoxBlur::Paint(cairo_t* a_destination)
 
 	cairo_surface_mark_dirty(m_imgSurface);
 
-	if (m_useFallback)
+	if (m_useFallback && m_downscale > 1)
+	{
+		// 8 bit mask, scaled up to full resolution:
+		cairo_pattern_t* l_mask = cairo_pattern_create_for_surface(m_imgSurface);
+		cairo_matrix_t l_matrix;
+
+		cairo_matrix_init_scale(&l_matrix, 1.0 / m_downscale, 1.0 / m_downscale);
+		cairo_pattern_set_matrix(l_mask, &l_matrix);
+		cairo_pattern_set_filter(l_mask, CAIRO_FILTER_BILINEAR);
+		cairo_pattern_set_extend(l_mask, CAIRO_EXTEND_PAD);
+
+		cairo_mask(a_destination, l_mask);
+
+		cairo_pattern_destroy(l_mask);
+	}
+	else if (m_useFallback)
 	{
 		// 8 bit mask
 		cairo_mask_surface(a_destination, m_imgSurface, 0, 0);
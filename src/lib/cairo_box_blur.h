@@ -18,7 +18,12 @@
 class CCairoBoxBlur
 {
 public:
-	CCairoBoxBlur(int a_width, int a_height, int a_blurRadius, bool a_useGPU = true);
+	/**
+	 * a_downscale > 1 renders and blurs the mask at 1/a_downscale of the size
+	 * and scales it up again (bilinearly) in Paint. The context still takes
+	 * full resolution coordinates. Only the CPU version supports this.
+	 **/
+	CCairoBoxBlur(int a_width, int a_height, int a_blurRadius, bool a_useGPU = true, int a_downscale = 1);
 	virtual ~CCairoBoxBlur();
 
 	/**
@@ -38,17 +43,26 @@ public:
 	void SetAllowFallback(bool allow) { m_allowFallback = allow; }
 	bool IsFallbackAllowed() const { return m_allowFallback; }
 
+	// polled while blurring on the CPU, possibly from several threads. Paint fails once it returns true:
+	void SetCancelCheck(const std::function<bool()>& a_isCancelled) { m_isCancelled = a_isCancelled; }
+
 	static bool IsGPUUsable();
+
+	// the largest a_downscale that leaves enough blur to hide the lower resolution:
+	static int GetMaxDownscale(int a_blurRadius);
 protected:
 	bool m_allowFallback;
 	bool m_useFallback;
 	int m_width, m_height;
 	// Blur radius in pixels:
 	int m_blurRadius;
+	// Full resolution pixels per pixel of the mask:
+	int m_downscale;
 	// Context of the temporary alpha surface:
 	cairo_t* m_context;
 	// The temporary alpha surface:
 	cairo_surface_t* m_imgSurface;
+	std::function<bool()> m_isCancelled;
 #ifdef _WIN32
 	static HMODULE m_hAmpDll;
 #endif
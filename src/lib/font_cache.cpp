@@ -0,0 +1,326 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "font_cache.h"
+
+#define FONT_METRICS_FILE_MAGIC "iNFekt font metrics v1"
+
+
+CFontMetricsCache& CFontMetricsCache::GetInstance()
+{
+	static CFontMetricsCache s_cache;
+
+	return s_cache;
+}
+
+
+CFontMetricsCache::CFontMetricsCache() :
+	m_nextStamp(0),
+	m_modified(false)
+{
+}
+
+
+bool CFontMetricsCache::GetGlyphMetrics(const std::string& a_font, int a_size, wchar_t a_char, SGlyphMetrics& ar_metrics) const
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_glyphs.find(TGlyphKey(a_font, a_size, a_char));
+
+	if (it == m_glyphs.end())
+	{
+		return false;
+	}
+
+	ar_metrics = it->second;
+
+	return true;
+}
+
+
+void CFontMetricsCache::AddGlyphMetrics(const std::string& a_font, int a_size, wchar_t a_char, const SGlyphMetrics& a_metrics)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	if (m_glyphs.size() >= MAX_GLYPHS)
+	{
+		// start over, the next calibration will only measure what it needs:
+		m_glyphs.clear();
+	}
+
+	m_glyphs[TGlyphKey(a_font, a_size, a_char)] = a_metrics;
+}
+
+
+bool CFontMetricsCache::GetGlyphDensity(const std::string& a_font, wchar_t a_char, double& ar_density) const
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_densities.find(TDensityKey(a_font, a_char));
+
+	if (it == m_densities.end())
+	{
+		return false;
+	}
+
+	ar_density = it->second;
+
+	return true;
+}
+
+
+void CFontMetricsCache::AddGlyphDensity(const std::string& a_font, wchar_t a_char, double a_density)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	if (m_densities.size() >= MAX_GLYPHS)
+	{
+		m_densities.clear();
+	}
+
+	m_densities[TDensityKey(a_font, a_char)] = a_density;
+}
+
+
+bool CFontMetricsCache::GetFontSize(const std::string& a_font, size_t a_blockWidth, size_t a_blockHeight, uint64_t a_charSet, int& ar_size) const
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_fontSizes.find(TFontSizeKey(a_font, a_blockWidth, a_blockHeight, a_charSet));
+
+	if (it == m_fontSizes.end())
+	{
+		return false;
+	}
+
+	ar_size = it->second.size;
+
+	return true;
+}
+
+
+void CFontMetricsCache::AddFontSize(const std::string& a_font, size_t a_blockWidth, size_t a_blockHeight, uint64_t a_charSet, int a_size)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	if (m_fontSizes.size() >= MAX_FONT_SIZES)
+	{
+		auto l_oldest = std::min_element(m_fontSizes.begin(), m_fontSizes.end(),
+			[](const std::pair<const TFontSizeKey, SFontSize>& a, const std::pair<const TFontSizeKey, SFontSize>& b) {
+				return a.second.stamp < b.second.stamp; });
+
+		m_fontSizes.erase(l_oldest);
+	}
+
+	m_fontSizes[TFontSizeKey(a_font, a_blockWidth, a_blockHeight, a_charSet)] = SFontSize{ a_size, m_nextStamp++ };
+	m_modified = true;
+}
+
+
+/**
+ * One result per line: size, block width, block height, char set hash and
+ * the font string, which comes last because it may contain spaces.
+ **/
+bool CFontMetricsCache::LoadFromFile(const std::_tstring& a_filePath)
+{
+	FILE* l_file = nullptr;
+
+#ifdef _WIN32
+	if (_tfopen_s(&l_file, a_filePath.c_str(), _T("rb")) != 0 || !l_file)
+#else
+	if (!(l_file = fopen(a_filePath.c_str(), "rb")))
+#endif
+	{
+		return false;
+	}
+
+	char l_line[512];
+	bool l_valid = (fgets(l_line, sizeof(l_line), l_file) != nullptr &&
+		strncmp(l_line, FONT_METRICS_FILE_MAGIC, strlen(FONT_METRICS_FILE_MAGIC)) == 0);
+
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	while (l_valid && fgets(l_line, sizeof(l_line), l_file) != nullptr)
+	{
+		int l_size = 0, l_fontPos = 0;
+		unsigned long long l_blockWidth, l_blockHeight, l_charSet;
+
+		if (sscanf(l_line, "%d %llu %llu %llx %n", &l_size, &l_blockWidth, &l_blockHeight, &l_charSet, &l_fontPos) != 4 ||
+			l_fontPos == 0 || l_size < 1 || m_fontSizes.size() >= MAX_FONT_SIZES)
+		{
+			continue;
+		}
+
+		std::string l_font(l_line + l_fontPos);
+
+		while (!l_font.empty() && (l_font.back() == '\n' || l_font.back() == '\r'))
+		{
+			l_font.pop_back();
+		}
+
+		if (l_font.empty())
+		{
+			continue;
+		}
+
+		// results from this session are more recent, don't overwrite them:
+		m_fontSizes.insert(std::make_pair(TFontSizeKey(l_font, static_cast<size_t>(l_blockWidth), static_cast<size_t>(l_blockHeight), l_charSet),
+			SFontSize{ l_size, m_nextStamp++ }));
+	}
+
+	fclose(l_file);
+
+	return l_valid;
+}
+
+
+bool CFontMetricsCache::SaveToFile(const std::_tstring& a_filePath)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	if (!m_modified)
+	{
+		return true;
+	}
+
+	FILE* l_file = nullptr;
+
+#ifdef _WIN32
+	if (_tfopen_s(&l_file, a_filePath.c_str(), _T("wb")) != 0 || !l_file)
+#else
+	if (!(l_file = fopen(a_filePath.c_str(), "wb")))
+#endif
+	{
+		return false;
+	}
+
+	// oldest first, so they are dropped first after loading, too:
+	std::vector<std::pair<uint64_t, const std::pair<const TFontSizeKey, SFontSize>*>> l_entries;
+
+	for (const auto& l_entry : m_fontSizes)
+	{
+		l_entries.emplace_back(l_entry.second.stamp, &l_entry);
+	}
+
+	std::sort(l_entries.begin(), l_entries.end());
+
+	bool l_ok = (fprintf(l_file, "%s\n", FONT_METRICS_FILE_MAGIC) > 0);
+
+	for (const auto& l_entry : l_entries)
+	{
+		const TFontSizeKey& l_key = l_entry.second->first;
+
+		l_ok = l_ok && fprintf(l_file, "%d %llu %llu %llx %s\n", l_entry.second->second.size,
+			static_cast<unsigned long long>(std::get<1>(l_key)), static_cast<unsigned long long>(std::get<2>(l_key)),
+			static_cast<unsigned long long>(std::get<3>(l_key)), std::get<0>(l_key).c_str()) > 0;
+	}
+
+	l_ok = (fclose(l_file) == 0) && l_ok;
+
+	if (l_ok)
+	{
+		m_modified = false;
+	}
+
+	return l_ok;
+}
+
+
+uint64_t CFontMetricsCache::HashCharSet(const std::set<wchar_t>& a_chars)
+{
+	// FNV-1a, std::set is sorted so the order is always the same:
+	uint64_t l_hash = 14695981039346656037ull;
+
+	for (wchar_t l_char : a_chars)
+	{
+		uint32_t l_value = static_cast<uint32_t>(l_char);
+
+		for (int i = 0; i < 4; i++)
+		{
+			l_hash ^= (l_value & 0xFF);
+			l_hash *= 1099511628211ull;
+			l_value >>= 8;
+		}
+	}
+
+	return l_hash;
+}
+
+
+/************************************************************************/
+/* CFontFaceCache Implementation                                        */
+/************************************************************************/
+
+CFontFaceCache& CFontFaceCache::GetInstance()
+{
+	static CFontFaceCache s_cache;
+
+	return s_cache;
+}
+
+
+CFontFaceCache::CFontFaceCache() :
+	m_nextStamp(0)
+{
+}
+
+
+cairo_scaled_font_t* CFontFaceCache::GetScaledFont(const std::string& a_face, bool a_bold, double a_size, const cairo_font_options_t* a_options)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	const TScaledFontKey l_key(a_face, a_bold, a_size, cairo_font_options_hash(a_options));
+
+	auto it = m_scaledFonts.find(l_key);
+
+	if (it != m_scaledFonts.end())
+	{
+		it->second.stamp = m_nextStamp++;
+
+		return cairo_scaled_font_reference(it->second.font);
+	}
+
+	// this is where the face name gets resolved, once per face and weight:
+	cairo_font_face_t*& l_face = m_faces[TFaceKey(a_face, a_bold)];
+
+	if (!l_face)
+	{
+		l_face = cairo_toy_font_face_create(a_face.c_str(), CAIRO_FONT_SLANT_NORMAL,
+			a_bold ? CAIRO_FONT_WEIGHT_BOLD : CAIRO_FONT_WEIGHT_NORMAL);
+	}
+
+	cairo_matrix_t l_fontMatrix, l_ctm;
+	cairo_matrix_init_scale(&l_fontMatrix, a_size, a_size);
+	cairo_matrix_init_identity(&l_ctm);
+
+	cairo_scaled_font_t* l_font = cairo_scaled_font_create(l_face, &l_fontMatrix, &l_ctm, a_options);
+
+	if (cairo_scaled_font_status(l_font) != CAIRO_STATUS_SUCCESS)
+	{
+		// don't keep error objects around, the caller has to deal with it:
+		return l_font;
+	}
+
+	if (m_scaledFonts.size() >= MAX_SCALED_FONTS)
+	{
+		auto l_oldest = std::min_element(m_scaledFonts.begin(), m_scaledFonts.end(),
+			[](const std::pair<const TScaledFontKey, SScaledFont>& a, const std::pair<const TScaledFontKey, SScaledFont>& b) {
+				return a.second.stamp < b.second.stamp; });
+
+		// contexts that still use it hold their own reference:
+		cairo_scaled_font_destroy(l_oldest->second.font);
+		m_scaledFonts.erase(l_oldest);
+	}
+
+	m_scaledFonts[l_key] = SScaledFont{ cairo_scaled_font_reference(l_font), m_nextStamp++ };
+
+	return l_font;
+}
@@ -0,0 +1,124 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#ifndef _FONT_CACHE_H
+#define _FONT_CACHE_H
+
+#include <tuple>
+
+
+/**
+ * Process-wide cache for the font calibration of the "rendered" mode, i.e. the
+ * font size that makes all characters of an NFO fit into its blocks. Glyph
+ * extents are kept per font and size, so calibrating for another block size
+ * (zooming) hardly has to measure anything. Calibration results can be saved
+ * to and loaded from a file, so they survive restarts.
+ * Fonts are identified by a string that contains the face name, weight and
+ * anything else that changes the metrics, see CNFORenderer::PreRenderText.
+ **/
+class CFontMetricsCache
+{
+public:
+	static CFontMetricsCache& GetInstance();
+
+	typedef struct
+	{
+		double advance;
+		double height;
+	} SGlyphMetrics;
+
+	bool GetGlyphMetrics(const std::string& a_font, int a_size, wchar_t a_char, SGlyphMetrics& ar_metrics) const;
+	void AddGlyphMetrics(const std::string& a_font, int a_size, wchar_t a_char, const SGlyphMetrics& a_metrics);
+
+	// a_charSet identifies the characters that have to fit, see HashCharSet:
+	bool GetFontSize(const std::string& a_font, size_t a_blockWidth, size_t a_blockHeight, uint64_t a_charSet, int& ar_size) const;
+	void AddFontSize(const std::string& a_font, size_t a_blockWidth, size_t a_blockHeight, uint64_t a_charSet, int a_size);
+
+	// only calibration results are persisted, glyph extents are cheap to get again.
+	// They are keyed by the font's name only: if a font file is replaced by another
+	// version under the same name, delete the file to calibrate again.
+	bool LoadFromFile(const std::_tstring& a_filePath);
+	bool SaveToFile(const std::_tstring& a_filePath); // no-op if nothing has changed since loading
+
+	// inked area of a glyph in units of the squared font size, measured at DENSITY_REFERENCE_SIZE.
+	// Used to draw cells that are too small to read, see CNFORenderer::SetLODCellSize:
+	bool GetGlyphDensity(const std::string& a_font, wchar_t a_char, double& ar_density) const;
+	void AddGlyphDensity(const std::string& a_font, wchar_t a_char, double a_density);
+
+	static uint64_t HashCharSet(const std::set<wchar_t>& a_chars);
+
+	static const size_t MAX_GLYPHS = 64 * 1024;
+	static const int DENSITY_REFERENCE_SIZE = 32;
+	static const size_t MAX_FONT_SIZES = 2048;
+
+protected:
+	CFontMetricsCache();
+
+	typedef std::tuple<std::string, int, wchar_t> TGlyphKey;
+	typedef std::tuple<std::string, size_t, size_t, uint64_t> TFontSizeKey;
+	typedef std::pair<std::string, wchar_t> TDensityKey;
+
+	typedef struct
+	{
+		int size;
+		uint64_t stamp; // for dropping the oldest results first
+	} SFontSize;
+
+	mutable std::mutex m_lock;
+	std::map<TGlyphKey, SGlyphMetrics> m_glyphs;
+	std::map<TFontSizeKey, SFontSize> m_fontSizes;
+	std::map<TDensityKey, double> m_densities;
+	uint64_t m_nextStamp;
+	bool m_modified;
+};
+
+
+/**
+ * Process-wide cache of resolved fonts. Selecting a font face by name makes
+ * cairo (and fontconfig) look it up again every time, so renderers get their
+ * scaled fonts from here instead, once per face, weight, size and options.
+ * Cairo's scaled fonts are reference counted and safe to use from several
+ * threads, all renderers and render threads share them. Font faces are kept
+ * until the process exits, only the MAX_SCALED_FONTS most recently used scaled
+ * fonts are kept, the cache's reference to older ones is dropped.
+ **/
+class CFontFaceCache
+{
+public:
+	static CFontFaceCache& GetInstance();
+
+	// returns a new reference, check cairo_scaled_font_status:
+	cairo_scaled_font_t* GetScaledFont(const std::string& a_face, bool a_bold, double a_size, const cairo_font_options_t* a_options);
+
+	static const size_t MAX_SCALED_FONTS = 64;
+
+protected:
+	CFontFaceCache();
+
+	typedef std::pair<std::string, bool> TFaceKey;
+	typedef std::tuple<std::string, bool, double, unsigned long> TScaledFontKey;
+
+	typedef struct
+	{
+		cairo_scaled_font_t* font;
+		uint64_t stamp; // for dropping the least recently used fonts first
+	} SScaledFont;
+
+	std::mutex m_lock;
+	std::map<TFaceKey, cairo_font_face_t*> m_faces;
+	std::map<TScaledFontKey, SScaledFont> m_scaledFonts;
+	uint64_t m_nextStamp;
+};
+
+#endif /* !_FONT_CACHE_H */
@@ -0,0 +1,350 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "glyph_atlas.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GLYPH_ATLAS_SSE2
+#include <emmintrin.h>
+#endif
+
+
+CGlyphAtlas::CGlyphAtlas(cairo_scaled_font_t* a_font, double a_phaseX, double a_phaseY) :
+	m_font(cairo_scaled_font_reference(a_font)),
+	m_phaseX(a_phaseX),
+	m_phaseY(a_phaseY)
+{
+}
+
+
+CGlyphAtlas::~CGlyphAtlas()
+{
+	cairo_scaled_font_destroy(m_font);
+}
+
+
+PGlyphAtlas CGlyphAtlas::GetShared(cairo_scaled_font_t* a_font, const std::string& a_fontKey, double a_phaseX, double a_phaseY)
+{
+	typedef std::tuple<std::string, double, double> TKey;
+
+	static std::mutex s_lock;
+	static std::map<TKey, std::pair<PGlyphAtlas, uint64_t>> s_atlases; // value: atlas + last use
+	static uint64_t s_nextStamp = 0;
+
+	std::lock_guard<std::mutex> l_lock(s_lock);
+	const TKey l_key(a_fontKey, a_phaseX, a_phaseY);
+
+	auto it = s_atlases.find(l_key);
+
+	if (it != s_atlases.end())
+	{
+		it->second.second = s_nextStamp++;
+
+		return it->second.first;
+	}
+
+	if (s_atlases.size() >= MAX_SHARED_ATLASES)
+	{
+		// renderers that are still using it keep their own reference:
+		s_atlases.erase(std::min_element(s_atlases.begin(), s_atlases.end(),
+			[](const std::pair<const TKey, std::pair<PGlyphAtlas, uint64_t>>& a, const std::pair<const TKey, std::pair<PGlyphAtlas, uint64_t>>& b) {
+				return a.second.second < b.second.second; }));
+	}
+
+	PGlyphAtlas l_atlas = std::make_shared<CGlyphAtlas>(a_font, a_phaseX, a_phaseY);
+
+	s_atlases[l_key] = std::make_pair(l_atlas, s_nextStamp++);
+
+	return l_atlas;
+}
+
+
+uint32_t CGlyphAtlas::SolidPixel(double a_red, double a_green, double a_blue, double a_alpha)
+{
+	// cairo stores colors as premultiplied 16 bit values (_cairo_color_double_to_short),
+	// pixman's solid fills use the upper 8 bits of those:
+	auto l_channel = [](double a_value) -> uint32_t {
+		return static_cast<uint32_t>(static_cast<uint16_t>(a_value * 65535.0 + 0.5)) >> 8;
+	};
+
+	return (l_channel(a_alpha) << 24) | (l_channel(a_red * a_alpha) << 16) |
+		(l_channel(a_green * a_alpha) << 8) | l_channel(a_blue * a_alpha);
+}
+
+
+// m_lock must be held:
+const CGlyphAtlas::SGlyph* CGlyphAtlas::GetGlyph(unsigned long a_index)
+{
+	std::unique_ptr<SGlyph>& l_glyph = m_glyphs[a_index];
+
+	if (!l_glyph)
+	{
+		l_glyph.reset(new SGlyph());
+
+		RasterizeGlyph(a_index, *l_glyph);
+	}
+
+	return l_glyph.get();
+}
+
+
+void CGlyphAtlas::RasterizeGlyph(unsigned long a_index, SGlyph& ar_glyph) const
+{
+	cairo_glyph_t l_glyph{ a_index, 0, 0 };
+	cairo_text_extents_t l_extents{};
+
+	cairo_scaled_font_glyph_extents(m_font, &l_glyph, 1, &l_extents);
+
+	ar_glyph.left = ar_glyph.top = ar_glyph.width = ar_glyph.height = 0;
+
+	if (l_extents.width <= 0 || l_extents.height <= 0)
+	{
+		// nothing to draw, e.g. spaces
+		return;
+	}
+
+	// the inked area at the atlas' phase, plus one pixel for anti-aliasing on each side:
+	ar_glyph.left = static_cast<int>(floor(m_phaseX + l_extents.x_bearing)) - 1;
+	ar_glyph.top = static_cast<int>(floor(m_phaseY + l_extents.y_bearing)) - 1;
+	ar_glyph.width = static_cast<int>(ceil(m_phaseX + l_extents.x_bearing + l_extents.width)) + 1 - ar_glyph.left;
+	ar_glyph.height = static_cast<int>(ceil(m_phaseY + l_extents.y_bearing + l_extents.height)) + 1 - ar_glyph.top;
+
+	cairo_surface_t* l_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, ar_glyph.width, ar_glyph.height);
+	cairo_t* cr = cairo_create(l_surface);
+
+	cairo_set_scaled_font(cr, m_font);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+
+	l_glyph.x = m_phaseX - ar_glyph.left;
+	l_glyph.y = m_phaseY - ar_glyph.top;
+
+	cairo_show_glyphs(cr, &l_glyph, 1);
+
+	cairo_destroy(cr);
+	cairo_surface_flush(l_surface);
+
+	const unsigned char* l_data = cairo_image_surface_get_data(l_surface);
+	const int l_stride = cairo_image_surface_get_stride(l_surface);
+
+	ar_glyph.coverage.resize(static_cast<size_t>(ar_glyph.width) * ar_glyph.height);
+
+	for (int y = 0; l_data && y < ar_glyph.height; y++)
+	{
+		memcpy(&ar_glyph.coverage[static_cast<size_t>(y) * ar_glyph.width], l_data + y * l_stride, ar_glyph.width);
+	}
+
+	cairo_surface_destroy(l_surface);
+}
+
+
+bool CGlyphAtlas::Blit(cairo_surface_t* a_surface, const cairo_glyph_t* a_glyphs, int a_numGlyphs, uint32_t a_color)
+{
+	const cairo_format_t l_format = cairo_image_surface_get_format(a_surface);
+
+	if (l_format != CAIRO_FORMAT_ARGB32 && l_format != CAIRO_FORMAT_A8)
+	{
+		return false;
+	}
+
+	unsigned char* l_data = cairo_image_surface_get_data(a_surface);
+	const int l_width = cairo_image_surface_get_width(a_surface),
+		l_height = cairo_image_surface_get_height(a_surface),
+		l_stride = cairo_image_surface_get_stride(a_surface);
+
+	if (!l_data)
+	{
+		return false;
+	}
+
+	if ((a_color >> 24) == 0 || a_numGlyphs < 1)
+	{
+		// fully transparent, nothing to do
+		return true;
+	}
+
+	// look everything up (rasterizing new glyphs) first, so the lock isn't held while blending:
+	std::vector<const SGlyph*> l_glyphs(a_numGlyphs);
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_lock);
+
+		for (int i = 0; i < a_numGlyphs; i++)
+		{
+			l_glyphs[i] = GetGlyph(a_glyphs[i].index);
+		}
+	}
+
+	for (int i = 0; i < a_numGlyphs; i++)
+	{
+		const SGlyph* l_glyph = l_glyphs[i];
+
+		if (l_glyph->width == 0)
+		{
+			continue;
+		}
+
+		// the origin minus the phase is a whole pixel position:
+		const int l_x = static_cast<int>(floor(a_glyphs[i].x - m_phaseX + 0.5)) + l_glyph->left,
+			l_y = static_cast<int>(floor(a_glyphs[i].y - m_phaseY + 0.5)) + l_glyph->top;
+
+		// clip to the surface:
+		const int l_xFrom = std::max(l_x, 0), l_xTo = std::min(l_x + l_glyph->width, l_width),
+			l_yFrom = std::max(l_y, 0), l_yTo = std::min(l_y + l_glyph->height, l_height);
+
+		for (int y = l_yFrom; y < l_yTo; y++)
+		{
+			const uint8_t* l_coverage = &l_glyph->coverage[static_cast<size_t>(y - l_y) * l_glyph->width + (l_xFrom - l_x)];
+			unsigned char* l_row = l_data + static_cast<size_t>(y) * l_stride;
+
+			if (l_format == CAIRO_FORMAT_ARGB32)
+			{
+				BlendRowARGB(reinterpret_cast<uint32_t*>(l_row) + l_xFrom, l_coverage, l_xTo - l_xFrom, a_color);
+			}
+			else
+			{
+				BlendRowA8(l_row + l_xFrom, l_coverage, l_xTo - l_xFrom, a_color);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * OVER with a solid source and an A8 mask, rounding exactly like pixman:
+ * s' = s * m, d = s' + d * (1 - alpha(s')), with x * y / 255 computed as
+ * t = x * y + 0x80, (t + (t >> 8)) >> 8.
+ **/
+static inline uint32_t _MulUN8(uint32_t a, uint32_t b)
+{
+	const uint32_t t = a * b + 0x80;
+
+	return (t + (t >> 8)) >> 8;
+}
+
+
+#ifdef GLYPH_ATLAS_SSE2
+// same as _MulUN8, for 8 16 bit lanes holding 8 bit values:
+static inline __m128i _MulUN8x8(__m128i a, __m128i b)
+{
+	const __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(0x80));
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+
+void CGlyphAtlas::BlendRowARGB(uint32_t* a_dest, const uint8_t* a_coverage, int a_count, uint32_t a_color)
+{
+	int i = 0;
+
+#ifdef GLYPH_ATLAS_SSE2
+	const __m128i l_zero = _mm_setzero_si128(), l_255 = _mm_set1_epi16(0xFF);
+	const __m128i l_src = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(a_color)), l_zero);
+	const __m128i l_src2 = _mm_unpacklo_epi64(l_src, l_src); // two pixels, one channel per lane
+
+	for (; i + 4 <= a_count; i += 4)
+	{
+		uint32_t l_mask4;
+		memcpy(&l_mask4, a_coverage + i, 4);
+
+		if (l_mask4 == 0)
+		{
+			continue;
+		}
+
+		// spread each pixel's coverage across its four channels:
+		__m128i l_mask = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(l_mask4)), l_zero);
+		l_mask = _mm_unpacklo_epi16(l_mask, l_mask);
+
+		const __m128i l_srcLo = _MulUN8x8(l_src2, _mm_unpacklo_epi32(l_mask, l_mask)),
+			l_srcHi = _MulUN8x8(l_src2, _mm_unpackhi_epi32(l_mask, l_mask));
+
+		// 255 - alpha, alpha is the fourth channel of each pixel:
+		const __m128i l_invLo = _mm_sub_epi16(l_255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(l_srcLo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3))),
+			l_invHi = _mm_sub_epi16(l_255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(l_srcHi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+
+		const __m128i l_dest = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a_dest + i));
+		const __m128i l_destLo = _mm_add_epi16(l_srcLo, _MulUN8x8(_mm_unpacklo_epi8(l_dest, l_zero), l_invLo)),
+			l_destHi = _mm_add_epi16(l_srcHi, _MulUN8x8(_mm_unpackhi_epi8(l_dest, l_zero), l_invHi));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(a_dest + i), _mm_packus_epi16(l_destLo, l_destHi));
+	}
+#endif
+
+	for (; i < a_count; i++)
+	{
+		const uint32_t l_mask = a_coverage[i];
+
+		if (l_mask == 0)
+		{
+			continue;
+		}
+
+		uint32_t l_result = 0;
+		const uint32_t l_src = a_color, l_dest = a_dest[i];
+		const uint32_t l_inv = 255 - _MulUN8(l_src >> 24, l_mask);
+
+		for (int l_shift = 0; l_shift < 32; l_shift += 8)
+		{
+			const uint32_t l_channel = _MulUN8((l_src >> l_shift) & 0xFF, l_mask) + _MulUN8((l_dest >> l_shift) & 0xFF, l_inv);
+
+			l_result |= std::min(l_channel, 255u) << l_shift;
+		}
+
+		a_dest[i] = l_result;
+	}
+}
+
+
+void CGlyphAtlas::BlendRowA8(uint8_t* a_dest, const uint8_t* a_coverage, int a_count, uint32_t a_color)
+{
+	const uint32_t l_alpha = a_color >> 24;
+	int i = 0;
+
+#ifdef GLYPH_ATLAS_SSE2
+	const __m128i l_zero = _mm_setzero_si128(), l_255 = _mm_set1_epi16(0xFF);
+	const __m128i l_src = _mm_set1_epi16(static_cast<short>(l_alpha));
+
+	for (; i + 8 <= a_count; i += 8)
+	{
+		uint64_t l_mask8;
+		memcpy(&l_mask8, a_coverage + i, 8);
+
+		if (l_mask8 == 0)
+		{
+			continue;
+		}
+
+		const __m128i l_mask = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a_coverage + i)), l_zero);
+		const __m128i l_srcAlpha = _MulUN8x8(l_src, l_mask);
+		const __m128i l_dest = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a_dest + i)), l_zero);
+
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(a_dest + i),
+			_mm_packus_epi16(_mm_add_epi16(l_srcAlpha, _MulUN8x8(l_dest, _mm_sub_epi16(l_255, l_srcAlpha))), l_zero));
+	}
+#endif
+
+	for (; i < a_count; i++)
+	{
+		if (a_coverage[i] != 0)
+		{
+			const uint32_t l_srcAlpha = _MulUN8(l_alpha, a_coverage[i]);
+
+			a_dest[i] = static_cast<uint8_t>(std::min(l_srcAlpha + _MulUN8(a_dest[i], 255 - l_srcAlpha), 255u));
+		}
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#ifndef _GLYPH_ATLAS_H
+#define _GLYPH_ATLAS_H
+
+#include <tuple>
+#include <unordered_map>
+
+class CGlyphAtlas;
+typedef std::shared_ptr<CGlyphAtlas> PGlyphAtlas;
+
+
+/**
+ * A8 coverage bitmaps of the glyphs of one scaled font, rasterized by cairo
+ * on first use. NFO text is strictly monospaced and every glyph sits on a
+ * cell origin, so all glyphs drawn from one atlas share the same sub-pixel
+ * phase and can be blitted straight into image surfaces. The blending
+ * matches what cairo/pixman do for cairo_show_glyphs with OVER.
+ * The scaled font should use grayscale or no anti-aliasing, there's no room
+ * for subpixel coverage in A8 bitmaps.
+ **/
+class CGlyphAtlas
+{
+public:
+	// a_phaseX/a_phaseY: the fractional part of all glyph origins that will be blitted:
+	CGlyphAtlas(cairo_scaled_font_t* a_font, double a_phaseX, double a_phaseY);
+	virtual ~CGlyphAtlas();
+
+	// draws a_glyphs onto an ARGB32 or A8 image surface in a_color (see SolidPixel).
+	// The caller has to flush the surface before and mark it dirty afterwards:
+	bool Blit(cairo_surface_t* a_surface, const cairo_glyph_t* a_glyphs, int a_numGlyphs, uint32_t a_color);
+
+	// premultiplied ARGB32 pixel, rounded the same way cairo does for solid sources:
+	static uint32_t SolidPixel(double a_red, double a_green, double a_blue, double a_alpha);
+
+	// process-wide, a_fontKey must identify the font including its size and options:
+	static PGlyphAtlas GetShared(cairo_scaled_font_t* a_font, const std::string& a_fontKey, double a_phaseX, double a_phaseY);
+
+	static const size_t MAX_SHARED_ATLASES = 16;
+
+protected:
+	typedef struct
+	{
+		int left, top; // relative to the glyph's origin (rounded down)
+		int width, height;
+		std::vector<uint8_t> coverage; // width * height
+	} SGlyph;
+
+	cairo_scaled_font_t* m_font;
+	double m_phaseX, m_phaseY;
+
+	// entries are never removed, so pointers stay valid without holding the lock:
+	std::mutex m_lock;
+	std::unordered_map<unsigned long, std::unique_ptr<SGlyph>> m_glyphs;
+
+	const SGlyph* GetGlyph(unsigned long a_index);
+	void RasterizeGlyph(unsigned long a_index, SGlyph& ar_glyph) const;
+
+	static void BlendRowARGB(uint32_t* a_dest, const uint8_t* a_coverage, int a_count, uint32_t a_color);
+	static void BlendRowA8(uint8_t* a_dest, const uint8_t* a_coverage, int a_count, uint32_t a_color);
+
+private:
+	// disallow copies:
+	CGlyphAtlas(const CGlyphAtlas&) = delete;
+	CGlyphAtlas& operator=(const CGlyphAtlas&) = delete;
+};
+
+#endif /* !_GLYPH_ATLAS_H */
@@ -499,6 +499,30 @@ bool CNFOColorMap::GetLineBackgrounds(size_t a_row, uint32_t a_defaultColor, siz
 	return true;
 }
 
+bool CNFOColorMap::GetCurrentForegroundColor(uint32_t &ar_color) const
+{
+	if (m_previousFore.color == NFOCOLOR_DEFAULT)
+	{
+		return false;
+	}
+
+	ar_color = GetRGB(m_previousFore);
+
+	return true;
+}
+
+bool CNFOColorMap::GetCurrentBackgroundColor(uint32_t &ar_color) const
+{
+	if (m_previousBack.color == NFOCOLOR_DEFAULT)
+	{
+		return false;
+	}
+
+	ar_color = GetRGB(m_previousBack);
+
+	return true;
+}
+
 uint32_t CNFOColorMap::GetRGB(const SNFOColorStop &a_stop) const
 {
 	if (a_stop.color == NFOCOLOR_RGB)
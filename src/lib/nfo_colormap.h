@@ -33,6 +33,10 @@ public:
 	bool GetLineBackgrounds(size_t a_row, uint32_t a_defaultColor, size_t a_width,
 		std::vector<size_t>& ar_sections, std::vector<uint32_t>& ar_colors) const;
 
+	// colors of the most recent graphic rendition, same return semantics as GetForegroundColor.
+	bool GetCurrentForegroundColor(uint32_t& ar_color) const;
+	bool GetCurrentBackgroundColor(uint32_t& ar_color) const;
+
 protected:
 	typedef enum {
 		NFOCOLOR_DEFAULT = 0,
@@ -18,6 +18,7 @@
 #include "sauce.h"
 #include "ansi_art.h"
 #include <numeric>
+#include <array>
 
 typedef std::list<std::wstring> TLineContainer;
 
@@ -38,6 +39,14 @@ CNFOData::CNFOData()
 	, m_ansiHintWidth(0)
 	, m_ansiHintHeight(0)
 	, m_colorMap()
+	, m_ansiFrameInterval(0)
+	, m_ansiFrames()
+	, m_sourceLines()
+	, m_sourceLinks()
+	, m_sourceMaxLineLen(0)
+	, m_wrapWidth(DEFAULT_WRAP_WIDTH)
+	, m_layout()
+	, m_layoutCache()
 {
 }
 
@@ -422,13 +431,24 @@ static void _InternalLoad_FixAnsiEscapeCodes(std::wstring& a_text)
 }
 
 
-static void _InternalLoad_WrapLongLines(TLineContainer& a_lines, size_t& a_newMaxLineLen)
+CNFOData::PWrapLayout CNFOData::GetWrapLayout(size_t a_width) const
 {
-	constexpr size_t MAX_LEN_SOFT = 100;
-	constexpr size_t MAX_LEN_HARD = 2 * 80;
+	for (auto it = m_layoutCache.begin(); it != m_layoutCache.end(); it++)
+	{
+		if (it->first == a_width)
+		{
+			m_layoutCache.splice(m_layoutCache.begin(), m_layoutCache, it);
+
+			return it->second;
+		}
+	}
+
+	// a width of 0 means "do not wrap" and yields the identity layout.
+	const size_t MAX_LEN_SOFT = (a_width > 0 ? a_width : std::numeric_limits<size_t>::max());
+	const size_t MAX_LEN_HARD = std::max<size_t>(2 * 80, a_width);
 	constexpr size_t EQUAL_CONSECUTIVE_CHARACTERS_MAX = 3;
 
-	constexpr auto is_line_wrapping_candidate = [](const std::wstring& line)
+	const auto is_line_wrapping_candidate = [MAX_LEN_SOFT](const std::wstring& line)
 	{
 		if (line.size() <= MAX_LEN_SOFT)
 		{
@@ -444,12 +464,6 @@ static void _InternalLoad_WrapLongLines(TLineContainer& a_lines, size_t& a_newMa
 		return true;
 	};
 
-	// quick exit for nice & compliant NFOs
-	if (std::find_if(a_lines.begin(), a_lines.end(), is_line_wrapping_candidate) == a_lines.end())
-	{
-		return;
-	}
-
 	constexpr auto count_leading_spaces = [](const std::wstring& line)
 	{
 		auto leading_spaces = line.find_first_not_of(L' ');
@@ -462,58 +476,74 @@ static void _InternalLoad_WrapLongLines(TLineContainer& a_lines, size_t& a_newMa
 		return leading_spaces;
 	};
 
-	constexpr auto wrap_line = [](std::wstring line, size_t num_leading_spaces, auto push_backer)
+	auto l_layout = std::make_shared<SWrapLayout>();
+	bool l_wrappedAny = false;
+
+	l_layout->rows.reserve(m_sourceLines.size());
+	l_layout->firstRowOfSource.reserve(m_sourceLines.size());
+	l_layout->maxLineLen = 0;
+
+	const auto push_row = [&l_layout](size_t a_sourceRow, size_t a_sourceCol, size_t a_length, size_t a_indent)
+	{
+		l_layout->rows.push_back(SWrappedRow{ a_sourceRow, a_sourceCol, a_length, a_indent });
+		l_layout->maxLineLen = std::max(l_layout->maxLineLen, a_indent + a_length);
+	};
+
+	// works on slices of the source line instead of copying and erasing,
+	// the resulting rows are the same as before.
+	const auto wrap_line = [&](size_t source_row, const std::wstring& line, size_t num_leading_spaces)
 	{
 		bool first_run = true;
+		size_t consumed = 0;
 
-		while (line.size() > 0)
+		while (consumed < line.size())
 		{
-			std::wstring::size_type cut_position = line.rfind(' ', MAX_LEN_SOFT);
+			const size_t remaining = line.size() - consumed;
+			const size_t space_position = line.rfind(' ', consumed + MAX_LEN_SOFT);
+			size_t cut_position = (space_position != std::wstring::npos && space_position >= consumed
+				? space_position - consumed : std::wstring::npos);
 
 			if (cut_position == std::wstring::npos
 				|| cut_position < num_leading_spaces
 				|| cut_position == 0
-				|| line.size() < MAX_LEN_SOFT)
+				|| remaining < MAX_LEN_SOFT)
 			{
 				cut_position = MAX_LEN_SOFT;
 			}
 
-			std::wstring new_line = line.substr(0, cut_position);
+			const size_t slice_end = consumed + std::min(cut_position, remaining);
+			size_t slice_start = consumed;
 
 			if (!first_run)
 			{
-				CUtil::StrTrimLeft(new_line);
-
-				new_line.insert(0,
-					num_leading_spaces // whitespace level of line being split
-					+ 2 // some indentation to denote what happened
-					, ' ');
+				while (slice_start < slice_end && wcschr(L"\t\r\n ", line[slice_start]) != nullptr)
+				{
+					++slice_start;
+				}
 			}
 
-			push_backer(std::move(new_line));
+			const size_t indent = (first_run ? 0 :
+				num_leading_spaces // whitespace level of line being split
+				+ 2); // some indentation to denote what happened
 
-			if (cut_position != MAX_LEN_SOFT)
-			{
-				// also erase space character
-				line.erase(0, cut_position + 1);
-			}
-			else
-			{
-				// there was no space character
-				line.erase(0, cut_position);
-			}
+			push_row(source_row, slice_start, slice_end - slice_start, indent);
+
+			// also skip the space character, if there was one:
+			consumed += (cut_position != MAX_LEN_SOFT ? cut_position + 1 : cut_position);
 
 			first_run = false;
 		}
 	};
 
-	TLineContainer new_lines;
-
-	for (const std::wstring& line : a_lines)
+	for (size_t l_row = 0; l_row < m_sourceLines.size(); l_row++)
 	{
+		const std::wstring& line = m_sourceLines[l_row];
+
+		l_layout->firstRowOfSource.push_back(l_layout->rows.size());
+
 		if (!is_line_wrapping_candidate(line))
 		{
-			new_lines.emplace_back(line);
+			push_row(l_row, 0, line.size(), 0);
 
 			continue;
 		}
@@ -551,7 +581,7 @@ static void _InternalLoad_WrapLongLines(TLineContainer& a_lines, size_t& a_newMa
 
 			if (equal_consecutive_count > EQUAL_CONSECUTIVE_CHARACTERS_MAX)
 			{
-				new_lines.emplace_back(line);
+				push_row(l_row, 0, line.size(), 0);
 
 				continue;
 			}
@@ -559,14 +589,31 @@ static void _InternalLoad_WrapLongLines(TLineContainer& a_lines, size_t& a_newMa
 
 	force_wrap:
 
-		wrap_line(line, num_leading_spaces, [&](auto&& new_line) {new_lines.emplace_back(new_line); });
+		wrap_line(l_row, line, num_leading_spaces);
+
+		l_wrappedAny = true;
+	}
+
+	if (!l_wrappedAny)
+	{
+		// keep the width that the loader determined for untouched documents.
+		l_layout->maxLineLen = m_sourceMaxLineLen;
+	}
+
+	m_layoutCache.emplace_front(a_width, l_layout);
+
+	// drop the least recently used layouts, except for the one that is in use:
+	for (auto it = m_layoutCache.end(); m_layoutCache.size() > MAX_CACHED_LAYOUTS && it != m_layoutCache.begin(); )
+	{
+		it--;
+
+		if (it->second != m_layout)
+		{
+			it = m_layoutCache.erase(it);
+		}
 	}
 
-	a_lines = new_lines;
-	a_newMaxLineLen = std::accumulate(new_lines.begin(), new_lines.end(), size_t(0),
-		[](size_t carry, auto& line) {
-			return std::max(line.size(), carry);
-		});
+	return l_layout;
 }
 
 
@@ -654,6 +701,7 @@ bool CNFOData::PostProcessLoadedContent()
 	bool l_ansiError = false;
 
 	m_colorMap.reset();
+	m_ansiFrames.clear();
 
 	if (!m_isAnsi)
 	{
@@ -669,11 +717,6 @@ bool CNFOData::PostProcessLoadedContent()
 		{
 			_InternalLoad_FixLfLf(m_textContent, l_lines);
 		}
-
-		if (m_lineWrap)
-		{
-			_InternalLoad_WrapLongLines(l_lines, l_maxLineLen);
-		}
 	}
 	else
 	{
@@ -686,7 +729,9 @@ bool CNFOData::PostProcessLoadedContent()
 		{
 			CAnsiArt l_ansiArtProcessor(WIDTH_LIMIT, LINES_LIMIT, m_ansiHintWidth, m_ansiHintHeight);
 
-			l_ansiError = !l_ansiArtProcessor.Parse(m_textContent) || !l_ansiArtProcessor.Process();
+			l_ansiArtProcessor.SetFrameCapture(m_ansiFrameInterval);
+
+			l_ansiError = !l_ansiArtProcessor.Interpret(m_textContent);
 
 			if (!l_ansiError)
 			{
@@ -694,6 +739,8 @@ bool CNFOData::PostProcessLoadedContent()
 				l_maxLineLen = l_ansiArtProcessor.GetMaxLineLength();
 				m_textContent = l_ansiArtProcessor.GetAsClassicText();
 				m_colorMap = l_ansiArtProcessor.GetColorMap();
+
+				l_ansiArtProcessor.TakeFrames(m_ansiFrames);
 			}
 		}
 		catch (const std::exception& ex)
@@ -703,11 +750,16 @@ bool CNFOData::PostProcessLoadedContent()
 		}
 	}
 
-	// copy lines to grid:
 	m_grid.reset();
 	m_utf8Map.clear();
 	m_hyperLinks.clear();
+	m_hyperLinkRows.clear();
 	m_utf8Content.clear();
+	m_sourceLines.clear();
+	m_sourceLinks.clear();
+	m_linkTargets.clear();
+	m_layout.reset();
+	m_layoutCache.clear();
 
 	if (l_ansiError)
 	{
@@ -717,62 +769,28 @@ bool CNFOData::PostProcessLoadedContent()
 		return false;
 	}
 
-	if (l_lines.size() == 0 || l_maxLineLen == 0)
-	{
-		SetLastError(NDE_EMPTY_FILE, "Unable to find any lines in this file.");
-
-		return false;
-	}
-
-	if (l_maxLineLen > WIDTH_LIMIT)
-	{
-		std::stringstream l_errmsg;
-		l_errmsg << "This file contains a line longer than " << WIDTH_LIMIT << " chars. To prevent damage and lock-ups, we do not load it.";
-
-		SetLastError(NDE_MAXIMUM_LINE_LENGTH_EXCEEDED, l_errmsg.str());
-
-		return false;
-	}
-
-	if (l_lines.size() > LINES_LIMIT)
-	{
-		std::stringstream l_errmsg;
-		l_errmsg << "This file contains more than " << LINES_LIMIT << " lines. To prevent damage and lock-ups, we do not load it.";
-
-		SetLastError(NDE_MAXIMUM_NUMBER_OF_LINES_EXCEEDED, l_errmsg.str());
-
-		return false;
-	}
-
-	// allocate mem:
-	m_grid = std::make_unique<TwoDimVector<wchar_t>>(l_lines.size(), l_maxLineLen, 0);
+	m_sourceLines.assign(std::make_move_iterator(l_lines.begin()), std::make_move_iterator(l_lines.end()));
+	m_sourceMaxLineLen = l_maxLineLen;
 
 	// vars for hyperlink detection:
 	std::wstring l_prevLinkUrl;
 	int l_maxLinkId = 1;
-	std::multimap<size_t, CNFOHyperLink>::iterator l_prevLinkIt = m_hyperLinks.end();
 
-	// go through line by line:
-	size_t i = 0; // line (row) index
-	for (TLineContainer::const_iterator it = l_lines.cbegin(); it != l_lines.cend(); it++, i++)
+	// go through line by line. links are detected on the unwrapped lines,
+	// and mapped onto the grid rows by ApplyWrapLayout.
+	for (size_t i = 0; i < m_sourceLines.size(); i++)
 	{
-		int l_lineLen = static_cast<int>(it->length());
-
-#pragma omp parallel for
-		for (int j = 0; j < l_lineLen; j++)
-		{
-			(*m_grid)[i][j] = (*it)[j];
-		}
+		const std::wstring& l_line = m_sourceLines[i];
 
 #ifndef INFEKT_2_CXXRUST
-		const std::string l_utf8Line = CUtil::FromWideStr(*it, CP_UTF8);
+		const std::string l_utf8Line = CUtil::FromWideStr(l_line, CP_UTF8);
 
 		const char* const p_start = l_utf8Line.c_str();
 		const char* p = p_start;
 		size_t char_index = 0;
 		while (p != nullptr && *p)
 		{
-			wchar_t w_at = (*m_grid)[i][char_index++];
+			wchar_t w_at = l_line[char_index++];
 			const char* p_char = p;
 			const char* p_next = utf8_find_next_char(p);
 
@@ -793,28 +811,26 @@ bool CNFOData::PostProcessLoadedContent()
 			std::wstring l_url, l_prevUrlCopy = l_prevLinkUrl;
 			size_t l_offset = 0;
 
-			while (CNFOHyperLink::FindLink(*it, l_offset, l_linkPos, l_linkLen, l_url, l_prevUrlCopy, l_linkContinued))
+			while (CNFOHyperLink::FindLink(l_line, l_offset, l_linkPos, l_linkLen, l_url, l_prevUrlCopy, l_linkContinued))
 			{
 				int l_linkID = (l_linkContinued ? l_maxLinkId - 1 : l_maxLinkId);
 
-				std::multimap<size_t, CNFOHyperLink>::iterator l_newItem =
-					m_hyperLinks.emplace(i, CNFOHyperLink(l_linkID, l_url, i, l_linkPos, l_linkLen));
+				m_sourceLinks.push_back(SSourceLink{ l_linkID, i, l_linkPos, l_linkLen });
 
 				if (!l_linkContinued)
 				{
 					l_maxLinkId++;
 					l_prevLinkUrl = l_url;
-					l_prevLinkIt = l_newItem;
+					m_linkTargets.push_back(SNFOLinkTarget{ l_url, std::string() });
 				}
 				else
 				{
-					(*l_newItem).second.SetHref(l_url);
+					_ASSERT(static_cast<size_t>(l_linkID) == m_linkTargets.size());
 
-					if (l_prevLinkIt != m_hyperLinks.end())
+					// the continued URL applies to the link's first line, too:
+					if (l_linkID > 0)
 					{
-						_ASSERT((*l_prevLinkIt).second.GetLinkID() == l_linkID);
-						// update href of link's first line:
-						(*l_prevLinkIt).second.SetHref(l_url);
+						m_linkTargets[l_linkID - 1].href = l_url;
 					}
 
 					l_prevLinkUrl.clear();
@@ -831,6 +847,185 @@ bool CNFOData::PostProcessLoadedContent()
 		}
 	} // end of foreach line loop.
 
+	for (SNFOLinkTarget& l_target : m_linkTargets)
+	{
+		l_target.hrefUtf8 = CUtil::FromWideStr(l_target.href, CP_UTF8);
+	}
+
+	return ApplyWrapLayout(GetWrapLayout(GetEffectiveWrapWidth()));
+}
+
+
+bool CNFOData::ApplyWrapLayout(const PWrapLayout& a_layout)
+{
+	if (a_layout == m_layout)
+	{
+		return true;
+	}
+
+	if (a_layout->rows.size() == 0 || a_layout->maxLineLen == 0)
+	{
+		SetLastError(NDE_EMPTY_FILE, "Unable to find any lines in this file.");
+
+		return false;
+	}
+
+	if (a_layout->maxLineLen > WIDTH_LIMIT)
+	{
+		std::stringstream l_errmsg;
+		l_errmsg << "This file contains a line longer than " << WIDTH_LIMIT << " chars. To prevent damage and lock-ups, we do not load it.";
+
+		SetLastError(NDE_MAXIMUM_LINE_LENGTH_EXCEEDED, l_errmsg.str());
+
+		return false;
+	}
+
+	if (a_layout->rows.size() > LINES_LIMIT)
+	{
+		std::stringstream l_errmsg;
+		l_errmsg << "This file contains more than " << LINES_LIMIT << " lines. To prevent damage and lock-ups, we do not load it.";
+
+		SetLastError(NDE_MAXIMUM_NUMBER_OF_LINES_EXCEEDED, l_errmsg.str());
+
+		return false;
+	}
+
+	// allocate mem:
+	m_grid = std::make_unique<TwoDimVector<wchar_t>>(a_layout->rows.size(), a_layout->maxLineLen, 0);
+
+	const int l_numRows = static_cast<int>(a_layout->rows.size());
+
+	// copy lines to grid:
+#pragma omp parallel for
+	for (int i = 0; i < l_numRows; i++)
+	{
+		const SWrappedRow& l_row = a_layout->rows[i];
+		std::vector<wchar_t>& l_gridRow = (*m_grid)[i];
+
+		std::fill_n(l_gridRow.begin(), l_row.indent, L' ');
+		std::copy_n(m_sourceLines[l_row.sourceRow].begin() + l_row.sourceCol, l_row.length, l_gridRow.begin() + l_row.indent);
+	}
+
+	// map links onto the rows they ended up in:
+	m_hyperLinks.clear();
+
+	for (const SSourceLink& l_link : m_sourceLinks)
+	{
+		const size_t l_sourceRow = l_link.row;
+		const size_t l_rowEnd = (l_sourceRow + 1 < a_layout->firstRowOfSource.size()
+			? a_layout->firstRowOfSource[l_sourceRow + 1] : a_layout->rows.size());
+
+		for (size_t l_gridRow = a_layout->firstRowOfSource[l_sourceRow]; l_gridRow < l_rowEnd; l_gridRow++)
+		{
+			const SWrappedRow& l_row = a_layout->rows[l_gridRow];
+			const size_t l_start = std::max(l_link.col, l_row.sourceCol);
+			const size_t l_end = std::min(l_link.col + l_link.length, l_row.sourceCol + l_row.length);
+
+			if (l_start < l_end)
+			{
+				m_hyperLinks.emplace_back(l_link.linkID, &m_linkTargets[l_link.linkID - 1], l_gridRow,
+					l_start - l_row.sourceCol + l_row.indent, l_end - l_start);
+			}
+		}
+	}
+
+	// source links come in this order already, GetLink relies on it:
+	std::stable_sort(m_hyperLinks.begin(), m_hyperLinks.end(), [](const CNFOHyperLink& a, const CNFOHyperLink& b) {
+		return (a.GetRow() != b.GetRow() ? a.GetRow() < b.GetRow() : a.GetColStart() < b.GetColStart());
+	});
+
+	m_hyperLinkRows.assign(a_layout->rows.size() + 1, 0);
+
+	for (const CNFOHyperLink& l_link : m_hyperLinks)
+	{
+		m_hyperLinkRows[l_link.GetRow() + 1]++;
+	}
+
+	for (size_t row = 1; row < m_hyperLinkRows.size(); row++)
+	{
+		m_hyperLinkRows[row] += m_hyperLinkRows[row - 1];
+	}
+
+	m_layout = a_layout;
+
+	return true;
+}
+
+
+bool CNFOData::SetWrapLines(bool nb)
+{
+	const bool l_prev = m_lineWrap;
+
+	m_lineWrap = nb;
+
+	if (m_loaded && !ApplyWrapLayout(GetWrapLayout(GetEffectiveWrapWidth())))
+	{
+		m_lineWrap = l_prev;
+
+		return false;
+	}
+
+	return true;
+}
+
+
+bool CNFOData::SetWrapWidth(size_t a_width)
+{
+	const size_t l_prev = m_wrapWidth;
+
+	m_wrapWidth = (a_width > 0 ? std::max(a_width, MIN_WRAP_WIDTH) : DEFAULT_WRAP_WIDTH);
+
+	if (m_loaded && !ApplyWrapLayout(GetWrapLayout(GetEffectiveWrapWidth())))
+	{
+		m_wrapWidth = l_prev;
+
+		return false;
+	}
+
+	return true;
+}
+
+
+bool CNFOData::MapToSourcePosition(size_t a_row, size_t a_col, size_t& ar_sourceRow, size_t& ar_sourceCol) const
+{
+	if (!m_layout || a_row >= m_layout->rows.size())
+	{
+		return false;
+	}
+
+	const SWrappedRow& l_row = m_layout->rows[a_row];
+
+	ar_sourceRow = l_row.sourceRow;
+	// positions inside the added indentation snap to the first char of the slice:
+	ar_sourceCol = l_row.sourceCol + (a_col > l_row.indent ? a_col - l_row.indent : 0);
+
+	return true;
+}
+
+
+bool CNFOData::MapFromSourcePosition(size_t a_sourceRow, size_t a_sourceCol, size_t& ar_row, size_t& ar_col) const
+{
+	if (!m_layout || a_sourceRow >= m_layout->firstRowOfSource.size())
+	{
+		return false;
+	}
+
+	const size_t l_rowEnd = (a_sourceRow + 1 < m_layout->firstRowOfSource.size()
+		? m_layout->firstRowOfSource[a_sourceRow + 1] : m_layout->rows.size());
+
+	// find the last slice that starts at or before a_sourceCol:
+	size_t l_gridRow = m_layout->firstRowOfSource[a_sourceRow];
+
+	while (l_gridRow + 1 < l_rowEnd && m_layout->rows[l_gridRow + 1].sourceCol <= a_sourceCol)
+	{
+		++l_gridRow;
+	}
+
+	const SWrappedRow& l_row = m_layout->rows[l_gridRow];
+
+	ar_row = l_gridRow;
+	ar_col = l_row.indent + (a_sourceCol > l_row.sourceCol ? a_sourceCol - l_row.sourceCol : 0);
+
 	return true;
 }
 
@@ -1436,6 +1631,223 @@ FILE* CNFOData::OpenFileForWritingWithErrorMessage(const std::_tstring& a_filePa
 }
 
 
+/************************************************************************/
+/* Streaming Text Export Code                                           */
+/************************************************************************/
+
+// reverse lookup table, Unicode (BMP) -> CP437. 0 marks "not convertible",
+// except for index 0, which is the NUL character itself.
+static constexpr std::array<unsigned char, 0x10000> _BuildUnicodeToCP437Table()
+{
+	std::array<unsigned char, 0x10000> l_table{};
+
+	for (size_t j = 0; j < 0x20; j++)
+	{
+		l_table[map_cp437_to_unicode_control_range[j]] = static_cast<unsigned char>(j);
+	}
+
+	for (size_t j = CP437_MAP_LOW; j <= 0xFF; j++)
+	{
+		l_table[map_cp437_to_unicode_high_bit[j - CP437_MAP_LOW]] = static_cast<unsigned char>(j);
+	}
+
+	// plain ASCII and line breaks always map to themselves:
+	for (size_t j = 0x20; j < CP437_MAP_LOW; j++)
+	{
+		l_table[j] = static_cast<unsigned char>(j);
+	}
+
+	l_table[L'\n'] = '\n';
+	l_table[L'\r'] = '\r';
+
+	return l_table;
+}
+
+static constexpr std::array<unsigned char, 0x10000> s_unicodeToCP437 = _BuildUnicodeToCP437Table();
+
+
+// collects encoded output in a fixed buffer and hands it to fwrite in large chunks.
+class CTextFileWriter
+{
+public:
+	CTextFileWriter(FILE* a_file) : m_file(a_file), m_buffer(BUFFER_SIZE), m_used(0), m_failed(false) {}
+
+	inline void Put(unsigned char a_byte)
+	{
+		if (m_used == BUFFER_SIZE)
+		{
+			Flush();
+		}
+
+		m_buffer[m_used++] = a_byte;
+	}
+
+	bool Flush()
+	{
+		if (m_used > 0 && !m_failed)
+		{
+			m_failed = (fwrite(m_buffer.data(), 1, m_used, m_file) != m_used);
+		}
+
+		m_used = 0;
+
+		return !m_failed;
+	}
+
+private:
+	static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+	FILE* m_file;
+	std::vector<unsigned char> m_buffer;
+	size_t m_used;
+	bool m_failed;
+};
+
+
+// same interface as CTextFileWriter, for in-memory results:
+class CTextBufferWriter
+{
+public:
+	CTextBufferWriter(std::vector<char>& ar_target) : m_target(ar_target) {}
+
+	inline void Put(unsigned char a_byte) { m_target.push_back(static_cast<char>(a_byte)); }
+
+private:
+	std::vector<char>& m_target;
+};
+
+
+// feeds the export characters to a_func, either straight from the loaded text or
+// from the grid, with empty cells boxed into spaces ("compound whitespace").
+template<typename F> static void _ForEachExportChar(const std::wstring& a_text, const TwoDimVector<wchar_t>* a_grid, F a_func)
+{
+	if (!a_grid)
+	{
+		for (const wchar_t wc : a_text)
+		{
+			a_func(wc);
+		}
+
+		return;
+	}
+
+	for (size_t rr = 0; rr < a_grid->GetRows(); rr++)
+	{
+		const std::vector<wchar_t>& l_row = (*a_grid)[rr];
+
+		for (size_t cc = 0; cc < a_grid->GetCols(); cc++)
+		{
+			a_func(l_row[cc] != 0 ? l_row[cc] : L' ');
+		}
+
+		a_func(L'\n');
+	}
+}
+
+
+// combines UTF-16 surrogate pairs (only ever seen with 16 bit wchar_t) into code points.
+// Unpaired surrogates become U+FFFD, the unit following a lone high surrogate is kept.
+class CCodePointDecoder
+{
+public:
+	CCodePointDecoder() : m_highSurrogate(0) {}
+
+	// calls a_emit with each complete code point, none if a_wc is the first half of a pair.
+	template<typename F> inline void Feed(wchar_t a_wc, F a_emit)
+	{
+		const uint32_t l_unit = static_cast<uint32_t>(a_wc);
+
+		if (l_unit >= 0xDC00 && l_unit <= 0xDFFF && m_highSurrogate != 0)
+		{
+			a_emit(0x10000 + ((m_highSurrogate - 0xD800) << 10) + (l_unit - 0xDC00));
+			m_highSurrogate = 0;
+			return;
+		}
+
+		Flush(a_emit);
+
+		if (l_unit >= 0xD800 && l_unit <= 0xDBFF)
+		{
+			m_highSurrogate = l_unit;
+		}
+		else
+		{
+			a_emit((l_unit >= 0xDC00 && l_unit <= 0xDFFF) || l_unit > 0x10FFFF ? 0xFFFD : l_unit);
+		}
+	}
+
+	// emits U+FFFD for a high surrogate that is still waiting for its other half.
+	template<typename F> inline void Flush(F a_emit)
+	{
+		if (m_highSurrogate != 0)
+		{
+			m_highSurrogate = 0;
+			a_emit(0xFFFD);
+		}
+	}
+
+private:
+	uint32_t m_highSurrogate;
+};
+
+
+template<typename W> static inline void _PutUtf8(W& a_writer, uint32_t a_cp)
+{
+	if (a_cp < 0x80)
+	{
+		a_writer.Put(static_cast<unsigned char>(a_cp));
+	}
+	else if (a_cp < 0x800)
+	{
+		a_writer.Put(static_cast<unsigned char>(0xC0 | (a_cp >> 6)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | (a_cp & 0x3F)));
+	}
+	else if (a_cp < 0x10000)
+	{
+		a_writer.Put(static_cast<unsigned char>(0xE0 | (a_cp >> 12)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | ((a_cp >> 6) & 0x3F)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | (a_cp & 0x3F)));
+	}
+	else
+	{
+		a_writer.Put(static_cast<unsigned char>(0xF0 | (a_cp >> 18)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | ((a_cp >> 12) & 0x3F)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | ((a_cp >> 6) & 0x3F)));
+		a_writer.Put(static_cast<unsigned char>(0x80 | (a_cp & 0x3F)));
+	}
+}
+
+
+template<typename W> static inline void _PutUtf16LE(W& a_writer, uint32_t a_unit)
+{
+	a_writer.Put(static_cast<unsigned char>(a_unit & 0xFF));
+	a_writer.Put(static_cast<unsigned char>((a_unit >> 8) & 0xFF));
+}
+
+
+template<typename W> static void _EncodeCP437(W& a_writer, const std::wstring& a_text, const TwoDimVector<wchar_t>* a_grid, size_t& ar_charsNotConverted)
+{
+	size_t l_notConverted = 0;
+
+	_ForEachExportChar(a_text, a_grid, [&](wchar_t wc) {
+		const uint32_t l_unit = static_cast<uint32_t>(wc);
+		const unsigned char l_converted = (l_unit < s_unicodeToCP437.size() ? s_unicodeToCP437[l_unit] : 0);
+
+		if (l_converted != 0 || l_unit == 0)
+		{
+			a_writer.Put(l_converted);
+		}
+		else
+		{
+			a_writer.Put(' ');
+			++l_notConverted;
+		}
+	});
+
+	ar_charsNotConverted = l_notConverted;
+}
+
+
 #ifndef INFEKT_2_CXXRUST
 bool CNFOData::SaveToUnicodeFile(const std::_tstring& a_filePath, bool a_utf8, bool a_compoundWhitespace)
 {
@@ -1446,37 +1858,44 @@ bool CNFOData::SaveToUnicodeFile(const std::_tstring& a_filePath, bool a_utf8, b
 		return false;
 	}
 
-	size_t l_written = 0;
-	bool l_success;
+	const TwoDimVector<wchar_t>* l_grid = (a_compoundWhitespace ? m_grid.get() : nullptr);
+	CTextFileWriter l_writer(l_file);
+	CCodePointDecoder l_decoder;
 
 	if (a_utf8)
 	{
-		unsigned char l_signature[3] = { 0xEF, 0xBB, 0xBF };
-		l_written += fwrite(l_signature, 1, sizeof(l_signature), l_file);
+		auto l_put = [&l_writer](uint32_t a_cp) { _PutUtf8(l_writer, a_cp); };
 
-		const std::string& l_contents = (a_compoundWhitespace
-			? CUtil::FromWideStr(GetWithBoxedWhitespace(), CP_UTF8)
-			: GetTextUtf8());
+		l_put(0xFEFF);
 
-		l_written += fwrite(l_contents.c_str(), l_contents.size(), 1, l_file);
+		_ForEachExportChar(m_textContent, l_grid, [&](wchar_t wc) { l_decoder.Feed(wc, l_put); });
 
-		l_success = (l_written == 4);
+		l_decoder.Flush(l_put);
 	}
 	else
 	{
-		unsigned char l_bom[2] = { 0xFF, 0xFE };
-		l_written += fwrite(l_bom, 1, sizeof(l_bom), l_file);
+		auto l_put = [&l_writer](uint32_t a_cp) {
+			if (a_cp >= 0x10000)
+			{
+				_PutUtf16LE(l_writer, 0xD800 + ((a_cp - 0x10000) >> 10));
+				_PutUtf16LE(l_writer, 0xDC00 + ((a_cp - 0x10000) & 0x3FF));
+			}
+			else
+			{
+				_PutUtf16LE(l_writer, a_cp);
+			}
+		};
 
-		const std::wstring& l_contents = (a_compoundWhitespace
-			? GetWithBoxedWhitespace()
-			: m_textContent);
+		l_put(0xFEFF);
 
-		l_written += fwrite(l_contents.c_str(), l_contents.size(), sizeof(wchar_t), l_file);
+		_ForEachExportChar(m_textContent, l_grid, [&](wchar_t wc) { l_decoder.Feed(wc, l_put); });
 
-		l_success = (l_written == 4);
+		l_decoder.Flush(l_put);
 	}
 
-	fclose(l_file);
+	bool l_success = l_writer.Flush();
+
+	l_success = (fclose(l_file) == 0) && l_success;
 
 	return l_success;
 }
@@ -1491,11 +1910,13 @@ bool CNFOData::SaveToCP437File(const std::_tstring& a_filePath, size_t& ar_chars
 		return false;
 	}
 
-	const std::vector<char> l_converted = GetTextCP437(ar_charsNotConverted, a_compoundWhitespace);
+	CTextFileWriter l_writer(fp);
 
-	bool l_success = (fwrite(l_converted.data(), 1, l_converted.size(), fp) == l_converted.size());
+	_EncodeCP437(l_writer, m_textContent, (a_compoundWhitespace ? m_grid.get() : nullptr), ar_charsNotConverted);
 
-	fclose(fp);
+	bool l_success = l_writer.Flush();
+
+	l_success = (fclose(fp) == 0) && l_success;
 
 	return l_success;
 }
@@ -1544,6 +1965,14 @@ wchar_t CNFOData::GetGridChar(size_t a_row, size_t a_col) const
 		: 0);
 }
 
+
+const wchar_t* CNFOData::GetGridRow(size_t a_row) const
+{
+	return (m_grid && a_row < m_grid->GetRows()
+		? (*m_grid)[a_row].data()
+		: nullptr);
+}
+
 #ifndef INFEKT_2_CXXRUST
 static std::string emptyUtf8String;
 
@@ -1606,42 +2035,27 @@ const std::wstring CNFOData::GetCharsetName() const
 
 
 /************************************************************************/
-/* Compound Whitespace Code                                             */
+/* Hyper Link Code                                                      */
 /************************************************************************/
 
-std::wstring CNFOData::GetWithBoxedWhitespace() const
+const CNFOHyperLink* CNFOData::GetLink(size_t a_row, size_t a_col) const
 {
-	std::wstring l_result;
-
-	for (size_t rr = 0; rr < m_grid->GetRows(); rr++)
+	if (a_row + 1 >= m_hyperLinkRows.size())
 	{
-		for (size_t cc = 0; cc < m_grid->GetCols(); cc++)
-		{
-			const wchar_t l_tmp = (*m_grid)[rr][cc];
-			l_result += (l_tmp != 0 ? l_tmp : L' ');
-		}
-
-		l_result += L"\n";
+		return nullptr;
 	}
 
-	return l_result;
-}
-
+	const auto l_first = m_hyperLinks.cbegin() + m_hyperLinkRows[a_row];
+	const auto l_last = m_hyperLinks.cbegin() + m_hyperLinkRows[a_row + 1];
 
-/************************************************************************/
-/* Hyper Link Code                                                      */
-/************************************************************************/
-
-const CNFOHyperLink* CNFOData::GetLink(size_t a_row, size_t a_col) const
-{
-	const auto l_range = m_hyperLinks.equal_range(a_row);
+	// segments on a row never overlap, so only the last one starting at or before a_col can match:
+	auto it = std::upper_bound(l_first, l_last, a_col, [](size_t col, const CNFOHyperLink& l_link) {
+		return col < l_link.GetColStart();
+	});
 
-	for (auto it = l_range.first; it != l_range.second; it++)
+	if (it != l_first && a_col <= (--it)->GetColEnd())
 	{
-		if (a_col >= it->second.GetColStart() && a_col <= it->second.GetColEnd())
-		{
-			return &it->second;
-		}
+		return &*it;
 	}
 
 	return nullptr;
@@ -1650,15 +2064,7 @@ const CNFOHyperLink* CNFOData::GetLink(size_t a_row, size_t a_col) const
 
 const CNFOHyperLink* CNFOData::GetLinkByIndex(size_t a_index) const
 {
-	if (a_index < m_hyperLinks.size())
-	{
-		/*std::multimap<size_t, CNFOHyperLink>::const_iterator it = m_hyperLinks.cbegin();
-		for (size_t i = 0; i < a_index; i++, it++);*/
-		const auto it = std::next(m_hyperLinks.cbegin(), a_index);
-		return &it->second;
-	}
-
-	return nullptr;
+	return (a_index < m_hyperLinks.size() ? &m_hyperLinks[a_index] : nullptr);
 }
 
 
@@ -1666,11 +2072,12 @@ const std::vector<const CNFOHyperLink*> CNFOData::GetLinksForLine(size_t a_row)
 {
 	std::vector<const CNFOHyperLink*> l_result;
 
-	const auto l_range = m_hyperLinks.equal_range(a_row);
-
-	for (auto it = l_range.first; it != l_range.second; it++)
+	if (a_row + 1 < m_hyperLinkRows.size())
 	{
-		l_result.push_back(&it->second);
+		for (size_t i = m_hyperLinkRows[a_row]; i < m_hyperLinkRows[a_row + 1]; i++)
+		{
+			l_result.push_back(&m_hyperLinks[i]);
+		}
 	}
 
 	return l_result;
@@ -1841,43 +2248,14 @@ std::wstring CNFOData::GetStrippedText() const
 
 const std::vector<char> CNFOData::GetTextCP437(size_t& ar_charsNotConverted, bool a_compoundWhitespace) const
 {
-	const std::wstring& l_input = (a_compoundWhitespace ? GetWithBoxedWhitespace() : m_textContent);
-	std::map<wchar_t, char> l_transl;
 	std::vector<char> l_converted;
+	CTextBufferWriter l_writer(l_converted);
 
-	for (int j = 0; j < 32; j++)
-	{
-		l_transl[map_cp437_to_unicode_control_range[j]] = j;
-	}
-
-	for (int j = CP437_MAP_LOW; j <= 0xFF; j++)
-	{
-		l_transl[map_cp437_to_unicode_high_bit[j - CP437_MAP_LOW]] = j;
-	}
-
-	ar_charsNotConverted = 0;
-
-	l_converted.resize(l_input.size(), ' ');
+	l_converted.reserve(a_compoundWhitespace
+		? m_grid->GetRows() * (m_grid->GetCols() + 1)
+		: m_textContent.size());
 
-#pragma omp parallel for
-	for (int i = 0; i < static_cast<int>(l_input.size()); i++)
-	{
-		const wchar_t wc = l_input[i];
-
-		if ((wc > 0x1F && wc < CP437_MAP_LOW) || wc == L'\n' || wc == L'\r')
-		{
-			l_converted[i] = (char)wc;
-		}
-		else if (const auto it = l_transl.find(wc); it != l_transl.end())
-		{
-			l_converted[i] = it->second;
-		}
-		else
-		{
-#pragma omp atomic
-			ar_charsNotConverted++;
-		}
-	}
+	_EncodeCP437(l_writer, m_textContent, (a_compoundWhitespace ? m_grid.get() : nullptr), ar_charsNotConverted);
 
 	return l_converted;
 }
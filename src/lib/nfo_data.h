@@ -18,6 +18,7 @@
 #include "util.h"
 #include "nfo_hyperlink.h"
 #include "nfo_colormap.h"
+#include "ansi_art.h"
 
 typedef enum: uint8_t
 {
@@ -56,6 +57,8 @@ public:
 	size_t GetGridWidth() const;
 	size_t GetGridHeight() const;
 	wchar_t GetGridChar(size_t a_row, size_t a_col) const;
+	// GetGridWidth() chars, nullptr if a_row is out of range:
+	const wchar_t* GetGridRow(size_t a_row) const;
 #ifdef INFEKT_2_CXXRUST
 	// Best effort to return a UTF-32 char, but it might be part of a UTF-16 surrogate pair or some other Unicode stuff:
 	uint32_t GetGridCharUint32(size_t a_row, size_t a_col) const {
@@ -84,12 +87,24 @@ public:
 	ENfoCharset GetCharset() const { return m_sourceCharset; }
 	static const std::wstring GetCharsetName(ENfoCharset a_charset);
 	const std::wstring GetCharsetName() const;
-	void SetWrapLines(bool nb) { m_lineWrap = nb; } /* only effective when calling Load* the next time */
+	/* both re-wrap an already loaded document right away, renderers need to re-assign it afterwards */
+	bool SetWrapLines(bool nb);
 	bool GetWrapLines() const { return m_lineWrap; }
+	bool SetWrapWidth(size_t a_width);
+	size_t GetWrapWidth() const { return m_wrapWidth; }
+
+	/* translate between grid coordinates and the lines of the loaded (unwrapped) document */
+	bool MapToSourcePosition(size_t a_row, size_t a_col, size_t& ar_sourceRow, size_t& ar_sourceCol) const;
+	bool MapFromSourcePosition(size_t a_sourceRow, size_t a_sourceCol, size_t& ar_row, size_t& ar_col) const;
+	size_t GetSourceLineCount() const { return m_sourceLines.size(); }
 
 	bool HasColorMap() const { return m_isAnsi && m_colorMap && m_colorMap->HasColors(); }
 	const PNFOColorMap GetColorMap() const { return m_colorMap; }
 
+	/* ANSImation frames are only captured if requested before loading, see CAnsiArt::SetFrameCapture */
+	void SetAnsiFrameCapture(size_t a_commandInterval) { m_ansiFrameInterval = a_commandInterval; }
+	const CAnsiArt::TFrameContainer& GetAnsiFrames() const { return m_ansiFrames; }
+
 	typedef enum {
 		NDE_NO_ERROR = 0,
 		NDE_UNRECOGNIZED_FILE_FORMAT = -9999,
@@ -118,7 +133,10 @@ private:
 	std::unique_ptr<TwoDimVector<wchar_t>> m_grid;
 	std::map<wchar_t, std::string> m_utf8Map;
 	bool m_loaded;
-	std::multimap<size_t, CNFOHyperLink> m_hyperLinks;
+	// link segments ordered by grid row and column, m_hyperLinkRows[row] is the index of
+	// the row's first segment, followed by one extra entry for the end:
+	std::vector<CNFOHyperLink> m_hyperLinks;
+	std::vector<size_t> m_hyperLinkRows;
 	std::_tstring m_filePath;
 	std::_tstring m_vFileName;
 	ENfoCharset m_sourceCharset;
@@ -127,10 +145,53 @@ private:
 	size_t m_ansiHintWidth;
 	size_t m_ansiHintHeight;
 	PNFOColorMap m_colorMap;
+	size_t m_ansiFrameInterval;
+	CAnsiArt::TFrameContainer m_ansiFrames;
 
 	static const int LINES_LIMIT = 10000;
 	static const int WIDTH_LIMIT = 2000;
 
+	static const size_t DEFAULT_WRAP_WIDTH = 100;
+	static const size_t MIN_WRAP_WIDTH = 20;
+	// wrap layouts kept for re-use, resizing a window goes through a lot of widths:
+	static const size_t MAX_CACHED_LAYOUTS = 3;
+
+	// one row of the grid, as a slice of a source line:
+	typedef struct
+	{
+		size_t sourceRow;
+		size_t sourceCol;
+		size_t length;
+		size_t indent; // leading spaces added in front of continued lines
+	} SWrappedRow;
+
+	typedef struct
+	{
+		std::vector<SWrappedRow> rows;
+		std::vector<size_t> firstRowOfSource;
+		size_t maxLineLen;
+	} SWrapLayout;
+
+	typedef std::shared_ptr<const SWrapLayout> PWrapLayout;
+
+	// a link segment on one source line:
+	typedef struct
+	{
+		int linkID;
+		size_t row;
+		size_t col;
+		size_t length;
+	} SSourceLink;
+
+	std::vector<std::wstring> m_sourceLines;
+	std::vector<SSourceLink> m_sourceLinks;
+	// indexed by link ID - 1, never modified after loading, so CNFOHyperLink can point into it:
+	std::vector<SNFOLinkTarget> m_linkTargets;
+	size_t m_sourceMaxLineLen;
+	size_t m_wrapWidth;
+	PWrapLayout m_layout;
+	mutable std::list<std::pair<size_t, PWrapLayout>> m_layoutCache; // most recently used first
+
 	enum class EApproach
 	{
 		EA_FALSE = 0,
@@ -153,7 +214,10 @@ private:
 	bool HasFileExtension(const TCHAR* a_extension) const;
 	bool PostProcessLoadedContent();
 
-	std::wstring GetWithBoxedWhitespace() const;
+	size_t GetEffectiveWrapWidth() const { return (m_lineWrap && !m_isAnsi ? m_wrapWidth : 0); }
+	PWrapLayout GetWrapLayout(size_t a_width) const;
+	bool ApplyWrapLayout(const PWrapLayout& a_layout);
+
 	std::wstring GetStrippedText() const;
 
 	FILE *OpenFileForWritingWithErrorMessage(const std::_tstring& a_filePath);
@@ -16,10 +16,9 @@
 #include "nfo_hyperlink.h"
 #include "util.h"
 
-CNFOHyperLink::CNFOHyperLink(int linkID, const std::wstring& href, size_t row, size_t col, size_t len)
+CNFOHyperLink::CNFOHyperLink(int linkID, const SNFOLinkTarget* target, size_t row, size_t col, size_t len)
 	: m_linkID(linkID)
-	, m_href(href)
-	, m_hrefUtf8()
+	, m_target(target)
 	, m_row(row)
 	, m_colStart(col)
 	, m_colEnd(col + len - 1)
@@ -258,13 +257,3 @@ CNFOHyperLink::CLinkRegEx::CLinkRegEx(const std::wstring& regexStr, bool isConti
 
 	m_regex = std::wregex(regexStr, flags);
 }
-
-const std::string& CNFOHyperLink::GetHrefUtf8() const
-{
-	if (m_hrefUtf8.empty())
-	{
-		m_hrefUtf8 = CUtil::FromWideStr(m_href, CP_UTF8);
-	}
-
-	return m_hrefUtf8;
-}
@@ -19,16 +19,22 @@
 #include <vector>
 #include <regex>
 
+// the target of a link, stored once per link ID and shared by all of its segments:
+typedef struct
+{
+	std::wstring href;
+	std::string hrefUtf8;
+} SNFOLinkTarget;
+
 class CNFOHyperLink
 {
 public:
 	CNFOHyperLink() = delete;
-	CNFOHyperLink(int linkID, const std::wstring& href, size_t row, size_t col, size_t len);
+	CNFOHyperLink(int linkID, const SNFOLinkTarget* target, size_t row, size_t col, size_t len);
 
-	void SetHref(const std::wstring& a_href) { m_href = a_href; }
 	int GetLinkID() const { return m_linkID; }
-	const std::wstring& GetHref() const { return m_href; }
-	const std::string& GetHrefUtf8() const;
+	const std::wstring& GetHref() const { return m_target->href; }
+	const std::string& GetHrefUtf8() const { return m_target->hrefUtf8; }
 	size_t GetRow() const { return m_row; }
 	size_t GetColStart() const { return m_colStart; }
 	size_t GetColEnd() const { return m_colEnd; }
@@ -39,8 +45,7 @@ public:
 
 protected:
 	int m_linkID;
-	std::wstring m_href;
-	mutable std::string m_hrefUtf8;
+	const SNFOLinkTarget* m_target; // owned by CNFOData
 	size_t m_row;
 	size_t m_colStart, m_colEnd;
 
@@ -15,6 +15,13 @@
 #include "stdafx.h"
 #include "nfo_renderer.h"
 #include "cairo_box_blur.h"
+#include "font_cache.h"
+#include "glyph_atlas.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GRID_CLASSIFY_SSE2
+#include <emmintrin.h>
+#endif
 
 
 CNFORenderer::CNFORenderer(bool a_classicMode) :
@@ -23,18 +30,34 @@ CNFORenderer::CNFORenderer(bool a_classicMode) :
 	m_forceGPUOff(false),
 	m_allowCPUFallback(true),
 	m_onDemandRendering(false),
-	m_preRenderThread(),
 	m_gridData(),
 	m_rendered(false),
+	m_recomposite(false),
 	m_linesPerStripe(0),
 	m_stripeHeight(0),
 	m_numStripes(0),
 	m_fontSize(-1),
 	m_zoomFactor(1.0f),
+	m_tiledRendering(false),
+	m_colsPerTile(0),
+	m_numTileCols(1),
 	m_hasBlocks(false),
 	m_stopPreRendering(true),
-	m_preRenderingStripe((size_t)-1),
-	m_cancelRenderingImmediately(false)
+	m_cancelRenderingImmediately(false),
+	m_viewFirstRow(0),
+	m_viewLastRow(0),
+	m_viewVelocity(0),
+	m_preRenderLookAhead(0),
+	m_packEvictedStripes(true),
+	m_zoomPreview(false),
+	m_zoomChanged(false),
+	m_zoomPreviewActive(false),
+	m_cacheColorLayers(false),
+	m_paletteStripes(false),
+	m_glyphAtlas(false),
+	m_reducedGlow(false),
+	m_lodCellSize(0),
+	m_drawReadyOnly(false)
 {
 	// default settings:
 	SetFontAntiAlias(true);
@@ -94,13 +117,16 @@ bool CNFORenderer::AssignNFO(const PNFOData& a_nfo)
 
 void CNFORenderer::UnAssignNFO()
 {
+	// stop the workers before pulling the data out from under them:
+	ClearStripes();
+	DropZoomPreview();
+
 	m_nfo.reset();
 
 	m_rendered = false;
 	m_fontSize = -1;
 	m_gridData.reset();
-
-	ClearStripes();
+	m_gridRows.clear();
 }
 
 
@@ -119,39 +145,77 @@ bool CNFORenderer::CalculateGrid()
 		m_nfo->GetGridWidth(), l_emptyBlock));
 	TwoDimVector<CRenderGridBlock>& l_grid = (*m_gridData);
 
+	const size_t l_cols = m_gridData->GetCols();
+
+	m_gridRows.assign(m_gridData->GetRows(), CRenderGridRow());
+
 	bool l_hasBlocks = false;
 
 	for (size_t row = 0; row < m_gridData->GetRows(); row++)
 	{
-		bool l_textStarted = false;
+		const wchar_t* l_chars = m_nfo->GetGridRow(row);
+		std::vector<CRenderGridBlock>& l_line = l_grid[row];
+		CRenderGridRow& l_index = m_gridRows[row];
 
-		for (size_t col = 0; col < m_gridData->GetCols(); col++)
-		{
-			CRenderGridBlock& l_block = l_grid[row][col];
+		CharCodesToGridBlocks(l_chars, l_cols, l_line.data());
+
+		// whitespace between the first and the last text char belongs to the text:
+		size_t l_textStart = l_cols, l_textEnd = 0;
+
+		l_index.lineEnd = 0;
 
-			l_block.shape = CharCodeToGridShape(m_nfo->GetGridChar(row, col), &l_block.alpha);
+		for (size_t col = 0; col < l_cols; col++)
+		{
+			const ERenderGridShape l_shape = l_line[col].shape;
 
-			if (!l_hasBlocks && l_block.shape != RGS_NO_BLOCK && l_block.shape != RGS_WHITESPACE) l_hasBlocks = true;
+			if (l_shape == RGS_NO_BLOCK)
+			{
+				if (l_textStart == l_cols) l_textStart = col;
+				l_textEnd = col + 1;
+			}
+			else if (l_shape != RGS_WHITESPACE)
+			{
+				l_hasBlocks = true;
+			}
 
-			if (l_block.shape == RGS_WHITESPACE && l_textStarted) l_block.shape = RGS_WHITESPACE_IN_TEXT;
-			else if (l_block.shape == RGS_NO_BLOCK) l_textStarted = true;
+			if (l_chars[col] != 0) l_index.lineEnd = col + 1;
 		}
 
-		if (l_textStarted)
+		for (size_t col = 0; col < l_index.lineEnd; col++)
 		{
-			for (size_t col = m_gridData->GetCols() - 1; col > 0; col--)
-			{
-				CRenderGridBlock& l_block = l_grid[row][col];
+			CRenderGridBlock& l_block = l_line[col];
 
-				if (l_block.shape == RGS_WHITESPACE_IN_TEXT)
-				{
-					l_block.shape = RGS_WHITESPACE;
-				}
-				else if (l_block.shape == RGS_NO_BLOCK)
+			if (l_block.shape == RGS_WHITESPACE)
+			{
+				if (col <= l_textStart || col >= l_textEnd)
 				{
-					break;
+					continue;
 				}
+
+				l_block.shape = RGS_WHITESPACE_IN_TEXT;
 			}
+
+			const bool l_text = (l_block.shape == RGS_NO_BLOCK || l_block.shape == RGS_WHITESPACE_IN_TEXT);
+
+			if (!l_index.runs.empty() && l_index.runs.back().text == l_text
+				&& l_index.runs.back().col + l_index.runs.back().len == col)
+			{
+				l_index.runs.back().len++;
+			}
+			else
+			{
+				l_index.runs.push_back(CRenderGridRun{ col, 1, l_text });
+			}
+		}
+
+		if (l_index.runs.empty())
+		{
+			l_index.firstCol = l_index.endCol = 0;
+		}
+		else
+		{
+			l_index.firstCol = l_index.runs.front().col;
+			l_index.endCol = l_index.runs.back().col + l_index.runs.back().len;
 		}
 	}
 
@@ -161,43 +225,137 @@ bool CNFORenderer::CalculateGrid()
 }
 
 
+// all block element chars are within U+2580..U+25AF:
+#define GRID_SHAPE_TABLE_FIRST 0x2580
+#define GRID_SHAPE_TABLE_SIZE 0x30
+
+static const CRenderGridBlock s_gridShapeTable[GRID_SHAPE_TABLE_SIZE] = {
+	{ RGS_BLOCK_UPPER_HALF, 255 }, /* 9600: upper half block */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_BLOCK_LOWER_HALF, 255 }, /* 9604: lower half block */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_FULL_BLOCK, 255 }, /* 9608: full block */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_BLOCK_LEFT_HALF, 255 }, /* 9612: left half block */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_BLOCK_RIGHT_HALF, 255 }, /* 9616: right half block */
+	{ RGS_FULL_BLOCK, 90 }, /* 9617: light shade */
+	{ RGS_FULL_BLOCK, 140 }, /* 9618: medium shade */
+	{ RGS_FULL_BLOCK, 190 }, /* 9619: dark shade */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_BLACK_SQUARE, 255 }, /* 9632: black square */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_NO_BLOCK, 255 },
+	{ RGS_BLACK_SMALL_SQUARE, 255 }, /* 9642: black small square */
+	{ RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 }, { RGS_NO_BLOCK, 255 },
+	{ RGS_NO_BLOCK, 255 },
+};
+
+
+static inline CRenderGridBlock _ClassifyGridChar(wchar_t a_char)
+{
+	const uint32_t l_offset = static_cast<uint32_t>(a_char) - GRID_SHAPE_TABLE_FIRST;
+
+	if (l_offset < GRID_SHAPE_TABLE_SIZE)
+	{
+		return s_gridShapeTable[l_offset];
+	}
+
+	if (a_char == 0 || a_char == 9 || a_char == 32)
+	{
+		return CRenderGridBlock{ RGS_WHITESPACE, 255 };
+	}
+
+	return CRenderGridBlock{ RGS_NO_BLOCK, 255 };
+}
+
+
 /*static*/ ERenderGridShape CNFORenderer::CharCodeToGridShape(wchar_t a_char, uint8_t* ar_alpha)
 {
-	switch (a_char)
-	{
-	case 0:
-	case 9:
-	case 32: /* whitespace */
-		return RGS_WHITESPACE;
-	case 9600: /* upper half block */
-		return RGS_BLOCK_UPPER_HALF;
-	case 9604: /* lower half block */
-		return RGS_BLOCK_LOWER_HALF;
-	case 9608: /* full block */
-		return RGS_FULL_BLOCK;
-	case 9612: /* left half block */
-		return RGS_BLOCK_LEFT_HALF;
-	case 9616: /* right half block */
-		return RGS_BLOCK_RIGHT_HALF;
-	case 9617: /* light shade */
-		if (ar_alpha) *ar_alpha = 90;
-		return RGS_FULL_BLOCK;
-	case 9618: /* medium shade */
-		if (ar_alpha) *ar_alpha = 140;
-		return RGS_FULL_BLOCK;
-		break;
-	case 9619: /* dark shade */
-		if (ar_alpha) *ar_alpha = 190;
-		return RGS_FULL_BLOCK;
-		break;
-	case 9632: /* black square */
-		return RGS_BLACK_SQUARE;
-		break;
-	case 9642: /* black small square */
-		return RGS_BLACK_SMALL_SQUARE;
-		break;
-	default:
-		return RGS_NO_BLOCK;
+	const CRenderGridBlock l_block = _ClassifyGridChar(a_char);
+
+	// only shades come with their own alpha:
+	if (ar_alpha && l_block.alpha != 255)
+	{
+		*ar_alpha = l_block.alpha;
+	}
+
+	return l_block.shape;
+}
+
+
+#ifdef GRID_CLASSIFY_SSE2
+// lane masks for chars that aren't plain text, and for spaces:
+static inline void _FindSpecialGridChars(__m128i a_chars, int& ar_special, int& ar_spaces)
+{
+	__m128i l_inTable, l_spaces, l_whitespace;
+
+	if (sizeof(wchar_t) == 2)
+	{
+		// there's no unsigned compare, so shift the range check into signed territory:
+		const __m128i l_biased = _mm_xor_si128(a_chars, _mm_set1_epi16(static_cast<short>(0x8000)));
+
+		l_inTable = _mm_and_si128(
+			_mm_cmpgt_epi16(l_biased, _mm_set1_epi16(static_cast<short>(0x8000 ^ (GRID_SHAPE_TABLE_FIRST - 1)))),
+			_mm_cmplt_epi16(l_biased, _mm_set1_epi16(static_cast<short>(0x8000 ^ (GRID_SHAPE_TABLE_FIRST + GRID_SHAPE_TABLE_SIZE)))));
+		l_spaces = _mm_cmpeq_epi16(a_chars, _mm_set1_epi16(32));
+		l_whitespace = _mm_or_si128(_mm_cmpeq_epi16(a_chars, _mm_setzero_si128()), _mm_cmpeq_epi16(a_chars, _mm_set1_epi16(9)));
+	}
+	else
+	{
+		// UTF-32, always positive:
+		l_inTable = _mm_and_si128(
+			_mm_cmpgt_epi32(a_chars, _mm_set1_epi32(GRID_SHAPE_TABLE_FIRST - 1)),
+			_mm_cmplt_epi32(a_chars, _mm_set1_epi32(GRID_SHAPE_TABLE_FIRST + GRID_SHAPE_TABLE_SIZE)));
+		l_spaces = _mm_cmpeq_epi32(a_chars, _mm_set1_epi32(32));
+		l_whitespace = _mm_or_si128(_mm_cmpeq_epi32(a_chars, _mm_setzero_si128()), _mm_cmpeq_epi32(a_chars, _mm_set1_epi32(9)));
+	}
+
+	ar_special = _mm_movemask_epi8(_mm_or_si128(l_inTable, _mm_or_si128(l_spaces, l_whitespace)));
+	ar_spaces = _mm_movemask_epi8(l_spaces);
+}
+#endif
+
+
+/*static*/ void CNFORenderer::CharCodesToGridBlocks(const wchar_t* a_chars, size_t a_count, CRenderGridBlock* ar_blocks)
+{
+	size_t i = 0;
+
+#ifdef GRID_CLASSIFY_SSE2
+	// plain text and runs of spaces make up most of any NFO, those are done a vector at a time:
+	const size_t l_lanes = 16 / sizeof(wchar_t);
+	const CRenderGridBlock l_text = { RGS_NO_BLOCK, 255 }, l_space = { RGS_WHITESPACE, 255 };
+
+	for (; i + l_lanes <= a_count; i += l_lanes)
+	{
+		int l_special, l_spaces;
+
+		_FindSpecialGridChars(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a_chars + i)), l_special, l_spaces);
+
+		if (l_special == 0)
+		{
+			std::fill(ar_blocks + i, ar_blocks + i + l_lanes, l_text);
+		}
+		else if (l_spaces == 0xFFFF)
+		{
+			std::fill(ar_blocks + i, ar_blocks + i + l_lanes, l_space);
+		}
+		else
+		{
+			for (size_t j = i; j < i + l_lanes; j++)
+			{
+				ar_blocks[j] = _ClassifyGridChar(a_chars[j]);
+			}
+		}
+	}
+#endif
+
+	for (; i < a_count; i++)
+	{
+		ar_blocks[i] = _ClassifyGridChar(a_chars[i]);
 	}
 }
 
@@ -207,14 +365,34 @@ bool CNFORenderer::DrawToSurface(cairo_surface_t *a_surface,
 	int source_x, int source_y, // coordinates between 0 and GetHeight() / GetWidth()
 	int a_width, int a_height)
 {
+	// while zooming, only wait for the new stripes if there's nothing to show instead:
+	const bool l_preview = !m_zoomPreviewLevels.empty();
+
 	if (m_onDemandRendering && m_numStripes == 0)
 	{
 		CalcStripeDimensions();
 	}
 
-	if (!m_onDemandRendering || m_numStripes == 1)
+	if (l_preview)
+	{
+		if (!IsRendered() && !PrepareStripes())
+		{
+			return false;
+		}
+
+		m_rendered = true;
+	}
+	else if (m_drawReadyOnly)
+	{
+		// RenderAsync takes care of the stripes:
+		if (!IsRendered() || GetNumSlots() == 0)
+		{
+			return false;
+		}
+	}
+	else if (!m_onDemandRendering || m_numStripes == 1)
 	{
-		if (!m_rendered && !Render())
+		if (!IsRendered() && !Render())
 		{
 			return false;
 		}
@@ -231,39 +409,60 @@ bool CNFORenderer::DrawToSurface(cairo_surface_t *a_surface,
 	int l_widthFixed = std::min(a_width, (int)GetWidth() - source_x);
 	int l_heightFixed = std::min(a_height, (int)GetHeight() - source_y);
 
-	if (m_numStripes == 1)
+	if (GetNumSlots() == 1 && !l_preview)
 	{
-		cairo_set_source_surface(cr, *m_stripes[0], dest_x - source_x, dest_y - source_y);
+		if (m_stripes[0].state.load(std::memory_order_acquire) == SS_READY)
+		{
+			int l_surfaceX, l_surfaceY;
+			cairo_surface_t* l_sourceSurface = GetStripeSurfaceARGB(0, source_x, source_y, l_widthFixed, l_heightFixed, l_surfaceX, l_surfaceY);
 
-		cairo_rectangle(cr, dest_x, dest_y, l_widthFixed, l_heightFixed);
+			cairo_set_source_surface(cr, l_sourceSurface, dest_x - source_x + l_surfaceX, dest_y - source_y + l_surfaceY);
 
-		cairo_fill(cr);
+			cairo_rectangle(cr, dest_x, dest_y, l_widthFixed, l_heightFixed);
+
+			cairo_fill(cr);
+
+			cairo_surface_destroy(l_sourceSurface);
+		}
+		else
+		{
+			// not rendered yet (see SetDrawReadyOnly), the background is filled in below:
+			l_heightFixed = 0;
+		}
 	}
 	else
 	{
-		int l_padding = GetPadding(),
-			l_stripeStart = (source_y - l_padding) / m_stripeHeight, // implicit floor()
-			l_stripeEnd = ((source_y + a_height - l_padding) / m_stripeHeight);
+		size_t l_firstStripe, l_lastStripe, l_firstTile, l_lastTile;
 
-		// sanity confinement ;)
-		l_stripeStart = std::min(l_stripeStart, (int)m_numStripes - 1);
-		l_stripeEnd = std::min(l_stripeEnd, (int)m_numStripes - 1);
+		GetSlotRange(source_x, source_y, a_width, a_height, l_firstStripe, l_lastStripe, l_firstTile, l_lastTile);
 
-		if (m_onDemandRendering)
-		{
-			Render(l_stripeStart, l_stripeEnd);
-		}
+		const int l_padding = GetPadding(),
+			l_stripeStart = static_cast<int>(l_firstStripe), l_stripeEnd = static_cast<int>(l_lastStripe),
+			l_tileStart = static_cast<int>(l_firstTile), l_tileEnd = static_cast<int>(l_lastTile);
 
-		for (int l_stripe = l_stripeStart; l_stripe <= l_stripeEnd; l_stripe++)
+		bool l_previewUsed = false;
+
+		if (l_preview)
 		{
-			cairo_surface_t* l_sourceSourface = GetStripeSurface(l_stripe);
+			QueueStripes(l_stripeStart, l_stripeEnd, l_tileStart, l_tileEnd);
 
-			if (!l_sourceSourface)
+			if (m_onDemandRendering)
 			{
-				// happens when zooming out, shouldn't happen otherwise.
-				continue;
+				CStripeCache::GetInstance().Trim(this, GetSlot(l_stripeStart, 0), GetSlot(l_stripeEnd, m_numTileCols - 1));
+			}
+			else
+			{
+				// the rest of the new stripes:
+				PreRender();
 			}
+		}
+		else if (m_onDemandRendering && !m_drawReadyOnly)
+		{
+			RenderTiles(l_stripeStart, l_stripeEnd, l_tileStart, l_tileEnd);
+		}
 
+		for (int l_stripe = l_stripeStart; l_stripe <= l_stripeEnd; l_stripe++)
+		{
 			// y pos in complete image:
 			int l_stripe_virtual_y = (l_stripe == 0 ? 0 : l_stripe * m_stripeHeight + GetPadding());
 			// y pos in stripe:
@@ -272,25 +471,94 @@ bool CNFORenderer::DrawToSurface(cairo_surface_t *a_surface,
 			// height of area of this stripe that is to be painted:
 			int l_height = (l_stripe == l_stripeEnd ? l_heightFixed : GetStripeHeight(l_stripe) - l_stripe_source_y);
 
-			if (l_stripe > l_stripeStart)
+			for (int l_tile = l_tileStart; l_tile <= l_tileEnd; l_tile++)
 			{
-				// must clip destination or additional pixels that have been added to stripes for
-				// correct blurring will be copied, too:
-				cairo_save(cr);
-				cairo_rectangle(cr, dest_x, l_stripe_virtual_y - source_y, l_widthFixed, l_height);
-				cairo_clip(cr);
+				const size_t l_slot = GetSlot(l_stripe, l_tile);
+				// part of the requested columns that this tile covers:
+				const int l_tileFrom = std::max(GetTileX(l_tile), source_x),
+					l_tileTo = std::min(GetTileX(l_tile) + GetTileWidth(l_tile), source_x + l_widthFixed);
+
+				if (l_tileTo <= l_tileFrom)
+				{
+					continue;
+				}
+
+				const bool l_ready = (m_stripes[l_slot].state.load(std::memory_order_acquire) == SS_READY);
+				const int l_bandTop = (l_stripe == 0 ? 0 : l_stripe * m_stripeHeight + l_padding),
+					l_bandBottom = (l_stripe == (int)m_numStripes - 1 ? (int)GetHeight() : (l_stripe + 1) * m_stripeHeight + l_padding);
+
+				if (l_preview && !l_ready)
+				{
+					DrawZoomPreview(cr, dest_x, dest_y, source_x, source_y, l_tileFrom, l_tileTo,
+						std::max(l_bandTop, source_y), std::min(l_bandBottom, source_y + l_heightFixed));
+
+					l_previewUsed = true;
+					continue;
+				}
+				else if (m_drawReadyOnly && !l_ready)
+				{
+					const int l_top = std::max(l_bandTop, source_y), l_bottom = std::min(l_bandBottom, source_y + l_heightFixed);
+
+					cairo_set_source_rgb(cr, S_COLOR_T_CAIRO(GetBackColor()));
+					cairo_rectangle(cr, dest_x + l_tileFrom - source_x, dest_y + l_top - source_y, l_tileTo - l_tileFrom, l_bottom - l_top);
+					cairo_fill(cr);
+					continue;
+				}
+
+				if (!GetStripeSurface(l_slot))
+				{
+					// happens when zooming out, shouldn't happen otherwise.
+					continue;
+				}
+
+				// x pos of the tile's surface in complete image:
+				int l_tile_virtual_x = GetTileX(l_tile) - GetTileWidthExtraLeft(l_tile);
+
+				int l_surfaceX, l_surfaceY;
+				cairo_surface_t* l_sourceSourface = GetStripeSurfaceARGB(l_slot, source_x - l_tile_virtual_x,
+					l_stripe_source_y + GetStripeHeightExtraTop(l_stripe), l_widthFixed, l_height, l_surfaceX, l_surfaceY);
+
+				const bool l_clip = (l_stripe > l_stripeStart || m_numTileCols > 1);
+
+				if (l_clip)
+				{
+					// must clip destination or additional pixels that have been added to stripes for
+					// correct blurring will be copied, too:
+					cairo_save(cr);
+					cairo_rectangle(cr, dest_x + l_tileFrom - source_x,
+						(l_stripe > l_stripeStart ? l_stripe_virtual_y - source_y : dest_y), l_tileTo - l_tileFrom, l_height);
+					cairo_clip(cr);
+				}
+
+				// actual copy operation:
+				cairo_set_source_surface(cr, l_sourceSourface, dest_x - source_x + l_tile_virtual_x + l_surfaceX,
+					dest_y - l_stripe_source_y - GetStripeHeightExtraTop(l_stripe) + l_surfaceY);
+				cairo_rectangle(cr, dest_x, dest_y, l_widthFixed, l_height);
+				cairo_fill(cr);
+
+				cairo_surface_destroy(l_sourceSourface);
+
+				if (l_clip)
+				{
+					// undo clip:
+					cairo_restore(cr);
+				}
 			}
+		}
 
-			// actual copy operation:
-			cairo_set_source_surface(cr, l_sourceSourface, dest_x - source_x,
-				dest_y - l_stripe_source_y - GetStripeHeightExtraTop(l_stripe));
-			cairo_rectangle(cr, dest_x, dest_y, l_widthFixed, l_height);
-			cairo_fill(cr);
+		if (l_preview && !l_previewUsed)
+		{
+			bool l_done = true;
 
-			if (l_stripe > l_stripeStart)
+			// without on-demand rendering, all stripes have to be there before drawing goes back to normal:
+			for (size_t l_slot = 0; l_slot < GetNumSlots() && !m_onDemandRendering && l_done; l_slot++)
 			{
-				// undo clip:
-				cairo_restore(cr);
+				l_done = (m_stripes[l_slot].state.load() == SS_READY);
+			}
+
+			if (l_done)
+			{
+				DropZoomPreview();
 			}
 		}
 	}
@@ -316,19 +584,24 @@ bool CNFORenderer::DrawToSurface(cairo_surface_t *a_surface,
 
 bool CNFORenderer::DrawToClippedHandle(cairo_t* a_cr, int dest_x, int dest_y)
 {
-	if (!m_rendered && !Render())
+	if (!IsRendered() && !Render())
 	{
 		return false;
 	}
 
 	cairo_save(a_cr);
 
-	if (m_numStripes == 1)
+	if (GetNumSlots() == 1)
 	{
-		cairo_set_source_surface(a_cr, *m_stripes[0], dest_x - 0, dest_y - 0);
+		int l_surfaceX, l_surfaceY;
+		cairo_surface_t* l_surface = GetStripeSurfaceARGB(0, 0, 0, (int)GetWidth(), (int)GetHeight(), l_surfaceX, l_surfaceY);
+
+		cairo_set_source_surface(a_cr, l_surface, dest_x + l_surfaceX, dest_y + l_surfaceY);
 		cairo_rectangle(a_cr, dest_x, dest_y,
 			static_cast<double>(GetWidth()), static_cast<double>(GetHeight()));
 		cairo_fill(a_cr);
+
+		cairo_surface_destroy(l_surface);
 	}
 	else
 	{
@@ -342,6 +615,60 @@ bool CNFORenderer::DrawToClippedHandle(cairo_t* a_cr, int dest_x, int dest_y)
 
 
 bool CNFORenderer::Render(size_t a_stripeFrom, size_t a_stripeTo)
+{
+	return RenderTiles(a_stripeFrom, a_stripeTo, 0, (size_t)-1);
+}
+
+
+/**
+ * Like Render, but only renders the tiles a_tileFrom to a_tileTo of each stripe.
+ **/
+bool CNFORenderer::RenderTiles(size_t a_stripeFrom, size_t a_stripeTo, size_t a_tileFrom, size_t a_tileTo)
+{
+	if (!PrepareStripes())
+	{
+		return false;
+	}
+
+	a_stripeTo = std::min(a_stripeTo, m_numStripes - 1);
+	a_tileTo = std::min(a_tileTo, m_numTileCols - 1);
+
+	QueueStripes(a_stripeFrom, a_stripeTo, a_tileFrom, a_tileTo);
+
+	// wait for our own stripes and for any that a pre-rendering task is working on:
+	for (size_t l_stripe = a_stripeFrom; l_stripe <= a_stripeTo; l_stripe++)
+	{
+		for (size_t l_tile = a_tileFrom; l_tile <= a_tileTo; l_tile++)
+		{
+			const size_t l_slot = GetSlot(l_stripe, l_tile);
+
+			WaitForStripe(l_slot);
+
+			// a cancelled RenderAsync request may have given up on it:
+			while (m_stripes[l_slot].state.load() == SS_EMPTY)
+			{
+				QueueStripes(l_stripe, l_stripe, l_tile, l_tile);
+				WaitForStripe(l_slot);
+			}
+		}
+	}
+
+	if (m_onDemandRendering)
+	{
+		// make room, but never throw out what's about to be drawn:
+		CStripeCache::GetInstance().Trim(this, GetSlot(a_stripeFrom, 0), GetSlot(a_stripeTo, m_numTileCols - 1));
+	}
+
+	m_rendered = true;
+
+	return true;
+}
+
+
+/**
+ * Sets up the grid, font size and stripe slots, unless they're up to date.
+ **/
+bool CNFORenderer::PrepareStripes()
 {
 	if (!m_nfo)
 	{
@@ -359,9 +686,16 @@ bool CNFORenderer::Render(size_t a_stripeFrom, size_t a_stripeTo)
 
 	if (!m_rendered)
 	{
-		StopPreRendering();
+		ClearStripes();
+
+		// anything other than zooming makes old zoom levels useless:
+		if (!m_zoomChanged)
+		{
+			DropZoomPreview();
+		}
 
-		m_stripes.clear();
+		m_zoomChanged = false;
+		m_recomposite = false;
 
 		if (m_classic)
 		{
@@ -379,1431 +713,3549 @@ bool CNFORenderer::Render(size_t a_stripeFrom, size_t a_stripeTo)
 
 		CalcStripeDimensions();
 	}
+	else if (m_recomposite)
+	{
+		RecompositeStripes();
+	}
 
-	std::vector<size_t> l_changedStripes;
+	return true;
+}
 
-	a_stripeTo = std::min(a_stripeTo, m_numStripes - 1);
-	for (size_t l_stripe = a_stripeFrom; l_stripe <= a_stripeTo; l_stripe++)
-	{
-		while (l_stripe == m_preRenderingStripe)
-		{
-			// risky business! not entirely sure if this is safe!
-		}
 
-		std::lock_guard<std::mutex> threadlock(m_stripesLock);
+/**
+ * Hands the stripes (tiles a_tileFrom to a_tileTo of them) in the given range
+ * that aren't there yet to the render pool.
+ **/
+void CNFORenderer::QueueStripes(size_t a_stripeFrom, size_t a_stripeTo, size_t a_tileFrom, size_t a_tileTo)
+{
+	std::vector<size_t> l_changedSlots;
+	std::vector<size_t> l_packedSlots;
 
-		if (!m_stripes[l_stripe])
+	for (size_t l_stripe = a_stripeFrom; l_stripe <= a_stripeTo && l_stripe < m_numStripes; l_stripe++)
+	{
+		for (size_t l_tile = a_tileFrom; l_tile <= a_tileTo && l_tile < m_numTileCols; l_tile++)
 		{
-			m_stripes[l_stripe] = PCairoSurface(new _CCairoSurface(
-				cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-				(int)GetWidth(),
-					GetStripeHeightPhysical(l_stripe))
-			));
+			const size_t l_slot = GetSlot(l_stripe, l_tile);
+			bool l_unpack = false;
 
 			// render each stripe only once:
-			l_changedStripes.push_back(l_stripe);
+			if (ClaimStripe(l_slot, &l_unpack))
+			{
+				(l_unpack ? l_packedSlots : l_changedSlots).push_back(l_slot);
+
+				if (m_onDemandRendering)
+				{
+					CStripeCache::GetInstance().CountMiss(l_unpack);
+				}
+			}
+			else if (m_onDemandRendering)
+			{
+				CStripeCache::GetInstance().Touch(this, l_slot);
+			}
 		}
 	}
 
-	_ASSERT(m_stripes.size() <= m_numStripes);
+	for (size_t l_slot : l_changedSlots)
+	{
+		CRenderPool::GetInstance().Submit(this, RP_VISIBLE, [this, l_slot] {
+			RenderStripe(l_slot);
+			FinishStripe(l_slot);
+		});
+	}
 
-	// for some weird reason, this conditional saves a lot of CPU time when scrolling?!.
-	if (l_changedStripes.size() > 0)
+	for (size_t l_slot : l_packedSlots)
 	{
-#pragma omp parallel for
-		for (int i = 0; i < static_cast<int>(l_changedStripes.size()); i++)
-		{
-			RenderStripe(l_changedStripes[i]);
-		}
+		CRenderPool::GetInstance().Submit(this, RP_VISIBLE, [this, l_slot] {
+			UnpackStripe(l_slot);
+			FinishStripe(l_slot);
+		});
 	}
+}
 
-	m_rendered = true;
 
-	return true;
-}
+/************************************************************************/
+/* Asynchronous rendering                                               */
+/************************************************************************/
 
+// the RenderAsync request that a worker is rendering a stripe for:
+static thread_local const CNFORenderRequest* s_currentRequest = nullptr;
 
-void CNFORenderer::CalcStripeDimensions()
+
+CNFORenderRequest::CNFORenderRequest(const NFORendererAreaReadyCallback& a_onAreaReady, const NFORendererRequestDoneCallback& a_onDone)
+	: m_cancelled(false)
+	, m_numTiles(0)
+	, m_numTilesReady(0)
+	, m_onAreaReady(a_onAreaReady)
+	, m_onDone(a_onDone)
+	, m_numTilesLeft(0)
+	, m_done(false)
+	, m_complete(false)
 {
-	if (!m_nfo || !m_gridData)
-	{
-		return;
-	}
+}
 
-	// 2 CPU cores <=> 2000 px stripe height
-	// ==> 8 CPU cores <=> 250
-	// (= more threads)
-	// but: never use less than 500px per stripe.
-	size_t l_stripeHeightMaxForCores = std::max(2000 * 2 / omp_get_num_procs(), 500);
 
-	size_t l_stripeHeightMax = std::max(l_stripeHeightMaxForCores, GetBlockHeight() * 2); // MUST not be smaller than one line's height, using two for sanity
+bool CNFORenderRequest::IsDone() const
+{
+	std::lock_guard<std::mutex> l_lock(m_callbackLock);
 
-	size_t l_numStripes = GetHeight() / l_stripeHeightMax; // implicit floor()
-	if (l_numStripes == 0) l_numStripes = 1;
-	size_t l_linesPerStripe = m_nfo->GetGridHeight() / l_numStripes; // implicit floor()
+	return m_done;
+}
 
-	while (l_linesPerStripe * l_numStripes < m_nfo->GetGridHeight())
-	{
-		// correct rounding errors
-		l_numStripes++;
-	}
 
-	// storing these three is a bit redundant, but saves code & calculations in other places:
-	m_linesPerStripe = l_linesPerStripe;
-	m_stripeHeight = static_cast<int>(l_linesPerStripe * GetBlockHeight());
-	m_numStripes = l_numStripes;
+bool CNFORenderRequest::Wait()
+{
+	std::unique_lock<std::mutex> l_lock(m_callbackLock);
 
-	_ASSERT(m_stripeHeight * m_numStripes + GetPadding() * 2 >= GetHeight());
+	m_doneCondition.wait(l_lock, [this] { return m_done; });
+
+	return m_complete;
 }
 
 
-// wrapper that we can use in const situations:
-cairo_surface_t *CNFORenderer::GetStripeSurface(size_t a_stripe) const
+/**
+ * m_callbackLock must be held.
+ **/
+void CNFORenderRequest::Finish(bool a_complete)
 {
-	std::map<size_t, PCairoSurface>::const_iterator it = m_stripes.find(a_stripe);
+	m_done = true;
+	m_complete = a_complete;
 
-	if (it != m_stripes.end())
+	if (m_onDone)
 	{
-		// the actual surface is not really const, but that's safe because
-		// we are parallelizing per stripe, so one surface can never be used by more than one thread.
-		return *it->second.get();
+		m_onDone(a_complete);
 	}
 
-	return nullptr;
+	m_doneCondition.notify_all();
 }
 
 
-int CNFORenderer::GetStripeHeight(size_t a_stripe) const
+bool CNFORenderer::IsRenderingCancelled() const
 {
-	int l_height = m_stripeHeight;
+	return m_cancelRenderingImmediately.load(std::memory_order_relaxed)
+		|| (s_currentRequest != nullptr && s_currentRequest->IsCancelled());
+}
 
-	if (a_stripe == 0)
-		l_height += GetPadding();
 
-	if (a_stripe == m_numStripes - 1)
-		l_height += GetPadding();
+bool CNFORenderer::IsRenderingCancelled(size_t& ar_numCalls) const
+{
+	if (ar_numCalls == (size_t)-1)
+	{
+		return true;
+	}
+	else if (++ar_numCalls % ms_cancelCheckCells != 0 || !IsRenderingCancelled())
+	{
+		return false;
+	}
 
-	return l_height;
+	ar_numCalls = (size_t)-1;
+
+	return true;
 }
 
 
-// adds some more pixels that allow the blur effect to be rendered without
-// issues on the lower and upper edges.
-int CNFORenderer::GetStripeHeightPhysical(size_t a_stripe) const
+std::function<bool()> CNFORenderer::GetCancelCheck() const
 {
-	if (IsClassicMode() || m_numStripes < 2)
-		return GetStripeHeight(a_stripe);
-	else if (a_stripe == 0)
-		return GetStripeHeightExtraBottom(a_stripe) + GetStripeHeight(a_stripe);
-	else if (a_stripe == m_numStripes - 1)
-		return GetStripeHeightExtraTop(a_stripe) + GetStripeHeight(a_stripe);
-	else
-		return GetStripeHeightExtraTop(a_stripe) + GetStripeHeightExtraBottom(a_stripe) + GetStripeHeight(a_stripe);
+	// s_currentRequest belongs to the calling thread:
+	const CNFORenderRequest* l_request = s_currentRequest;
+
+	return [this, l_request]() {
+		return m_cancelRenderingImmediately.load(std::memory_order_relaxed)
+			|| (l_request != nullptr && l_request->IsCancelled());
+	};
 }
 
 
-int CNFORenderer::GetStripeHeightExtraTop(size_t a_stripe) const
+PNFORenderRequest CNFORenderer::RenderAsync(int a_x, int a_y, int a_width, int a_height,
+	const NFORendererAreaReadyCallback& a_onAreaReady, const NFORendererRequestDoneCallback& a_onDone)
 {
-	return static_cast<int>(GetStripeExtraLinesTop(a_stripe) * GetBlockHeight());
-}
+	if (!PrepareStripes())
+	{
+		return nullptr;
+	}
 
+	// from now on, DrawToSurface uses what's there:
+	m_rendered = true;
 
-int CNFORenderer::GetStripeHeightExtraBottom(size_t a_stripe) const
-{
-	return static_cast<int>(GetStripeExtraLinesBottom(a_stripe) * GetBlockHeight());
-}
+	size_t l_firstStripe, l_lastStripe, l_firstTile, l_lastTile;
 
+	GetSlotRange(a_x, a_y, a_width, a_height, l_firstStripe, l_lastStripe, l_firstTile, l_lastTile);
 
-size_t CNFORenderer::GetStripeExtraLinesTop(size_t a_stripe) const
-{
-	if (IsClassicMode() || !GetEnableGaussShadow() || a_stripe == 0)
-		return 0;
+	PNFORenderRequest l_request = std::make_shared<CNFORenderRequest>(a_onAreaReady, a_onDone);
 
-	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockHeight())));
-}
+	for (size_t l_stripe = l_firstStripe; l_stripe <= l_lastStripe; l_stripe++)
+	{
+		for (size_t l_tile = l_firstTile; l_tile <= l_lastTile; l_tile++)
+		{
+			l_request->m_pendingSlots.push_back(GetSlot(l_stripe, l_tile));
+		}
+	}
 
+	l_request->m_numTiles = l_request->m_numTilesLeft = l_request->m_pendingSlots.size();
 
-size_t CNFORenderer::GetStripeExtraLinesBottom(size_t a_stripe) const
-{
-	if (IsClassicMode() || !GetEnableGaussShadow() || a_stripe == m_numStripes - 1)
-		return 0;
+	const std::vector<size_t> l_slots = l_request->m_pendingSlots;
 
-	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockHeight())));
-}
+	// register first, so that no FinishStripe call can slip through between checking and waiting:
+	{
+		std::lock_guard<std::mutex> l_lock(m_requestsLock);
 
+		m_requests.push_back(l_request);
+	}
 
-void CNFORenderer::RenderStripe(size_t a_stripe) const
-{
-	cairo_surface_t * const l_surface = GetStripeSurface(a_stripe);
+	for (size_t l_slot : l_slots)
+	{
+		if (m_stripes[l_slot].state.load(std::memory_order_acquire) == SS_READY)
+		{
+			if (m_onDemandRendering)
+			{
+				CStripeCache::GetInstance().Touch(this, l_slot);
+			}
 
-	_ASSERT(l_surface != nullptr);
+			NotifyRequests(l_slot, l_request.get());
+		}
+		else
+		{
+			SubmitRequestStripe(l_slot, l_request);
+		}
+	}
 
-	if ((!m_hasBlocks || m_classic) && GetBackColor().A > 0)
+	if (m_onDemandRendering)
 	{
-		cairo_t* cr = cairo_create(l_surface);
-		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
-		cairo_paint(cr);
-		cairo_destroy(cr);
+		// make room, but never throw out what has been requested:
+		CStripeCache::GetInstance().Trim(this, GetSlot(l_firstStripe, 0), GetSlot(l_lastStripe, m_numTileCols - 1));
 	}
 
-	// hacke-di-hack (RenderClassic is adding GetPadding() for historical reasons, so we have to subtract it beforehand.
-	// it's also operating on the full NFO image's coordinates, so we have to subtract those too):
-	double l_baseY = (a_stripe == 0 ? 0 : -GetPadding() - (double)a_stripe * m_stripeHeight) + GetStripeHeightExtraTop(a_stripe);
-	size_t l_rowStart = (m_numStripes > 1 ? a_stripe * m_linesPerStripe - GetStripeExtraLinesTop(a_stripe) : (size_t)-1),
-		l_rowEnd = a_stripe * m_linesPerStripe + m_linesPerStripe + GetStripeExtraLinesBottom(a_stripe);
+	return l_request;
+}
 
-	if (m_classic)
+
+/**
+ * Renders a_slot on behalf of a_request, unless someone else is working on it already.
+ **/
+void CNFORenderer::SubmitRequestStripe(size_t a_slot, const PNFORenderRequest& a_request)
+{
+	bool l_unpack = false;
+
+	// FinishStripe lets the request know when whoever holds the stripe is done with it:
+	if (!ClaimStripe(a_slot, &l_unpack))
 	{
-		RenderClassic(GetTextColor(), nullptr, GetHyperLinkColor(),
-			false,
-			l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
-			l_surface, 0, l_baseY);
+		return;
 	}
-	else
+
+	if (m_onDemandRendering)
 	{
-		if (m_hasBlocks && GetEnableGaussShadow() && ((m_partial & NRP_RENDER_BLOCKS) != 0 || (m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0))
-		{
-			if ((m_partial & NRP_RENDER_GAUSS_SHADOW) != 0)
-			{
-				auto p_blur = std::make_shared<CCairoBoxBlur>(
-					(int)GetWidth(), GetStripeHeightPhysical(a_stripe),
-					(int)GetGaussBlurRadius(), ms_useGPU && !m_forceGPUOff);
-				p_blur->SetAllowFallback(m_allowCPUFallback);
+		CStripeCache::GetInstance().CountMiss(l_unpack);
+	}
 
-				cairo_t* cr = cairo_create(l_surface);
+	CRenderPool::GetInstance().Submit(this, RP_VISIBLE, [this, a_slot, l_unpack, a_request] {
+		s_currentRequest = a_request.get();
 
-				RenderBackgrounds(l_rowStart, l_rowEnd, l_baseY, cr);
+		if (l_unpack)
+			UnpackStripe(a_slot);
+		else
+			RenderStripe(a_slot);
 
-				// shadow effect:
-				if (!m_cancelRenderingImmediately)
-				{
-					RenderStripeBlocks(a_stripe, false, true, p_blur->GetContext());
+		FinishStripe(a_slot);
 
-					// important when running in CPU fallback mode only:
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetGaussColor()));
+		s_currentRequest = nullptr;
+	});
+}
 
-					if (!p_blur->Paint(cr) && p_blur->IsFallbackAllowed())
-					{
-						// retry once.
 
-						RenderStripeBlocks(a_stripe, false, true, p_blur->GetContext());
+/**
+ * Tells the requests that are waiting for a_slot (or just a_only) that it's done.
+ * Stripes that have been cancelled are submitted again for requests that still want them.
+ **/
+void CNFORenderer::NotifyRequests(size_t a_slot, const CNFORenderRequest* a_only)
+{
+	const bool l_ready = (m_stripes[a_slot].state.load(std::memory_order_acquire) == SS_READY);
+	std::vector<PNFORenderRequest> l_notify, l_retry;
 
-						// important when running in CPU fallback mode only:
-						cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetGaussColor()));
+	{
+		std::lock_guard<std::mutex> l_lock(m_requestsLock);
 
-						p_blur->Paint(cr);
-					}
-				}
+		for (auto it = m_requests.begin(); it != m_requests.end(); )
+		{
+			CNFORenderRequest& l_request = **it;
+			const auto l_pos = std::find(l_request.m_pendingSlots.begin(), l_request.m_pendingSlots.end(), a_slot);
 
-				cairo_destroy(cr);
+			if ((a_only && &l_request != a_only) || l_pos == l_request.m_pendingSlots.end())
+			{
+				++it;
 			}
-
-			if ((m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0 && (m_partial & NRP_RENDER_GAUSS_SHADOW) == 0 && !m_cancelRenderingImmediately)
+			else if (!l_ready && !l_request.IsCancelled())
 			{
-				// render blocks in gaussian color
-				RenderStripeBlocks(a_stripe, false, true);
+				l_retry.push_back(*it);
+				++it;
 			}
-			else if ((m_partial & NRP_RENDER_BLOCKS) != 0 && !m_cancelRenderingImmediately)
+			else
 			{
-				// normal mode
-				RenderStripeBlocks(a_stripe, false, false);
+				l_request.m_pendingSlots.erase(l_pos);
+				l_notify.push_back(*it);
+
+				// cancelled requests are done as soon as any of their stripes comes back:
+				it = (l_request.m_pendingSlots.empty() || l_request.IsCancelled() ? m_requests.erase(it) : it + 1);
 			}
 		}
-		else if (m_hasBlocks && (m_partial & NRP_RENDER_BLOCKS) != 0 && !m_cancelRenderingImmediately)
+	}
+
+	for (const PNFORenderRequest& l_request : l_notify)
+	{
+		std::lock_guard<std::mutex> l_lock(l_request->m_callbackLock);
+
+		if (l_request->m_done)
 		{
-			RenderStripeBlocks(a_stripe, true, false);
+			continue;
 		}
 
-		if ((m_partial & NRP_RENDER_TEXT) != 0 && !m_cancelRenderingImmediately)
+		if (l_ready)
 		{
-			RenderText(GetTextColor(), nullptr, GetHyperLinkColor(),
-				l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
-				l_surface, 0, l_baseY);
+			l_request->m_numTilesReady++;
+
+			if (l_request->m_onAreaReady && !l_request->IsCancelled())
+			{
+				int l_x, l_y, l_width, l_height;
+
+				GetSlotArea(a_slot, l_x, l_y, l_width, l_height);
+
+				l_request->m_onAreaReady(l_x, l_y, l_width, l_height);
+			}
+		}
+
+		if (--l_request->m_numTilesLeft == 0 || l_request->IsCancelled())
+		{
+			l_request->Finish(l_request->m_numTilesReady == l_request->m_numTiles);
 		}
 	}
+
+	for (const PNFORenderRequest& l_request : l_retry)
+	{
+		SubmitRequestStripe(a_slot, l_request);
+	}
 }
 
 
-void CNFORenderer::RenderBackgrounds(size_t a_rowStart, size_t a_rowEnd, double a_yBase, cairo_t* cr) const
+/**
+ * Cancels all requests, their done callbacks report false right away.
+ **/
+void CNFORenderer::AbortRequests()
 {
-	cairo_save(cr);
+	std::vector<PNFORenderRequest> l_requests;
 
-	if (GetBackColor().A > 0)
 	{
-		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
-		cairo_paint(cr);
+		std::lock_guard<std::mutex> l_lock(m_requestsLock);
+
+		l_requests.swap(m_requests);
 	}
 
-	if (m_nfo->HasColorMap())
+	for (const PNFORenderRequest& l_request : l_requests)
 	{
-		double dbw = static_cast<double>(GetBlockWidth());
-		double dbh = static_cast<double>(GetBlockHeight());
-		uint32_t l_defaultColor = GetBackColor().AsWord();
+		l_request->Cancel();
 
-		for (size_t row = (a_rowStart == -1 ? 0 : a_rowStart); row <= a_rowEnd; row++)
+		std::lock_guard<std::mutex> l_lock(l_request->m_callbackLock);
+
+		if (!l_request->m_done)
 		{
-			std::vector<size_t> l_columns;
-			std::vector<uint32_t> l_colors;
+			l_request->Finish(false);
+		}
+	}
+}
 
-			if (!m_nfo->GetColorMap()->GetLineBackgrounds(row, l_defaultColor, m_gridData->GetCols(), l_columns, l_colors))
-				continue;
 
-			_ASSERT(l_colors.size() == l_columns.size());
-			_ASSERT(l_columns.size() > 0);
+/**
+ * Stripes and tiles that cover the given area of the image, confined to the document.
+ **/
+void CNFORenderer::GetSlotRange(int a_x, int a_y, int a_width, int a_height,
+	size_t& ar_stripeFrom, size_t& ar_stripeTo, size_t& ar_tileFrom, size_t& ar_tileTo) const
+{
+	const int l_padding = GetPadding();
+	const int l_tileWidth = std::max(static_cast<int>(m_colsPerTile * GetBlockWidth()), 1);
 
-			size_t col = 0;
+	auto l_confine = [](int a_index, size_t a_count) {
+		return std::min(static_cast<size_t>(std::max(a_index, 0)), a_count - 1);
+	};
 
-			for (size_t section = 0; section < l_colors.size(); section++)
-			{
-				_ASSERT(l_columns[section] > 0);
-				_ASSERT(l_columns[section] <= m_gridData->GetCols());
+	ar_stripeFrom = l_confine((a_y - l_padding) / m_stripeHeight, m_numStripes); // implicit floor()
+	ar_stripeTo = l_confine((a_y + a_height - l_padding) / m_stripeHeight, m_numStripes);
+	ar_tileFrom = l_confine(std::max(a_x - l_padding, 0) / l_tileWidth, m_numTileCols);
+	ar_tileTo = l_confine((a_x + a_width - l_padding) / l_tileWidth, m_numTileCols);
+}
 
-				size_t col_to = col + l_columns[section];
 
-				_ASSERT(col_to > col);
+/**
+ * The part of the image that a_slot's stripe or tile is drawn to, without the extra pixels around it.
+ **/
+void CNFORenderer::GetSlotArea(size_t a_slot, int& ar_x, int& ar_y, int& ar_width, int& ar_height) const
+{
+	const size_t l_stripe = GetSlotStripe(a_slot), l_tile = GetSlotTile(a_slot);
+	const int l_top = (l_stripe == 0 ? 0 : static_cast<int>(l_stripe) * m_stripeHeight + GetPadding()),
+		l_bottom = (l_stripe == m_numStripes - 1 ? static_cast<int>(GetHeight()) : static_cast<int>(l_stripe + 1) * m_stripeHeight + GetPadding());
+
+	ar_x = GetTileX(l_tile);
+	ar_y = l_top;
+	ar_width = GetTileWidth(l_tile);
+	ar_height = l_bottom - l_top;
+}
 
-				if (l_colors[section] != l_defaultColor)
-				{
-					double x_from = col * dbw, x_to = col_to * dbw;
 
-					cairo_set_source_rgb(cr, S_COLOR_T_CAIRO(S_COLOR_T(l_colors[section])));
+void CNFORenderer::CalcStripeDimensions()
+{
+	if (!m_nfo || !m_gridData)
+	{
+		return;
+	}
 
-					cairo_rectangle(cr, GetPadding() + x_from, a_yBase + GetPadding() + dbh * row, x_to - x_from, dbh);
+	// 2 CPU cores <=> 2000 px stripe height
+	// ==> 8 CPU cores <=> 250
+	// (= more threads)
+	// but: never use less than 500px per stripe.
+	size_t l_stripeHeightMaxForCores = std::max(2000 * 2 / omp_get_num_procs(), 500);
 
-					cairo_fill(cr);
-				}
+	size_t l_stripeHeightMax = std::max(l_stripeHeightMaxForCores, GetBlockHeight() * 2); // MUST not be smaller than one line's height, using two for sanity
 
-				col = col_to;
-			}
-		}
+	size_t l_numStripes = GetHeight() / l_stripeHeightMax; // implicit floor()
+	if (l_numStripes == 0) l_numStripes = 1;
+	size_t l_linesPerStripe = m_nfo->GetGridHeight() / l_numStripes; // implicit floor()
+
+	while (l_linesPerStripe * l_numStripes < m_nfo->GetGridHeight())
+	{
+		// correct rounding errors
+		l_numStripes++;
 	}
 
-	cairo_restore(cr);
-}
+	// storing these three is a bit redundant, but saves code & calculations in other places:
+	m_linesPerStripe = l_linesPerStripe;
+	m_stripeHeight = static_cast<int>(l_linesPerStripe * GetBlockHeight());
+	m_numStripes = l_numStripes;
 
+	// tiles span whole blocks, just like stripes:
+	const size_t l_gridWidth = std::max(m_nfo->GetGridWidth(), (size_t)1);
 
-/************************************************************************/
-/* RENDER BLOCKS                                                        */
-/************************************************************************/
+	m_colsPerTile = (m_tiledRendering ? std::max(ms_tileWidth / std::max(GetBlockWidth(), (size_t)1), (size_t)1) : l_gridWidth);
+	m_colsPerTile = std::min(m_colsPerTile, l_gridWidth);
+	m_numTileCols = (l_gridWidth + m_colsPerTile - 1) / m_colsPerTile;
 
-void CNFORenderer::RenderStripeBlocks(size_t a_stripe, bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context) const
-{
-	cairo_t* l_context = (a_context ? a_context : cairo_create(GetStripeSurface(a_stripe)));
+	_ASSERT(!m_stripes);
+	m_stripes.reset(new SStripeSlot[GetNumSlots()]);
 
-	RenderBlocks(a_opaqueBg, a_gaussStep, l_context,
-		(m_numStripes > 1 ? a_stripe * m_linesPerStripe - GetStripeExtraLinesTop(a_stripe) : (size_t)-1),
-		a_stripe * m_linesPerStripe + m_linesPerStripe + GetStripeExtraLinesBottom(a_stripe),
-		// see comment in RenderStripe():
-		0, (a_stripe == 0 ? 0 : -GetPadding() - (double)a_stripe * m_stripeHeight) + GetStripeHeightExtraTop(a_stripe));
+	_ASSERT(m_stripeHeight * m_numStripes + GetPadding() * 2 >= GetHeight());
+}
 
-	if (!a_context)
+
+// wrapper that we can use in const situations:
+cairo_surface_t *CNFORenderer::GetStripeSurface(size_t a_slot) const
+{
+	if (!m_stripes || a_slot >= GetNumSlots())
 	{
-		cairo_destroy(l_context);
+		return nullptr;
 	}
+
+	// the actual surface is not really const, but that's safe because a stripe
+	// can only be claimed by one thread at a time, see ClaimStripe().
+	return m_stripes[a_slot].surface.load(std::memory_order_acquire);
 }
 
-void CNFORenderer::RenderBlocks(bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context,
-	size_t a_rowStart, size_t a_rowEnd, double a_xBase, double a_yBase) const
+
+/**
+ * Turns palette indexes back into ARGB32 pixels, a_count per row.
+ **/
+static void _ExpandPaletteRows(const unsigned char* a_src, int a_srcStride, const std::vector<uint32_t>& a_palette,
+	unsigned char* a_dest, int a_destStride, int a_count, int a_rows)
 {
-	double l_off_x = GetPadding() + a_xBase, l_off_y = GetPadding() + a_yBase;
+	const uint32_t* const l_palette = a_palette.data();
 
-	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
-	if (a_rowStart != (size_t)-1)
+	for (int y = 0; y < a_rows; y++)
 	{
-		l_rowStart = std::max(a_rowStart, l_rowStart);
-		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+		const unsigned char* l_src = a_src + y * a_srcStride;
+		uint32_t* l_dest = reinterpret_cast<uint32_t*>(a_dest + y * a_destStride);
+
+		for (int x = 0; x < a_count; x++)
+		{
+			l_dest[x] = l_palette[l_src[x]];
+		}
 	}
+}
 
-	cairo_t * const cr = a_context;
-	cairo_save(cr);
 
-	if (a_opaqueBg)
-	{
-		RenderBackgrounds(l_rowStart, l_rowEnd, a_yBase, cr);
+cairo_surface_t *CNFORenderer::GetStripeSurfaceARGB(size_t a_slot, int a_x, int a_y, int a_width, int a_height, int& ar_x, int& ar_y) const
+{
+	cairo_surface_t* l_surface = GetStripeSurface(a_slot);
+
+	ar_x = ar_y = 0;
+
+	if (!l_surface || m_stripes[a_slot].palette.empty())
+	{
+		return (l_surface ? cairo_surface_reference(l_surface) : nullptr);
 	}
 
-	cairo_set_antialias(cr, CAIRO_ANTIALIAS_SUBPIXEL);
+	const int l_surfaceWidth = cairo_image_surface_get_width(l_surface),
+		l_surfaceHeight = cairo_image_surface_get_height(l_surface);
 
-	bool l_hasColorMap = m_nfo->HasColorMap();
-	int l_oldAlpha = 0;
-	uint32_t l_oldColor = 0;
-	bool l_first = true;
+	// only expand what is going to be painted:
+	ar_x = std::max(0, std::min(a_x, l_surfaceWidth));
+	ar_y = std::max(0, std::min(a_y, l_surfaceHeight));
 
-	// micro optimization
-	const double bwd = static_cast<double>(GetBlockWidth());
-	const double bhd = static_cast<double>(GetBlockHeight());
-	const double bwd05 = bwd * 0.5;
-	const double bhd05 = bhd * 0.5;
+	const int l_width = std::max(1, std::min(a_width, l_surfaceWidth - ar_x)),
+		l_height = std::max(1, std::min(a_height, l_surfaceHeight - ar_y));
 
-	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	cairo_surface_t* l_argb = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, l_width, l_height);
+
+	if (ar_x + l_width <= l_surfaceWidth && ar_y + l_height <= l_surfaceHeight)
 	{
-		if (m_cancelRenderingImmediately)
-		{
-			break;
-		}
+		const int l_srcStride = cairo_image_surface_get_stride(l_surface);
 
-		for (size_t col = 0; col < m_gridData->GetCols(); col++)
-		{
-			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+		cairo_surface_flush(l_argb);
 
-			if (l_block.shape == RGS_NO_BLOCK ||
-				l_block.shape == RGS_WHITESPACE ||
-				l_block.shape == RGS_WHITESPACE_IN_TEXT)
-			{
-				continue;
-			}
+		_ExpandPaletteRows(cairo_image_surface_get_data(l_surface) + ar_y * l_srcStride + ar_x, l_srcStride,
+			m_stripes[a_slot].palette, cairo_image_surface_get_data(l_argb), cairo_image_surface_get_stride(l_argb),
+			l_width, l_height);
 
-			S_COLOR_T l_drawingColor = a_gaussStep ? GetGaussColor() : GetArtColor();
+		cairo_surface_mark_dirty(l_argb);
+	}
 
-			if (l_hasColorMap)
-			{
-				uint32_t clr;
+	return l_argb;
+}
 
-				m_nfo->GetColorMap()->GetForegroundColor(row, col, l_drawingColor.AsWord(), clr);
 
-				l_drawingColor = S_COLOR_T(clr);
-			}
+int CNFORenderer::GetStripeHeight(size_t a_stripe) const
+{
+	int l_height = m_stripeHeight;
 
-			if (l_first
-				|| (l_block.alpha != l_oldAlpha)  // R,G,B never change during the loop (unless there's a colormap)
-				|| (l_hasColorMap && l_drawingColor != l_oldColor)
-				) {
-				cairo_fill(cr); // complete previous drawing operation(s)
+	if (a_stripe == 0)
+		l_height += GetPadding();
 
-				cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(l_drawingColor), (l_block.alpha / 255.0) * (l_drawingColor.A / 255.0));
+	if (a_stripe == m_numStripes - 1)
+		l_height += GetPadding();
 
-				// known issue: Alpha from GetGauss/ArtColor is discarded if there's a colormap.
+	return l_height;
+}
 
-				l_oldAlpha = l_block.alpha;
-				l_oldColor = l_drawingColor.AsWord();
-				l_first = false;
-			}
 
-			double l_pos_x = col * bwd, l_pos_y = row * bhd, l_width = bwd, l_height = bhd;
+// adds some more pixels that allow the blur effect to be rendered without
+// issues on the lower and upper edges.
+int CNFORenderer::GetStripeHeightPhysical(size_t a_stripe) const
+{
+	if (IsClassicMode() || m_numStripes < 2)
+		return GetStripeHeight(a_stripe);
+	else if (a_stripe == 0)
+		return GetStripeHeightExtraBottom(a_stripe) + GetStripeHeight(a_stripe);
+	else if (a_stripe == m_numStripes - 1)
+		return GetStripeHeightExtraTop(a_stripe) + GetStripeHeight(a_stripe);
+	else
+		return GetStripeHeightExtraTop(a_stripe) + GetStripeHeightExtraBottom(a_stripe) + GetStripeHeight(a_stripe);
+}
 
-			switch (l_block.shape)
-			{
-			case RGS_BLOCK_LOWER_HALF:
-				l_pos_y += bhd05;
-			case RGS_BLOCK_UPPER_HALF:
-				l_height = bhd05;
-				break;
-			case RGS_BLOCK_RIGHT_HALF:
-				l_pos_x += bwd05;
-			case RGS_BLOCK_LEFT_HALF:
-				l_width = bwd05;
-				break;
-			case RGS_BLACK_SQUARE:
-				l_width = l_height = bwd * 0.75;
-				l_pos_y += bhd05 - l_height * 0.5;
-				l_pos_x += bwd05 - l_width * 0.5;
-				break;
-			case RGS_BLACK_SMALL_SQUARE:
-				l_width = l_height = bwd05;
-				l_pos_y += bhd05 - l_height * 0.5;
-				l_pos_x += bwd05 - l_width * 0.5;
-				break;
-			}
 
-			cairo_rectangle(cr, l_off_x + l_pos_x, l_off_y + l_pos_y, l_width, l_height);
-		}
+/**
+ * The glow mask consists of whole blocks (or halves), so rendering it at
+ * one pixel per block loses nothing that survives a wide enough blur.
+ **/
+int CNFORenderer::GetGlowDownscale() const
+{
+	if (!m_reducedGlow)
+	{
+		return 1;
 	}
 
-	cairo_fill(cr); // complete pending drawing operation(s)
+	const size_t l_blockSize = std::min(GetBlockWidth(), GetBlockHeight());
 
-	cairo_restore(cr);
+	return std::max(std::min(CCairoBoxBlur::GetMaxDownscale((int)GetGaussBlurRadius()), static_cast<int>(l_blockSize)), 1);
 }
 
 
-/************************************************************************/
-/* Utilities for RenderText and RenderClassic                           */
-/************************************************************************/
+int CNFORenderer::GetStripeHeightExtraTop(size_t a_stripe) const
+{
+	return static_cast<int>(GetStripeExtraLinesTop(a_stripe) * GetBlockHeight());
+}
 
-void CNFORenderer::_FixUpRowColStartEnd(size_t& a_rowStart, size_t& a_colStart, size_t& a_rowEnd, size_t& a_colEnd)
+
+int CNFORenderer::GetStripeHeightExtraBottom(size_t a_stripe) const
 {
-	if (a_rowStart != (size_t)-1)
-	{
-		if (a_rowEnd < a_rowStart)
-		{
-			size_t tmp = a_rowStart; a_rowStart = a_rowEnd; a_rowEnd = tmp;
-			tmp = a_colStart; a_colStart = a_colEnd; a_colEnd = tmp;
-		}
-		else if (a_rowEnd == a_rowStart && a_colStart > a_colEnd)
-		{
-			size_t tmp = a_colStart; a_colStart = a_colEnd; a_colEnd = tmp;
-		}
-	}
+	return static_cast<int>(GetStripeExtraLinesBottom(a_stripe) * GetBlockHeight());
 }
 
-static inline void _SetUpHyperLinkUnderlining(const CNFORenderer* r, cairo_t* cr)
+
+size_t CNFORenderer::GetStripeExtraLinesTop(size_t a_stripe) const
 {
-	if (r->GetHilightHyperLinks() && r->GetUnderlineHyperLinks())
-	{
-		cairo_set_line_width(cr, 1);
-		cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE); // looks better
-	}
+	if (IsClassicMode() || !GetEnableGaussShadow() || a_stripe == 0)
+		return 0;
+
+	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockHeight())));
 }
 
-static inline void _SetUpDrawingTools(const CNFORenderer* r, cairo_surface_t* a_surface, cairo_t** pcr, cairo_font_options_t** pcfo)
+
+size_t CNFORenderer::GetStripeExtraLinesBottom(size_t a_stripe) const
 {
-	cairo_t* cr = cairo_create(a_surface);
+	if (IsClassicMode() || !GetEnableGaussShadow() || a_stripe == m_numStripes - 1)
+		return 0;
 
-	cairo_font_options_t *cfo = cairo_font_options_create();
+	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockHeight())));
+}
 
-	cairo_font_options_set_antialias(cfo, (r->GetFontAntiAlias() ? CAIRO_ANTIALIAS_SUBPIXEL : CAIRO_ANTIALIAS_NONE));
-	// not sure anymore about the rational behind this logic:
-	cairo_font_options_set_hint_style(cfo, (r->IsClassicMode() ? CAIRO_HINT_STYLE_DEFAULT : CAIRO_HINT_STYLE_NONE));
-	cairo_font_options_set_hint_metrics(cfo, (r->IsClassicMode() || r->GetFontBold() ? CAIRO_HINT_METRICS_ON : CAIRO_HINT_METRICS_OFF));
 
-	const std::string l_font
-#ifdef _UNICODE
-		= CUtil::FromWideStr(r->GetFontFace(), CP_UTF8);
-#else
-		= r->GetFontFace();
-#endif
-	cairo_select_font_face(cr, l_font.c_str(), CAIRO_FONT_SLANT_NORMAL,
-		r->GetFontBold() ? CAIRO_FONT_WEIGHT_BOLD : CAIRO_FONT_WEIGHT_NORMAL);
-	cairo_set_font_options(cr, cfo);
+int CNFORenderer::GetTileX(size_t a_tile) const
+{
+	return (a_tile == 0 ? 0 : GetPadding() + static_cast<int>(a_tile * m_colsPerTile * GetBlockWidth()));
+}
 
-	if (r->IsClassicMode())
-	{
-		cairo_set_font_size(cr, static_cast<double>(r->GetFontSize()));
-	}
 
-	*pcr = cr;
-	*pcfo = cfo;
+int CNFORenderer::GetTileWidth(size_t a_tile) const
+{
+	const size_t l_cols = std::min(m_colsPerTile, m_nfo->GetGridWidth() - a_tile * m_colsPerTile);
+	int l_width = static_cast<int>(l_cols * GetBlockWidth());
+
+	if (a_tile == 0)
+		l_width += GetPadding();
+
+	if (a_tile == m_numTileCols - 1)
+		l_width += GetPadding();
+
+	return l_width;
 }
 
-static inline void _FinalizeDrawingTools(cairo_t** pcr, cairo_font_options_t** pcfo)
+
+// the left and right edges of tiles need extra pixels for the blur effect,
+// just like the upper and lower edges of stripes.
+int CNFORenderer::GetTileWidthPhysical(size_t a_tile) const
 {
-	cairo_font_options_destroy(*pcfo);
-	*pcfo = nullptr;
+	return GetTileWidthExtraLeft(a_tile) + GetTileWidth(a_tile) + GetTileWidthExtraRight(a_tile);
+}
 
-	cairo_destroy(*pcr);
-	*pcr = nullptr;
+
+int CNFORenderer::GetTileWidthExtraLeft(size_t a_tile) const
+{
+	return static_cast<int>(GetTileExtraColsLeft(a_tile) * GetBlockWidth());
 }
 
 
-/************************************************************************/
-/* RENDER TEXT                                                          */
-/************************************************************************/
+int CNFORenderer::GetTileWidthExtraRight(size_t a_tile) const
+{
+	return static_cast<int>(GetTileExtraColsRight(a_tile) * GetBlockWidth());
+}
 
-void CNFORenderer::PreRenderText()
+
+size_t CNFORenderer::GetTileExtraColsLeft(size_t a_tile) const
 {
-	if (m_classic || m_fontSize > 0)
+	if (IsClassicMode() || !GetEnableGaussShadow() || a_tile == 0)
+		return 0;
+
+	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockWidth())));
+}
+
+
+size_t CNFORenderer::GetTileExtraColsRight(size_t a_tile) const
+{
+	if (IsClassicMode() || !GetEnableGaussShadow() || a_tile == m_numTileCols - 1)
+		return 0;
+
+	return static_cast<size_t>(ceil(static_cast<double>(GetGaussBlurRadius()) / static_cast<double>(GetBlockWidth())));
+}
+
+
+void CNFORenderer::GetTileTextColumns(size_t a_tile, size_t& ar_colStart, size_t& ar_colLimit) const
+{
+	if (m_numTileCols < 2)
 	{
+		ar_colStart = 0;
+		ar_colLimit = (size_t)-1;
 		return;
 	}
 
-	// create a dummy surface so we can measure things:
-	cairo_surface_t *l_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 100, 30);
-	cairo_t* cr;
-	cairo_font_options_t* l_fontOptions;
+	// plus one column on each side, for glyphs that reach into the neighbouring tiles:
+	const size_t l_first = a_tile * m_colsPerTile;
 
-	_SetUpDrawingTools(this, l_surface, &cr, &l_fontOptions);
+	ar_colStart = (l_first > 0 ? l_first - 1 : 0);
+	ar_colLimit = l_first + m_colsPerTile + 1;
+}
 
-	double l_fontSize = static_cast<double>(GetBlockWidth());
-	bool l_broken = false, l_foundText = false;
 
-	std::set<wchar_t> l_checkChars;
+void CNFORenderer::RenderStripe(size_t a_slot) const
+{
+	cairo_surface_t * const l_surface = GetStripeSurface(a_slot);
 
-	for (size_t row = 0; row < m_gridData->GetRows() && !l_broken; row++)
+	_ASSERT(l_surface != nullptr);
+
+	if (UseColorLayers())
 	{
-		for (size_t col = 0; col < m_gridData->GetCols() && !l_broken; col++)
-		{
-			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+		RenderStripeLayers(a_slot);
 
-			if (l_block.shape == RGS_NO_BLOCK)
-			{
-				l_checkChars.insert(m_nfo->GetGridChar(row, col));
-			}
+		if (!IsRenderingCancelled())
+		{
+			CompositeStripe(a_slot);
 		}
+
+		return;
 	}
 
-	if (l_checkChars.size() > 0)
+	if ((!m_hasBlocks || m_classic) && GetBackColor().A > 0)
 	{
-		// add some generic "big" chars for NFOs that e.g.
-		// contain nothing but dots or middots:
-		l_checkChars.insert(L'W');
-		l_checkChars.insert(L'M');
+		cairo_t* cr = cairo_create(l_surface);
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
+		cairo_paint(cr);
+		cairo_destroy(cr);
+	}
 
-		// calculate font size that fits into blocks of the given size:
-		do
-		{
-			cairo_set_font_size(cr, l_fontSize + 1);
+	const size_t l_stripe = GetSlotStripe(a_slot), l_tile = GetSlotTile(a_slot);
+
+	// hacke-di-hack (RenderClassic is adding GetPadding() for historical reasons, so we have to subtract it beforehand.
+	// it's also operating on the full NFO image's coordinates, so we have to subtract those too):
+	double l_baseY = (l_stripe == 0 ? 0 : -GetPadding() - (double)l_stripe * m_stripeHeight) + GetStripeHeightExtraTop(l_stripe);
+	size_t l_rowStart = (m_numStripes > 1 ? l_stripe * m_linesPerStripe - GetStripeExtraLinesTop(l_stripe) : (size_t)-1),
+		l_rowEnd = l_stripe * m_linesPerStripe + m_linesPerStripe + GetStripeExtraLinesBottom(l_stripe);
+	// same for tiles, text is only laid out for the tile's columns:
+	double l_baseX = -GetTileX(l_tile) + GetTileWidthExtraLeft(l_tile);
+	size_t l_colStart, l_colLimit;
+
+	GetTileTextColumns(l_tile, l_colStart, l_colLimit);
 
-			for (wchar_t checkChar : l_checkChars)
+	if (m_classic)
+	{
+		RenderClassic(GetTextColor(), nullptr, GetHyperLinkColor(),
+			false,
+			l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+			l_surface, l_baseX, l_baseY, nullptr, l_colStart, l_colLimit);
+	}
+	else
+	{
+		if (m_hasBlocks && GetEnableGaussShadow() && ((m_partial & NRP_RENDER_BLOCKS) != 0 || (m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0))
+		{
+			if ((m_partial & NRP_RENDER_GAUSS_SHADOW) != 0)
 			{
-				cairo_text_extents_t l_extents{};
+				auto p_blur = std::make_shared<CCairoBoxBlur>(
+					GetTileWidthPhysical(l_tile), GetStripeHeightPhysical(l_stripe),
+					(int)GetGaussBlurRadius(), ms_useGPU && !m_forceGPUOff, GetGlowDownscale());
+				p_blur->SetAllowFallback(m_allowCPUFallback);
+				p_blur->SetCancelCheck(GetCancelCheck());
 
-				// measure the inked area of this glyph (char):
-				cairo_scaled_font_t *l_csf = cairo_get_scaled_font(cr);
-				cairo_glyph_t *l_glyphs = nullptr;
-				int l_numGlyphs = 0;
+				cairo_t* cr = cairo_create(l_surface);
 
-				const std::string utf8 = m_nfo->GetGridCharUtf8(checkChar);
+				RenderBackgrounds(l_rowStart, l_rowEnd, l_baseX, l_baseY, cr);
 
-				if (cairo_scaled_font_text_to_glyphs(l_csf, 0, 0, utf8.c_str(), -1,
-					&l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr) == CAIRO_STATUS_SUCCESS)
+				// shadow effect:
+				if (!IsRenderingCancelled())
 				{
-					cairo_scaled_font_glyph_extents(l_csf, l_glyphs, l_numGlyphs, &l_extents);
-					cairo_glyph_free(l_glyphs);
+					RenderStripeBlocks(a_slot, false, true, p_blur->GetContext());
+
+					// important when running in CPU fallback mode only:
+					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetGaussColor()));
 
-					// find char that covers the largest area...
-					if (l_extents.x_advance > GetBlockWidth() || l_extents.height > GetBlockHeight())
+					if (!p_blur->Paint(cr) && p_blur->IsFallbackAllowed() && !IsRenderingCancelled())
 					{
-						l_broken = true;
-					}
+						// retry once.
+
+						RenderStripeBlocks(a_slot, false, true, p_blur->GetContext());
 
-					l_foundText = true;
+						// important when running in CPU fallback mode only:
+						cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetGaussColor()));
+
+						p_blur->Paint(cr);
+					}
 				}
+
+				cairo_destroy(cr);
 			}
 
-			if (!l_broken)
+			if ((m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0 && (m_partial & NRP_RENDER_GAUSS_SHADOW) == 0 && !IsRenderingCancelled())
+			{
+				// render blocks in gaussian color
+				RenderStripeBlocks(a_slot, false, true);
+			}
+			else if ((m_partial & NRP_RENDER_BLOCKS) != 0 && !IsRenderingCancelled())
 			{
-				l_fontSize++;
+				// normal mode
+				RenderStripeBlocks(a_slot, false, false);
 			}
-		} while (!l_broken && l_foundText);
-	}
-
-	m_fontSize = l_fontSize + 1;
+		}
+		else if (m_hasBlocks && (m_partial & NRP_RENDER_BLOCKS) != 0 && !IsRenderingCancelled())
+		{
+			RenderStripeBlocks(a_slot, true, false);
+		}
 
-	_FinalizeDrawingTools(&cr, &l_fontOptions);
+		if ((m_partial & NRP_RENDER_TEXT) != 0 && !IsRenderingCancelled())
+		{
+			RenderText(GetTextColor(), nullptr, GetHyperLinkColor(),
+				l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+				l_surface, l_baseX, l_baseY, l_colStart, l_colLimit);
+		}
+	}
 }
 
-void CNFORenderer::RenderText(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
-	const S_COLOR_T& a_hyperLinkColor,
-	size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
-	cairo_surface_t* a_surface, double a_xBase, double a_yBase) const noexcept
+
+/**
+ * Renders a_slot's coverage masks, without any colors, for CompositeStripe.
+ * Text is anti-aliased in grayscale since A8 surfaces can't take subpixel coverage.
+ **/
+void CNFORenderer::RenderStripeLayers(size_t a_slot) const
 {
-	double l_off_x = a_xBase + GetPadding(), l_off_y = a_yBase + GetPadding();
+	SStripeSlot& l_slot = m_stripes[a_slot];
+	const size_t l_stripe = GetSlotStripe(a_slot), l_tile = GetSlotTile(a_slot);
+	const int l_width = GetTileWidthPhysical(l_tile), l_height = GetStripeHeightPhysical(l_stripe);
+	const S_COLOR_T l_opaque(0, 0, 0, 255), l_invisible(0, 0, 0, 0);
 
-	_FixUpRowColStartEnd(a_rowStart, a_colStart, a_rowEnd, a_colEnd);
+	auto l_newLayer = [&l_slot, l_width, l_height](EStripeLayer a_layer) {
+		return (l_slot.layers[a_layer] = cairo_image_surface_create(CAIRO_FORMAT_A8, l_width, l_height));
+	};
 
-	cairo_t* cr;
-	cairo_font_options_t* l_fontOptions;
-	_SetUpDrawingTools(this, a_surface, &cr, &l_fontOptions);
+	// see comment in RenderStripe():
+	double l_baseX = -GetTileX(l_tile) + GetTileWidthExtraLeft(l_tile),
+		l_baseY = (l_stripe == 0 ? 0 : -GetPadding() - (double)l_stripe * m_stripeHeight) + GetStripeHeightExtraTop(l_stripe);
+	size_t l_rowStart = (m_numStripes > 1 ? l_stripe * m_linesPerStripe - GetStripeExtraLinesTop(l_stripe) : (size_t)-1),
+		l_rowEnd = l_stripe * m_linesPerStripe + m_linesPerStripe + GetStripeExtraLinesBottom(l_stripe);
+	size_t l_colStart, l_colLimit;
 
-	_SetUpHyperLinkUnderlining(this, cr);
+	GetTileTextColumns(l_tile, l_colStart, l_colLimit);
 
-	// m_fontSize has been calculated by PreRenderText:
-	cairo_set_font_size(cr, m_fontSize);
+	// links go into a layer of their own, but only if there are any:
+	bool l_hasLinks = false;
 
-	if (m_fontSize < 4)
+	for (size_t row = (l_rowStart == (size_t)-1 ? 0 : l_rowStart); row <= l_rowEnd && GetHilightHyperLinks() && !l_hasLinks; row++)
 	{
-		// disable anti-alias to avoid colorful artifacts in low zoom levels:
-		cairo_font_options_set_antialias(l_fontOptions, CAIRO_ANTIALIAS_NONE);
-		cairo_set_font_options(cr, l_fontOptions);
+		l_hasLinks = !m_nfo->GetLinksForLine(row).empty();
 	}
 
-	// get general font info to vertically center chars into the blocks:
-	cairo_font_extents_t l_font_extents;
-	cairo_font_extents(cr, &l_font_extents);
+	l_slot.layered = true;
 
-	// determine ranges to draw (important for selection/highlights):
-	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
-	if (a_rowStart != (size_t)-1)
+	if (m_classic)
 	{
-		l_rowStart = std::max(a_rowStart, l_rowStart);
-		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
-	}
+		if ((m_partial & NRP_RENDER_TEXT) != 0)
+		{
+			RenderClassic(l_opaque, nullptr, l_hasLinks ? l_invisible : l_opaque, false,
+				l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+				l_newLayer(SL_TEXT), l_baseX, l_baseY, &l_invisible, l_colStart, l_colLimit);
 
-	// set main text color:
-	cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+			if (l_hasLinks && !IsRenderingCancelled())
+			{
+				RenderClassic(l_invisible, nullptr, l_opaque, false,
+					l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+					l_newLayer(SL_LINKS), l_baseX, l_baseY, &l_invisible, l_colStart, l_colLimit);
+			}
+		}
 
-	// get a scaled font reference from cr.
-	// remember this reference will become invalid as soon as cr does.
-	cairo_scaled_font_t *l_csf = cairo_get_scaled_font(cr);
+		if ((m_partial & NRP_RENDER_BLOCKS) != 0 && !IsRenderingCancelled())
+		{
+			RenderClassic(l_invisible, nullptr, l_invisible, false,
+				l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+				l_newLayer(SL_BLOCKS), l_baseX, l_baseY, &l_opaque, l_colStart, l_colLimit);
+		}
 
-	std::string l_utfBuf;
-	l_utfBuf.reserve(m_nfo->GetGridWidth());
+		return;
+	}
 
-	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	const bool l_blocks = m_hasBlocks && ((m_partial & NRP_RENDER_BLOCKS) != 0 ||
+		(GetEnableGaussShadow() && (m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0));
+
+	if (l_blocks && GetEnableGaussShadow() && (m_partial & NRP_RENDER_GAUSS_SHADOW) != 0)
 	{
-		size_t l_firstCol = (size_t)-1;
+		// the GPU path yields colored pixels, we need plain coverage:
+		CCairoBoxBlur l_blur(l_width, l_height, (int)GetGaussBlurRadius(), false, GetGlowDownscale());
+		l_blur.SetAllowFallback(true);
+		l_blur.SetCancelCheck(GetCancelCheck());
+
+		RenderStripeBlocks(a_slot, false, true, l_blur.GetContext(), &l_opaque);
+
+		cairo_t* cr = cairo_create(l_newLayer(SL_GLOW));
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		l_blur.Paint(cr);
+		cairo_destroy(cr);
+	}
+
+	if (l_blocks && !IsRenderingCancelled())
+	{
+		cairo_t* cr = cairo_create(l_newLayer(SL_BLOCKS));
+		RenderStripeBlocks(a_slot, false, false, cr, &l_opaque);
+		cairo_destroy(cr);
+	}
+
+	if ((m_partial & NRP_RENDER_TEXT) != 0 && !IsRenderingCancelled())
+	{
+		RenderText(l_opaque, nullptr, l_hasLinks ? l_invisible : l_opaque,
+			l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+			l_newLayer(SL_TEXT), l_baseX, l_baseY, l_colStart, l_colLimit);
 
-		if (m_cancelRenderingImmediately)
+		if (l_hasLinks && !IsRenderingCancelled())
 		{
-			break;
+			RenderText(l_invisible, nullptr, l_opaque,
+				l_rowStart, 0, l_rowEnd, m_nfo->GetGridWidth() - 1,
+				l_newLayer(SL_LINKS), l_baseX, l_baseY, l_colStart, l_colLimit);
 		}
+	}
+}
 
-		// collect an UTF-8 buffer of each line:
-		for (size_t col = 0; col < m_gridData->GetCols(); col++)
-		{
-			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
 
-			if (l_block.shape != RGS_NO_BLOCK && l_block.shape != RGS_WHITESPACE_IN_TEXT)
-			{
-				if (l_firstCol != (size_t)-1)
-					l_utfBuf += ' '; // add whitespace between non-whitespace chars that are skipped
+/**
+ * Paints a_slot's surface from its coverage layers, using the current colors.
+ * Same order as RenderStripe: background, glow, blocks, text, links.
+ **/
+void CNFORenderer::CompositeStripe(size_t a_slot) const
+{
+	const SStripeSlot& l_slot = m_stripes[a_slot];
+	cairo_t* cr = cairo_create(GetStripeSurface(a_slot));
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+	// RenderStripe doesn't paint the background if it only draws glow-colored blocks or text:
+	const bool l_back = (!m_hasBlocks || m_classic) ||
+		(GetEnableGaussShadow() && (m_partial & (NRP_RENDER_BLOCKS | NRP_RENDER_GAUSS_BLOCKS)) != 0 ?
+		(m_partial & NRP_RENDER_GAUSS_SHADOW) != 0 : (m_partial & NRP_RENDER_BLOCKS) != 0);
+
+	if (l_back && GetBackColor().A > 0)
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
+		cairo_paint(cr);
+	}
+
+	if (l_slot.layers[SL_GLOW])
+	{
+		// the direct path applies the glow color's alpha to the blur input and to the mask:
+		const S_COLOR_T l_glow = GetGaussColor();
+
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(l_glow), (l_glow.A / 255.0) * (l_glow.A / 255.0));
+		cairo_mask_surface(cr, l_slot.layers[SL_GLOW], 0, 0);
+	}
+
+	if (l_slot.layers[SL_BLOCKS])
+	{
+		const bool l_gaussBlocks = !m_classic && GetEnableGaussShadow() &&
+			(m_partial & NRP_RENDER_GAUSS_BLOCKS) != 0 && (m_partial & NRP_RENDER_GAUSS_SHADOW) == 0;
+
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(l_gaussBlocks ? GetGaussColor() : GetArtColor()));
+		cairo_mask_surface(cr, l_slot.layers[SL_BLOCKS], 0, 0);
+	}
+
+	if (l_slot.layers[SL_TEXT])
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetTextColor()));
+		cairo_mask_surface(cr, l_slot.layers[SL_TEXT], 0, 0);
+	}
+
+	if (l_slot.layers[SL_LINKS])
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetHyperLinkColor()));
+		cairo_mask_surface(cr, l_slot.layers[SL_LINKS], 0, 0);
+	}
+
+	cairo_destroy(cr);
+}
+
+
+void CNFORenderer::RenderBackgrounds(size_t a_rowStart, size_t a_rowEnd, double a_xBase, double a_yBase, cairo_t* cr) const
+{
+	cairo_save(cr);
+
+	if (GetBackColor().A > 0)
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
+		cairo_paint(cr);
+	}
+
+	if (m_nfo->HasColorMap())
+	{
+		double dbw = static_cast<double>(GetBlockWidth());
+		double dbh = static_cast<double>(GetBlockHeight());
+		uint32_t l_defaultColor = GetBackColor().AsWord();
+
+		for (size_t row = (a_rowStart == -1 ? 0 : a_rowStart); row <= a_rowEnd; row++)
+		{
+			std::vector<size_t> l_columns;
+			std::vector<uint32_t> l_colors;
 
+			if (!m_nfo->GetColorMap()->GetLineBackgrounds(row, l_defaultColor, m_gridData->GetCols(), l_columns, l_colors))
 				continue;
-			}
 
-			if (a_rowStart != (size_t)-1)
+			_ASSERT(l_colors.size() == l_columns.size());
+			_ASSERT(l_columns.size() > 0);
+
+			size_t col = 0;
+
+			for (size_t section = 0; section < l_colors.size(); section++)
 			{
-				if (row == a_rowStart && col < a_colStart)
-					continue;
-				else if (row == a_rowEnd && col > a_colEnd)
-					break;
-			}
+				_ASSERT(l_columns[section] > 0);
+				_ASSERT(l_columns[section] <= m_gridData->GetCols());
+
+				size_t col_to = col + l_columns[section];
+
+				_ASSERT(col_to > col);
+
+				if (l_colors[section] != l_defaultColor)
+				{
+					double x_from = col * dbw, x_to = col_to * dbw;
+
+					cairo_set_source_rgb(cr, S_COLOR_T_CAIRO(S_COLOR_T(l_colors[section])));
+
+					cairo_rectangle(cr, a_xBase + GetPadding() + x_from, a_yBase + GetPadding() + dbh * row, x_to - x_from, dbh);
 
-			l_utfBuf += m_nfo->GetGridCharUtf8(row, col);
+					cairo_fill(cr);
+				}
 
-			if (col < l_firstCol) l_firstCol = col;
+				col = col_to;
+			}
 		}
+	}
 
-		if (l_firstCol != (size_t)-1)
+	cairo_restore(cr);
+}
+
+
+/************************************************************************/
+/* RENDER BLOCKS                                                        */
+/************************************************************************/
+
+// fraction of its cell a_block covers, for drawing it as a flat fill (see SetLODCellSize):
+static inline double _GetLODBlockCoverage(const CRenderGridBlock& a_block, double a_blockWidth, double a_blockHeight)
+{
+	double l_area;
+
+	switch (a_block.shape)
+	{
+	case RGS_FULL_BLOCK:
+		l_area = 1.0;
+		break;
+	case RGS_BLOCK_LOWER_HALF:
+	case RGS_BLOCK_UPPER_HALF:
+	case RGS_BLOCK_LEFT_HALF:
+	case RGS_BLOCK_RIGHT_HALF:
+		l_area = 0.5;
+		break;
+	case RGS_BLACK_SQUARE:
+		// same geometry as in RenderBlocks:
+		l_area = 0.5625 * a_blockWidth / a_blockHeight;
+		break;
+	case RGS_BLACK_SMALL_SQUARE:
+		l_area = 0.25 * a_blockWidth / a_blockHeight;
+		break;
+	default:
+		return 0;
+	}
+
+	return std::min(l_area, 1.0) * a_block.alpha / 255.0;
+}
+
+
+void CNFORenderer::RenderStripeBlocks(size_t a_slot, bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context,
+	const S_COLOR_T* a_colorOverride) const
+{
+	cairo_t* l_context = (a_context ? a_context : cairo_create(GetStripeSurface(a_slot)));
+	const size_t l_stripe = GetSlotStripe(a_slot), l_tile = GetSlotTile(a_slot);
+
+	RenderBlocks(a_opaqueBg, a_gaussStep, l_context,
+		(m_numStripes > 1 ? l_stripe * m_linesPerStripe - GetStripeExtraLinesTop(l_stripe) : (size_t)-1),
+		l_stripe * m_linesPerStripe + m_linesPerStripe + GetStripeExtraLinesBottom(l_stripe),
+		// see comment in RenderStripe():
+		-GetTileX(l_tile) + GetTileWidthExtraLeft(l_tile),
+		(l_stripe == 0 ? 0 : -GetPadding() - (double)l_stripe * m_stripeHeight) + GetStripeHeightExtraTop(l_stripe),
+		a_colorOverride,
+		l_tile * m_colsPerTile - GetTileExtraColsLeft(l_tile),
+		(l_tile + 1) * m_colsPerTile - 1 + GetTileExtraColsRight(l_tile));
+
+	if (!a_context)
+	{
+		cairo_destroy(l_context);
+	}
+}
+
+void CNFORenderer::RenderBlocks(bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context,
+	size_t a_rowStart, size_t a_rowEnd, double a_xBase, double a_yBase, const S_COLOR_T* a_colorOverride,
+	size_t a_colStart, size_t a_colEnd) const
+{
+	double l_off_x = GetPadding() + a_xBase, l_off_y = GetPadding() + a_yBase;
+
+	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
+	if (a_rowStart != (size_t)-1)
+	{
+		l_rowStart = std::max(a_rowStart, l_rowStart);
+		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+	}
+
+	cairo_t * const cr = a_context;
+	cairo_save(cr);
+
+	if (a_opaqueBg)
+	{
+		RenderBackgrounds(l_rowStart, l_rowEnd, a_xBase, a_yBase, cr);
+	}
+
+	// below the LOD cell size, blocks become full cells of the same coverage, and neighbours are merged:
+	const bool l_lod = UseLOD();
+
+	cairo_set_antialias(cr, l_lod ? CAIRO_ANTIALIAS_NONE : CAIRO_ANTIALIAS_SUBPIXEL);
+
+	bool l_hasColorMap = m_nfo->HasColorMap();
+	int l_oldAlpha = 0;
+	uint32_t l_oldColor = 0;
+	bool l_first = true;
+
+	// micro optimization
+	const double bwd = static_cast<double>(GetBlockWidth());
+	const double bhd = static_cast<double>(GetBlockHeight());
+	const double bwd05 = bwd * 0.5;
+	const double bhd05 = bhd * 0.5;
+
+	// pending LOD rectangle, in cells:
+	size_t l_spanRow = 0, l_spanCol = 0, l_spanLen = 0;
+
+	auto l_addSpan = [&]() {
+		if (l_spanLen > 0)
 		{
-			cairo_glyph_t *l_glyphs = nullptr, *l_pg;
-			int l_numGlyphs = -1, i;
+			cairo_rectangle(cr, l_off_x + l_spanCol * bwd, l_off_y + l_spanRow * bhd, l_spanLen * bwd, bhd);
+			l_spanLen = 0;
+		}
+	};
 
-			// remove trailing whitespace added above:
-			CUtil::StrTrimRight(l_utfBuf);
+	size_t l_numCells = 0;
 
-			// we call this to get the glyph indexes from the backend.
-			// the actual position/coordinates of the glyphs will be calculated below.
-			cairo_scaled_font_text_to_glyphs(l_csf,
-				0,
-				l_off_y + row * GetBlockHeight() + (l_font_extents.ascent + GetBlockHeight()) / 2.0 - 2,
-				l_utfBuf.c_str(), (int)l_utfBuf.size(), &l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr);
+	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	{
+		if (IsRenderingCancelled())
+		{
+			break;
+		}
 
-			// put each char/glyph into its cell in the grid:
-			for (l_pg = l_glyphs, i = 0; i < l_numGlyphs; i++, l_pg++)
+		for (const CRenderGridRun& l_run : m_gridRows[row].runs)
+		{
+			if (l_run.text || l_run.col + l_run.len <= a_colStart)
 			{
-				l_pg->x = l_off_x + (l_firstCol + i) * GetBlockWidth();
+				continue;
 			}
-
-			// draw background for highlights/selection etc:
-			if (a_backColor)
+			else if (l_run.col > a_colEnd)
 			{
-				cairo_save(cr);
-				cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*a_backColor));
-				cairo_rectangle(cr, l_off_x + l_firstCol * GetBlockWidth(), l_off_y + row * GetBlockHeight(),
-					static_cast<double>(GetBlockWidth() * l_numGlyphs), static_cast<double>(GetBlockHeight()));
-				cairo_fill(cr);
-				cairo_restore(cr);
+				break;
 			}
 
-			// check for hyperlinks...
-			const std::vector<const CNFOHyperLink*> l_links = m_nfo->GetLinksForLine(row);
-
-			if (l_links.size() == 0 || !GetHilightHyperLinks())
-			{
-				// ... no hyperlinks, draw the entire line in one go:
-				cairo_show_glyphs(cr, l_glyphs, l_numGlyphs);
-			}
-			else if (a_rowStart == (size_t)-1 || !a_backColor)
+			for (size_t col = std::max(l_run.col, a_colStart); col < l_run.col + l_run.len && col <= a_colEnd; col++)
 			{
-				size_t l_nextCol = l_firstCol;
+				if (IsRenderingCancelled(l_numCells))
+				{
+					break;
+				}
 
-				cairo_save(cr);
+				const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+				const int l_alpha = (l_lod ? static_cast<int>(_GetLODBlockCoverage(l_block, bwd, bhd) * 255.0 + 0.5) : l_block.alpha);
 
-				// go through each hyperlink and hilight them as requested:
-				for (const auto l_link : l_links)
+				if (l_lod && l_alpha == 0)
 				{
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+					continue;
+				}
 
-					cairo_show_glyphs(cr, l_glyphs + l_nextCol - l_firstCol,
-						static_cast<int>(l_link->GetColStart() - l_nextCol));
+				S_COLOR_T l_drawingColor = a_colorOverride ? *a_colorOverride : (a_gaussStep ? GetGaussColor() : GetArtColor());
 
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
+				if (l_hasColorMap && !a_colorOverride)
+				{
+					uint32_t clr;
 
-					if (GetUnderlineHyperLinks())
+					m_nfo->GetColorMap()->GetForegroundColor(row, col, l_drawingColor.AsWord(), clr);
+
+					l_drawingColor = S_COLOR_T(clr);
+				}
+
+				if (l_first
+					|| (l_alpha != l_oldAlpha)  // R,G,B never change during the loop (unless there's a colormap)
+					|| (l_hasColorMap && l_drawingColor != l_oldColor)
+					) {
+					l_addSpan();
+					cairo_fill(cr); // complete previous drawing operation(s)
+
+					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(l_drawingColor), (l_alpha / 255.0) * (l_drawingColor.A / 255.0));
+
+					// known issue: Alpha from GetGauss/ArtColor is discarded if there's a colormap.
+
+					l_oldAlpha = l_alpha;
+					l_oldColor = l_drawingColor.AsWord();
+					l_first = false;
+				}
+
+				if (l_lod)
+				{
+					if (l_spanLen > 0 && l_spanRow == row && l_spanCol + l_spanLen == col)
 					{
-						cairo_move_to(cr, l_off_x + l_link->GetColStart() * GetBlockWidth(), l_off_y + (row + 1) * GetBlockHeight());
-						cairo_rel_line_to(cr, static_cast<double>(l_link->GetLength() * GetBlockWidth()), 0);
-						cairo_stroke(cr);
+						l_spanLen++;
 					}
+					else
+					{
+						l_addSpan();
 
-					cairo_show_glyphs(cr, l_glyphs + l_link->GetColStart() - l_firstCol, (int)l_link->GetLength());
+						l_spanRow = row;
+						l_spanCol = col;
+						l_spanLen = 1;
+					}
 
-					l_nextCol = l_link->GetColEnd() + 1;
+					continue;
 				}
 
-				cairo_restore(cr);
+				double l_pos_x = col * bwd, l_pos_y = row * bhd, l_width = bwd, l_height = bhd;
 
-				// draw remaining text following the last link:
-				if (l_nextCol - l_firstCol < (size_t)l_numGlyphs)
+				switch (l_block.shape)
 				{
-					cairo_show_glyphs(cr, l_glyphs + l_nextCol - l_firstCol,
-						static_cast<int>(l_numGlyphs + l_firstCol - l_nextCol));
+				case RGS_BLOCK_LOWER_HALF:
+					l_pos_y += bhd05;
+				case RGS_BLOCK_UPPER_HALF:
+					l_height = bhd05;
+					break;
+				case RGS_BLOCK_RIGHT_HALF:
+					l_pos_x += bwd05;
+				case RGS_BLOCK_LEFT_HALF:
+					l_width = bwd05;
+					break;
+				case RGS_BLACK_SQUARE:
+					l_width = l_height = bwd * 0.75;
+					l_pos_y += bhd05 - l_height * 0.5;
+					l_pos_x += bwd05 - l_width * 0.5;
+					break;
+				case RGS_BLACK_SMALL_SQUARE:
+					l_width = l_height = bwd05;
+					l_pos_y += bhd05 - l_height * 0.5;
+					l_pos_x += bwd05 - l_width * 0.5;
+					break;
 				}
+
+				cairo_rectangle(cr, l_off_x + l_pos_x, l_off_y + l_pos_y, l_width, l_height);
 			}
-			else
-			{
-				// this is rather slow, but required to get lines with hyperlinks and selection in them right:
-				size_t l_showStart = 0;
-				int l_showLen = 0;
-				bool l_inLink;
-				size_t l_linkRest = 0;
+		}
+	}
 
-				cairo_save(cr);
+	l_addSpan();
+	cairo_fill(cr); // complete pending drawing operation(s)
 
-				for (int p = 0; p <= l_numGlyphs; p++) /* excess run: draw remaining stuff */
+	cairo_restore(cr);
+}
+
+
+/************************************************************************/
+/* Utilities for RenderText and RenderClassic                           */
+/************************************************************************/
+
+void CNFORenderer::_FixUpRowColStartEnd(size_t& a_rowStart, size_t& a_colStart, size_t& a_rowEnd, size_t& a_colEnd)
+{
+	if (a_rowStart != (size_t)-1)
+	{
+		if (a_rowEnd < a_rowStart)
+		{
+			size_t tmp = a_rowStart; a_rowStart = a_rowEnd; a_rowEnd = tmp;
+			tmp = a_colStart; a_colStart = a_colEnd; a_colEnd = tmp;
+		}
+		else if (a_rowEnd == a_rowStart && a_colStart > a_colEnd)
+		{
+			size_t tmp = a_colStart; a_colStart = a_colEnd; a_colEnd = tmp;
+		}
+	}
+}
+
+static inline void _SetUpHyperLinkUnderlining(const CNFORenderer* r, cairo_t* cr)
+{
+	if (r->GetHilightHyperLinks() && r->GetUnderlineHyperLinks())
+	{
+		cairo_set_line_width(cr, 1);
+		cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE); // looks better
+	}
+}
+
+static inline std::string _GetFontFaceUtf8(const CNFORenderer* r)
+{
+#ifdef _UNICODE
+	return CUtil::FromWideStr(r->GetFontFace(), CP_UTF8);
+#else
+	return r->GetFontFace();
+#endif
+}
+
+// returns a new reference from the process-wide cache, resolving fonts is expensive:
+static inline cairo_scaled_font_t* _GetScaledFont(const CNFORenderer* r, double a_fontSize, cairo_antialias_t a_antiAlias)
+{
+	cairo_font_options_t *cfo = cairo_font_options_create();
+
+	cairo_font_options_set_antialias(cfo, a_antiAlias);
+	// not sure anymore about the rational behind this logic:
+	cairo_font_options_set_hint_style(cfo, (r->IsClassicMode() ? CAIRO_HINT_STYLE_DEFAULT : CAIRO_HINT_STYLE_NONE));
+	cairo_font_options_set_hint_metrics(cfo, (r->IsClassicMode() || r->GetFontBold() ? CAIRO_HINT_METRICS_ON : CAIRO_HINT_METRICS_OFF));
+
+	cairo_scaled_font_t* l_font = CFontFaceCache::GetInstance().GetScaledFont(_GetFontFaceUtf8(r), r->GetFontBold(), a_fontSize, cfo);
+
+	cairo_font_options_destroy(cfo);
+
+	return l_font;
+}
+
+static inline bool _UseFontAntiAlias(const CNFORenderer* r, double a_fontSize)
+{
+	// disable anti-alias to avoid colorful artifacts in low zoom levels (not in classic mode):
+	return r->GetFontAntiAlias() && (r->IsClassicMode() || a_fontSize >= 4);
+}
+
+static inline void _SetUpDrawingTools(const CNFORenderer* r, cairo_surface_t* a_surface, cairo_t** pcr, double a_fontSize, bool a_grayscale = false)
+{
+	cairo_t* cr = cairo_create(a_surface);
+
+	cairo_scaled_font_t* l_font = _GetScaledFont(r, a_fontSize,
+		!_UseFontAntiAlias(r, a_fontSize) ? CAIRO_ANTIALIAS_NONE : (a_grayscale ? CAIRO_ANTIALIAS_GRAY : CAIRO_ANTIALIAS_SUBPIXEL));
+
+	cairo_set_scaled_font(cr, l_font);
+	cairo_scaled_font_destroy(l_font);
+
+	*pcr = cr;
+}
+
+static inline void _FinalizeDrawingTools(cairo_t** pcr)
+{
+	cairo_destroy(*pcr);
+	*pcr = nullptr;
+}
+
+// glyphs can only be blitted into image surfaces with one byte per coverage value:
+static inline bool _CanUseGlyphAtlas(const CNFORenderer* r, cairo_surface_t* a_surface)
+{
+	if (!r->GetGlyphAtlas() || cairo_surface_get_type(a_surface) != CAIRO_SURFACE_TYPE_IMAGE)
+	{
+		return false;
+	}
+
+	const cairo_format_t l_format = cairo_image_surface_get_format(a_surface);
+
+	return (l_format == CAIRO_FORMAT_ARGB32 || l_format == CAIRO_FORMAT_A8);
+}
+
+// a_baseX/a_baseY: origin of the first glyph, all others are whole multiples of the block size away from it.
+// cr must have been set up with a_grayscale = true:
+static inline PGlyphAtlas _GetGlyphAtlas(const CNFORenderer* r, cairo_t* cr, double a_fontSize, double a_baseX, double a_baseY)
+{
+	// everything that changes the glyph bitmaps, see _GetScaledFont:
+	const std::string l_fontKey = _GetFontFaceUtf8(r) + (r->GetFontBold() ? "|bold" : "") + (r->IsClassicMode() ? "|classic" : "") +
+		(_UseFontAntiAlias(r, a_fontSize) ? "" : "|noaa") + "|" + std::to_string(a_fontSize);
+
+	return CGlyphAtlas::GetShared(cairo_get_scaled_font(cr), l_fontKey, a_baseX - floor(a_baseX), a_baseY - floor(a_baseY));
+}
+
+// blits from a_atlas if there is one, otherwise draws using cr's current source:
+static inline void _ShowGlyphs(cairo_t* cr, cairo_surface_t* a_surface, const PGlyphAtlas& a_atlas,
+	const cairo_glyph_t* a_glyphs, int a_numGlyphs, const S_COLOR_T& a_color)
+{
+	if (!a_atlas)
+	{
+		cairo_show_glyphs(cr, a_glyphs, a_numGlyphs);
+		return;
+	}
+
+	cairo_surface_flush(a_surface);
+	a_atlas->Blit(a_surface, a_glyphs, a_numGlyphs, CGlyphAtlas::SolidPixel(S_COLOR_T_CAIRO_A(a_color)));
+	cairo_surface_mark_dirty(a_surface);
+}
+
+
+/************************************************************************/
+/* RENDER TEXT                                                          */
+/************************************************************************/
+
+void CNFORenderer::PreRenderText()
+{
+	if (m_classic || m_fontSize > 0)
+	{
+		return;
+	}
+
+	std::set<wchar_t> l_checkChars;
+
+	for (size_t row = 0; row < m_gridData->GetRows(); row++)
+	{
+		for (size_t col = 0; col < m_gridData->GetCols(); col++)
+		{
+			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+
+			if (l_block.shape == RGS_NO_BLOCK)
+			{
+				l_checkChars.insert(m_nfo->GetGridChar(row, col));
+			}
+		}
+	}
+
+	if (l_checkChars.empty())
+	{
+		m_fontSize = static_cast<double>(GetBlockWidth() + 1);
+		return;
+	}
+
+	// add some generic "big" chars for NFOs that e.g.
+	// contain nothing but dots or middots:
+	l_checkChars.insert(L'W');
+	l_checkChars.insert(L'M');
+
+	// everything that changes the glyph extents, see _SetUpDrawingTools:
+	const std::string l_fontKey = _GetFontFaceUtf8(this) + (GetFontBold() ? "|bold" : "") + (GetFontAntiAlias() ? "" : "|noaa");
+	const uint64_t l_charSet = CFontMetricsCache::HashCharSet(l_checkChars);
+	CFontMetricsCache& l_cache = CFontMetricsCache::GetInstance();
+	int l_cachedSize;
+
+	if (l_cache.GetFontSize(l_fontKey, GetBlockWidth(), GetBlockHeight(), l_charSet, l_cachedSize))
+	{
+		m_fontSize = static_cast<double>(l_cachedSize);
+		return;
+	}
+
+	// true if all chars fit into a block at a_size. ar_measured is false if no char could be measured at all:
+	auto l_fits = [&](int a_size, bool& ar_measured) -> bool {
+		cairo_scaled_font_t *l_csf = nullptr;
+		bool l_allFit = true;
+
+		ar_measured = false;
+
+		for (wchar_t l_char : l_checkChars)
+		{
+			CFontMetricsCache::SGlyphMetrics l_metrics;
+
+			if (!l_cache.GetGlyphMetrics(l_fontKey, a_size, l_char, l_metrics))
+			{
+				if (!l_csf)
 				{
-					bool l_linkAtPos = (l_linkRest > 0);
+					l_csf = _GetScaledFont(this, a_size, GetFontAntiAlias() ? CAIRO_ANTIALIAS_SUBPIXEL : CAIRO_ANTIALIAS_NONE);
+				}
 
-					if (p == 0 || (!l_linkAtPos && p < l_numGlyphs))
-					{
-						for (std::vector<const CNFOHyperLink*>::const_iterator it = l_links.begin(); it != l_links.end(); it++)
-						{
-							if (p + l_firstCol >= (*it)->GetColStart() && p + l_firstCol <= (*it)->GetColEnd())
-							{
-								l_linkAtPos = true;
-								l_linkRest = (*it)->GetLength() - (p + l_firstCol - (*it)->GetColStart()) - 1;
-								break;
-							}
-						}
+				// measure the inked area of this glyph (char):
+				cairo_glyph_t *l_glyphs = nullptr;
+				int l_numGlyphs = 0;
 
-						if (p == 0) l_inLink = l_linkAtPos;
-					}
-					else
-						l_linkRest--;
+				const std::string utf8 = m_nfo->GetGridCharUtf8(l_char);
 
-					if (l_linkAtPos == l_inLink)
-					{
-						l_showLen++;
-					}
+				if (cairo_scaled_font_text_to_glyphs(l_csf, 0, 0, utf8.c_str(), -1,
+					&l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr) != CAIRO_STATUS_SUCCESS)
+				{
+					continue;
+				}
 
-					if ((l_linkAtPos != l_inLink || p == l_numGlyphs) && l_showLen > 0)
-					{
-						if (p == l_numGlyphs && l_linkAtPos == l_inLink)
-						{
-							l_showLen--;
-						}
+				cairo_text_extents_t l_extents{};
 
-						if (l_inLink) // "buffer" contains hyperlink text
-						{
-							cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
+				cairo_scaled_font_glyph_extents(l_csf, l_glyphs, l_numGlyphs, &l_extents);
+				cairo_glyph_free(l_glyphs);
 
-							if (GetUnderlineHyperLinks())
-							{
-								cairo_move_to(cr, l_off_x + (l_showStart + l_firstCol) * GetBlockWidth(), l_off_y + (row + 1) * GetBlockHeight());
-								cairo_rel_line_to(cr, static_cast<double>(l_showLen * GetBlockWidth()), 0);
-								cairo_stroke(cr);
-							}
-						}
-						else
-						{
-							cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
-						}
+				l_metrics.advance = l_extents.x_advance;
+				l_metrics.height = l_extents.height;
 
-						cairo_show_glyphs(cr, l_glyphs + l_showStart, l_showLen);
+				l_cache.AddGlyphMetrics(l_fontKey, a_size, l_char, l_metrics);
+			}
 
-						if (p < l_numGlyphs)
-						{
-							l_showStart = (size_t)p;
-							l_showLen = 1;
-						}
-					}
+			ar_measured = true;
+
+			if (l_metrics.advance > GetBlockWidth() || l_metrics.height > GetBlockHeight())
+			{
+				l_allFit = false;
+				break;
+			}
+		}
+
+		if (l_csf)
+		{
+			cairo_scaled_font_destroy(l_csf);
+		}
+
+		return l_allFit;
+	};
+
+	// the result is the smallest size above the block width that does NOT fit,
+	// find an upper bound with growing steps, then bisect:
+	int l_fitting = static_cast<int>(GetBlockWidth()), l_broken = 0;
+	bool l_measured;
+
+	for (int l_step = 1; l_broken == 0; l_step *= 2)
+	{
+		const int l_size = l_fitting + l_step;
+
+		if (!l_fits(l_size, l_measured))
+		{
+			l_broken = l_size;
+		}
+		else
+		{
+			l_fitting = l_size;
+
+			// no text that could be measured, nothing to calibrate:
+			if (!l_measured || l_size >= ms_maxCalibratedFontSize)
+			{
+				l_broken = l_size + 1;
+			}
+		}
+	}
+
+	while (l_broken - l_fitting > 1)
+	{
+		const int l_size = l_fitting + (l_broken - l_fitting) / 2;
+
+		if (l_fits(l_size, l_measured))
+		{
+			l_fitting = l_size;
+		}
+		else
+		{
+			l_broken = l_size;
+		}
+	}
+
+	m_fontSize = static_cast<double>(l_broken);
+
+	l_cache.AddFontSize(l_fontKey, GetBlockWidth(), GetBlockHeight(), l_charSet, l_broken);
+}
+
+void CNFORenderer::RenderText(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
+	const S_COLOR_T& a_hyperLinkColor,
+	size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
+	cairo_surface_t* a_surface, double a_xBase, double a_yBase,
+	size_t a_windowColStart, size_t a_windowColLimit) const noexcept
+{
+	double l_off_x = a_xBase + GetPadding(), l_off_y = a_yBase + GetPadding();
+
+	_FixUpRowColStartEnd(a_rowStart, a_colStart, a_rowEnd, a_colEnd);
+
+	if (UseLOD())
+	{
+		RenderCellsLOD(a_textColor, a_backColor, a_hyperLinkColor, nullptr, false, m_fontSize,
+			a_rowStart, a_colStart, a_rowEnd, a_colEnd, a_surface, a_xBase, a_yBase, a_windowColStart, a_windowColLimit);
+		return;
+	}
+
+	const bool l_useAtlas = _CanUseGlyphAtlas(this, a_surface);
+
+	// m_fontSize has been calculated by PreRenderText:
+	cairo_t* cr;
+	_SetUpDrawingTools(this, a_surface, &cr, m_fontSize, l_useAtlas);
+
+	_SetUpHyperLinkUnderlining(this, cr);
+
+	// get general font info to vertically center chars into the blocks:
+	cairo_font_extents_t l_font_extents;
+	cairo_font_extents(cr, &l_font_extents);
+
+	PGlyphAtlas l_atlas;
+
+	if (l_useAtlas)
+	{
+		l_atlas = _GetGlyphAtlas(this, cr, m_fontSize, l_off_x, l_off_y + (l_font_extents.ascent + GetBlockHeight()) / 2.0 - 2);
+	}
+
+	// the source color has to be set for cairo_show_glyphs:
+	auto l_showGlyphs = [&](const cairo_glyph_t* a_glyphs, int a_numGlyphs, const S_COLOR_T& a_color) {
+		_ShowGlyphs(cr, a_surface, l_atlas, a_glyphs, a_numGlyphs, a_color);
+	};
+
+	// determine ranges to draw (important for selection/highlights):
+	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
+	if (a_rowStart != (size_t)-1)
+	{
+		l_rowStart = std::max(a_rowStart, l_rowStart);
+		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+	}
+
+	// set main text color:
+	cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+
+	// get a scaled font reference from cr.
+	// remember this reference will become invalid as soon as cr does.
+	cairo_scaled_font_t *l_csf = cairo_get_scaled_font(cr);
+
+	std::string l_utfBuf;
+	l_utfBuf.reserve(m_nfo->GetGridWidth());
+
+	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	{
+		size_t l_firstCol = (size_t)-1;
+
+		// once per row is enough here, each row is shaped and drawn by a few cairo calls,
+		// the loops over its cells only collect text and move glyphs:
+		if (IsRenderingCancelled())
+		{
+			break;
+		}
+
+		// collect an UTF-8 buffer of each line from its text runs:
+		size_t l_nextCol = 0;
+
+		for (const CRenderGridRun& l_run : m_gridRows[row].runs)
+		{
+			size_t l_colStart = std::max(l_run.col, a_windowColStart), l_colEnd = l_run.col + l_run.len;
+
+			if (!l_run.text || l_colEnd <= a_windowColStart)
+			{
+				continue;
+			}
+			else if (l_run.col >= a_windowColLimit)
+			{
+				break;
+			}
+
+			l_colEnd = std::min(l_colEnd, a_windowColLimit);
+
+			if (a_rowStart != (size_t)-1)
+			{
+				if (row == a_rowStart) l_colStart = std::max(l_colStart, a_colStart);
+				if (row == a_rowEnd) l_colEnd = std::min(l_colEnd, a_colEnd + 1);
+			}
+
+			if (l_colStart >= l_colEnd)
+			{
+				continue;
+			}
+
+			if (l_firstCol == (size_t)-1)
+			{
+				l_firstCol = l_colStart;
+			}
+			else
+			{
+				// add whitespace between non-whitespace chars that are skipped:
+				l_utfBuf.append(l_colStart - l_nextCol, ' ');
+			}
+
+			for (size_t col = l_colStart; col < l_colEnd; col++)
+			{
+				l_utfBuf += m_nfo->GetGridCharUtf8(row, col);
+			}
+
+			l_nextCol = l_colEnd;
+		}
+
+		if (l_firstCol != (size_t)-1)
+		{
+			cairo_glyph_t *l_glyphs = nullptr, *l_pg;
+			int l_numGlyphs = -1, i;
+
+			// remove trailing whitespace added above:
+			CUtil::StrTrimRight(l_utfBuf);
+
+			// we call this to get the glyph indexes from the backend.
+			// the actual position/coordinates of the glyphs will be calculated below.
+			cairo_scaled_font_text_to_glyphs(l_csf,
+				0,
+				l_off_y + row * GetBlockHeight() + (l_font_extents.ascent + GetBlockHeight()) / 2.0 - 2,
+				l_utfBuf.c_str(), (int)l_utfBuf.size(), &l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr);
+
+			// put each char/glyph into its cell in the grid:
+			for (l_pg = l_glyphs, i = 0; i < l_numGlyphs; i++, l_pg++)
+			{
+				l_pg->x = l_off_x + (l_firstCol + i) * GetBlockWidth();
+			}
+
+			// draw background for highlights/selection etc:
+			if (a_backColor)
+			{
+				cairo_save(cr);
+				cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*a_backColor));
+				cairo_rectangle(cr, l_off_x + l_firstCol * GetBlockWidth(), l_off_y + row * GetBlockHeight(),
+					static_cast<double>(GetBlockWidth() * l_numGlyphs), static_cast<double>(GetBlockHeight()));
+				cairo_fill(cr);
+				cairo_restore(cr);
+			}
+
+			// check for hyperlinks...
+			const std::vector<const CNFOHyperLink*> l_links = m_nfo->GetLinksForLine(row);
+
+			if (l_links.size() == 0 || !GetHilightHyperLinks())
+			{
+				// ... no hyperlinks, draw the entire line in one go:
+				l_showGlyphs(l_glyphs, l_numGlyphs, a_textColor);
+			}
+			else if (a_rowStart == (size_t)-1 || !a_backColor)
+			{
+				size_t l_nextCol = l_firstCol;
+
+				cairo_save(cr);
+
+				// go through each hyperlink and hilight them as requested:
+				for (const auto l_link : l_links)
+				{
+					// only the part of the link that has been laid out (see a_windowColStart):
+					const size_t l_linkStart = std::max(l_link->GetColStart(), l_nextCol),
+						l_linkEnd = std::min(l_link->GetColEnd() + 1, l_firstCol + l_numGlyphs);
+
+					if (l_linkStart >= l_linkEnd)
+					{
+						continue;
+					}
+
+					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+
+					l_showGlyphs(l_glyphs + l_nextCol - l_firstCol,
+						static_cast<int>(l_linkStart - l_nextCol), a_textColor);
+
+					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
+
+					if (GetUnderlineHyperLinks())
+					{
+						cairo_move_to(cr, l_off_x + l_linkStart * GetBlockWidth(), l_off_y + (row + 1) * GetBlockHeight());
+						cairo_rel_line_to(cr, static_cast<double>((l_linkEnd - l_linkStart) * GetBlockWidth()), 0);
+						cairo_stroke(cr);
+					}
+
+					l_showGlyphs(l_glyphs + l_linkStart - l_firstCol, static_cast<int>(l_linkEnd - l_linkStart), a_hyperLinkColor);
+
+					l_nextCol = l_linkEnd;
+				}
+
+				cairo_restore(cr);
+
+				// draw remaining text following the last link:
+				if (l_nextCol - l_firstCol < (size_t)l_numGlyphs)
+				{
+					l_showGlyphs(l_glyphs + l_nextCol - l_firstCol,
+						static_cast<int>(l_numGlyphs + l_firstCol - l_nextCol), a_textColor);
+				}
+			}
+			else
+			{
+				// this is rather slow, but required to get lines with hyperlinks and selection in them right:
+				size_t l_showStart = 0;
+				int l_showLen = 0;
+				bool l_inLink;
+				size_t l_linkRest = 0;
+
+				cairo_save(cr);
+
+				for (int p = 0; p <= l_numGlyphs; p++) /* excess run: draw remaining stuff */
+				{
+					bool l_linkAtPos = (l_linkRest > 0);
+
+					if (p == 0 || (!l_linkAtPos && p < l_numGlyphs))
+					{
+						for (std::vector<const CNFOHyperLink*>::const_iterator it = l_links.begin(); it != l_links.end(); it++)
+						{
+							if (p + l_firstCol >= (*it)->GetColStart() && p + l_firstCol <= (*it)->GetColEnd())
+							{
+								l_linkAtPos = true;
+								l_linkRest = (*it)->GetLength() - (p + l_firstCol - (*it)->GetColStart()) - 1;
+								break;
+							}
+						}
+
+						if (p == 0) l_inLink = l_linkAtPos;
+					}
+					else
+						l_linkRest--;
+
+					if (l_linkAtPos == l_inLink)
+					{
+						l_showLen++;
+					}
+
+					if ((l_linkAtPos != l_inLink || p == l_numGlyphs) && l_showLen > 0)
+					{
+						if (p == l_numGlyphs && l_linkAtPos == l_inLink)
+						{
+							l_showLen--;
+						}
+
+						if (l_inLink) // "buffer" contains hyperlink text
+						{
+							cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
+
+							if (GetUnderlineHyperLinks())
+							{
+								cairo_move_to(cr, l_off_x + (l_showStart + l_firstCol) * GetBlockWidth(), l_off_y + (row + 1) * GetBlockHeight());
+								cairo_rel_line_to(cr, static_cast<double>(l_showLen * GetBlockWidth()), 0);
+								cairo_stroke(cr);
+							}
+						}
+						else
+						{
+							cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+						}
+
+						l_showGlyphs(l_glyphs + l_showStart, l_showLen, l_inLink ? a_hyperLinkColor : a_textColor);
+
+						if (p < l_numGlyphs)
+						{
+							l_showStart = (size_t)p;
+							l_showLen = 1;
+						}
+					}
+
+					l_inLink = l_linkAtPos;
+				}
+
+				cairo_restore(cr);
+			}
+
+			// free glyph array (allocated by cairo_scaled_font_text_to_glyphs):
+			cairo_glyph_free(l_glyphs);
+
+			l_utfBuf = "";
+		}
+	}
+
+	_FinalizeDrawingTools(&cr);
+}
+
+
+bool CNFORenderer::CalcClassicModeBlockSizes(bool a_force)
+{
+	bool success = true;
+
+	if (m_classic && (m_fontSize < 0 || a_force))
+	{
+		cairo_surface_t* l_tmpSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 100, 100);
+
+		cairo_t* cr;
+		_SetUpDrawingTools(this, l_tmpSurface, &cr, static_cast<double>(GetFontSize()));
+
+		wchar_t l_blockStr[2] = { 9608, 0 }; // full block + null terminator
+		const std::string l_blockStrUtf = CUtil::FromWideStr(l_blockStr, CP_UTF8);
+
+		cairo_text_extents_t l_extents;
+		cairo_text_extents(cr, l_blockStrUtf.c_str(), &l_extents);
+
+		if (l_extents.x_advance < 1 || l_extents.height < 1)
+		{
+			success = false;
+		}
+		else
+		{
+			m_settings.uBlockWidth = (size_t)l_extents.x_advance;
+			m_settings.uBlockHeight = (size_t)l_extents.height;
+
+			m_fontSize = 1; // we use this as a flag. pretty gross, huh?
+		}
+
+		_FinalizeDrawingTools(&cr);
+
+		cairo_surface_destroy(l_tmpSurface);
+	}
+
+	return success;
+}
+
+
+void CNFORenderer::RenderClassic(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
+	const S_COLOR_T& a_hyperLinkColor, bool a_backBlocks,
+	size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
+	cairo_surface_t* a_surface, double a_xBase, double a_yBase, const S_COLOR_T* a_artColor,
+	size_t a_windowColStart, size_t a_windowColLimit) const
+{
+	double l_off_x = a_xBase + GetPadding(), l_off_y = a_yBase + GetPadding();
+	const S_COLOR_T l_artColor = (a_artColor ? *a_artColor : GetArtColor());
+	const bool l_useAtlas = _CanUseGlyphAtlas(this, a_surface);
+
+	_FixUpRowColStartEnd(a_rowStart, a_colStart, a_rowEnd, a_colEnd);
+
+	if (UseLOD())
+	{
+		const S_COLOR_T l_none(0, 0, 0, 0);
+		const bool l_text = (m_partial & NRP_RENDER_TEXT) != 0, l_blocks = (m_partial & NRP_RENDER_BLOCKS) != 0;
+
+		RenderCellsLOD(l_text ? a_textColor : l_none, a_backColor, l_text ? a_hyperLinkColor : l_none,
+			(l_blocks ? (a_backBlocks ? &a_textColor : &l_artColor) : &l_none), a_backBlocks, static_cast<double>(GetFontSize()),
+			a_rowStart, a_colStart, a_rowEnd, a_colEnd, a_surface, a_xBase, a_yBase, a_windowColStart, a_windowColLimit);
+		return;
+	}
+
+	cairo_t* cr;
+	_SetUpDrawingTools(this, a_surface, &cr, static_cast<double>(GetFontSize()), l_useAtlas);
+
+	_SetUpHyperLinkUnderlining(this, cr);
+
+	cairo_font_extents_t l_font_extents;
+	cairo_font_extents(cr, &l_font_extents);
+
+	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
+	if (a_rowStart != (size_t)-1)
+	{
+		l_rowStart = std::max(a_rowStart, l_rowStart);
+		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+	}
+
+	typedef enum
+	{
+		_BT_UNDEF = -1,
+		BT_TEXT = 0,
+		BT_BLOCK,
+		BT_LINK,
+		_BT_MAX
+	} _block_color_type;
+
+	// one color per type:
+	const S_COLOR_T* l_colors[_BT_MAX] = { &a_textColor, (a_backBlocks ? &a_textColor : &l_artColor), &a_hyperLinkColor };
+
+	bool l_drawType[_BT_MAX] = {
+		(m_partial & NRP_RENDER_TEXT) != 0,
+		(m_partial & NRP_RENDER_BLOCKS) != 0,
+		(m_partial & NRP_RENDER_TEXT) != 0 };
+
+	// all glyphs of one color are collected across all rows and drawn in one go:
+	std::vector<cairo_glyph_t> l_glyphs[_BT_MAX];
+
+	// runs of cells that get a background or an underline:
+	typedef struct
+	{
+		size_t row, col, len;
+	} _cell_span;
+
+	std::vector<_cell_span> l_backSpans, l_linkSpans;
+
+	// glyph index lookups are done once per distinct char:
+	cairo_scaled_font_t *l_csf = cairo_get_scaled_font(cr);
+	std::unordered_map<wchar_t, unsigned long> l_glyphIndexes;
+	const unsigned long l_noGlyph = (unsigned long)-1;
+
+	std::vector<bool> l_linkCols;
+	size_t l_numCells = 0;
+
+	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	{
+		_block_color_type l_curType = _BT_UNDEF;
+
+		if (IsRenderingCancelled())
+		{
+			break;
+		}
+
+		// link spans of this row:
+		l_linkCols.assign(m_gridData->GetCols(), false);
+
+		if (GetHilightHyperLinks())
+		{
+			for (const CNFOHyperLink* l_link : m_nfo->GetLinksForLine(row))
+			{
+				for (size_t col = l_link->GetColStart(); col <= l_link->GetColEnd() && col < l_linkCols.size(); col++)
+				{
+					l_linkCols[col] = true;
+				}
+			}
+		}
+
+		const double l_baseLine = row * GetBlockHeight() + l_off_y + l_font_extents.ascent;
+
+		// whitespace outside of text only matters if it gets a background:
+		const CRenderGridRow& l_index = m_gridRows[row];
+		const bool l_allCells = (a_backColor && a_backBlocks);
+		size_t l_colBegin = (l_allCells ? 0 : l_index.firstCol), l_colLimit = (l_allCells ? l_index.lineEnd : l_index.endCol);
+		size_t l_run = 0;
+
+		if (a_rowStart != (size_t)-1)
+		{
+			if (row == a_rowStart) l_colBegin = std::max(l_colBegin, a_colStart);
+			if (row == a_rowEnd) l_colLimit = std::min(l_colLimit, a_colEnd + 1);
+		}
+
+		l_colBegin = std::max(l_colBegin, a_windowColStart);
+		l_colLimit = std::min(l_colLimit, a_windowColLimit);
+
+		for (size_t col = l_colBegin; col < l_colLimit; col++)
+		{
+			if (IsRenderingCancelled(l_numCells))
+			{
+				break;
+			}
+
+			if (!l_allCells)
+			{
+				while (l_index.runs[l_run].col + l_index.runs[l_run].len <= col)
+				{
+					l_run++;
+				}
+
+				if (l_index.runs[l_run].col > col)
+				{
+					// skipped whitespace would have been drawn like blocks:
+					col = l_index.runs[l_run].col;
+					l_curType = BT_BLOCK;
+
+					if (col >= l_colLimit) break;
+				}
+			}
+
+			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+			_block_color_type l_type;
+
+			if (l_block.shape == RGS_NO_BLOCK)
+			{
+				l_type = (l_linkCols[col] ? BT_LINK : BT_TEXT);
+			}
+			else if (l_block.shape == RGS_WHITESPACE_IN_TEXT && l_curType != BT_LINK)
+			{
+				l_type = l_curType;
+			}
+			else
+			{
+				l_type = BT_BLOCK;
+			}
+
+			const bool l_newRun = (l_type != l_curType);
+
+			l_curType = l_type;
+
+			if (l_type == _BT_UNDEF || !l_drawType[l_type] || (l_colors[l_type]->A == 0 && !a_backColor))
+			{
+				continue;
+			}
+
+			const wchar_t l_char = m_nfo->GetGridChar(row, col);
+
+			// the grid is padded with zeros after the end of each line, they don't get highlighted:
+			if (a_backColor && (l_type != BT_BLOCK || a_backBlocks) && l_char != 0)
+			{
+				if (l_newRun || l_backSpans.empty() || l_backSpans.back().row != row)
+					l_backSpans.push_back(_cell_span{ row, col, 1 });
+				else
+					l_backSpans.back().len++;
+			}
+
+			if (l_type == BT_LINK && GetUnderlineHyperLinks())
+			{
+				if (l_newRun || l_linkSpans.empty() || l_linkSpans.back().row != row)
+					l_linkSpans.push_back(_cell_span{ row, col, 1 });
+				else
+					l_linkSpans.back().len++;
+			}
+
+			if (l_char == L' ' || l_char == 0)
+			{
+				continue;
+			}
+
+			auto it = l_glyphIndexes.find(l_char);
+
+			if (it == l_glyphIndexes.end())
+			{
+				const std::string& l_utf8 = m_nfo->GetGridCharUtf8(l_char);
+				cairo_glyph_t *l_charGlyphs = nullptr;
+				int l_numGlyphs = 0;
+
+				cairo_scaled_font_text_to_glyphs(l_csf, 0, 0, l_utf8.c_str(), (int)l_utf8.size(),
+					&l_charGlyphs, &l_numGlyphs, nullptr, nullptr, nullptr);
+
+				it = l_glyphIndexes.emplace(l_char, (l_numGlyphs > 0 ? l_charGlyphs[0].index : l_noGlyph)).first;
+
+				cairo_glyph_free(l_charGlyphs);
+			}
+
+			if (it->second != l_noGlyph)
+			{
+				l_glyphs[l_type].push_back(cairo_glyph_t{ it->second, l_off_x + col * GetBlockWidth(), l_baseLine });
+			}
+		}
+	}
+
+	// draw char background for highlights/selection etc:
+	if (!l_backSpans.empty())
+	{
+		cairo_save(cr);
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*a_backColor));
+
+		for (const _cell_span& l_span : l_backSpans)
+		{
+			cairo_rectangle(cr,
+				static_cast<double>(l_off_x + l_span.col * GetBlockWidth()),
+				static_cast<double>(l_span.row * GetBlockHeight() + l_off_y),
+				static_cast<double>(GetBlockWidth() * l_span.len),
+				static_cast<double>(GetBlockHeight()));
+		}
+
+		cairo_fill(cr);
+		cairo_restore(cr);
+	}
+
+	if (!l_linkSpans.empty())
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
+
+		for (const _cell_span& l_span : l_linkSpans)
+		{
+			cairo_move_to(cr,
+				static_cast<double>(l_off_x + l_span.col * GetBlockWidth()),
+				static_cast<double>(l_off_y + (l_span.row + 1) * GetBlockHeight()));
+			cairo_rel_line_to(cr, static_cast<double>(GetBlockWidth() * l_span.len), 0);
+		}
+
+		cairo_stroke(cr);
+	}
+
+	PGlyphAtlas l_atlas;
+
+	if (l_useAtlas)
+	{
+		l_atlas = _GetGlyphAtlas(this, cr, static_cast<double>(GetFontSize()), l_off_x, l_off_y + l_font_extents.ascent);
+	}
+
+	for (int l_type = BT_TEXT; l_type < _BT_MAX; l_type++)
+	{
+		if (!l_glyphs[l_type].empty() && l_colors[l_type]->A > 0)
+		{
+			cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*l_colors[l_type]));
+
+			_ShowGlyphs(cr, a_surface, l_atlas, l_glyphs[l_type].data(), static_cast<int>(l_glyphs[l_type].size()), *l_colors[l_type]);
+		}
+	}
+
+	_FinalizeDrawingTools(&cr);
+}
+
+
+/************************************************************************/
+/* RENDER LEVEL OF DETAIL                                               */
+/************************************************************************/
+
+// inked area of a_utf8's glyph in units of the squared font size, a_font must be at DENSITY_REFERENCE_SIZE:
+static double _MeasureGlyphDensity(cairo_scaled_font_t* a_font, const std::string& a_utf8)
+{
+	cairo_glyph_t *l_glyphs = nullptr;
+	int l_numGlyphs = 0;
+
+	if (cairo_scaled_font_text_to_glyphs(a_font, 0, 0, a_utf8.c_str(), (int)a_utf8.size(),
+		&l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr) != CAIRO_STATUS_SUCCESS)
+	{
+		return 0;
+	}
+
+	cairo_text_extents_t l_extents{};
+	double l_ink = 0;
+
+	if (l_numGlyphs > 0)
+	{
+		cairo_scaled_font_glyph_extents(a_font, l_glyphs, 1, &l_extents);
+	}
+
+	if (l_extents.width > 0 && l_extents.height > 0)
+	{
+		// the inked area plus one pixel for anti-aliasing on each side:
+		const int l_left = static_cast<int>(floor(l_extents.x_bearing)) - 1, l_top = static_cast<int>(floor(l_extents.y_bearing)) - 1;
+		const int l_width = static_cast<int>(ceil(l_extents.x_bearing + l_extents.width)) + 1 - l_left,
+			l_height = static_cast<int>(ceil(l_extents.y_bearing + l_extents.height)) + 1 - l_top;
+
+		cairo_surface_t* l_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, l_width, l_height);
+		cairo_t* cr = cairo_create(l_surface);
+
+		cairo_set_scaled_font(cr, a_font);
+
+		l_glyphs[0].x = -l_left;
+		l_glyphs[0].y = -l_top;
+
+		cairo_show_glyphs(cr, l_glyphs, 1);
+		cairo_destroy(cr);
+		cairo_surface_flush(l_surface);
+
+		const unsigned char* l_data = cairo_image_surface_get_data(l_surface);
+		const int l_stride = cairo_image_surface_get_stride(l_surface);
+		uint64_t l_sum = 0;
+
+		for (int y = 0; l_data && y < l_height; y++)
+		{
+			for (int x = 0; x < l_width; x++)
+			{
+				l_sum += l_data[y * l_stride + x];
+			}
+		}
+
+		cairo_surface_destroy(l_surface);
+
+		l_ink = l_sum / 255.0;
+	}
+
+	cairo_glyph_free(l_glyphs);
+
+	const double l_size = static_cast<double>(CFontMetricsCache::DENSITY_REFERENCE_SIZE);
+
+	return l_ink / (l_size * l_size);
+}
+
+
+/**
+ * Draws cells as flat rectangles of their average coverage instead of glyphs, for block sizes
+ * at which text can't be read anyway. Glyph densities are measured once per font and char, and
+ * scaled from the reference size to a_fontSize. Blocks are only drawn if there's a_artColor
+ * (classic mode), RenderBlocks takes care of them otherwise.
+ **/
+void CNFORenderer::RenderCellsLOD(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
+	const S_COLOR_T& a_hyperLinkColor, const S_COLOR_T* a_artColor, bool a_backBlocks, double a_fontSize,
+	size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
+	cairo_surface_t* a_surface, double a_xBase, double a_yBase,
+	size_t a_windowColStart, size_t a_windowColLimit) const
+{
+	const double l_off_x = a_xBase + GetPadding(), l_off_y = a_yBase + GetPadding();
+	const double bwd = static_cast<double>(GetBlockWidth()), bhd = static_cast<double>(GetBlockHeight());
+
+	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
+	if (a_rowStart != (size_t)-1)
+	{
+		l_rowStart = std::max(a_rowStart, l_rowStart);
+		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+	}
+
+	typedef enum
+	{
+		LT_TEXT = 0,
+		LT_LINK,
+		LT_BLOCK,
+		_LT_MAX
+	} _lod_cell_type;
+
+	const S_COLOR_T* l_colors[_LT_MAX] = { &a_textColor, &a_hyperLinkColor, a_artColor };
+
+	typedef struct
+	{
+		size_t row, col, len;
+	} _cell_span;
+
+	// one path per color and coverage level, neighbouring cells of the same kind are merged:
+	std::vector<_cell_span> l_spans[_LT_MAX][ms_lodLevels + 1];
+	std::vector<_cell_span> l_backSpans;
+
+	auto l_addCell = [](std::vector<_cell_span>& ar_spans, size_t a_row, size_t a_col) {
+		if (!ar_spans.empty() && ar_spans.back().row == a_row && ar_spans.back().col + ar_spans.back().len == a_col)
+			ar_spans.back().len++;
+		else
+			ar_spans.push_back(_cell_span{ a_row, a_col, 1 });
+	};
+
+	// the reference font is only needed for chars that haven't been measured before:
+	const std::string l_fontKey = _GetFontFaceUtf8(this) + (GetFontBold() ? "|bold" : "") + (IsClassicMode() ? "|classic" : "");
+	const double l_densityScale = a_fontSize * a_fontSize / (bwd * bhd);
+	CFontMetricsCache& l_cache = CFontMetricsCache::GetInstance();
+	cairo_scaled_font_t* l_refFont = nullptr;
+	std::unordered_map<wchar_t, int> l_textLevels;
+
+	auto l_getTextLevel = [&](wchar_t a_char) -> int {
+		auto it = l_textLevels.find(a_char);
+
+		if (it != l_textLevels.end())
+		{
+			return it->second;
+		}
+
+		double l_density;
+
+		if (!l_cache.GetGlyphDensity(l_fontKey, a_char, l_density))
+		{
+			if (!l_refFont)
+			{
+				l_refFont = _GetScaledFont(this, CFontMetricsCache::DENSITY_REFERENCE_SIZE, CAIRO_ANTIALIAS_GRAY);
+			}
+
+			l_density = _MeasureGlyphDensity(l_refFont, m_nfo->GetGridCharUtf8(a_char));
+
+			l_cache.AddGlyphDensity(l_fontKey, a_char, l_density);
+		}
+
+		const int l_level = std::min(ms_lodLevels, static_cast<int>(l_density * l_densityScale * ms_lodLevels + 0.5));
+
+		l_textLevels[a_char] = l_level;
+
+		return l_level;
+	};
+
+	std::vector<bool> l_linkCols;
+	size_t l_numCells = 0;
+
+	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
+	{
+		if (IsRenderingCancelled())
+		{
+			break;
+		}
+
+		l_linkCols.assign(m_gridData->GetCols(), false);
+
+		if (GetHilightHyperLinks())
+		{
+			for (const CNFOHyperLink* l_link : m_nfo->GetLinksForLine(row))
+			{
+				for (size_t col = l_link->GetColStart(); col <= l_link->GetColEnd() && col < l_linkCols.size(); col++)
+				{
+					l_linkCols[col] = true;
+				}
+			}
+		}
+
+		// see RenderClassic:
+		const CRenderGridRow& l_index = m_gridRows[row];
+		const bool l_allCells = (a_backColor && a_backBlocks);
+		size_t l_colBegin = (l_allCells ? 0 : l_index.firstCol), l_colLimit = (l_allCells ? l_index.lineEnd : l_index.endCol);
+		size_t l_run = 0;
+
+		if (a_rowStart != (size_t)-1)
+		{
+			if (row == a_rowStart) l_colBegin = std::max(l_colBegin, a_colStart);
+			if (row == a_rowEnd) l_colLimit = std::min(l_colLimit, a_colEnd + 1);
+		}
+
+		l_colBegin = std::max(l_colBegin, a_windowColStart);
+		l_colLimit = std::min(l_colLimit, a_windowColLimit);
+
+		for (size_t col = l_colBegin; col < l_colLimit; col++)
+		{
+			if (IsRenderingCancelled(l_numCells))
+			{
+				break;
+			}
+
+			if (!l_allCells)
+			{
+				while (l_index.runs[l_run].col + l_index.runs[l_run].len <= col)
+				{
+					l_run++;
+				}
+
+				if (l_index.runs[l_run].col > col)
+				{
+					col = l_index.runs[l_run].col;
+
+					if (col >= l_colLimit) break;
+				}
+			}
+
+			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+			const bool l_isBlock = (l_block.shape != RGS_NO_BLOCK && l_block.shape != RGS_WHITESPACE && l_block.shape != RGS_WHITESPACE_IN_TEXT);
+
+			if (l_isBlock && !a_artColor)
+			{
+				continue;
+			}
+
+			const wchar_t l_char = m_nfo->GetGridChar(row, col);
+
+			// the grid is padded with zeros after the end of each line, they don't get highlighted:
+			if (a_backColor && (!l_isBlock || a_backBlocks) && l_char != 0)
+			{
+				l_addCell(l_backSpans, row, col);
+			}
+
+			if (l_isBlock)
+			{
+				const int l_level = static_cast<int>(_GetLODBlockCoverage(l_block, bwd, bhd) * ms_lodLevels + 0.5);
+
+				if (l_level > 0)
+				{
+					l_addCell(l_spans[LT_BLOCK][l_level], row, col);
+				}
+			}
+			else if (l_block.shape == RGS_NO_BLOCK && l_char != L' ' && l_char != 0)
+			{
+				const int l_level = l_getTextLevel(l_char);
+
+				if (l_level > 0)
+				{
+					l_addCell(l_spans[l_linkCols[col] ? LT_LINK : LT_TEXT][l_level], row, col);
+				}
+			}
+		}
+	}
+
+	if (l_refFont)
+	{
+		cairo_scaled_font_destroy(l_refFont);
+	}
+
+	cairo_t* cr = cairo_create(a_surface);
+
+	// keeps neighbouring rectangles from bleeding into each other:
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+
+	auto l_fillSpans = [&](const std::vector<_cell_span>& a_spans) {
+		for (const _cell_span& l_span : a_spans)
+		{
+			cairo_rectangle(cr, l_off_x + l_span.col * bwd, l_off_y + l_span.row * bhd, l_span.len * bwd, bhd);
+		}
+
+		cairo_fill(cr);
+	};
+
+	if (!l_backSpans.empty())
+	{
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*a_backColor));
+		l_fillSpans(l_backSpans);
+	}
+
+	for (int l_type = LT_TEXT; l_type < _LT_MAX; l_type++)
+	{
+		if (!l_colors[l_type] || l_colors[l_type]->A == 0)
+		{
+			continue;
+		}
+
+		for (int l_level = 1; l_level <= ms_lodLevels; l_level++)
+		{
+			if (!l_spans[l_type][l_level].empty())
+			{
+				cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(*l_colors[l_type]),
+					(l_colors[l_type]->A / 255.0) * l_level / ms_lodLevels);
+				l_fillSpans(l_spans[l_type][l_level]);
+			}
+		}
+	}
+
+	cairo_destroy(cr);
+}
+
+
+bool CNFORenderer::IsTextChar(size_t a_row, size_t a_col, bool a_allowWhiteSpace) const
+{
+	if (!m_gridData) return false;
+
+	if (a_row < m_gridData->GetRows() && a_col < m_gridData->GetCols())
+	{
+		const CRenderGridBlock& l_block = (*m_gridData)[a_row][a_col];
+
+		if (m_classic)
+		{
+			return a_allowWhiteSpace || (l_block.shape != RGS_WHITESPACE);
+		}
+		else
+		{
+			return (l_block.shape == RGS_NO_BLOCK ||
+				(a_allowWhiteSpace && l_block.shape == RGS_WHITESPACE_IN_TEXT));
+		}
+	}
+
+	return false;
+}
+
+
+void CNFORenderer::InvalidateColors()
+{
+	if (m_rendered && UseColorLayers())
+	{
+		// next Render() call only needs to recomposite:
+		m_recomposite = true;
+	}
+	else
+	{
+		m_rendered = false;
+	}
+}
+
+
+void CNFORenderer::SetZoom(unsigned int a_percent)
+{
+	unsigned int l_oldPercent = static_cast<unsigned int>(m_zoomFactor * 100);
+
+	if (a_percent != l_oldPercent)
+	{
+		if (m_zoomPreview && m_rendered)
+		{
+			CaptureZoomPreview();
+		}
+
+		m_zoomFactor = a_percent / 100.0f;
+
+		ClearStripes();
+
+		m_fontSize = -1;
+		m_rendered = false;
+		m_zoomChanged = true;
+
+		// keep the levels that are closest to the new zoom factor:
+		while (m_zoomPreviewLevels.size() > ms_maxZoomPreviewLevels)
+		{
+			auto l_farthest = std::max_element(m_zoomPreviewLevels.begin(), m_zoomPreviewLevels.end(),
+				[this](const SZoomPreviewLevel& a, const SZoomPreviewLevel& b) {
+				return std::fabs(std::log(a.zoomFactor / m_zoomFactor)) < std::fabs(std::log(b.zoomFactor / m_zoomFactor));
+			});
+
+			for (const SZoomPreviewStripe& l_stripe : l_farthest->stripes)
+			{
+				cairo_surface_destroy(l_stripe.surface);
+			}
+
+			m_zoomPreviewLevels.erase(l_farthest);
+		}
+	}
+}
+
+
+/**
+ * Takes over all READY stripe surfaces as a new zoom preview level.
+ * Stripes that are being rendered are cancelled.
+ **/
+void CNFORenderer::CaptureZoomPreview()
+{
+	StopPreRendering(true);
+
+	SZoomPreviewLevel l_level{ m_zoomFactor, GetBlockWidth(), GetBlockHeight(), GetPadding(), {} };
+
+	for (size_t l_index = 0; m_stripes && l_index < GetNumSlots(); l_index++)
+	{
+		SStripeSlot& l_slot = m_stripes[l_index];
+		const size_t l_stripe = GetSlotStripe(l_index), l_tile = GetSlotTile(l_index);
+
+		if (l_slot.state.load() != SS_READY)
+		{
+			continue;
+		}
+
+		CStripeCache::GetInstance().Remove(this, l_index);
+
+		SZoomPreviewStripe l_preview;
+
+		l_preview.top = (l_stripe == 0 ? 0 : static_cast<int>(l_stripe) * m_stripeHeight + l_level.padding);
+		l_preview.bottom = (l_stripe == m_numStripes - 1 ? static_cast<int>(GetHeight()) :
+			static_cast<int>(l_stripe + 1) * m_stripeHeight + l_level.padding);
+		l_preview.left = GetTileX(l_tile);
+		l_preview.right = l_preview.left + GetTileWidth(l_tile);
+		l_preview.surfaceX = l_preview.left - GetTileWidthExtraLeft(l_tile);
+		l_preview.surfaceY = l_preview.top - GetStripeHeightExtraTop(l_stripe);
+
+		if (l_slot.palette.empty())
+		{
+			l_preview.surface = l_slot.surface.exchange(nullptr);
+		}
+		else
+		{
+			// the preview is painted scaled, so it has to be ARGB32:
+			int l_x, l_y;
+			l_preview.surface = GetStripeSurfaceARGB(l_index, 0, 0,
+				GetTileWidthPhysical(l_tile), GetStripeHeightPhysical(l_stripe), l_x, l_y);
+
+			cairo_surface_destroy(l_slot.surface.exchange(nullptr));
+			l_slot.palette.clear();
+		}
+
+		l_slot.state.store(SS_EMPTY);
+
+		l_level.stripes.push_back(l_preview);
+	}
+
+	if (!l_level.stripes.empty())
+	{
+		m_zoomPreviewLevels.push_back(l_level);
+		m_zoomPreviewActive = true;
+	}
+}
+
+
+void CNFORenderer::DropZoomPreview()
+{
+	m_zoomPreviewActive = false;
+
+	for (const SZoomPreviewLevel& l_level : m_zoomPreviewLevels)
+	{
+		for (const SZoomPreviewStripe& l_stripe : l_level.stripes)
+		{
+			cairo_surface_destroy(l_stripe.surface);
+		}
+	}
+
+	m_zoomPreviewLevels.clear();
+}
+
+
+/**
+ * Fills the area a_xFrom/a_yFrom to a_xTo/a_yTo (in image coordinates) from the preview levels,
+ * the level that is closest to the current zoom factor is painted last, so it wins
+ * wherever it has pixels. The others fill its gaps, plain background fills the rest.
+ **/
+void CNFORenderer::DrawZoomPreview(cairo_t* a_cr, int a_destX, int a_destY, int a_sourceX, int a_sourceY,
+	int a_xFrom, int a_xTo, int a_yFrom, int a_yTo) const
+{
+	if (a_yTo <= a_yFrom || a_xTo <= a_xFrom)
+	{
+		return;
+	}
+
+	std::vector<const SZoomPreviewLevel*> l_levels;
+
+	for (const SZoomPreviewLevel& l_level : m_zoomPreviewLevels)
+	{
+		l_levels.push_back(&l_level);
+	}
+
+	std::sort(l_levels.begin(), l_levels.end(), [this](const SZoomPreviewLevel* a, const SZoomPreviewLevel* b) {
+		return std::fabs(std::log(a->zoomFactor / m_zoomFactor)) > std::fabs(std::log(b->zoomFactor / m_zoomFactor));
+	});
+
+	cairo_save(a_cr);
+
+	cairo_rectangle(a_cr, a_destX + a_xFrom - a_sourceX, a_destY + a_yFrom - a_sourceY, a_xTo - a_xFrom, a_yTo - a_yFrom);
+	cairo_clip(a_cr);
+
+	cairo_set_source_rgb(a_cr, S_COLOR_T_CAIRO(GetBackColor()));
+	cairo_paint(a_cr);
+
+	// from here on, in image coordinates:
+	cairo_translate(a_cr, a_destX - a_sourceX, a_destY - a_sourceY);
+
+	for (const SZoomPreviewLevel* l_level : l_levels)
+	{
+		const double l_scaleX = static_cast<double>(GetBlockWidth()) / l_level->blockWidth,
+			l_scaleY = static_cast<double>(GetBlockHeight()) / l_level->blockHeight;
+		// the requested rows in the level's image coordinates:
+		const double l_levelFrom = l_level->padding + (a_yFrom - GetPadding()) / l_scaleY,
+			l_levelTo = l_level->padding + (a_yTo - GetPadding()) / l_scaleY;
+
+		cairo_save(a_cr);
+
+		// padding does not scale with the zoom factor:
+		cairo_translate(a_cr, GetPadding(), GetPadding());
+		cairo_scale(a_cr, l_scaleX, l_scaleY);
+		cairo_translate(a_cr, -l_level->padding, -l_level->padding);
+
+		for (const SZoomPreviewStripe& l_stripe : l_level->stripes)
+		{
+			if (l_stripe.bottom <= l_levelFrom || l_stripe.top >= l_levelTo)
+			{
+				continue;
+			}
+
+			cairo_set_source_surface(a_cr, l_stripe.surface, l_stripe.surfaceX, l_stripe.surfaceY);
+			cairo_pattern_set_filter(cairo_get_source(a_cr), CAIRO_FILTER_FAST);
+
+			// only the stripe's own area, not the extra pixels that overlap its neighbours:
+			cairo_rectangle(a_cr, l_stripe.left, l_stripe.top, l_stripe.right - l_stripe.left, l_stripe.bottom - l_stripe.top);
+			cairo_fill(a_cr);
+		}
+
+		cairo_restore(a_cr);
+	}
+
+	cairo_restore(a_cr);
+}
+
+
+size_t CNFORenderer::GetWidth() const
+{
+	if (!m_nfo) return 0;
+
+	return m_nfo->GetGridWidth() * GetBlockWidth() + GetPadding() * 2;
+}
+
+
+size_t CNFORenderer::GetHeight() const
+{
+	if (!m_nfo) return 0;
+
+	return m_nfo->GetGridHeight() * GetBlockHeight() + GetPadding() * 2;
+}
+
+
+bool CNFORenderer::ParseColor(const char* a_str, S_COLOR_T* ar)
+{
+	if (ar && _stricmp(a_str, "transparent") == 0)
+	{
+		ar->R = ar->G = ar->B = 255;
+		ar->A = 0;
+		return true;
+	}
+
+	// HTML/CSS style!
+	if (a_str[0] == '#') a_str++;
+
+	int R = 0, G = 0, B = 0, A = 255;
+
+	if (ar && (strlen(a_str) == 8 && sscanf_s(a_str, "%2x%2x%2x%2x", &R, &G, &B, &A) == 4) ||
+		(strlen(a_str) == 6 && sscanf_s(a_str, "%2x%2x%2x", &R, &G, &B) == 3))
+	{
+		// it's VERY unlikely these fail with %2x, but whatever...
+		if (R >= 0 && R <= 255 &&
+			G >= 0 && G <= 255 &&
+			B >= 0 && B <= 255 &&
+			A >= 0 && A <= 255)
+		{
+			ar->R = (uint8_t)R;
+			ar->G = (uint8_t)G;
+			ar->B = (uint8_t)B;
+			ar->A = (uint8_t)A;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+bool CNFORenderer::ParseColor(const wchar_t* a_str, S_COLOR_T* ar)
+{
+	const std::string l_color = CUtil::FromWideStr(a_str, CP_UTF8);
+	return ParseColor(l_color.c_str(), ar);
+}
+
+
+void CNFORenderer::InjectSettings(const CNFORenderSettings& ns)
+{
+	// use the setter methods so m_rendered only goes "false"
+	// if there has really been a change.
+
+	if (!m_classic)
+	{
+		if (ns.uBlockWidth > 0 && ns.uBlockWidth < 200 &&
+			ns.uBlockHeight > 0 && ns.uBlockHeight < 200)
+		{
+			SetBlockSize(ns.uBlockWidth, ns.uBlockHeight);
+		}
+
+		SetEnableGaussShadow(ns.bGaussShadow, ns.bGaussANSI);
+		SetGaussColor(ns.cGaussColor);
+		if (ns.uGaussBlurRadius <= 100)
+			SetGaussBlurRadius(ns.uGaussBlurRadius);
+		else
+			SetGaussBlurRadius(0);
+	}
+	else
+	{
+		if (ns.uFontSize >= 3 && ns.uFontSize < 200)
+			SetFontSize(ns.uFontSize);
+		else
+			SetFontSize(ms_defaultClassicFontSize);
+
+		SetEnableGaussShadow(false);
+		SetGaussBlurRadius(0);
+	}
+
+	SetBackColor(ns.cBackColor);
+	SetTextColor(ns.cTextColor);
+	SetArtColor(ns.cArtColor);
+
+	SetHilightHyperLinks(ns.bHilightHyperlinks);
+	SetHyperLinkColor(ns.cHyperlinkColor);
+	SetUnderlineHyperLinks(ns.bUnderlineHyperlinks);
+
+	SetFontBold(ns.bFontBold);
+	SetFontAntiAlias(ns.bFontAntiAlias);
+	SetFontFace(ns.sFontFace);
+
+	if (!m_rendered) // stuff has changed
+	{
+		ClearStripes();
+	}
+}
+
+
+void CNFORenderer::ClearStripes()
+{
+	StopPreRendering();
+
+	for (size_t l_slot = 0; m_stripes && l_slot < GetNumSlots(); l_slot++)
+	{
+		ResetStripe(l_slot);
+	}
+
+	m_stripes.reset();
+
+	m_stripeHeight = 0;
+	m_numStripes = 0;
+	m_linesPerStripe = 0;
+	m_colsPerTile = 0;
+	m_numTileCols = 1;
+}
+
+
+CNFORenderer::~CNFORenderer()
+{
+	ClearStripes();
+	DropZoomPreview();
+}
+
+
+/************************************************************************/
+/* CNFORenderSettings serialization                                     */
+/************************************************************************/
+
+std::wstring CNFORenderSettings::Serialize() const
+{
+	std::wstringstream l_ss;
+	l_ss << "{\n\t";
+
+	l_ss << "blw: " << uBlockWidth << ";\n\t";
+	l_ss << "blh: " << uBlockHeight << ";\n\t";
+	l_ss << "fos: " << uFontSize << ";\n\t";
+
+	l_ss << "cba: " << cBackColor.AsHex(true) << ";\n\t";
+	l_ss << "cte: " << cTextColor.AsHex(true) << ";\n\t";
+	l_ss << "car: " << cArtColor.AsHex(true) << ";\n\t";
+
+	l_ss << "fof: '" << sFontFace << "';\n\t";
+	l_ss << "fob: " << (bFontBold ? 1 : 0) << ";\n\t";
+	l_ss << "foa: " << (bFontAntiAlias ? 1 : 0) << ";\n\t";
+
+	l_ss << "cga: " << cGaussColor.AsHex(true) << ";\n\t";
+	l_ss << "gas: " << (bGaussShadow ? 1 : 0) << ";\n\t";
+	l_ss << "gar: " << uGaussBlurRadius << ";\n\t";
+	// no need to serialize bGaussANSI I think.
+
+	l_ss << "hhl: " << (bHilightHyperlinks ? 1 : 0) << ";\n\t";
+	l_ss << "chl: " << cHyperlinkColor.AsHex(true) << ";\n\t";
+	l_ss << "hul: " << (bUnderlineHyperlinks ? 1 : 0) << ";\n";
+
+	l_ss << "}";
+	return l_ss.str();
+}
+
+
+bool CNFORenderSettings::UnSerialize(std::wstring a_str, bool a_classic)
+{
+	CUtil::StrTrim(a_str);
+
+	if (a_str.size() < 3 || a_str[0] != L'{' || a_str[a_str.size() - 1] != L'}')
+	{
+		return false;
+	}
+
+	a_str.erase(0, 1);
+	a_str.erase(a_str.size() - 1);
+	CUtil::StrTrim(a_str);
+
+	int l_numExtracted = 0;
+	CNFORenderSettings l_tmpSets;
+
+	std::wstring::size_type l_colonPos = a_str.find(L':'), l_posBeforeColon = 0;
+	while (l_colonPos != std::wstring::npos)
+	{
+		std::wstring l_key = a_str.substr(l_posBeforeColon, l_colonPos - l_posBeforeColon);
+
+		std::wstring::size_type l_pos = l_colonPos + 1;
+		while (l_pos < a_str.size() && iswspace(a_str[l_pos])) l_pos++;
+
+		if (l_pos >= a_str.size() - 1) break;
+
+		std::wstring::size_type l_valEndPos;
+
+		if (a_str[l_pos] == L'\'')
+		{
+			l_valEndPos = a_str.find(L'\'', l_pos + 1);
+		}
+		else
+		{
+			l_valEndPos = a_str.find(L';', l_pos);
+		}
+
+		if (l_valEndPos == std::wstring::npos)
+		{
+			break;
+		}
+
+		std::wstring l_val = a_str.substr(l_pos, l_valEndPos - l_pos);
+
+		if (a_str[l_pos] == L'\'')
+		{
+			l_val.erase(0, 1);
+
+			l_valEndPos = a_str.find(L';', l_valEndPos);
+
+			if (l_valEndPos == std::wstring::npos)
+			{
+				l_valEndPos = a_str.size();
+			}
+		}
+
+		l_numExtracted++;
+
+		if (l_key == L"blw")
+			l_tmpSets.uBlockWidth = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
+		else if (l_key == L"blh")
+			l_tmpSets.uBlockHeight = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
+		else if (l_key == L"fos")
+			l_tmpSets.uFontSize = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
+		else if (l_key == L"cba")
+			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cBackColor);
+		else if (l_key == L"cte")
+			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cTextColor);
+		else if (l_key == L"car")
+			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cArtColor);
+		else if (l_key == L"fof" && l_val.size() <= LF_FACESIZE)
+		{
+#ifdef _UNICODE
+			wcscpy_s(l_tmpSets.sFontFace, LF_FACESIZE + 1, l_val.c_str());
+#else
+			const std::string l_sff = CUtil::FromWideStr(l_val, CP_UTF8);
+
+			if (l_sff.size() <= LF_FACESIZE)
+			{
+				strcpy_s(l_tmpSets.sFontFace, LF_FACESIZE + 1, l_sff.c_str());
+			}
+#endif
+		}
+		else if (l_key == L"fob")
+			l_tmpSets.bFontBold = (wcstol(l_val.c_str(), nullptr, 10) != 0);
+		else if (l_key == L"foa")
+			l_tmpSets.bFontAntiAlias = (wcstol(l_val.c_str(), nullptr, 10) != 0);
+		else if (l_key == L"cga")
+			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cGaussColor);
+		else if (l_key == L"gas")
+			l_tmpSets.bGaussShadow = (wcstol(l_val.c_str(), nullptr, 10) != 0);
+		else if (l_key == L"gar")
+			l_tmpSets.uGaussBlurRadius = static_cast<unsigned int>(wcstoul(l_val.c_str(), nullptr, 10));
+		else if (l_key == L"hhl")
+			l_tmpSets.bHilightHyperlinks = (wcstol(l_val.c_str(), nullptr, 10) != 0);
+		else if (l_key == L"chl")
+			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cHyperlinkColor);
+		else if (l_key == L"hul")
+			l_tmpSets.bUnderlineHyperlinks = (wcstol(l_val.c_str(), nullptr, 10) != 0);
+		else
+			l_numExtracted--;
 
-					l_inLink = l_linkAtPos;
-				}
+		l_posBeforeColon = l_valEndPos + 1;
+		l_colonPos = a_str.find(L':', l_posBeforeColon);
+	}
 
-				cairo_restore(cr);
-			}
+	if (l_numExtracted > 0)
+	{
+		// we use this to validate the raw data from a_str:
+		CNFORenderer l_dummyRenderer(a_classic);
+		l_dummyRenderer.InjectSettings(l_tmpSets);
 
-			// free glyph array (allocated by cairo_scaled_font_text_to_glyphs):
-			cairo_glyph_free(l_glyphs);
+		*this = l_dummyRenderer.GetSettings();
 
-			l_utfBuf = "";
-		}
+		return true;
 	}
 
-	_FinalizeDrawingTools(&cr, &l_fontOptions);
+	return false;
 }
 
 
-bool CNFORenderer::CalcClassicModeBlockSizes(bool a_force)
+void CNFORenderer::WaitForPreRender()
 {
-	bool success = true;
+	CRenderPool::GetInstance().WaitForOwner(this);
 
-	if (m_classic && (m_fontSize < 0 || a_force))
-	{
-		cairo_surface_t* l_tmpSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 100, 100);
+	m_cancelRenderingImmediately = false;
+}
 
-		cairo_t* cr;
-		cairo_font_options_t* l_fontOptions;
-		_SetUpDrawingTools(this, l_tmpSurface, &cr, &l_fontOptions);
 
-		wchar_t l_blockStr[2] = { 9608, 0 }; // full block + null terminator
-		const std::string l_blockStrUtf = CUtil::FromWideStr(l_blockStr, CP_UTF8);
+void CNFORenderer::StopPreRendering(bool a_cancel)
+{
+	// whatever they're waiting for is about to go away:
+	AbortRequests();
 
-		cairo_text_extents_t l_extents;
-		cairo_text_extents(cr, l_blockStrUtf.c_str(), &l_extents);
+	m_stopPreRendering = true;
+	m_cancelRenderingImmediately = a_cancel;
 
-		if (l_extents.x_advance < 1 || l_extents.height < 1)
-		{
-			success = false;
-		}
-		else
-		{
-			m_settings.uBlockWidth = (size_t)l_extents.x_advance;
-			m_settings.uBlockHeight = (size_t)l_extents.height;
+	CRenderPool::GetInstance().Cancel(this);
 
-			m_fontSize = 1; // we use this as a flag. pretty gross, huh?
+	WaitForPreRender();
+
+	// stripes whose tasks have been dropped before they ran are still claimed:
+	for (size_t l_slot = 0; m_stripes && l_slot < GetNumSlots(); l_slot++)
+	{
+		if (m_stripes[l_slot].state.load() == SS_RENDERING)
+		{
+			ResetStripe(l_slot);
 		}
+	}
+}
 
-		_FinalizeDrawingTools(&cr, &l_fontOptions);
 
-		cairo_surface_destroy(l_tmpSurface);
+void CNFORenderer::PreRender()
+{
+	if (!m_stopPreRendering || GetNumSlots() < 2)
+	{
+		return;
 	}
 
-	return success;
+	m_stopPreRendering = false;
+
+	QueuePreRender();
 }
 
 
-void CNFORenderer::RenderClassic(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
-	const S_COLOR_T& a_hyperLinkColor, bool a_backBlocks,
-	size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
-	cairo_surface_t* a_surface, double a_xBase, double a_yBase) const
+void CNFORenderer::SetViewportHint(size_t a_firstRow, size_t a_lastRow, int a_velocity)
 {
-	double l_off_x = a_xBase + GetPadding(), l_off_y = a_yBase + GetPadding();
+	m_viewFirstRow = a_firstRow;
+	m_viewLastRow = std::max(a_firstRow, a_lastRow);
+	m_viewVelocity = a_velocity;
 
-	_FixUpRowColStartEnd(a_rowStart, a_colStart, a_rowEnd, a_colEnd);
+	if (!m_stopPreRendering && GetNumSlots() > 1)
+	{
+		// re-order whatever has not been picked up by a worker yet:
+		CRenderPool::GetInstance().Cancel(this, RP_BACKGROUND);
 
-	cairo_t* cr;
-	cairo_font_options_t* l_fontOptions;
-	_SetUpDrawingTools(this, a_surface, &cr, &l_fontOptions);
+		QueuePreRender();
+	}
+}
 
-	_SetUpHyperLinkUnderlining(this, cr);
 
-	cairo_font_extents_t l_font_extents;
-	cairo_font_extents(cr, &l_font_extents);
+/**
+ * Submits one task per stripe that still needs rendering, fanning out from the
+ * viewport. Stripes in the direction of travel are queued twice as often as
+ * the ones behind the viewport. Visible stripes submitted by Render() always
+ * take precedence, and the pool spreads these tasks across all workers.
+ **/
+void CNFORenderer::QueuePreRender()
+{
+	const size_t l_firstStripe = std::min(m_viewFirstRow / m_linesPerStripe, m_numStripes - 1),
+		l_lastStripe = std::min(m_viewLastRow / m_linesPerStripe, m_numStripes - 1);
+	const size_t l_reach = (m_preRenderLookAhead > 0 ? (m_preRenderLookAhead + m_linesPerStripe - 1) / m_linesPerStripe : m_numStripes);
+	const bool l_downwards = (m_viewVelocity >= 0);
+	const int l_aheadPerBehind = (m_viewVelocity != 0 ? 2 : 1);
 
-	size_t l_rowStart = 0, l_rowEnd = m_gridData->GetRows() - 1;
-	if (a_rowStart != (size_t)-1)
+	std::vector<size_t> l_order;
+
+	for (size_t l_stripe = l_firstStripe; l_stripe <= l_lastStripe; l_stripe++)
 	{
-		l_rowStart = std::max(a_rowStart, l_rowStart);
-		l_rowEnd = std::min(a_rowEnd, l_rowEnd);
+		l_order.push_back(l_stripe);
 	}
 
-	typedef enum
+	// returns false if a_distance leads outside of the document:
+	auto l_addStripe = [&](size_t a_distance, bool a_below) {
+		if (a_below ? l_lastStripe + a_distance >= m_numStripes : a_distance > l_firstStripe)
+			return false;
+		l_order.push_back(a_below ? l_lastStripe + a_distance : l_firstStripe - a_distance);
+		return true;
+	};
+
+	for (size_t l_ahead = 1, l_behind = 1; ; )
 	{
-		_BT_UNDEF = -1,
-		BT_TEXT = 1,
-		BT_BLOCK,
-		BT_LINK
-	} _block_color_type;
+		bool l_added = false;
 
-	std::string l_utfBuf;
-	l_utfBuf.reserve(m_nfo->GetGridWidth());
+		for (int k = 0; k < l_aheadPerBehind && l_ahead <= l_reach; k++)
+		{
+			l_added |= l_addStripe(l_ahead++, l_downwards);
+		}
 
-	for (size_t row = l_rowStart; row <= l_rowEnd; row++)
-	{
-		_block_color_type l_curType = _BT_UNDEF;
-		size_t l_bufStart = (size_t)-1;
+		if (l_behind <= l_reach)
+		{
+			l_added |= l_addStripe(l_behind++, !l_downwards);
+		}
 
-		if (m_cancelRenderingImmediately)
+		if (!l_added)
 		{
 			break;
 		}
+	}
 
-		for (size_t col = 0; col <= m_gridData->GetCols(); col++)
+	for (size_t l_stripe : l_order)
+	{
+		for (size_t l_tile = 0; l_tile < m_numTileCols; l_tile++)
 		{
-			if (a_rowStart != (size_t)-1)
-			{
-				if (row == a_rowStart && col < a_colStart)
-					continue;
-				else if (row == a_rowEnd && col > a_colEnd)
-					col = m_gridData->GetCols();
-			}
-
-			_block_color_type l_type;
+			const size_t l_slot = GetSlot(l_stripe, l_tile);
 
-			if (col != m_gridData->GetCols())
+			if (m_stripes[l_slot].state.load() == SS_READY)
 			{
-				const CRenderGridBlock& l_block = (*m_gridData)[row][col];
+				continue;
+			}
 
-				if (l_block.shape == RGS_NO_BLOCK)
-				{
-					if (GetHilightHyperLinks() && m_nfo->GetLink(row, col) != nullptr)
-						l_type = BT_LINK;
-					else
-						l_type = BT_TEXT;
-				}
-				else if (l_block.shape == RGS_WHITESPACE_IN_TEXT && l_curType != BT_LINK)
+			CRenderPool::GetInstance().Submit(this, RP_BACKGROUND, [this, l_slot] {
+				// pre-rendering must not push visited stripes out of the cache:
+				if (m_onDemandRendering && !CStripeCache::GetInstance().HasRoomFor(GetStripeBytes(l_slot)))
 				{
-					l_type = l_curType;
+					return;
 				}
-				else
+
+				if (!m_stopPreRendering && ClaimStripe(l_slot))
 				{
-					l_type = BT_BLOCK;
+					RenderStripe(l_slot);
+					FinishStripe(l_slot);
 				}
-			}
-			else
-			{
-				l_type = _BT_UNDEF;
-			}
+			});
+		}
+	}
+}
 
-			if (l_type == l_curType && l_type != _BT_UNDEF)
-			{
-				l_utfBuf += m_nfo->GetGridCharUtf8(row, col);
-				if (l_bufStart == (size_t)-1) l_bufStart = col;
 
-				continue;
-			}
-			/* else */
+static void _DestroyLayers(SStripeSlot& ar_slot)
+{
+	for (size_t l_layer = 0; l_layer < _SL_MAX; l_layer++)
+	{
+		if (ar_slot.layers[l_layer])
+		{
+			cairo_surface_destroy(ar_slot.layers[l_layer]);
+			ar_slot.layers[l_layer] = nullptr;
+		}
+	}
 
-			if (l_curType != _BT_UNDEF && !l_utfBuf.empty() &&
-				!(l_curType == BT_BLOCK && (m_partial & NRP_RENDER_BLOCKS) == 0) &&
-				!((l_curType == BT_TEXT || l_curType == BT_LINK) && (m_partial & NRP_RENDER_TEXT) == 0))
-			{
-				// draw buffer:
-				size_t l_len = (col == m_gridData->GetCols() ? utf8_strlen(l_utfBuf.c_str(), -1) :
-					(col - l_bufStart));
+	ar_slot.layered = false;
+}
 
-				// draw char background for highlights/selection etc:
-				if (a_backColor && (l_curType != BT_BLOCK || a_backBlocks))
-				{
-					cairo_save(cr);
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(*a_backColor));
-					cairo_rectangle(cr,
-						static_cast<double>(l_off_x + l_bufStart * GetBlockWidth()),
-						static_cast<double>(row * GetBlockHeight() + l_off_y),
-						static_cast<double>(GetBlockWidth() * l_len),
-						static_cast<double>(GetBlockHeight()));
-					cairo_fill(cr);
-					cairo_restore(cr);
-				}
 
-				if (l_curType == BT_LINK && GetUnderlineHyperLinks())
-				{
-					cairo_move_to(cr,
-						static_cast<double>(l_off_x + l_bufStart * GetBlockWidth()),
-						static_cast<double>(l_off_y + (row + 1) * GetBlockHeight()));
-					cairo_rel_line_to(cr, static_cast<double>(GetBlockWidth() * l_len), 0);
-					cairo_stroke(cr);
-				}
+/**
+ * Converts an ARGB32 surface to an A8 surface of indexes into ar_palette.
+ * Gives up and returns nullptr as soon as there are more than 256 colors.
+ * Non-ANSI NFOs only use back, text, art, link and glow color, plus the
+ * anti-aliasing shades between them, so this almost always works out.
+ **/
+static cairo_surface_t* _IndexSurface(cairo_surface_t* a_surface, std::vector<uint32_t>& ar_palette)
+{
+	const int l_width = cairo_image_surface_get_width(a_surface),
+		l_height = cairo_image_surface_get_height(a_surface),
+		l_stride = cairo_image_surface_get_stride(a_surface);
 
-				cairo_move_to(cr, l_off_x + l_bufStart * GetBlockWidth(),
-					row * GetBlockHeight() + l_off_y + l_font_extents.ascent);
+	cairo_surface_flush(a_surface);
 
-				cairo_show_text(cr, l_utfBuf.c_str());
-			}
+	const unsigned char* l_data = cairo_image_surface_get_data(a_surface);
 
-			// set up new type
-			l_curType = l_type;
+	// open addressing, twice the palette size keeps the probe sequences short:
+	const size_t TABLE_SIZE = 512;
+	uint32_t l_keys[TABLE_SIZE];
+	int l_values[TABLE_SIZE];
+
+	std::fill_n(l_values, TABLE_SIZE, -1);
+	ar_palette.clear();
+
+	cairo_surface_t* l_indexed = cairo_image_surface_create(CAIRO_FORMAT_A8, l_width, l_height);
+	const int l_indexedStride = cairo_image_surface_get_stride(l_indexed);
 
-			if (l_type != _BT_UNDEF)
+	cairo_surface_flush(l_indexed);
+
+	unsigned char* l_indexedData = cairo_image_surface_get_data(l_indexed);
+
+	for (int y = 0; y < l_height; y++)
+	{
+		const uint32_t* l_row = reinterpret_cast<const uint32_t*>(l_data + y * l_stride);
+		unsigned char* l_dest = l_indexedData + y * l_indexedStride;
+		uint32_t l_lastPixel = 0;
+		int l_lastIndex = -1;
+
+		for (int x = 0; x < l_width; x++)
+		{
+			const uint32_t l_pixel = l_row[x];
+
+			// most rows are long runs of the same color:
+			if (l_pixel != l_lastPixel || l_lastIndex < 0)
 			{
-				if (l_type == BT_LINK)
-				{
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_hyperLinkColor));
-				}
-				else if (l_type == BT_TEXT || a_backBlocks)
+				size_t l_slot = (l_pixel * 2654435761u) >> 23;
+
+				while (l_values[l_slot] >= 0 && l_keys[l_slot] != l_pixel)
 				{
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(a_textColor));
+					l_slot = (l_slot + 1) % TABLE_SIZE;
 				}
-				else if (l_type == BT_BLOCK)
+
+				if (l_values[l_slot] < 0)
 				{
-					cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetArtColor()));
+					if (ar_palette.size() == 256)
+					{
+						cairo_surface_destroy(l_indexed);
+						ar_palette.clear();
+						return nullptr;
+					}
+
+					l_keys[l_slot] = l_pixel;
+					l_values[l_slot] = static_cast<int>(ar_palette.size());
+					ar_palette.push_back(l_pixel);
 				}
 
-				l_utfBuf = m_nfo->GetGridCharUtf8(row, col);
-				l_bufStart = col;
+				l_lastPixel = l_pixel;
+				l_lastIndex = l_values[l_slot];
 			}
-		} /* end of inner for loop */
+
+			l_dest[x] = static_cast<unsigned char>(l_lastIndex);
+		}
 	}
 
-	_FinalizeDrawingTools(&cr, &l_fontOptions);
+	cairo_surface_mark_dirty(l_indexed);
+
+	return l_indexed;
 }
 
 
-bool CNFORenderer::IsTextChar(size_t a_row, size_t a_col, bool a_allowWhiteSpace) const
+/**
+ * Row-level RLE for ARGB32 surfaces. Each row starts with a flag byte, 1 = same as
+ * the previous row. Otherwise, 16 bit tokens follow until the row is complete:
+ * with the high bit set, the next pixel repeats (token & 0x7FFF) times, without
+ * it, (token) literal pixels follow. Rendered stripes are mostly flat background,
+ * so this typically gets them down to a few percent of their size.
+ **/
+static void _PackSurface(cairo_surface_t* a_surface, std::vector<uint8_t>& ar_packed)
 {
-	if (!m_gridData) return false;
+	cairo_surface_flush(a_surface);
 
-	if (a_row < m_gridData->GetRows() && a_col < m_gridData->GetCols())
+	const uint8_t* l_data = cairo_image_surface_get_data(a_surface);
+	const int l_width = cairo_image_surface_get_width(a_surface),
+		l_height = cairo_image_surface_get_height(a_surface),
+		l_stride = cairo_image_surface_get_stride(a_surface);
+	const size_t l_maxCount = 0x7FFF;
+
+	ar_packed.clear();
+
+	auto l_put16 = [&ar_packed](uint16_t v) {
+		ar_packed.push_back(static_cast<uint8_t>(v & 0xFF));
+		ar_packed.push_back(static_cast<uint8_t>(v >> 8));
+	};
+
+	for (int y = 0; y < l_height; y++)
 	{
-		const CRenderGridBlock& l_block = (*m_gridData)[a_row][a_col];
+		const uint32_t* l_row = reinterpret_cast<const uint32_t*>(l_data + y * l_stride);
 
-		if (m_classic)
-		{
-			return a_allowWhiteSpace || (l_block.shape != RGS_WHITESPACE);
-		}
-		else
+		if (y > 0 && memcmp(l_row, l_data + (y - 1) * l_stride, l_width * sizeof(uint32_t)) == 0)
 		{
-			return (l_block.shape == RGS_NO_BLOCK ||
-				(a_allowWhiteSpace && l_block.shape == RGS_WHITESPACE_IN_TEXT));
+			ar_packed.push_back(1);
+			continue;
 		}
-	}
 
-	return false;
-}
+		ar_packed.push_back(0);
 
+		size_t x = 0;
 
-void CNFORenderer::SetZoom(unsigned int a_percent)
-{
-	unsigned int l_oldPercent = static_cast<unsigned int>(m_zoomFactor * 100);
+		while (x < (size_t)l_width)
+		{
+			size_t l_run = 1;
 
-	if (a_percent != l_oldPercent)
-	{
-		m_zoomFactor = a_percent / 100.0f;
+			while (x + l_run < (size_t)l_width && l_run < l_maxCount && l_row[x + l_run] == l_row[x])
+			{
+				l_run++;
+			}
 
-		ClearStripes();
+			if (l_run >= 3)
+			{
+				l_put16(static_cast<uint16_t>(0x8000 | l_run));
+				ar_packed.insert(ar_packed.end(), reinterpret_cast<const uint8_t*>(&l_row[x]),
+					reinterpret_cast<const uint8_t*>(&l_row[x + 1]));
 
-		m_fontSize = -1;
-		m_rendered = false;
-	}
-}
+				x += l_run;
+				continue;
+			}
 
+			// collect literals up to the next run of at least three pixels:
+			size_t l_end = x;
 
-size_t CNFORenderer::GetWidth() const
-{
-	if (!m_nfo) return 0;
+			while (l_end < (size_t)l_width && l_end - x < l_maxCount)
+			{
+				if (l_end + 2 < (size_t)l_width && l_row[l_end] == l_row[l_end + 1] && l_row[l_end] == l_row[l_end + 2])
+				{
+					break;
+				}
 
-	return m_nfo->GetGridWidth() * GetBlockWidth() + GetPadding() * 2;
-}
+				l_end++;
+			}
 
+			l_put16(static_cast<uint16_t>(l_end - x));
+			ar_packed.insert(ar_packed.end(), reinterpret_cast<const uint8_t*>(&l_row[x]),
+				reinterpret_cast<const uint8_t*>(&l_row[l_end]));
 
-size_t CNFORenderer::GetHeight() const
-{
-	if (!m_nfo) return 0;
+			x = l_end;
+		}
+	}
 
-	return m_nfo->GetGridHeight() * GetBlockHeight() + GetPadding() * 2;
+	ar_packed.shrink_to_fit();
 }
 
 
-bool CNFORenderer::ParseColor(const char* a_str, S_COLOR_T* ar)
+static bool _UnpackSurface(const std::vector<uint8_t>& a_packed, cairo_surface_t* a_surface)
 {
-	if (ar && _stricmp(a_str, "transparent") == 0)
+	if (!a_surface || a_packed.empty())
 	{
-		ar->R = ar->G = ar->B = 255;
-		ar->A = 0;
-		return true;
+		return false;
 	}
 
-	// HTML/CSS style!
-	if (a_str[0] == '#') a_str++;
+	cairo_surface_flush(a_surface);
 
-	int R = 0, G = 0, B = 0, A = 255;
+	uint8_t* l_data = cairo_image_surface_get_data(a_surface);
+	const int l_width = cairo_image_surface_get_width(a_surface),
+		l_height = cairo_image_surface_get_height(a_surface),
+		l_stride = cairo_image_surface_get_stride(a_surface);
+	const uint8_t *p = a_packed.data(), *l_end = p + a_packed.size();
 
-	if (ar && (strlen(a_str) == 8 && sscanf_s(a_str, "%2x%2x%2x%2x", &R, &G, &B, &A) == 4) ||
-		(strlen(a_str) == 6 && sscanf_s(a_str, "%2x%2x%2x", &R, &G, &B) == 3))
+	for (int y = 0; y < l_height; y++)
 	{
-		// it's VERY unlikely these fail with %2x, but whatever...
-		if (R >= 0 && R <= 255 &&
-			G >= 0 && G <= 255 &&
-			B >= 0 && B <= 255 &&
-			A >= 0 && A <= 255)
+		uint32_t* l_row = reinterpret_cast<uint32_t*>(l_data + y * l_stride);
+
+		if (p >= l_end)
 		{
-			ar->R = (uint8_t)R;
-			ar->G = (uint8_t)G;
-			ar->B = (uint8_t)B;
-			ar->A = (uint8_t)A;
+			return false;
+		}
+
+		if (*p++ == 1)
+		{
+			if (y == 0)
+			{
+				return false;
+			}
+
+			memcpy(l_row, l_data + (y - 1) * l_stride, l_width * sizeof(uint32_t));
+			continue;
+		}
+
+		size_t x = 0;
+
+		while (x < (size_t)l_width)
+		{
+			if (l_end - p < 2)
+			{
+				return false;
+			}
+
+			const uint16_t l_token = static_cast<uint16_t>(p[0] | (p[1] << 8));
+			const size_t l_count = l_token & 0x7FFF;
+			p += 2;
+
+			if (l_count == 0 || x + l_count > (size_t)l_width)
+			{
+				return false;
+			}
+
+			if (l_token & 0x8000)
+			{
+				uint32_t l_pixel;
 
-			return true;
+				if (l_end - p < 4)
+				{
+					return false;
+				}
+
+				memcpy(&l_pixel, p, sizeof(uint32_t));
+				p += 4;
+
+				std::fill(l_row + x, l_row + x + l_count, l_pixel);
+			}
+			else
+			{
+				if ((size_t)(l_end - p) < l_count * 4)
+				{
+					return false;
+				}
+
+				memcpy(l_row + x, p, l_count * 4);
+				p += l_count * 4;
+			}
+
+			x += l_count;
 		}
 	}
 
-	return false;
-}
-
+	cairo_surface_mark_dirty(a_surface);
 
-bool CNFORenderer::ParseColor(const wchar_t* a_str, S_COLOR_T* ar)
-{
-	const std::string l_color = CUtil::FromWideStr(a_str, CP_UTF8);
-	return ParseColor(l_color.c_str(), ar);
+	return (p == l_end);
 }
 
 
-void CNFORenderer::InjectSettings(const CNFORenderSettings& ns)
+/**
+ * Moves a_slot from EMPTY or EVICTED to RENDERING and gives it a fresh surface.
+ * If ar_unpack is given, PACKED stripes are claimed too, and *ar_unpack tells
+ * whether the surface needs to be filled by UnpackStripe instead of RenderStripe.
+ * Returns false if the stripe is being rendered or has been rendered already.
+ **/
+bool CNFORenderer::ClaimStripe(size_t a_slot, bool* ar_unpack)
 {
-	// use the setter methods so m_rendered only goes "false"
-	// if there has really been a change.
+	SStripeSlot& l_slot = m_stripes[a_slot];
+	EStripeState l_state = l_slot.state.load();
 
-	if (!m_classic)
+	do
 	{
-		if (ns.uBlockWidth > 0 && ns.uBlockWidth < 200 &&
-			ns.uBlockHeight > 0 && ns.uBlockHeight < 200)
+		if (l_state != SS_EMPTY && l_state != SS_EVICTED && (l_state != SS_PACKED || !ar_unpack))
 		{
-			SetBlockSize(ns.uBlockWidth, ns.uBlockHeight);
+			return false;
 		}
+	} while (!l_slot.state.compare_exchange_weak(l_state, SS_RENDERING));
 
-		SetEnableGaussShadow(ns.bGaussShadow, ns.bGaussANSI);
-		SetGaussColor(ns.cGaussColor);
-		if (ns.uGaussBlurRadius <= 100)
-			SetGaussBlurRadius(ns.uGaussBlurRadius);
-		else
-			SetGaussBlurRadius(0);
-	}
-	else
+	if (l_state == SS_PACKED)
 	{
-		if (ns.uFontSize >= 3 && ns.uFontSize < 200)
-			SetFontSize(ns.uFontSize);
-		else
-			SetFontSize(ms_defaultClassicFontSize);
+		*ar_unpack = true;
 
-		SetEnableGaussShadow(false);
-		SetGaussBlurRadius(0);
+		CStripeCache::GetInstance().RemovePacked(this, a_slot);
 	}
 
-	SetBackColor(ns.cBackColor);
-	SetTextColor(ns.cTextColor);
-	SetArtColor(ns.cArtColor);
+	l_slot.surface.store(cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+		GetTileWidthPhysical(GetSlotTile(a_slot)), GetStripeHeightPhysical(GetSlotStripe(a_slot))), std::memory_order_release);
 
-	SetHilightHyperLinks(ns.bHilightHyperlinks);
-	SetHyperLinkColor(ns.cHyperlinkColor);
-	SetUnderlineHyperLinks(ns.bUnderlineHyperlinks);
+	return true;
+}
 
-	SetFontBold(ns.bFontBold);
-	SetFontAntiAlias(ns.bFontAntiAlias);
-	SetFontFace(ns.sFontFace);
 
-	if (!m_rendered) // stuff has changed
+void CNFORenderer::FinishStripe(size_t a_slot)
+{
+	SStripeSlot& l_slot = m_stripes[a_slot];
+
+	if (IsRenderingCancelled())
 	{
-		ClearStripes();
+		// incomplete, will be rendered again when it's needed:
+		cairo_surface_destroy(l_slot.surface.exchange(nullptr));
+		_DestroyLayers(l_slot);
+		l_slot.state.store(SS_EMPTY);
 	}
-}
-
+	else
+	{
+		if (m_paletteStripes && !IsAnsi())
+		{
+			if (cairo_surface_t* l_indexed = _IndexSurface(l_slot.surface.load(), l_slot.palette))
+			{
+				cairo_surface_destroy(l_slot.surface.exchange(l_indexed));
+			}
+		}
 
-void CNFORenderer::ClearStripes()
-{
-	StopPreRendering();
+		l_slot.state.store(SS_READY, std::memory_order_release);
 
-	m_stripes.clear();
+		// only READY stripes can be evicted, so register it afterwards:
+		if (m_onDemandRendering)
+		{
+			CStripeCache::GetInstance().Insert(this, a_slot, GetStripeBytes(a_slot, !l_slot.palette.empty()));
+		}
+	}
 
-	m_stripeHeight = 0;
-	m_numStripes = 0;
-	m_linesPerStripe = 0;
-}
+	l_slot.state.notify_all();
 
+	if (m_zoomPreviewActive && m_stripeReadyCallback && !IsRenderingCancelled())
+	{
+		// time to replace some of the preview:
+		m_stripeReadyCallback();
+	}
 
-CNFORenderer::~CNFORenderer()
-{
-	ClearStripes();
+	NotifyRequests(a_slot);
 }
 
 
-/************************************************************************/
-/* CNFORenderSettings serialization                                     */
-/************************************************************************/
-
-std::wstring CNFORenderSettings::Serialize() const
+void CNFORenderer::WaitForStripe(size_t a_slot) const
 {
-	std::wstringstream l_ss;
-	l_ss << "{\n\t";
-
-	l_ss << "blw: " << uBlockWidth << ";\n\t";
-	l_ss << "blh: " << uBlockHeight << ";\n\t";
-	l_ss << "fos: " << uFontSize << ";\n\t";
-
-	l_ss << "cba: " << cBackColor.AsHex(true) << ";\n\t";
-	l_ss << "cte: " << cTextColor.AsHex(true) << ";\n\t";
-	l_ss << "car: " << cArtColor.AsHex(true) << ";\n\t";
-
-	l_ss << "fof: '" << sFontFace << "';\n\t";
-	l_ss << "fob: " << (bFontBold ? 1 : 0) << ";\n\t";
-	l_ss << "foa: " << (bFontAntiAlias ? 1 : 0) << ";\n\t";
-
-	l_ss << "cga: " << cGaussColor.AsHex(true) << ";\n\t";
-	l_ss << "gas: " << (bGaussShadow ? 1 : 0) << ";\n\t";
-	l_ss << "gar: " << uGaussBlurRadius << ";\n\t";
-	// no need to serialize bGaussANSI I think.
-
-	l_ss << "hhl: " << (bHilightHyperlinks ? 1 : 0) << ";\n\t";
-	l_ss << "chl: " << cHyperlinkColor.AsHex(true) << ";\n\t";
-	l_ss << "hul: " << (bUnderlineHyperlinks ? 1 : 0) << ";\n";
+	const SStripeSlot& l_slot = m_stripes[a_slot];
 
-	l_ss << "}";
-	return l_ss.str();
+	l_slot.state.wait(SS_RENDERING, std::memory_order_acquire);
 }
 
 
-bool CNFORenderSettings::UnSerialize(std::wstring a_str, bool a_classic)
+/**
+ * Must only be used when no task for a_slot can be running.
+ **/
+void CNFORenderer::ResetStripe(size_t a_slot)
 {
-	CUtil::StrTrim(a_str);
+	SStripeSlot& l_slot = m_stripes[a_slot];
 
-	if (a_str.size() < 3 || a_str[0] != L'{' || a_str[a_str.size() - 1] != L'}')
+	CStripeCache::GetInstance().Remove(this, a_slot);
+	CStripeCache::GetInstance().RemovePacked(this, a_slot);
+
+	if (cairo_surface_t* l_surface = l_slot.surface.exchange(nullptr))
 	{
-		return false;
+		cairo_surface_destroy(l_surface);
 	}
 
-	a_str.erase(0, 1);
-	a_str.erase(a_str.size() - 1);
-	CUtil::StrTrim(a_str);
+	std::vector<uint8_t>().swap(l_slot.packed);
+	l_slot.palette.clear();
 
-	int l_numExtracted = 0;
-	CNFORenderSettings l_tmpSets;
+	_DestroyLayers(l_slot);
 
-	std::wstring::size_type l_colonPos = a_str.find(L':'), l_posBeforeColon = 0;
-	while (l_colonPos != std::wstring::npos)
-	{
-		std::wstring l_key = a_str.substr(l_posBeforeColon, l_colonPos - l_posBeforeColon);
+	l_slot.state.store(SS_EMPTY);
+	l_slot.state.notify_all();
+}
 
-		std::wstring::size_type l_pos = l_colonPos + 1;
-		while (l_pos < a_str.size() && iswspace(a_str[l_pos])) l_pos++;
 
-		if (l_pos >= a_str.size() - 1) break;
+/**
+ * Brings all READY stripes up to date with the current colors. Stripes with
+ * color layers are recomposited on the render pool, the others are reset.
+ **/
+void CNFORenderer::RecompositeStripes()
+{
+	// stripes that are being rendered right now would come out in the old colors:
+	StopPreRendering(true);
 
-		std::wstring::size_type l_valEndPos;
+	std::vector<size_t> l_slots;
 
-		if (a_str[l_pos] == L'\'')
-		{
-			l_valEndPos = a_str.find(L'\'', l_pos + 1);
-		}
-		else
-		{
-			l_valEndPos = a_str.find(L';', l_pos);
-		}
+	for (size_t l_index = 0; m_stripes && l_index < GetNumSlots(); l_index++)
+	{
+		SStripeSlot& l_slot = m_stripes[l_index];
+		const EStripeState l_state = l_slot.state.load(std::memory_order_acquire);
 
-		if (l_valEndPos == std::wstring::npos)
+		if (l_state == SS_READY && l_slot.layered)
 		{
-			break;
-		}
+			// nothing else is running for this renderer, so no need to CAS:
+			l_slot.state.store(SS_RENDERING);
 
-		std::wstring l_val = a_str.substr(l_pos, l_valEndPos - l_pos);
+			// FinishStripe registers it again:
+			CStripeCache::GetInstance().Remove(this, l_index);
 
-		if (a_str[l_pos] == L'\'')
-		{
-			l_val.erase(0, 1);
+			if (!l_slot.palette.empty())
+			{
+				// CompositeStripe paints ARGB32, FinishStripe will index the result again:
+				cairo_surface_t* l_indexed = l_slot.surface.load();
 
-			l_valEndPos = a_str.find(L';', l_valEndPos);
+				l_slot.surface.store(cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					cairo_image_surface_get_width(l_indexed), cairo_image_surface_get_height(l_indexed)));
+				l_slot.palette.clear();
 
-			if (l_valEndPos == std::wstring::npos)
-			{
-				l_valEndPos = a_str.size();
+				cairo_surface_destroy(l_indexed);
 			}
-		}
 
-		l_numExtracted++;
-
-		if (l_key == L"blw")
-			l_tmpSets.uBlockWidth = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
-		else if (l_key == L"blh")
-			l_tmpSets.uBlockHeight = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
-		else if (l_key == L"fos")
-			l_tmpSets.uFontSize = static_cast<size_t>(wcstoul(l_val.c_str(), nullptr, 10));
-		else if (l_key == L"cba")
-			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cBackColor);
-		else if (l_key == L"cte")
-			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cTextColor);
-		else if (l_key == L"car")
-			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cArtColor);
-		else if (l_key == L"fof" && l_val.size() <= LF_FACESIZE)
+			l_slots.push_back(l_index);
+		}
+		else if (l_state == SS_READY || l_state == SS_PACKED)
 		{
-#ifdef _UNICODE
-			wcscpy_s(l_tmpSets.sFontFace, LF_FACESIZE + 1, l_val.c_str());
-#else
-			const std::string l_sff = CUtil::FromWideStr(l_val, CP_UTF8);
-
-			if (l_sff.size() <= LF_FACESIZE)
-			{
-				strcpy_s(l_tmpSets.sFontFace, LF_FACESIZE + 1, l_sff.c_str());
-			}
-#endif
+			ResetStripe(l_index);
 		}
-		else if (l_key == L"fob")
-			l_tmpSets.bFontBold = (wcstol(l_val.c_str(), nullptr, 10) != 0);
-		else if (l_key == L"foa")
-			l_tmpSets.bFontAntiAlias = (wcstol(l_val.c_str(), nullptr, 10) != 0);
-		else if (l_key == L"cga")
-			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cGaussColor);
-		else if (l_key == L"gas")
-			l_tmpSets.bGaussShadow = (wcstol(l_val.c_str(), nullptr, 10) != 0);
-		else if (l_key == L"gar")
-			l_tmpSets.uGaussBlurRadius = static_cast<unsigned int>(wcstoul(l_val.c_str(), nullptr, 10));
-		else if (l_key == L"hhl")
-			l_tmpSets.bHilightHyperlinks = (wcstol(l_val.c_str(), nullptr, 10) != 0);
-		else if (l_key == L"chl")
-			CNFORenderer::ParseColor(l_val.c_str(), &l_tmpSets.cHyperlinkColor);
-		else if (l_key == L"hul")
-			l_tmpSets.bUnderlineHyperlinks = (wcstol(l_val.c_str(), nullptr, 10) != 0);
-		else
-			l_numExtracted--;
-
-		l_posBeforeColon = l_valEndPos + 1;
-		l_colonPos = a_str.find(L':', l_posBeforeColon);
 	}
 
-	if (l_numExtracted > 0)
+	for (size_t l_index : l_slots)
 	{
-		// we use this to validate the raw data from a_str:
-		CNFORenderer l_dummyRenderer(a_classic);
-		l_dummyRenderer.InjectSettings(l_tmpSets);
-
-		*this = l_dummyRenderer.GetSettings();
+		CRenderPool::GetInstance().Submit(this, RP_VISIBLE, [this, l_index] {
+			CompositeStripe(l_index);
+			FinishStripe(l_index);
+		});
+	}
 
-		return true;
+	for (size_t l_index : l_slots)
+	{
+		WaitForStripe(l_index);
 	}
 
-	return false;
+	m_recomposite = false;
 }
 
 
-void CNFORenderer::WaitForPreRender()
+/**
+ * Drops a READY stripe's surface, Render() will claim and render it again when needed.
+ * If m_packEvictedStripes is set, the pixels are kept run-length encoded so that they
+ * can be restored without rendering, ar_packedBytes is set to the compressed size then.
+ * Only called by CStripeCache::Trim, from the thread that draws on-demand renderers.
+ **/
+bool CNFORenderer::EvictStripe(size_t a_slot, size_t& ar_packedBytes)
 {
-	auto l_renderThread = m_preRenderThread;
+	SStripeSlot& l_slot = m_stripes[a_slot];
+	EStripeState l_expected = SS_READY;
 
-	if (l_renderThread && l_renderThread->joinable())
-	{
-		l_renderThread->join();
+	ar_packedBytes = 0;
 
-		m_preRenderThread.reset();
+	// hold the stripe in RENDERING while packing so nobody else can claim it:
+	if (!l_slot.state.compare_exchange_strong(l_expected, SS_RENDERING))
+	{
+		return false;
 	}
 
-	m_cancelRenderingImmediately = false;
-}
+	// a packed budget of zero would throw the packed stripe away right after packing it:
+	if (m_packEvictedStripes && CStripeCache::GetInstance().GetPackedBudget() > 0)
+	{
+		// the packed format is ARGB32 only, palette stripes are indexed again when they are restored:
+		int l_x, l_y;
+		cairo_surface_t* l_surface = GetStripeSurfaceARGB(a_slot, 0, 0,
+			GetTileWidthPhysical(GetSlotTile(a_slot)), GetStripeHeightPhysical(GetSlotStripe(a_slot)), l_x, l_y);
 
+		_PackSurface(l_surface, l_slot.packed);
 
-void CNFORenderer::StopPreRendering(bool a_cancel)
-{
-	if (!m_preRenderThread || m_stopPreRendering)
-	{
-		return;
+		cairo_surface_destroy(l_surface);
+
+		ar_packedBytes = l_slot.packed.size();
 	}
 
-	m_stopPreRendering = true;
-	m_cancelRenderingImmediately = a_cancel;
+	cairo_surface_destroy(l_slot.surface.exchange(nullptr));
+	l_slot.palette.clear();
 
-	WaitForPreRender();
+	// unpacked stripes are re-rendered if the colors change:
+	_DestroyLayers(l_slot);
+
+	l_slot.state.store(ar_packedBytes > 0 ? SS_PACKED : SS_EVICTED, std::memory_order_release);
+	l_slot.state.notify_all();
+
+	return true;
 }
 
 
-void CNFORenderer::PreRender()
+/**
+ * Throws away the compressed pixels of a PACKED stripe, for CStripeCache::Trim.
+ **/
+void CNFORenderer::DropPackedStripe(size_t a_slot)
 {
-	if (m_preRenderThread || m_numStripes < 2)
-	{
-		return;
-	}
+	SStripeSlot& l_slot = m_stripes[a_slot];
+	EStripeState l_expected = SS_PACKED;
 
-	m_stopPreRendering = false;
+	if (l_slot.state.compare_exchange_strong(l_expected, SS_RENDERING))
+	{
+		std::vector<uint8_t>().swap(l_slot.packed);
 
-	m_preRenderThread = std::make_shared<std::thread>(
-		[this] { PreRenderThreadProc(); });
+		l_slot.state.store(SS_EVICTED);
+		l_slot.state.notify_all();
+	}
 }
 
 
-void CNFORenderer::PreRenderThreadProc()
+void CNFORenderer::UnpackStripe(size_t a_slot)
 {
-	for (size_t l_stripe = 0; l_stripe < m_numStripes && !m_stopPreRendering; ++l_stripe)
+	SStripeSlot& l_slot = m_stripes[a_slot];
+
+	if (!_UnpackSurface(l_slot.packed, l_slot.surface.load(std::memory_order_acquire)))
 	{
-		m_stripesLock.lock();
+		// should never happen, but better safe than sorry:
+		RenderStripe(a_slot);
+	}
 
-		if (!m_stripes[l_stripe])
-		{
-			m_stripes[l_stripe] = PCairoSurface(new _CCairoSurface(
-				cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-				(int)GetWidth(),
-					GetStripeHeightPhysical(l_stripe))
-			));
+	std::vector<uint8_t>().swap(l_slot.packed);
+}
 
-			m_stripesLock.unlock();
 
-			m_preRenderingStripe.store(l_stripe);
+size_t CNFORenderer::GetStripeBytes(size_t a_slot, bool a_palette) const
+{
+	const int l_width = GetTileWidthPhysical(GetSlotTile(a_slot));
+	size_t l_bytes = static_cast<size_t>(cairo_format_stride_for_width(
+		a_palette ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_ARGB32, l_width));
 
-			m_cancelRenderingImmediately = false;
-			RenderStripe(l_stripe);
-		}
-		else
-		{
-			m_stripesLock.unlock();
-		}
+	if (UseColorLayers())
+	{
+		// upper bound, the links layer only exists if there are links:
+		l_bytes += _SL_MAX * static_cast<size_t>(cairo_format_stride_for_width(CAIRO_FORMAT_A8, l_width));
 	}
 
-	m_preRenderingStripe.store((size_t)-1);
+	return l_bytes * GetStripeHeightPhysical(GetSlotStripe(a_slot));
 }
 
 
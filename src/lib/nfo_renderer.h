@@ -17,6 +17,7 @@
 
 #include "nfo_data.h"
 #include "cairo_box_blur.h"
+#include "render_pool.h"
 
 // http://www.alanwood.net/unicode/block_elements.html
 // http://www.alanwood.net/demos/wgl4.html
@@ -45,6 +46,26 @@ typedef struct _render_grid_block_t
 } CRenderGridBlock;
 
 
+typedef struct _render_grid_run_t
+{
+	size_t col, len;
+	bool text; /* RGS_NO_BLOCK and RGS_WHITESPACE_IN_TEXT cells, block shapes otherwise */
+} CRenderGridRun;
+
+
+/**
+ * Run-length index of one grid row, built by CalculateGrid. Whitespace that
+ * doesn't belong to text isn't part of any run, so consumers can skip empty
+ * stretches instead of looking at every cell.
+ **/
+typedef struct _render_grid_row_t
+{
+	size_t firstCol, endCol; /* bounding columns of all runs, firstCol == endCol if there are none */
+	size_t lineEnd; /* cells from here on are NUL padding */
+	std::vector<CRenderGridRun> runs; /* ordered by column */
+} CRenderGridRow;
+
+
 typedef struct _s_color_t
 {
 	uint8_t R, G, B;
@@ -137,6 +158,114 @@ typedef enum _nfo_render_partial_t
 } ENFORenderPartial;
 
 
+typedef enum _stripe_state_t : uint8_t
+{
+	SS_EMPTY = 0,
+	SS_RENDERING, // claimed by exactly one thread
+	SS_READY,
+	SS_EVICTED, // surface has been dropped, can be claimed again
+	SS_PACKED, // surface has been dropped, but its pixels have been kept in compressed form
+
+	_SS_MAX
+} EStripeState;
+
+
+typedef enum _stripe_layer_t
+{
+	SL_GLOW = 0, // blurred shadow of the blocks
+	SL_BLOCKS,
+	SL_TEXT,
+	SL_LINKS, // hyperlink text and underlines
+
+	_SL_MAX
+} EStripeLayer;
+
+
+typedef struct _stripe_slot_t
+{
+	std::atomic<EStripeState> state;
+	// owned by the slot, non-null while RENDERING or READY:
+	std::atomic<cairo_surface_t*> surface;
+	// run-length encoded pixels, only used while PACKED:
+	std::vector<uint8_t> packed;
+	// if not empty, surface is an A8 surface of indexes into this (see SetPaletteStripes):
+	std::vector<uint32_t> palette;
+	// A8 coverage masks the surface has been composited from, see SetCacheColorLayers.
+	// owned like the surface, but only touched by whoever holds the stripe:
+	bool layered = false;
+	cairo_surface_t* layers[_SL_MAX] = {};
+} SStripeSlot;
+
+
+typedef struct _zoom_preview_stripe_t
+{
+	int top, bottom, left, right; // area in the level's image coordinates
+	int surfaceX, surfaceY; // include the extra pixels around the stripe (or tile)
+	cairo_surface_t* surface;
+} SZoomPreviewStripe;
+
+
+// whatever had been rendered at a previous zoom level:
+typedef struct _zoom_preview_level_t
+{
+	float zoomFactor;
+	size_t blockWidth, blockHeight;
+	int padding;
+	std::vector<SZoomPreviewStripe> stripes;
+} SZoomPreviewLevel;
+
+
+typedef std::function<void()> NFORendererStripeReadyCallback;
+// an area of the image that has been rendered, in image coordinates:
+typedef std::function<void(int a_x, int a_y, int a_width, int a_height)> NFORendererAreaReadyCallback;
+typedef std::function<void(bool a_complete)> NFORendererRequestDoneCallback;
+
+
+/**
+ * Handle for an area that CNFORenderer::RenderAsync renders on the render pool.
+ * The callbacks are called from worker threads (or from RenderAsync itself for
+ * stripes that are ready already), one at a time per request, and must not call
+ * Wait. Cancelling makes the stripes that are rendered for this request stop at
+ * the renderer's next check, the done callback then reports false.
+ **/
+class CNFORenderRequest
+{
+public:
+	CNFORenderRequest(const NFORendererAreaReadyCallback& a_onAreaReady, const NFORendererRequestDoneCallback& a_onDone);
+
+	void Cancel() { m_cancelled = true; }
+	bool IsCancelled() const { return m_cancelled; }
+	bool IsDone() const;
+	// blocks until the request is done, returns true if the entire area has been rendered:
+	bool Wait();
+
+	// stripes, or tiles of stripes, that make up the area:
+	size_t GetNumTiles() const { return m_numTiles; }
+	size_t GetNumTilesReady() const { return m_numTilesReady; }
+
+protected:
+	friend class CNFORenderer;
+
+	std::atomic<bool> m_cancelled;
+	size_t m_numTiles;
+	std::atomic<size_t> m_numTilesReady;
+	std::vector<size_t> m_pendingSlots; // guarded by the renderer's m_requestsLock
+
+	// serializes the callbacks, guards everything below:
+	mutable std::mutex m_callbackLock;
+	std::condition_variable m_doneCondition;
+	NFORendererAreaReadyCallback m_onAreaReady;
+	NFORendererRequestDoneCallback m_onDone;
+	size_t m_numTilesLeft;
+	bool m_done;
+	bool m_complete;
+
+	void Finish(bool a_complete);
+};
+
+typedef std::shared_ptr<CNFORenderRequest> PNFORenderRequest;
+
+
 class CNFORenderer
 {
 private:
@@ -149,19 +278,100 @@ private:
 	// internal state data:
 	// don't mess with these, they are NOT settings:
 	bool m_rendered;
+	bool m_recomposite; // colors have changed, but the cached layers are still good
 	double m_fontSize;
+	static const int ms_maxCalibratedFontSize = 4096;
 
 	size_t m_linesPerStripe; // in no. of lines
 	int m_stripeHeight; // in pixels
 
-	// for background pre-rendering:
-	std::shared_ptr<std::thread> m_preRenderThread;
-	std::atomic<size_t> m_preRenderingStripe;
-	std::mutex m_stripesLock;
-	bool m_stopPreRendering;
-	bool m_cancelRenderingImmediately;
-
-	void PreRenderThreadProc();
+	// tiled rendering splits each stripe into columns, see SetTiledRendering:
+	bool m_tiledRendering;
+	size_t m_colsPerTile; // in no. of grid columns
+	size_t m_numTileCols;
+
+	static const size_t ms_tileWidth = 1024; // in pixels, rounded down to whole blocks
+
+	// stripes are rendered by CRenderPool's workers:
+	std::atomic<bool> m_stopPreRendering;
+	std::atomic<bool> m_cancelRenderingImmediately;
+
+	// where the user is looking, see SetViewportHint:
+	size_t m_viewFirstRow;
+	size_t m_viewLastRow;
+	int m_viewVelocity;
+	size_t m_preRenderLookAhead;
+
+	bool m_packEvictedStripes;
+
+	// zoom transitions, see SetZoomPreview:
+	bool m_zoomPreview;
+	bool m_zoomChanged;
+	std::vector<SZoomPreviewLevel> m_zoomPreviewLevels; // only touched by the drawing thread
+	std::atomic<bool> m_zoomPreviewActive;
+	NFORendererStripeReadyCallback m_stripeReadyCallback;
+
+	static const size_t ms_maxZoomPreviewLevels = 3;
+
+	void CaptureZoomPreview();
+	void DropZoomPreview();
+	void DrawZoomPreview(cairo_t* a_cr, int a_destX, int a_destY, int a_sourceX, int a_sourceY,
+		int a_xFrom, int a_xTo, int a_yFrom, int a_yTo) const;
+
+	bool PrepareStripes();
+	bool RenderTiles(size_t a_stripeFrom, size_t a_stripeTo, size_t a_tileFrom, size_t a_tileTo);
+	void QueueStripes(size_t a_stripeFrom, size_t a_stripeTo, size_t a_tileFrom = 0, size_t a_tileTo = (size_t)-1);
+
+	// color changes only recomposite stripes from cached coverage layers:
+	bool m_cacheColorLayers;
+
+	bool UseColorLayers() const { return m_cacheColorLayers && !IsAnsi(); }
+	void InvalidateColors();
+	void RenderStripeLayers(size_t a_slot) const;
+	void CompositeStripe(size_t a_slot) const;
+	void RecompositeStripes();
+
+	// finished stripes with few colors are stored as palette indexes:
+	bool m_paletteStripes;
+
+	// text is blitted from pre-rasterized glyph bitmaps instead of being drawn by cairo:
+	bool m_glyphAtlas;
+
+	// the glow mask is rendered and blurred at a reduced resolution:
+	bool m_reducedGlow;
+	int GetGlowDownscale() const;
+
+	// blocks less tall than this are drawn as rectangles of their average coverage (level of detail):
+	size_t m_lodCellSize;
+	bool UseLOD() const { return m_lodCellSize > 0 && GetBlockHeight() < m_lodCellSize; }
+	static const int ms_lodLevels = 16;
+
+	// requests made by RenderAsync that are still waiting for stripes:
+	std::mutex m_requestsLock;
+	std::vector<PNFORenderRequest> m_requests;
+	// DrawToSurface doesn't render, see SetDrawReadyOnly:
+	bool m_drawReadyOnly;
+
+	void SubmitRequestStripe(size_t a_slot, const PNFORenderRequest& a_request);
+	void NotifyRequests(size_t a_slot, const CNFORenderRequest* a_only = nullptr);
+	void AbortRequests();
+	void GetSlotRange(int a_x, int a_y, int a_width, int a_height,
+		size_t& ar_stripeFrom, size_t& ar_stripeTo, size_t& ar_tileFrom, size_t& ar_tileTo) const;
+	void GetSlotArea(size_t a_slot, int& ar_x, int& ar_y, int& ar_width, int& ar_height) const;
+
+	void QueuePreRender();
+	bool ClaimStripe(size_t a_slot, bool* ar_unpack = nullptr);
+	void UnpackStripe(size_t a_slot);
+	void FinishStripe(size_t a_slot);
+	void WaitForStripe(size_t a_slot) const;
+	void ResetStripe(size_t a_slot);
+	// a_palette: for a finished stripe that is stored as palette indexes, rendering always needs ARGB32:
+	size_t GetStripeBytes(size_t a_slot, bool a_palette = false) const;
+
+	// on-demand renderers keep their stripes within CStripeCache's budget:
+	friend class CStripeCache;
+	bool EvictStripe(size_t a_slot, size_t& ar_packedBytes);
+	void DropPackedStripe(size_t a_slot);
 
 protected:
 	bool m_forceGPUOff;
@@ -172,38 +382,80 @@ protected:
 
 	PNFOData m_nfo;
 	std::unique_ptr<TwoDimVector<CRenderGridBlock>> m_gridData;
+	std::vector<CRenderGridRow> m_gridRows; // one per row of m_gridData
 	bool m_hasBlocks;
 
 	size_t m_numStripes;
-	std::map<size_t, PCairoSurface> m_stripes; // stripe no. -> surface
+	// one slot per stripe (per tile with tiled rendering, row by row, see GetSlot), allocated by
+	// CalcStripeDimensions. Surface pointers remain valid until StopPreRendering/ClearStripes,
+	// no locking needed to read them:
+	std::unique_ptr<SStripeSlot[]> m_stripes;
 
 	// internal calls:
-	bool IsRendered() const { return m_rendered; }
+	bool IsRendered() const { return m_rendered && !m_recomposite; }
+	// checked by the rendering code, also covers the RenderAsync request the current thread works for:
+	bool IsRenderingCancelled() const;
+	// for the loops over cells, only asks IsRenderingCancelled every ms_cancelCheckCells calls.
+	// a_numCalls starts at 0, and the answer stays true once it has been:
+	bool IsRenderingCancelled(size_t& ar_numCalls) const;
+	// IsRenderingCancelled for other threads, see CCairoBoxBlur::SetCancelCheck:
+	std::function<bool()> GetCancelCheck() const;
+	static const size_t ms_cancelCheckCells = 64;
 	bool IsAnsi() const { return m_nfo && m_nfo->HasColorMap(); }
 	bool CalculateGrid();
-	cairo_surface_t *GetStripeSurface(size_t a_stripe) const;
+	cairo_surface_t *GetStripeSurface(size_t a_slot) const;
+	bool IsPaletteStripe(size_t a_slot) const { return !m_stripes[a_slot].palette.empty(); }
+	const std::vector<uint32_t>& GetStripePalette(size_t a_slot) const { return m_stripes[a_slot].palette; }
+	// ARGB32 pixels of (at least) the given stripe area, palette stripes are expanded into a temporary
+	// surface. Returns a new reference, ar_x/ar_y receive the surface's position within the stripe:
+	cairo_surface_t *GetStripeSurfaceARGB(size_t a_slot, int a_x, int a_y, int a_width, int a_height, int& ar_x, int& ar_y) const;
+	size_t GetNumSlots() const { return m_numStripes * m_numTileCols; }
+	size_t GetSlot(size_t a_stripe, size_t a_tile) const { return a_stripe * m_numTileCols + a_tile; }
+	size_t GetSlotStripe(size_t a_slot) const { return a_slot / m_numTileCols; }
+	size_t GetSlotTile(size_t a_slot) const { return a_slot % m_numTileCols; }
+	int GetTileX(size_t a_tile) const;
+	int GetTileWidth(size_t a_tile) const;
+	int GetTileWidthExtraLeft(size_t a_tile) const;
+	int GetTileWidthExtraRight(size_t a_tile) const;
+	int GetTileWidthPhysical(size_t a_tile) const;
+	size_t GetTileExtraColsLeft(size_t a_tile) const;
+	size_t GetTileExtraColsRight(size_t a_tile) const;
 	int GetStripeHeight(size_t a_stripe) const;
 	int GetStripeHeightExtraTop(size_t a_stripe) const;
 	int GetStripeHeightExtraBottom(size_t a_stripe) const;
 	int GetStripeHeightPhysical(size_t a_stripe) const;
 	size_t GetStripeExtraLinesTop(size_t a_stripe) const;
 	size_t GetStripeExtraLinesBottom(size_t a_stripe) const;
-	void RenderStripe(size_t a_stripe) const;
-	void RenderStripeBlocks(size_t a_stripe, bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context = nullptr) const;
-	void RenderBackgrounds(size_t a_rowStart, size_t a_rowEnd, double a_yBase, cairo_t* a_context) const;
+	void RenderStripe(size_t a_slot) const;
+	void RenderStripeBlocks(size_t a_slot, bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context = nullptr,
+		const S_COLOR_T* a_colorOverride = nullptr) const;
+	void RenderBackgrounds(size_t a_rowStart, size_t a_rowEnd, double a_xBase, double a_yBase, cairo_t* a_context) const;
 
 	void RenderBlocks(bool a_opaqueBg, bool a_gaussStep, cairo_t* a_context = nullptr,
-		size_t a_rowStart = (size_t)-1, size_t a_rowEnd = 0, double a_xBase = 0, double a_yBase = 0) const;
+		size_t a_rowStart = (size_t)-1, size_t a_rowEnd = 0, double a_xBase = 0, double a_yBase = 0,
+		const S_COLOR_T* a_colorOverride = nullptr, size_t a_colStart = 0, size_t a_colEnd = (size_t)-1) const;
 	void PreRenderText();
+	double GetCalculatedFontSize() const { return m_fontSize; } // set by PreRenderText
+	// a_windowColStart/a_windowColLimit restrict every row to those columns (exclusive limit),
+	// tiles only lay out the text that can show up on them:
 	void RenderText(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
 		const S_COLOR_T& a_hyperLinkColor,
 		size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
-		cairo_surface_t* a_surface, double a_xBase, double a_yBase) const noexcept;
+		cairo_surface_t* a_surface, double a_xBase, double a_yBase,
+		size_t a_windowColStart = 0, size_t a_windowColLimit = (size_t)-1) const noexcept;
 
 	void RenderClassic(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
 		const S_COLOR_T& a_hyperLinkColor, bool a_backBlocks,
 		size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
-		cairo_surface_t* a_surface, double a_xBase, double a_yBase) const;
+		cairo_surface_t* a_surface, double a_xBase, double a_yBase, const S_COLOR_T* a_artColor = nullptr,
+		size_t a_windowColStart = 0, size_t a_windowColLimit = (size_t)-1) const;
+	void RenderCellsLOD(const S_COLOR_T& a_textColor, const S_COLOR_T* a_backColor,
+		const S_COLOR_T& a_hyperLinkColor, const S_COLOR_T* a_artColor, bool a_backBlocks, double a_fontSize,
+		size_t a_rowStart, size_t a_colStart, size_t a_rowEnd, size_t a_colEnd,
+		cairo_surface_t* a_surface, double a_xBase, double a_yBase,
+		size_t a_windowColStart = 0, size_t a_windowColLimit = (size_t)-1) const;
+	// the columns whose text can show up in a_tile, see a_windowColStart/a_windowColLimit above:
+	void GetTileTextColumns(size_t a_tile, size_t& ar_colStart, size_t& ar_colLimit) const;
 	bool CalcClassicModeBlockSizes(bool a_force = false);
 
 	bool IsTextChar(size_t a_row, size_t a_col, bool a_allowWhiteSpace = false) const;
@@ -223,6 +475,8 @@ public:
 	virtual ~CNFORenderer();
 
 	static ERenderGridShape CharCodeToGridShape(wchar_t a_char, uint8_t* ar_alpha = nullptr);
+	// classifies a_count chars at once, ar_blocks must have room for a_count entries:
+	static void CharCodesToGridBlocks(const wchar_t* a_chars, size_t a_count, CRenderGridBlock* ar_blocks);
 
 	static void SetGlobalUseGPUFlag(bool nb) {
 		ms_useGPU = nb; }
@@ -239,6 +493,27 @@ public:
 	virtual bool DrawToClippedHandle(cairo_t* a_cr, int dest_x, int dest_y);
 	// you should not call this directly without a good reason, prefer DrawToSurface:
 	bool Render(size_t a_stripeFrom = 0, size_t a_stripeTo = (~1));
+	// renders the stripes covering the given area of the image on the render pool and returns right away.
+	// Must be called from the thread that draws, like DrawToSurface. Returns nullptr on errors:
+	PNFORenderRequest RenderAsync(int a_x, int a_y, int a_width, int a_height,
+		const NFORendererAreaReadyCallback& a_onAreaReady = nullptr, const NFORendererRequestDoneCallback& a_onDone = nullptr);
+	// DrawToSurface never waits for rendering, it draws whatever RenderAsync (or pre-rendering) has finished,
+	// the rest of the area gets the background color:
+	void SetDrawReadyOnly(bool nb) { m_drawReadyOnly = nb; }
+	bool GetDrawReadyOnly() const { return m_drawReadyOnly; }
+	// lets pre-rendering start at the visible rows. a_velocity is in rows per scroll step, < 0 = upwards:
+	void SetViewportHint(size_t a_firstRow, size_t a_lastRow, int a_velocity = 0);
+	// pre-rendering stops this many rows away from the viewport, 0 = no limit:
+	void SetPreRenderLookAhead(size_t a_rows) { m_preRenderLookAhead = a_rows; }
+	size_t GetPreRenderLookAhead() const { return m_preRenderLookAhead; }
+	// evicted stripes are compressed instead of thrown away (on-demand rendering only):
+	void SetPackEvictedStripes(bool nb) { m_packEvictedStripes = nb; }
+	bool GetPackEvictedStripes() const { return m_packEvictedStripes; }
+	// SetZoom keeps showing the old stripes, scaled, while the new ones render in the background.
+	// a_onStripeReady is called from a worker thread whenever one of them is done, so the view can repaint:
+	void SetZoomPreview(bool nb, const NFORendererStripeReadyCallback& a_onStripeReady = nullptr) {
+		m_zoomPreview = nb; m_stripeReadyCallback = a_onStripeReady; if (!nb) DropZoomPreview(); }
+	bool GetZoomPreview() const { return m_zoomPreview; }
 
 	bool IsClassicMode() const { return m_classic; }
 
@@ -251,12 +526,31 @@ public:
 	size_t GetWidth() const;
 	size_t GetHeight() const;
 
+	// keeps A8 coverage masks per stripe, so changing colors doesn't need a re-render (uses more memory):
+	void SetCacheColorLayers(bool nb) { m_rendered = m_rendered && (m_cacheColorLayers == nb); m_cacheColorLayers = nb; }
+	bool GetCacheColorLayers() const { return m_cacheColorLayers; }
+	// keeps stripes of non-ANSI NFOs as 8 bit palette indexes if they have no more than 256 colors:
+	void SetPaletteStripes(bool nb) { m_rendered = m_rendered && (m_paletteStripes == nb); m_paletteStripes = nb; }
+	bool GetPaletteStripes() const { return m_paletteStripes; }
+	// draws text into image surfaces from cached grayscale glyph bitmaps (no subpixel anti-aliasing):
+	void SetGlyphAtlas(bool nb) { m_rendered = m_rendered && (m_glyphAtlas == nb); m_glyphAtlas = nb; }
+	bool GetGlyphAtlas() const { return m_glyphAtlas; }
+	// computes the glow at down to one pixel per block and scales it up while compositing:
+	void SetReducedGlow(bool nb) { m_rendered = m_rendered && (m_reducedGlow == nb); m_reducedGlow = nb; }
+	bool GetReducedGlow() const { return m_reducedGlow; }
+	// below a_height pixels per block, text and blocks are drawn as flat rectangles instead of glyphs and shapes (0 = never):
+	void SetLODCellSize(size_t a_height) { m_rendered = m_rendered && (m_lodCellSize == a_height); m_lodCellSize = a_height; }
+	size_t GetLODCellSize() const { return m_lodCellSize; }
+	// splits stripes of wide NFOs into tiles, so that on-demand rendering only renders the tiles that are drawn:
+	void SetTiledRendering(bool nb) { m_rendered = m_rendered && (m_tiledRendering == nb); m_tiledRendering = nb; }
+	bool GetTiledRendering() const { return m_tiledRendering; }
+
 	// color setters & getters:
-	void SetBackColor(const S_COLOR_T& nc) { m_rendered = m_rendered && (m_settings.cBackColor == nc); m_settings.cBackColor = nc; }
-	void SetTextColor(const S_COLOR_T& nc) { m_rendered = m_rendered && (m_settings.cTextColor == nc); m_settings.cTextColor = nc; }
-	void SetArtColor(const S_COLOR_T& nc) { m_rendered = m_rendered && (m_settings.cArtColor == nc); m_settings.cArtColor = nc; }
-	void SetGaussColor(const S_COLOR_T& nc) { m_rendered = m_rendered && (m_settings.cGaussColor == nc); m_settings.cGaussColor = nc; }
-	void SetHyperLinkColor(const S_COLOR_T& nc) { m_rendered = m_rendered && (m_settings.cHyperlinkColor == nc); m_settings.cHyperlinkColor = nc; }
+	void SetBackColor(const S_COLOR_T& nc) { if (m_settings.cBackColor != nc) InvalidateColors(); m_settings.cBackColor = nc; }
+	void SetTextColor(const S_COLOR_T& nc) { if (m_settings.cTextColor != nc) InvalidateColors(); m_settings.cTextColor = nc; }
+	void SetArtColor(const S_COLOR_T& nc) { if (m_settings.cArtColor != nc) InvalidateColors(); m_settings.cArtColor = nc; }
+	void SetGaussColor(const S_COLOR_T& nc) { if (m_settings.cGaussColor != nc) InvalidateColors(); m_settings.cGaussColor = nc; }
+	void SetHyperLinkColor(const S_COLOR_T& nc) { if (m_settings.cHyperlinkColor != nc) InvalidateColors(); m_settings.cHyperlinkColor = nc; }
 	S_COLOR_T GetBackColor() const {
 		return IsAnsi() ? S_COLOR_T(0, 0, 0) : m_settings.cBackColor;
 	}
@@ -74,6 +74,7 @@ protected:
 // PNG export wrapper,
 // uses cairo+pixman for small images and
 // direct libpng calls for large ones.
+// Documents with few colors are written as palette or grayscale images.
 class CNFOToPNG : public CNFORenderer
 {
 public:
@@ -82,6 +83,61 @@ public:
 	bool SavePNG(const std::_tstring& a_filePath);
 protected:
 	bool SaveWithLibpng(const std::_tstring& a_filePath);
+	bool MergeStripePalettes(std::vector<uint32_t>& ar_palette, std::vector<std::vector<uint8_t>>& ar_remap) const;
+};
+
+// ANSImation export, plays back the frames captured by CAnsiArt.
+// every frame only re-renders the cells that have changed on a persistent canvas
+// and is written as a sub-rectangle into an APNG, or as a full PNG per frame.
+class CNFOToANSImation : public CNFORenderer
+{
+public:
+	CNFOToANSImation();
+
+	unsigned int GetFrameDelay() const { return m_frameDelay; }
+	void SetFrameDelay(unsigned int a_ms) { m_frameDelay = std::min(a_ms, 65535u); } // fcTL has 16 bits for it
+
+	bool SaveAPNG(const std::_tstring& a_filePath);
+	// writes <a_filePath without .png>-00001.png etc.
+	bool SaveFrameSequence(const std::_tstring& a_filePath);
+protected:
+	unsigned int m_frameDelay; // milliseconds
+
+	typedef struct
+	{
+		const CAnsiArt::SFrame* frame;
+		size_t rowEnd, colEnd; // confined to the grid
+	} SFrameRange;
+
+	bool PrepareCanvas(cairo_surface_t** ar_surface, std::vector<SFrameRange>& ar_ranges);
+	void RenderFrame(cairo_t* a_context, const SFrameRange& a_range) const;
+	void GetFrameRect(const SFrameRange& a_range, int& ar_x, int& ar_y, int& ar_width, int& ar_height) const;
+};
+
+// Thumbnail export, renders only the rows that are going to show up, at a block size
+// near the thumbnail's resolution, and scales the result down by averaging areas.
+class CNFOThumbnailer : public CNFORenderer
+{
+public:
+	CNFOThumbnailer(bool a_classicMode = false);
+
+	// fits the NFO into a_maxWidth, the part below a_maxHeight is cut off (and faded out).
+	// Returns a new ARGB32 surface or nullptr:
+	cairo_surface_t* CreateThumbnail(int a_maxWidth, int a_maxHeight);
+	bool SaveThumbnail(const std::_tstring& a_filePath, int a_maxWidth, int a_maxHeight);
+
+	bool GetFadeOut() const { return m_fadeOut; }
+	void SetFadeOut(bool nb) { m_fadeOut = nb; }
+
+	// rendered resolution relative to the thumbnail's:
+	static const int SUPERSAMPLING = 2;
+protected:
+	bool m_fadeOut;
+
+	cairo_surface_t* RenderThumbnail(int a_maxWidth, int a_maxHeight);
+	void FadeOut(cairo_surface_t* a_surface) const;
+
+	static bool AreaDownscale(cairo_surface_t* a_source, cairo_surface_t* a_dest);
 };
 
 #endif /* !_NFO_RENDERER_EXPORT_H */
@@ -0,0 +1,601 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "nfo_renderer_export.h"
+#include "font_cache.h"
+#include <cairo.h>
+#include <png.h>
+#include <array>
+
+
+CNFOToANSImation::CNFOToANSImation()
+	: CNFORenderer(false),
+	m_frameDelay(40)
+{
+	m_forceGPUOff = true;
+}
+
+
+bool CNFOToANSImation::PrepareCanvas(cairo_surface_t** ar_surface, std::vector<SFrameRange>& ar_ranges)
+{
+	if (!m_nfo || m_nfo->GetAnsiFrames().empty())
+	{
+		return false;
+	}
+
+	// blurring is not local to the changed cells, so there is no glow in animations:
+	SetEnableGaussShadow(false);
+	m_padding = 0;
+
+	if (!m_gridData && !CalculateGrid())
+	{
+		return false;
+	}
+
+	PreRenderText();
+
+	if (GetHeight() >= 32767 || GetWidth() >= 32767)
+	{
+		return false;
+	}
+
+	ar_ranges.clear();
+
+	for (const CAnsiArt::SFrame& l_frame : m_nfo->GetAnsiFrames())
+	{
+		SFrameRange l_range;
+
+		l_range.frame = &l_frame;
+		l_range.rowEnd = std::min(l_frame.row + l_frame.rows, m_nfo->GetGridHeight());
+		l_range.colEnd = std::min(l_frame.col + l_frame.cols, m_nfo->GetGridWidth());
+
+		// trailing empty lines and columns are not part of the final grid:
+		if (l_range.rowEnd > l_frame.row && l_range.colEnd > l_frame.col)
+		{
+			ar_ranges.push_back(l_range);
+		}
+	}
+
+	if (ar_ranges.empty())
+	{
+		return false;
+	}
+
+	cairo_surface_t* l_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int)GetWidth(), (int)GetHeight());
+
+	if (cairo_surface_status(l_surface) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(l_surface);
+		return false;
+	}
+
+	cairo_t* cr = cairo_create(l_surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetBackColor()));
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	*ar_surface = l_surface;
+
+	return true;
+}
+
+
+void CNFOToANSImation::GetFrameRect(const SFrameRange& a_range, int& ar_x, int& ar_y, int& ar_width, int& ar_height) const
+{
+	ar_x = static_cast<int>(GetPadding() + a_range.frame->col * GetBlockWidth());
+	ar_y = static_cast<int>(GetPadding() + a_range.frame->row * GetBlockHeight());
+	ar_width = static_cast<int>((a_range.colEnd - a_range.frame->col) * GetBlockWidth());
+	ar_height = static_cast<int>((a_range.rowEnd - a_range.frame->row) * GetBlockHeight());
+}
+
+
+// paints the cells of one frame over what the previous frames have left on the canvas.
+// a_context must have the text font set up.
+void CNFOToANSImation::RenderFrame(cairo_t* cr, const SFrameRange& a_range) const
+{
+	const CAnsiArt::SFrame& l_frame = *a_range.frame;
+
+	const double bwd = static_cast<double>(GetBlockWidth());
+	const double bhd = static_cast<double>(GetBlockHeight());
+	const double bwd05 = bwd * 0.5;
+	const double bhd05 = bhd * 0.5;
+	const double l_off_x = GetPadding(), l_off_y = GetPadding();
+
+	int l_x, l_y, l_width, l_height;
+	GetFrameRect(a_range, l_x, l_y, l_width, l_height);
+
+	cairo_save(cr);
+
+	// glyphs may not spill over into cells that have not changed:
+	cairo_rectangle(cr, l_x, l_y, l_width, l_height);
+	cairo_clip(cr);
+
+	cairo_font_extents_t l_font_extents;
+	cairo_font_extents(cr, &l_font_extents);
+
+	cairo_scaled_font_t *l_csf = cairo_get_scaled_font(cr);
+
+	std::wstring l_text;
+	std::vector<size_t> l_textCols;
+
+	for (size_t row = l_frame.row; row < a_range.rowEnd; row++)
+	{
+		const size_t l_rowIndex = (row - l_frame.row) * l_frame.cols;
+		const double l_pos_y = l_off_y + row * bhd;
+
+		// backgrounds, in runs of the same color:
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+		for (size_t col = l_frame.col; col < a_range.colEnd; )
+		{
+			const uint32_t l_back = l_frame.backColors[l_rowIndex + col - l_frame.col];
+			size_t l_runEnd = col + 1;
+
+			while (l_runEnd < a_range.colEnd && l_frame.backColors[l_rowIndex + l_runEnd - l_frame.col] == l_back)
+			{
+				l_runEnd++;
+			}
+
+			const S_COLOR_T l_color = (l_back != CAnsiArt::FRAME_DEFAULT_COLOR ? S_COLOR_T(l_back) : GetBackColor());
+
+			cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(l_color));
+			cairo_rectangle(cr, l_off_x + col * bwd, l_pos_y, (l_runEnd - col) * bwd, bhd);
+			cairo_fill(cr);
+
+			col = l_runEnd;
+		}
+
+		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+		// blocks, collect text on the way:
+		l_text.clear();
+		l_textCols.clear();
+
+		for (size_t col = l_frame.col; col < a_range.colEnd; col++)
+		{
+			const wchar_t l_char = l_frame.chars[l_rowIndex + col - l_frame.col];
+			uint8_t l_alpha = 255;
+			const ERenderGridShape l_shape = CharCodeToGridShape(l_char, &l_alpha);
+
+			if (l_shape == RGS_WHITESPACE)
+			{
+				continue;
+			}
+			else if (l_shape == RGS_NO_BLOCK)
+			{
+				l_text += l_char;
+				l_textCols.push_back(col);
+				continue;
+			}
+
+			const uint32_t l_fore = l_frame.foreColors[l_rowIndex + col - l_frame.col];
+			const S_COLOR_T l_color = (l_fore != CAnsiArt::FRAME_DEFAULT_COLOR ? S_COLOR_T(l_fore) : GetArtColor());
+
+			double l_pos_x = col * bwd, l_block_y = row * bhd, l_bw = bwd, l_bh = bhd;
+
+			switch (l_shape)
+			{
+			case RGS_BLOCK_LOWER_HALF:
+				l_block_y += bhd05;
+			case RGS_BLOCK_UPPER_HALF:
+				l_bh = bhd05;
+				break;
+			case RGS_BLOCK_RIGHT_HALF:
+				l_pos_x += bwd05;
+			case RGS_BLOCK_LEFT_HALF:
+				l_bw = bwd05;
+				break;
+			case RGS_BLACK_SQUARE:
+				l_bw = l_bh = bwd * 0.75;
+				l_block_y += bhd05 - l_bh * 0.5;
+				l_pos_x += bwd05 - l_bw * 0.5;
+				break;
+			case RGS_BLACK_SMALL_SQUARE:
+				l_bw = l_bh = bwd05;
+				l_block_y += bhd05 - l_bh * 0.5;
+				l_pos_x += bwd05 - l_bw * 0.5;
+				break;
+			default:
+				break;
+			}
+
+			cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(l_color), (l_alpha / 255.0) * (l_color.A / 255.0));
+			cairo_rectangle(cr, l_off_x + l_pos_x, l_off_y + l_block_y, l_bw, l_bh);
+			cairo_fill(cr);
+		}
+
+		if (l_text.empty())
+		{
+			continue;
+		}
+
+		// text, one glyph per cell. like in the regular renderer, ANSI colors only apply to blocks:
+		const std::string l_utf8 = CUtil::FromWideStr(l_text, CP_UTF8);
+		cairo_glyph_t *l_glyphs = nullptr;
+		int l_numGlyphs = 0;
+
+		if (cairo_scaled_font_text_to_glyphs(l_csf, 0,
+			l_pos_y + (l_font_extents.ascent + GetBlockHeight()) / 2.0 - 2,
+			l_utf8.c_str(), (int)l_utf8.size(), &l_glyphs, &l_numGlyphs, nullptr, nullptr, nullptr) != CAIRO_STATUS_SUCCESS)
+		{
+			continue;
+		}
+
+		l_numGlyphs = std::min(l_numGlyphs, static_cast<int>(l_textCols.size()));
+
+		for (int i = 0; i < l_numGlyphs; i++)
+		{
+			l_glyphs[i].x = l_off_x + l_textCols[i] * bwd;
+		}
+
+		cairo_set_source_rgba(cr, S_COLOR_T_CAIRO_A(GetTextColor()));
+		cairo_show_glyphs(cr, l_glyphs, l_numGlyphs);
+
+		cairo_glyph_free(l_glyphs);
+	}
+
+	cairo_restore(cr);
+}
+
+
+static cairo_t* _CreateFrameContext(const CNFOToANSImation* r, cairo_surface_t* a_surface, double a_fontSize)
+{
+	cairo_t* cr = cairo_create(a_surface);
+
+	cairo_font_options_t *cfo = cairo_font_options_create();
+
+	cairo_font_options_set_antialias(cfo, (r->GetFontAntiAlias() && a_fontSize >= 4 ? CAIRO_ANTIALIAS_SUBPIXEL : CAIRO_ANTIALIAS_NONE));
+	cairo_font_options_set_hint_style(cfo, CAIRO_HINT_STYLE_NONE);
+	cairo_font_options_set_hint_metrics(cfo, (r->GetFontBold() ? CAIRO_HINT_METRICS_ON : CAIRO_HINT_METRICS_OFF));
+
+	const std::string l_font
+#ifdef _UNICODE
+		= CUtil::FromWideStr(r->GetFontFace(), CP_UTF8);
+#else
+		= r->GetFontFace();
+#endif
+	// shares the resolved font with the renderers, see CFontFaceCache:
+	cairo_scaled_font_t* l_scaledFont = CFontFaceCache::GetInstance().GetScaledFont(l_font, r->GetFontBold(), a_fontSize, cfo);
+
+	cairo_set_scaled_font(cr, l_scaledFont);
+
+	cairo_scaled_font_destroy(l_scaledFont);
+	cairo_font_options_destroy(cfo);
+
+	return cr;
+}
+
+
+bool CNFOToANSImation::SaveFrameSequence(const std::_tstring& a_filePath)
+{
+	cairo_surface_t* l_surface = nullptr;
+	std::vector<SFrameRange> l_ranges;
+
+	if (!PrepareCanvas(&l_surface, l_ranges))
+	{
+		return false;
+	}
+
+	std::string l_prefix =
+#ifdef _UNICODE
+		CUtil::FromWideStr(a_filePath, CP_UTF8);
+#else
+		a_filePath;
+#endif
+
+	if (l_prefix.size() > 4 && _stricmp(l_prefix.c_str() + l_prefix.size() - 4, ".png") == 0)
+	{
+		l_prefix.erase(l_prefix.size() - 4);
+	}
+
+	cairo_t* cr = _CreateFrameContext(this, l_surface, GetCalculatedFontSize());
+	bool l_success = true;
+
+	for (size_t i = 0; i < l_ranges.size() && l_success; i++)
+	{
+		RenderFrame(cr, l_ranges[i]);
+
+		char l_suffix[32];
+		snprintf(l_suffix, 32, "-%05u.png", static_cast<unsigned int>(i + 1));
+
+		l_success = (cairo_surface_write_to_png(l_surface, (l_prefix + l_suffix).c_str()) == CAIRO_STATUS_SUCCESS);
+	}
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(l_surface);
+
+	return l_success;
+}
+
+
+#ifndef DeleteFile
+#define DeleteFile(a) unlink(a)
+#endif
+
+
+/************************************************************************/
+/* APNG Writer                                                          */
+/************************************************************************/
+
+// libpng has no APNG support, so it is only used to encode each frame's
+// pixels, which are then taken out of its IDAT chunks and wrapped into fdAT.
+
+static uint32_t _Crc32(uint32_t a_crc, const uint8_t* a_data, size_t a_len)
+{
+	static const auto s_table = []
+	{
+		std::array<uint32_t, 256> l_table{};
+
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+
+			for (int k = 0; k < 8; k++)
+			{
+				c = (c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1);
+			}
+
+			l_table[n] = c;
+		}
+
+		return l_table;
+	}();
+
+	a_crc ^= 0xFFFFFFFFu;
+
+	for (size_t i = 0; i < a_len; i++)
+	{
+		a_crc = s_table[(a_crc ^ a_data[i]) & 0xFF] ^ (a_crc >> 8);
+	}
+
+	return a_crc ^ 0xFFFFFFFFu;
+}
+
+static void _PutUint32BE(std::vector<uint8_t>& a_buf, uint32_t a_value)
+{
+	a_buf.push_back(static_cast<uint8_t>(a_value >> 24));
+	a_buf.push_back(static_cast<uint8_t>(a_value >> 16));
+	a_buf.push_back(static_cast<uint8_t>(a_value >> 8));
+	a_buf.push_back(static_cast<uint8_t>(a_value));
+}
+
+static uint32_t _GetUint32BE(const uint8_t* a_data)
+{
+	return (static_cast<uint32_t>(a_data[0]) << 24) | (static_cast<uint32_t>(a_data[1]) << 16) |
+		(static_cast<uint32_t>(a_data[2]) << 8) | a_data[3];
+}
+
+static bool _WritePngChunk(FILE* a_file, const char* a_type, const std::vector<uint8_t>& a_data)
+{
+	std::vector<uint8_t> l_buf;
+	l_buf.reserve(a_data.size() + 12);
+
+	_PutUint32BE(l_buf, static_cast<uint32_t>(a_data.size()));
+	l_buf.insert(l_buf.end(), a_type, a_type + 4);
+	l_buf.insert(l_buf.end(), a_data.begin(), a_data.end());
+	_PutUint32BE(l_buf, _Crc32(0, l_buf.data() + 4, a_data.size() + 4));
+
+	return fwrite(l_buf.data(), 1, l_buf.size(), a_file) == l_buf.size();
+}
+
+static void _PngWriteToVector(png_structp png_ptr, png_bytep a_data, png_size_t a_length)
+{
+	std::vector<uint8_t>* l_buf = static_cast<std::vector<uint8_t>*>(png_get_io_ptr(png_ptr));
+
+	l_buf->insert(l_buf->end(), a_data, a_data + a_length);
+}
+
+static void _PngFlushVector(png_structp)
+{
+}
+
+// compresses a rectangle of a cairo image surface, returns the zlib stream from the IDAT chunks.
+static bool _EncodeRect(cairo_surface_t* a_surface, int a_x, int a_y, int a_width, int a_height, std::vector<uint8_t>& ar_zdata)
+{
+	const unsigned char* l_data = cairo_image_surface_get_data(a_surface);
+	const size_t l_stride = cairo_image_surface_get_stride(a_surface);
+
+	// unpremultiply native endian ARGB into RGBA bytes:
+	std::vector<uint8_t> l_pixels(static_cast<size_t>(a_width) * a_height * 4);
+	std::vector<png_bytep> l_rows(a_height);
+
+	for (int y = 0; y < a_height; y++)
+	{
+		const uint32_t* l_src = reinterpret_cast<const uint32_t*>(l_data + (a_y + y) * l_stride) + a_x;
+		uint8_t* l_dst = &l_pixels[static_cast<size_t>(y) * a_width * 4];
+
+		l_rows[y] = l_dst;
+
+		for (int x = 0; x < a_width; x++, l_dst += 4)
+		{
+			const uint32_t l_pixel = l_src[x];
+			const uint8_t l_alpha = static_cast<uint8_t>(l_pixel >> 24);
+
+			if (l_alpha == 0)
+			{
+				l_dst[0] = l_dst[1] = l_dst[2] = l_dst[3] = 0;
+			}
+			else
+			{
+				l_dst[0] = static_cast<uint8_t>((((l_pixel >> 16) & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+				l_dst[1] = static_cast<uint8_t>((((l_pixel >> 8) & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+				l_dst[2] = static_cast<uint8_t>(((l_pixel & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+				l_dst[3] = l_alpha;
+			}
+		}
+	}
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+
+	if (!png_ptr)
+	{
+		return false;
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+
+	if (!info_ptr)
+	{
+		png_destroy_write_struct(&png_ptr, nullptr);
+		return false;
+	}
+
+	std::vector<uint8_t> l_png;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return false;
+	}
+
+	png_set_write_fn(png_ptr, &l_png, _PngWriteToVector, _PngFlushVector);
+
+	png_set_IHDR(png_ptr, info_ptr, static_cast<uint32_t>(a_width), static_cast<uint32_t>(a_height),
+		8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	png_set_rows(png_ptr, info_ptr, l_rows.data());
+	png_write_png(png_ptr, info_ptr, 0, nullptr);
+
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	// pick the IDAT chunks from the encoded file:
+	ar_zdata.clear();
+
+	for (size_t l_pos = 8; l_pos + 12 <= l_png.size(); )
+	{
+		const size_t l_len = _GetUint32BE(&l_png[l_pos]);
+
+		if (l_pos + 12 + l_len > l_png.size())
+		{
+			return false;
+		}
+
+		if (memcmp(&l_png[l_pos + 4], "IDAT", 4) == 0)
+		{
+			ar_zdata.insert(ar_zdata.end(), l_png.begin() + l_pos + 8, l_png.begin() + l_pos + 8 + l_len);
+		}
+
+		l_pos += 12 + l_len;
+	}
+
+	return !ar_zdata.empty();
+}
+
+
+bool CNFOToANSImation::SaveAPNG(const std::_tstring& a_filePath)
+{
+	cairo_surface_t* l_surface = nullptr;
+	std::vector<SFrameRange> l_ranges;
+
+	if (!PrepareCanvas(&l_surface, l_ranges))
+	{
+		return false;
+	}
+
+	FILE *fp = nullptr;
+
+#ifdef _UNICODE
+	if (_wfopen_s(&fp, a_filePath.c_str(), L"wb") != 0 || !fp)
+#else
+	if ((fp = fopen(a_filePath.c_str(), "wb")) == nullptr)
+#endif
+	{
+		cairo_surface_destroy(l_surface);
+		return false;
+	}
+
+	static const uint8_t s_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	bool l_success = (fwrite(s_signature, 1, 8, fp) == 8);
+
+	std::vector<uint8_t> l_chunk;
+
+	// IHDR: RGBA, 8 bits per channel
+	_PutUint32BE(l_chunk, static_cast<uint32_t>(GetWidth()));
+	_PutUint32BE(l_chunk, static_cast<uint32_t>(GetHeight()));
+	l_chunk.insert(l_chunk.end(), { 8, 6, 0, 0, 0 });
+	l_success = l_success && _WritePngChunk(fp, "IHDR", l_chunk);
+
+	// acTL: number of frames, loop forever
+	l_chunk.clear();
+	_PutUint32BE(l_chunk, static_cast<uint32_t>(l_ranges.size()));
+	_PutUint32BE(l_chunk, 0);
+	l_success = l_success && _WritePngChunk(fp, "acTL", l_chunk);
+
+	cairo_t* cr = _CreateFrameContext(this, l_surface, GetCalculatedFontSize());
+	uint32_t l_sequence = 0;
+	std::vector<uint8_t> l_zdata;
+
+	for (size_t i = 0; i < l_ranges.size() && l_success; i++)
+	{
+		RenderFrame(cr, l_ranges[i]);
+		cairo_surface_flush(l_surface);
+
+		int l_x = 0, l_y = 0, l_width = (int)GetWidth(), l_height = (int)GetHeight();
+
+		// the first frame is the default image and has to cover all of it:
+		if (i > 0)
+		{
+			GetFrameRect(l_ranges[i], l_x, l_y, l_width, l_height);
+		}
+
+		if (!_EncodeRect(l_surface, l_x, l_y, l_width, l_height, l_zdata))
+		{
+			l_success = false;
+			break;
+		}
+
+		// fcTL: the changed area is replaced, everything else stays as it was
+		l_chunk.clear();
+		_PutUint32BE(l_chunk, l_sequence++);
+		_PutUint32BE(l_chunk, static_cast<uint32_t>(l_width));
+		_PutUint32BE(l_chunk, static_cast<uint32_t>(l_height));
+		_PutUint32BE(l_chunk, static_cast<uint32_t>(l_x));
+		_PutUint32BE(l_chunk, static_cast<uint32_t>(l_y));
+		l_chunk.insert(l_chunk.end(), {
+			static_cast<uint8_t>(m_frameDelay >> 8), static_cast<uint8_t>(m_frameDelay), // delay numerator
+			0x03, 0xE8, // delay denominator (1000)
+			0, // APNG_DISPOSE_OP_NONE
+			0 }); // APNG_BLEND_OP_SOURCE
+		l_success = _WritePngChunk(fp, "fcTL", l_chunk);
+
+		if (i == 0)
+		{
+			l_success = l_success && _WritePngChunk(fp, "IDAT", l_zdata);
+		}
+		else
+		{
+			l_chunk.clear();
+			_PutUint32BE(l_chunk, l_sequence++);
+			l_chunk.insert(l_chunk.end(), l_zdata.begin(), l_zdata.end());
+			l_success = l_success && _WritePngChunk(fp, "fdAT", l_chunk);
+		}
+	}
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(l_surface);
+
+	l_success = l_success && _WritePngChunk(fp, "IEND", std::vector<uint8_t>());
+
+	fclose(fp);
+
+	if (!l_success)
+	{
+		::DeleteFile(a_filePath.c_str());
+	}
+
+	return l_success;
+}
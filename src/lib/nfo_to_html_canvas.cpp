@@ -97,29 +97,20 @@ const std::string CNFOToHTMLCanvas::GetRenderJSONString()
 		j_row_blocks["b"] = json::array();
 
 		size_t l_buf_first_col = (size_t)-1;
-		size_t l_block_grp_col = 0;
-		json j_block_grp;
+		size_t l_buf_next_col = 0;
 
-		for (size_t col = 0; col < m_nfo->GetGridWidth(); col++)
+		for (const CRenderGridRun& l_run : m_gridRows[row].runs)
 		{
-			const CRenderGridBlock& l_block = (*m_gridData)[row][col];
-
-			if (l_block.shape != RGS_NO_BLOCK && l_block.shape != RGS_WHITESPACE_IN_TEXT)
+			if (!l_run.text)
 			{
-				if (l_block.shape != RGS_WHITESPACE)
-				{
-					// it's a block!
+				// it's a run of blocks!
+				json j_block_grp;
 
-					if (!j_block_grp.empty() && col != l_block_grp_col + 1)
-					{
-						j_row_blocks["b"].push_back(j_block_grp);
-						j_block_grp.clear();
-					}
+				j_block_grp.push_back(l_run.col);
 
-					if (j_block_grp.empty())
-					{
-						j_block_grp.push_back(col);
-					}
+				for (size_t col = l_run.col; col < l_run.col + l_run.len; col++)
+				{
+					const CRenderGridBlock& l_block = (*m_gridData)[row][col];
 
 					switch (l_block.shape)
 					{
@@ -136,16 +127,19 @@ const std::string CNFOToHTMLCanvas::GetRenderJSONString()
 						else j_block_grp.push_back(ExportBlockIndices::FULL_BLOCK);
 						break;
 					}
-
-					l_block_grp_col = col;
 				}
 
-				if (l_buf_first_col != (size_t)-1)
-				{
-					l_line_buf += ' '; // add whitespace between non-whitespace chars that are skipped
-				}
+				j_row_blocks["b"].push_back(j_block_grp);
+
+				continue;
 			}
-			else
+
+			if (l_buf_first_col != (size_t)-1)
+			{
+				l_line_buf.append(l_run.col - l_buf_next_col, ' '); // add whitespace between non-whitespace chars that are skipped
+			}
+
+			for (size_t col = l_run.col; col < l_run.col + l_run.len; col++)
 			{
 				if (l_buf_first_col == (size_t)-1)
 				{
@@ -181,11 +175,8 @@ const std::string CNFOToHTMLCanvas::GetRenderJSONString()
 
 				l_line_buf += m_nfo->GetGridCharUtf8(row, col);
 			}
-		}
 
-		if (!j_block_grp.empty())
-		{
-			j_row_blocks["b"].push_back(j_block_grp);
+			l_buf_next_col = l_run.col + l_run.len;
 		}
 
 		if (!j_row_blocks["b"].empty())
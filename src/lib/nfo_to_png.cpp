@@ -23,6 +23,15 @@ CNFOToPNG::CNFOToPNG(bool a_classicMode)
 {
 	// the GPU algorithm does not produce a mask, so it can't handle transparency.
 	m_forceGPUOff = true;
+
+	// a quarter of the memory, and palette images can be written straight from the stripes:
+	SetPaletteStripes(true);
+
+	// PNG files don't know the subpixel layout of the screen they will be viewed on anyway:
+	SetGlyphAtlas(true);
+
+	// exports tend to use big glow radii, which is where this pays off most:
+	SetReducedGlow(true);
 }
 
 
@@ -38,7 +47,7 @@ bool CNFOToPNG::SavePNG(const std::_tstring& a_filePath)
 		return false;
 	}
 
-	if (m_stripes.size() == 1 && GetHeight() < 32767)
+	if (m_numStripes == 1 && GetHeight() < 32767 && !IsPaletteStripe(0))
 	{
 		std::string l_filePath =
 #ifdef _UNICODE
@@ -47,7 +56,7 @@ bool CNFOToPNG::SavePNG(const std::_tstring& a_filePath)
 			a_filePath;
 #endif
 
-		return (cairo_surface_write_to_png(*m_stripes[0], l_filePath.c_str()) == CAIRO_STATUS_SUCCESS);
+		return (cairo_surface_write_to_png(GetStripeSurface(0), l_filePath.c_str()) == CAIRO_STATUS_SUCCESS);
 	}
 
 	return SaveWithLibpng(a_filePath);
@@ -87,12 +96,64 @@ unpremultiply_data(png_structp png, png_row_infop row_info, png_bytep data)
 #endif
 
 
+/**
+ * Merges all stripe palettes into one, ar_remap[stripe][index] is the stripe palette
+ * entry's index in ar_palette. Fails if a stripe is stored as ARGB32, or if there are
+ * more than 256 colors in the whole image.
+ **/
+bool CNFOToPNG::MergeStripePalettes(std::vector<uint32_t>& ar_palette, std::vector<std::vector<uint8_t>>& ar_remap) const
+{
+	std::map<uint32_t, uint8_t> l_indexes;
+
+	ar_palette.clear();
+	ar_remap.clear();
+
+	for (size_t l_stripe = 0; l_stripe < m_numStripes; l_stripe++)
+	{
+		if (!IsPaletteStripe(l_stripe))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> l_remap;
+
+		for (uint32_t l_color : GetStripePalette(l_stripe))
+		{
+			auto it = l_indexes.find(l_color);
+
+			if (it == l_indexes.end())
+			{
+				if (ar_palette.size() == 256)
+				{
+					return false;
+				}
+
+				it = l_indexes.emplace(l_color, static_cast<uint8_t>(ar_palette.size())).first;
+				ar_palette.push_back(l_color);
+			}
+
+			l_remap.push_back(it->second);
+		}
+
+		ar_remap.push_back(l_remap);
+	}
+
+	return true;
+}
+
+
 bool CNFOToPNG::SaveWithLibpng(const std::_tstring& a_filePath)
 {
 	FILE *fp = nullptr;
-	png_bytep *row_ptr = nullptr;
 	bool l_result = false;
 
+	// declared before setjmp, so that nothing leaks if libpng bails out:
+	std::vector<uint32_t> l_palette;
+	std::vector<std::vector<uint8_t>> l_remap;
+	std::vector<png_byte> l_rowBuffer;
+	std::vector<png_color> l_pngPalette;
+	std::vector<png_byte> l_pngAlpha;
+
 	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 
 	if (!png_ptr)
@@ -120,12 +181,6 @@ bool CNFOToPNG::SaveWithLibpng(const std::_tstring& a_filePath)
 			::DeleteFile(a_filePath.c_str());
 		}
 
-		if (row_ptr)
-		{
-			delete[] row_ptr;
-			row_ptr = nullptr;
-		}
-
 		return false;
 	}
 
@@ -136,93 +191,169 @@ bool CNFOToPNG::SaveWithLibpng(const std::_tstring& a_filePath)
 #endif
 	{
 		bool l_error = true; // we perform some custom user-land error checking, too.
-		uint32_t l_imgHeight = static_cast<uint32_t>(GetHeight());
+		const uint32_t l_imgWidth = static_cast<uint32_t>(GetWidth()),
+			l_imgHeight = static_cast<uint32_t>(GetHeight());
 
 		int bpc = 8;
 
+		// palette stripes can be written as they are, with their indexes remapped to the merged palette:
+		const bool l_usePalette = MergeStripePalettes(l_palette, l_remap);
+		bool l_gray = l_usePalette;
+
+		for (uint32_t l_color : l_palette)
+		{
+			const uint8_t r = (l_color >> 16) & 0xFF, g = (l_color >> 8) & 0xFF, b = l_color & 0xFF;
+
+			l_gray = l_gray && (l_color >> 24) == 0xFF && r == g && g == b;
+		}
+
+		if (l_gray)
+		{
+			// black on white etc., the remapped value can be the gray level itself:
+			for (std::vector<uint8_t>& l_stripeRemap : l_remap)
+			{
+				for (uint8_t& l_index : l_stripeRemap)
+				{
+					l_index = static_cast<uint8_t>(l_palette[l_index] & 0xFF);
+				}
+			}
+		}
+
 		png_init_io(png_ptr, fp);
 
-		png_set_IHDR(png_ptr, info_ptr, static_cast<uint32_t>(GetWidth()), l_imgHeight,
-			bpc, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_set_IHDR(png_ptr, info_ptr, l_imgWidth, l_imgHeight,
+			bpc, (l_gray ? PNG_COLOR_TYPE_GRAY : (l_usePalette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB_ALPHA)),
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+		if (l_usePalette && !l_gray)
+		{
+			// the stripe colors are premultiplied, PNG wants them straight:
+			for (uint32_t l_color : l_palette)
+			{
+				const unsigned int l_alpha = (l_color >> 24);
+				png_color l_pngColor = { 0, 0, 0 };
+
+				if (l_alpha > 0)
+				{
+					l_pngColor.red = static_cast<png_byte>((((l_color >> 16) & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+					l_pngColor.green = static_cast<png_byte>((((l_color >> 8) & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+					l_pngColor.blue = static_cast<png_byte>(((l_color & 0xFF) * 255 + l_alpha / 2) / l_alpha);
+				}
 
-		png_color_16 white;
-		white.red = white.blue = white.green = white.gray = (1 << bpc) - 1;
-		png_set_bKGD(png_ptr, info_ptr, &white);
+				l_pngPalette.push_back(l_pngColor);
+				l_pngAlpha.push_back(static_cast<png_byte>(l_alpha));
+			}
 
-		png_set_write_user_transform_fn(png_ptr, unpremultiply_data);
+			png_set_PLTE(png_ptr, info_ptr, l_pngPalette.data(), static_cast<int>(l_pngPalette.size()));
 
-		row_ptr = new (std::nothrow) png_bytep[l_imgHeight];
+			if (std::find_if(l_pngAlpha.begin(), l_pngAlpha.end(), [](png_byte a) { return a != 0xFF; }) != l_pngAlpha.end())
+			{
+				png_set_tRNS(png_ptr, info_ptr, l_pngAlpha.data(), static_cast<int>(l_pngAlpha.size()), nullptr);
+			}
+		}
+		else
+		{
+			png_color_16 white;
+			white.red = white.blue = white.green = white.gray = (1 << bpc) - 1;
+			png_set_bKGD(png_ptr, info_ptr, &white);
+		}
 
-		if (row_ptr)
+		if (!l_usePalette)
 		{
-			size_t l_png_row = 0;
+			png_set_write_user_transform_fn(png_ptr, unpremultiply_data);
+		}
 
-			for (size_t l_stripe = 0; l_stripe < m_numStripes; l_stripe++)
+		png_write_info(png_ptr, info_ptr);
+
+		l_rowBuffer.resize(static_cast<size_t>(l_imgWidth) * 4);
+
+		size_t l_png_row = 0;
+
+		for (size_t l_stripe = 0; l_stripe < m_numStripes; l_stripe++)
+		{
+			cairo_surface_t * const l_surface = GetStripeSurface(l_stripe);
+
+			if (cairo_surface_status(l_surface) != CAIRO_STATUS_SUCCESS)
 			{
-				cairo_surface_t * const l_surface = GetStripeSurface(l_stripe);
+				break;
+			}
 
-				unsigned char *l_data = cairo_image_surface_get_data(l_surface);
-				size_t l_stride = cairo_image_surface_get_stride(l_surface);
-				size_t l_num_rows = cairo_image_surface_get_height(l_surface) - GetStripeHeightExtraBottom(l_stripe);
+			const unsigned char *l_data = cairo_image_surface_get_data(l_surface);
+			size_t l_stride = cairo_image_surface_get_stride(l_surface);
+			size_t l_num_rows = cairo_image_surface_get_height(l_surface) - GetStripeHeightExtraBottom(l_stripe);
+			const std::vector<uint32_t>& l_stripePalette = GetStripePalette(l_stripe);
 
-				_ASSERT(l_num_rows - GetStripeHeightExtraTop(l_stripe) == GetStripeHeight(l_stripe));
+			_ASSERT(l_num_rows - GetStripeHeightExtraTop(l_stripe) == GetStripeHeight(l_stripe));
 
-				if (cairo_surface_status(l_surface) == CAIRO_STATUS_SUCCESS)
+			for (size_t l_row = GetStripeHeightExtraTop(l_stripe); l_row < l_num_rows; l_row++)
+			{
+				if (l_png_row >= l_imgHeight)
 				{
-					for (size_t l_row = GetStripeHeightExtraTop(l_stripe); l_row < l_num_rows; l_row++)
+					// remember that (m_numStripes * m_stripeHeight + m_padding * 2) can legitimately
+					// exceed the actual GetHeight() value!
+					if (l_stripe != m_numStripes - 1)
 					{
-						if (l_png_row >= l_imgHeight)
-						{
-							// remember that (m_numStripes * m_stripeHeight + m_padding * 2) can legitimately
-							// exceed the actual GetHeight() value!
-							if (l_stripe != m_numStripes - 1)
-							{
-								// however this would be FUCKING ILLEGAL
-								l_png_row = (size_t)-1;
-							}
-							break;
-						}
-
-						row_ptr[l_png_row] = (png_bytep)(&l_data[l_row * l_stride]);
-
-						l_png_row++;
+						// however this would be FUCKING ILLEGAL
+						l_png_row = (size_t)-1;
 					}
+					break;
 				}
-				else
+
+				const unsigned char *l_src = &l_data[l_row * l_stride];
+
+				if (l_usePalette)
 				{
-					break;
+					const std::vector<uint8_t>& l_stripeRemap = l_remap[l_stripe];
+
+					for (uint32_t x = 0; x < l_imgWidth; x++)
+					{
+						l_rowBuffer[x] = l_stripeRemap[l_src[x]];
+					}
+
+					l_src = l_rowBuffer.data();
+				}
+				else if (!l_stripePalette.empty())
+				{
+					uint32_t* l_dest = reinterpret_cast<uint32_t*>(l_rowBuffer.data());
+
+					for (uint32_t x = 0; x < l_imgWidth; x++)
+					{
+						l_dest[x] = l_stripePalette[l_src[x]];
+					}
+
+					l_src = l_rowBuffer.data();
 				}
+
+				// libpng copies the row before transforming it:
+				png_write_row(png_ptr, const_cast<png_bytep>(l_src));
+
+				l_png_row++;
 			}
 
-			if (l_png_row == l_imgHeight)
+			if (l_png_row == (size_t)-1)
 			{
-				// everything went well so far.
-				png_set_rows(png_ptr, info_ptr, row_ptr);
-
-				l_error = false;
+				break;
 			}
 		}
 
-		if (!l_error)
+		if (l_png_row == l_imgHeight)
 		{
-			png_write_png(png_ptr, info_ptr, 0, nullptr);
+			// everything went well.
+			png_write_end(png_ptr, info_ptr);
 
-			fclose(fp);
+			l_error = false;
+		}
+
+		fclose(fp);
 
+		if (!l_error)
+		{
 			l_result = true;
 		}
 		else
 		{
-			fclose(fp);
 			::DeleteFile(a_filePath.c_str());
 		}
-
-		if (row_ptr)
-		{
-			delete[] row_ptr;
-			row_ptr = nullptr;
-		}
 	}
 
 	png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -0,0 +1,355 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "nfo_renderer_export.h"
+#include "glyph_atlas.h"
+#include "util.h"
+
+
+CNFOThumbnailer::CNFOThumbnailer(bool a_classicMode)
+	: CNFORenderer(a_classicMode)
+	, m_fadeOut(true)
+{
+	// thumbnails are always composited on the CPU:
+	m_forceGPUOff = true;
+
+	SetGlyphAtlas(true);
+	SetReducedGlow(true);
+
+	// text is unreadable at these sizes anyway, even before scaling down:
+	SetLODCellSize(8);
+}
+
+
+cairo_surface_t* CNFOThumbnailer::CreateThumbnail(int a_maxWidth, int a_maxHeight)
+{
+	if (!m_nfo || m_nfo->GetGridWidth() == 0 || a_maxWidth < 1 || a_maxHeight < 1)
+	{
+		return nullptr;
+	}
+
+	if (!GetEnableGaussShadow())
+	{
+		m_padding = 0;
+	}
+
+	// measure the blocks at the configured size:
+	SetZoom(100);
+
+	if (IsClassicMode() && !CalcClassicModeBlockSizes())
+	{
+		return nullptr;
+	}
+
+	// render at about SUPERSAMPLING times the thumbnail's resolution, but never above the configured size.
+	// Blocks narrower than two pixels don't look like anything anymore:
+	const double l_blockWidth = std::max(2.0, static_cast<double>(a_maxWidth) * SUPERSAMPLING / m_nfo->GetGridWidth());
+	const unsigned int l_zoom = static_cast<unsigned int>(std::min(100.0, std::ceil(100.0 * l_blockWidth / GetBlockWidth())));
+
+	SetZoom(l_zoom);
+
+	// zooming doesn't change the glow radius, but here it has to shrink with everything else:
+	const unsigned int l_glowRadius = GetGaussBlurRadius();
+
+	SetGaussBlurRadius(std::max(1u, l_glowRadius * l_zoom / 100));
+
+	cairo_surface_t* l_thumb = RenderThumbnail(a_maxWidth, a_maxHeight);
+
+	SetGaussBlurRadius(l_glowRadius);
+
+	return l_thumb;
+}
+
+
+cairo_surface_t* CNFOThumbnailer::RenderThumbnail(int a_maxWidth, int a_maxHeight)
+{
+	// the block size is needed before rendering starts:
+	if (IsClassicMode() && !CalcClassicModeBlockSizes())
+	{
+		return nullptr;
+	}
+
+	const int l_fullWidth = static_cast<int>(GetWidth()), l_fullHeight = static_cast<int>(GetHeight());
+	const double l_scale = std::min(1.0, static_cast<double>(a_maxWidth) / l_fullWidth);
+
+	const int l_width = std::max(1, static_cast<int>(l_fullWidth * l_scale + 0.5));
+	const int l_height = std::max(1, std::min(a_maxHeight, static_cast<int>(l_fullHeight * l_scale + 0.5)));
+
+	// nothing below this is rendered:
+	const int l_sourceHeight = std::min(l_fullHeight, static_cast<int>(std::ceil(l_height / l_scale)));
+
+	PNFORenderRequest l_request = RenderAsync(0, 0, l_fullWidth, l_sourceHeight);
+
+	if (!l_request || !l_request->Wait())
+	{
+		return nullptr;
+	}
+
+	cairo_surface_t* l_source = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, l_fullWidth, l_sourceHeight);
+
+	SetDrawReadyOnly(true);
+
+	bool l_success = (cairo_surface_status(l_source) == CAIRO_STATUS_SUCCESS)
+		&& DrawToSurface(l_source, 0, 0, 0, 0, l_fullWidth, l_sourceHeight);
+
+	SetDrawReadyOnly(false);
+
+	cairo_surface_t* l_thumb = l_source;
+
+	if (l_success && (l_width != l_fullWidth || l_height != l_sourceHeight))
+	{
+		l_thumb = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, l_width, l_height);
+
+		l_success = AreaDownscale(l_source, l_thumb);
+
+		cairo_surface_destroy(l_source);
+	}
+
+	if (!l_success)
+	{
+		cairo_surface_destroy(l_thumb);
+
+		return nullptr;
+	}
+
+	if (m_fadeOut && l_sourceHeight < l_fullHeight)
+	{
+		FadeOut(l_thumb);
+	}
+
+	return l_thumb;
+}
+
+
+bool CNFOThumbnailer::SaveThumbnail(const std::_tstring& a_filePath, int a_maxWidth, int a_maxHeight)
+{
+	cairo_surface_t* l_thumb = CreateThumbnail(a_maxWidth, a_maxHeight);
+
+	if (!l_thumb)
+	{
+		return false;
+	}
+
+	std::string l_filePath =
+#ifdef _UNICODE
+		CUtil::FromWideStr(a_filePath, CP_UTF8);
+#else
+		a_filePath;
+#endif
+
+	const bool l_success = (cairo_surface_write_to_png(l_thumb, l_filePath.c_str()) == CAIRO_STATUS_SUCCESS);
+
+	cairo_surface_destroy(l_thumb);
+
+	return l_success;
+}
+
+
+/**
+ * Blends the bottom rows into the background color, so that it's obvious that there's more.
+ **/
+void CNFOThumbnailer::FadeOut(cairo_surface_t* a_surface) const
+{
+	const int l_width = cairo_image_surface_get_width(a_surface), l_height = cairo_image_surface_get_height(a_surface);
+	const int l_stride = cairo_image_surface_get_stride(a_surface);
+	const int l_fadeHeight = std::max(1, l_height / 6);
+	const uint32_t l_back = CGlyphAtlas::SolidPixel(S_COLOR_T_CAIRO_A(GetBackColor()));
+
+	cairo_surface_flush(a_surface);
+
+	unsigned char* l_data = cairo_image_surface_get_data(a_surface);
+
+	for (int y = l_height - l_fadeHeight; y < l_height; y++)
+	{
+		// all background in the last row:
+		const uint32_t l_amount = static_cast<uint32_t>((y - (l_height - l_fadeHeight) + 1) * 256 / l_fadeHeight);
+		uint32_t* l_row = reinterpret_cast<uint32_t*>(l_data + static_cast<size_t>(y) * l_stride);
+
+		for (int x = 0; x < l_width; x++)
+		{
+			uint32_t l_pixel = 0;
+
+			for (int l_shift = 0; l_shift < 32; l_shift += 8)
+			{
+				const uint32_t l_value = ((l_row[x] >> l_shift) & 0xFF) * (256 - l_amount) + ((l_back >> l_shift) & 0xFF) * l_amount;
+
+				l_pixel |= ((l_value + 128) >> 8) << l_shift;
+			}
+
+			l_row[x] = l_pixel;
+		}
+	}
+
+	cairo_surface_mark_dirty(a_surface);
+}
+
+
+/************************************************************************/
+/* Area averaging                                                       */
+/************************************************************************/
+
+typedef struct
+{
+	int first, count; // source pixels
+	size_t weights; // index of the first weight
+} SAreaSpan;
+
+
+/**
+ * Every destination pixel covers a_sourceSize / a_destSize source pixels, the ones on the
+ * borders of that area only partially. Weights are 16 bit fixed point and add up to 1.
+ **/
+static void _CalcAreaSpans(int a_sourceSize, int a_destSize, std::vector<SAreaSpan>& ar_spans, std::vector<uint32_t>& ar_weights)
+{
+	const double l_ratio = static_cast<double>(a_sourceSize) / a_destSize;
+
+	ar_spans.resize(a_destSize);
+	ar_weights.clear();
+
+	for (int i = 0; i < a_destSize; i++)
+	{
+		const double l_from = i * l_ratio, l_to = std::min((i + 1) * l_ratio, static_cast<double>(a_sourceSize));
+		const int l_first = static_cast<int>(l_from), l_last = std::min(static_cast<int>(std::ceil(l_to)), a_sourceSize) - 1;
+
+		SAreaSpan& l_span = ar_spans[i];
+		l_span.first = l_first;
+		l_span.count = l_last - l_first + 1;
+		l_span.weights = ar_weights.size();
+
+		uint32_t l_sum = 0, l_largestWeight = 0;
+		size_t l_largest = l_span.weights;
+
+		for (int j = l_first; j <= l_last; j++)
+		{
+			const double l_coverage = std::min(l_to, j + 1.0) - std::max(l_from, static_cast<double>(j));
+			const uint32_t l_weight = static_cast<uint32_t>(l_coverage / (l_to - l_from) * 65536 + 0.5);
+
+			if (l_weight > l_largestWeight)
+			{
+				l_largestWeight = l_weight;
+				l_largest = ar_weights.size();
+			}
+
+			ar_weights.push_back(l_weight);
+			l_sum += l_weight;
+		}
+
+		// rounding must not change the brightness:
+		ar_weights[l_largest] += 65536 - l_sum;
+	}
+}
+
+
+/**
+ * Scales a_source down to the size of a_dest, both have to be ARGB32.
+ * Premultiplied pixels can be averaged as they are.
+ **/
+bool CNFOThumbnailer::AreaDownscale(cairo_surface_t* a_source, cairo_surface_t* a_dest)
+{
+	if (cairo_surface_status(a_source) != CAIRO_STATUS_SUCCESS || cairo_surface_status(a_dest) != CAIRO_STATUS_SUCCESS)
+	{
+		return false;
+	}
+
+	const int l_srcWidth = cairo_image_surface_get_width(a_source), l_srcHeight = cairo_image_surface_get_height(a_source);
+	const int l_dstWidth = cairo_image_surface_get_width(a_dest), l_dstHeight = cairo_image_surface_get_height(a_dest);
+	const int l_srcStride = cairo_image_surface_get_stride(a_source), l_dstStride = cairo_image_surface_get_stride(a_dest);
+
+	if (l_dstWidth > l_srcWidth || l_dstHeight > l_srcHeight)
+	{
+		return false;
+	}
+
+	std::vector<SAreaSpan> l_colSpans, l_rowSpans;
+	std::vector<uint32_t> l_colWeights, l_rowWeights;
+
+	_CalcAreaSpans(l_srcWidth, l_dstWidth, l_colSpans, l_colWeights);
+	_CalcAreaSpans(l_srcHeight, l_dstHeight, l_rowSpans, l_rowWeights);
+
+	cairo_surface_flush(a_source);
+	cairo_surface_flush(a_dest);
+
+	const unsigned char* l_srcData = cairo_image_surface_get_data(a_source);
+	unsigned char* l_dstData = cairo_image_surface_get_data(a_dest);
+
+	// horizontally first, four channels per pixel with eight extra bits of precision:
+	const size_t l_rowValues = static_cast<size_t>(l_dstWidth) * 4;
+	std::vector<uint32_t> l_narrow(l_rowValues * l_srcHeight);
+
+	for (int y = 0; y < l_srcHeight; y++)
+	{
+		const uint32_t* l_src = reinterpret_cast<const uint32_t*>(l_srcData + static_cast<size_t>(y) * l_srcStride);
+		uint32_t* l_out = &l_narrow[l_rowValues * y];
+
+		for (const SAreaSpan& l_span : l_colSpans)
+		{
+			uint32_t l_sums[4] = { 0 };
+
+			for (int j = 0; j < l_span.count; j++)
+			{
+				const uint32_t l_pixel = l_src[l_span.first + j], l_weight = l_colWeights[l_span.weights + j];
+
+				for (int c = 0; c < 4; c++)
+				{
+					l_sums[c] += ((l_pixel >> (c * 8)) & 0xFF) * l_weight;
+				}
+			}
+
+			for (int c = 0; c < 4; c++)
+			{
+				*l_out++ = (l_sums[c] + 128) >> 8;
+			}
+		}
+	}
+
+	// then vertically:
+	std::vector<uint64_t> l_sums(l_rowValues);
+
+	for (int y = 0; y < l_dstHeight; y++)
+	{
+		const SAreaSpan& l_span = l_rowSpans[y];
+
+		std::fill(l_sums.begin(), l_sums.end(), 0);
+
+		for (int j = 0; j < l_span.count; j++)
+		{
+			const uint32_t* l_in = &l_narrow[l_rowValues * (l_span.first + j)];
+			const uint64_t l_weight = l_rowWeights[l_span.weights + j];
+
+			for (size_t i = 0; i < l_rowValues; i++)
+			{
+				l_sums[i] += l_in[i] * l_weight;
+			}
+		}
+
+		uint32_t* l_dst = reinterpret_cast<uint32_t*>(l_dstData + static_cast<size_t>(y) * l_dstStride);
+
+		for (int x = 0; x < l_dstWidth; x++)
+		{
+			uint32_t l_pixel = 0;
+
+			for (int c = 0; c < 4; c++)
+			{
+				l_pixel |= static_cast<uint32_t>((l_sums[x * 4 + c] + (1 << 23)) >> 24) << (c * 8);
+			}
+
+			l_dst[x] = l_pixel;
+		}
+	}
+
+	cairo_surface_mark_dirty(a_dest);
+
+	return true;
+}
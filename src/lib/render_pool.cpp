@@ -0,0 +1,426 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#include "stdafx.h"
+#include "render_pool.h"
+#include "nfo_renderer.h"
+#include <omp.h>
+
+
+CRenderPool& CRenderPool::GetInstance()
+{
+	static CRenderPool s_pool;
+
+	return s_pool;
+}
+
+
+CRenderPool::CRenderPool() :
+	m_queued(0),
+	m_nextWorker(0),
+	m_shutdown(false)
+{
+	const size_t l_numWorkers = static_cast<size_t>(std::max(omp_get_num_procs(), 1));
+
+	for (size_t i = 0; i < l_numWorkers; i++)
+	{
+		m_workers.emplace_back(new SWorker());
+	}
+
+	for (size_t i = 0; i < l_numWorkers; i++)
+	{
+		m_threads.emplace_back([this, i] { WorkerThreadProc(i); });
+	}
+}
+
+
+void CRenderPool::Submit(const void* a_owner, ERenderPoolPriority a_priority, const std::function<void()>& a_task)
+{
+	std::lock_guard<std::mutex> l_stateLock(m_stateLock);
+
+	SWorker* l_worker = m_workers[m_nextWorker++ % m_workers.size()].get();
+
+	m_pending[a_owner]++;
+	m_queued++;
+
+	{
+		std::lock_guard<std::mutex> l_lock(l_worker->lock);
+
+		l_worker->queues[a_priority].push_back(STask{ a_owner, a_task });
+	}
+
+	m_wakeUp.notify_one();
+}
+
+
+size_t CRenderPool::Cancel(const void* a_owner, ERenderPoolPriority a_priority)
+{
+	std::lock_guard<std::mutex> l_stateLock(m_stateLock);
+	size_t l_dropped = 0;
+
+	for (auto& l_worker : m_workers)
+	{
+		std::lock_guard<std::mutex> l_lock(l_worker->lock);
+
+		for (size_t l_prio = 0; l_prio < _RP_MAX; l_prio++)
+		{
+			if (a_priority != _RP_MAX && a_priority != l_prio)
+			{
+				continue;
+			}
+
+			std::deque<STask>& l_queue = l_worker->queues[l_prio];
+			auto l_newEnd = std::remove_if(l_queue.begin(), l_queue.end(),
+				[a_owner](const STask& t) { return t.owner == a_owner; });
+
+			l_dropped += std::distance(l_newEnd, l_queue.end());
+
+			l_queue.erase(l_newEnd, l_queue.end());
+		}
+	}
+
+	if (l_dropped > 0)
+	{
+		m_queued -= l_dropped;
+
+		auto it = m_pending.find(a_owner);
+
+		if ((it->second -= l_dropped) == 0)
+		{
+			m_pending.erase(it);
+
+			m_ownerDone.notify_all();
+		}
+	}
+
+	return l_dropped;
+}
+
+
+void CRenderPool::WaitForOwner(const void* a_owner)
+{
+	std::unique_lock<std::mutex> l_stateLock(m_stateLock);
+
+	m_ownerDone.wait(l_stateLock, [this, a_owner] { return m_pending.find(a_owner) == m_pending.end(); });
+}
+
+
+bool CRenderPool::TakeTask(size_t a_worker, STask& ar_task)
+{
+	const size_t l_numWorkers = m_workers.size();
+
+	// visible work first, no matter whose queue it's in.
+	// within one priority level, try the worker's own queue before stealing:
+	for (size_t l_prio = 0; l_prio < _RP_MAX; l_prio++)
+	{
+		for (size_t k = 0; k < l_numWorkers; k++)
+		{
+			SWorker* l_worker = m_workers[(a_worker + k) % l_numWorkers].get();
+			std::lock_guard<std::mutex> l_lock(l_worker->lock);
+			std::deque<STask>& l_queue = l_worker->queues[l_prio];
+
+			if (!l_queue.empty())
+			{
+				// oldest first, so pre-rendering roughly follows submission order:
+				ar_task = std::move(l_queue.front());
+				l_queue.pop_front();
+
+				m_queued--;
+
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+void CRenderPool::TaskDone(const void* a_owner)
+{
+	std::lock_guard<std::mutex> l_stateLock(m_stateLock);
+
+	auto it = m_pending.find(a_owner);
+
+	if (--it->second == 0)
+	{
+		m_pending.erase(it);
+
+		m_ownerDone.notify_all();
+	}
+}
+
+
+void CRenderPool::WorkerThreadProc(size_t a_worker)
+{
+	// stripes are already spread across all cores, don't let
+	// the CPU blur fork another team of threads per stripe:
+	omp_set_num_threads(1);
+
+	while (true)
+	{
+		STask l_task;
+
+		if (TakeTask(a_worker, l_task))
+		{
+			l_task.func();
+
+			TaskDone(l_task.owner);
+
+			continue;
+		}
+
+		std::unique_lock<std::mutex> l_stateLock(m_stateLock);
+
+		m_wakeUp.wait(l_stateLock, [this] { return m_shutdown || m_queued > 0; });
+
+		if (m_shutdown)
+		{
+			break;
+		}
+	}
+}
+
+
+CRenderPool::~CRenderPool()
+{
+	{
+		std::lock_guard<std::mutex> l_stateLock(m_stateLock);
+		m_shutdown = true;
+		m_wakeUp.notify_all();
+	}
+
+	for (auto& l_thread : m_threads)
+	{
+		if (l_thread.joinable())
+		{
+			l_thread.join();
+		}
+	}
+}
+
+
+/************************************************************************/
+/* CStripeCache Implementation                                          */
+/************************************************************************/
+
+CStripeCache& CStripeCache::GetInstance()
+{
+	static CStripeCache s_cache;
+
+	return s_cache;
+}
+
+
+CStripeCache::CStripeCache() :
+	m_budget(DEFAULT_BUDGET),
+	m_bytesUsed(0),
+	m_packedBudget(DEFAULT_PACKED_BUDGET),
+	m_packedBytesUsed(0),
+	m_hits(0),
+	m_misses(0),
+	m_evictions(0),
+	m_packedHits(0)
+{
+}
+
+
+void CStripeCache::SetBudget(size_t a_bytes)
+{
+	// takes effect with the next Trim call, i.e. the next time something is drawn.
+	m_budget = a_bytes;
+}
+
+
+void CStripeCache::SetPackedBudget(size_t a_bytes)
+{
+	// 0 disables the second tier.
+	m_packedBudget = a_bytes;
+}
+
+
+CStripeCache::SStats CStripeCache::GetStats() const
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	return SStats{ m_hits, m_misses, m_evictions, m_packedHits,
+		m_bytesUsed, m_budget, m_packedBytesUsed, m_packedBudget };
+}
+
+
+void CStripeCache::ResetStats()
+{
+	m_hits = m_misses = m_evictions = m_packedHits = 0;
+}
+
+
+void CStripeCache::Insert(CNFORenderer* a_owner, size_t a_stripe, size_t a_bytes)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	const TKey l_key(a_owner, a_stripe);
+
+	_ASSERT(m_entries.find(l_key) == m_entries.end());
+
+	m_lru.push_front(l_key);
+	m_entries[l_key] = SEntry{ m_lru.begin(), a_bytes };
+	m_bytesUsed += a_bytes;
+}
+
+
+void CStripeCache::Remove(const CNFORenderer* a_owner, size_t a_stripe)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_entries.find(TKey(const_cast<CNFORenderer*>(a_owner), a_stripe));
+
+	if (it != m_entries.end())
+	{
+		m_bytesUsed -= it->second.bytes;
+		m_lru.erase(it->second.lruPos);
+		m_entries.erase(it);
+	}
+}
+
+
+void CStripeCache::RemovePacked(const CNFORenderer* a_owner, size_t a_stripe)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_packedEntries.find(TKey(const_cast<CNFORenderer*>(a_owner), a_stripe));
+
+	if (it != m_packedEntries.end())
+	{
+		m_packedBytesUsed -= it->second.bytes;
+		m_packedLru.erase(it->second.lruPos);
+		m_packedEntries.erase(it);
+	}
+}
+
+
+void CStripeCache::Touch(const CNFORenderer* a_owner, size_t a_stripe)
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+	auto it = m_entries.find(TKey(const_cast<CNFORenderer*>(a_owner), a_stripe));
+
+	if (it != m_entries.end())
+	{
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+	}
+
+	m_hits++;
+}
+
+
+bool CStripeCache::HasRoomFor(size_t a_bytes) const
+{
+	std::lock_guard<std::mutex> l_lock(m_lock);
+
+	return m_bytesUsed + a_bytes <= m_budget;
+}
+
+
+/**
+ * Evicting and packing stripes takes a while, so it happens without holding
+ * m_lock, which every worker needs to finish a stripe. The victims' entries
+ * are taken out first, so that a stripe that is rendered again in the
+ * meantime can be inserted as usual.
+ **/
+void CStripeCache::Trim(const CNFORenderer* a_keepOwner, size_t a_keepFrom, size_t a_keepTo)
+{
+	std::vector<std::pair<TKey, size_t>> l_victims; // key, bytes
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_lock);
+
+		auto it = m_lru.end();
+
+		while (m_bytesUsed > m_budget && it != m_lru.begin())
+		{
+			--it;
+
+			const TKey l_key = *it;
+
+			if (l_key.first == a_keepOwner && l_key.second >= a_keepFrom && l_key.second <= a_keepTo)
+			{
+				continue;
+			}
+
+			auto l_entry = m_entries.find(l_key);
+			l_victims.emplace_back(l_key, l_entry->second.bytes);
+			m_bytesUsed -= l_entry->second.bytes;
+			m_entries.erase(l_entry);
+
+			it = m_lru.erase(it);
+		}
+	}
+
+	std::vector<size_t> l_packedBytes(l_victims.size(), 0);
+	std::vector<bool> l_evicted(l_victims.size(), false);
+
+	for (size_t i = 0; i < l_victims.size(); i++)
+	{
+		l_evicted[i] = l_victims[i].first.first->EvictStripe(l_victims[i].first.second, l_packedBytes[i]);
+	}
+
+	std::vector<TKey> l_dropped;
+
+	{
+		std::lock_guard<std::mutex> l_lock(m_lock);
+
+		for (size_t i = 0; i < l_victims.size(); i++)
+		{
+			const TKey& l_key = l_victims[i].first;
+
+			if (!l_evicted[i])
+			{
+				// still in use, account for it again unless it has been reset and inserted anew:
+				if (m_entries.find(l_key) == m_entries.end())
+				{
+					m_lru.push_back(l_key);
+					m_entries[l_key] = SEntry{ std::prev(m_lru.end()), l_victims[i].second };
+					m_bytesUsed += l_victims[i].second;
+				}
+
+				continue;
+			}
+
+			m_evictions++;
+
+			if (l_packedBytes[i] > 0 && m_packedEntries.find(l_key) == m_packedEntries.end())
+			{
+				m_packedLru.push_front(l_key);
+				m_packedEntries[l_key] = SEntry{ m_packedLru.begin(), l_packedBytes[i] };
+				m_packedBytesUsed += l_packedBytes[i];
+			}
+		}
+
+		// stripes that dropped out of the second tier need to be rendered from scratch:
+		while (m_packedBytesUsed > m_packedBudget && !m_packedLru.empty())
+		{
+			const TKey l_key = m_packedLru.back();
+
+			auto l_entry = m_packedEntries.find(l_key);
+			m_packedBytesUsed -= l_entry->second.bytes;
+			m_packedEntries.erase(l_entry);
+
+			m_packedLru.pop_back();
+
+			l_dropped.push_back(l_key);
+		}
+	}
+
+	// a stripe that is being unpacked right now is left alone, it won't be PACKED anymore either way:
+	for (const TKey& l_key : l_dropped)
+	{
+		l_key.first->DropPackedStripe(l_key.second);
+	}
+}
@@ -0,0 +1,162 @@
+/**
+ * Copyright (C) 2014 syndicode
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ **/
+
+#ifndef _RENDER_POOL_H
+#define _RENDER_POOL_H
+
+#include <deque>
+#include <list>
+#include <condition_variable>
+
+class CNFORenderer;
+
+typedef enum _render_pool_priority_t
+{
+	RP_VISIBLE = 0, // stripes that are on screen right now
+	RP_BACKGROUND, // pre-rendering
+
+	_RP_MAX
+} ERenderPoolPriority;
+
+
+/**
+ * Process-wide pool with one worker thread per core. Each worker owns a queue
+ * per priority level and steals from the others when it runs dry, so all
+ * cores share whatever stripe work is pending. Idle workers sleep.
+ **/
+class CRenderPool
+{
+public:
+	static CRenderPool& GetInstance();
+	virtual ~CRenderPool();
+
+	void Submit(const void* a_owner, ERenderPoolPriority a_priority, const std::function<void()>& a_task);
+	// drops queued (not yet running) tasks of a_owner, _RP_MAX = any priority.
+	// returns the number of dropped tasks:
+	size_t Cancel(const void* a_owner, ERenderPoolPriority a_priority = _RP_MAX);
+	// blocks until a_owner has no more queued or running tasks:
+	void WaitForOwner(const void* a_owner);
+
+	size_t GetNumWorkers() const { return m_workers.size(); }
+
+protected:
+	CRenderPool();
+
+	typedef struct
+	{
+		const void* owner;
+		std::function<void()> func;
+	} STask;
+
+	typedef struct
+	{
+		std::mutex lock;
+		std::deque<STask> queues[_RP_MAX];
+	} SWorker;
+
+	std::vector<std::unique_ptr<SWorker>> m_workers;
+	std::vector<std::thread> m_threads;
+
+	// guards everything below, always acquire before a worker's lock:
+	std::mutex m_stateLock;
+	std::condition_variable m_wakeUp;
+	std::condition_variable m_ownerDone;
+	std::map<const void*, size_t> m_pending; // owner -> no. of queued + running tasks
+	std::atomic<size_t> m_queued; // TakeTask decrements this without m_stateLock
+	size_t m_nextWorker;
+	bool m_shutdown;
+
+	bool TakeTask(size_t a_worker, STask& ar_task);
+	void TaskDone(const void* a_owner);
+	void WorkerThreadProc(size_t a_worker);
+};
+
+
+/**
+ * Process-wide memory budget for the stripe surfaces of on-demand renderers.
+ * Stripes are kept in LRU order across all renderer instances, the least
+ * recently drawn ones are evicted once the budget is exceeded and will be
+ * rendered again when they are needed. All on-demand renderers are expected
+ * to be drawn from the same (UI) thread, since eviction happens there.
+ * Evicted stripes can be kept run-length encoded in a second LRU tier with
+ * its own budget, restoring those is much cheaper than rendering them again.
+ **/
+class CStripeCache
+{
+public:
+	static CStripeCache& GetInstance();
+
+	typedef struct
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t packedHits;
+		size_t bytesUsed;
+		size_t budget;
+		size_t packedBytesUsed;
+		size_t packedBudget;
+	} SStats;
+
+	void SetBudget(size_t a_bytes);
+	size_t GetBudget() const { return m_budget; }
+	void SetPackedBudget(size_t a_bytes);
+	size_t GetPackedBudget() const { return m_packedBudget; }
+	SStats GetStats() const;
+	void ResetStats();
+
+	// called by CNFORenderer:
+	void Insert(CNFORenderer* a_owner, size_t a_stripe, size_t a_bytes);
+	void Remove(const CNFORenderer* a_owner, size_t a_stripe);
+	void Touch(const CNFORenderer* a_owner, size_t a_stripe); // counts a hit
+	void RemovePacked(const CNFORenderer* a_owner, size_t a_stripe);
+	void CountMiss(bool a_unpacked) { if (a_unpacked) m_packedHits++; else m_misses++; }
+	bool HasRoomFor(size_t a_bytes) const;
+	// evicts until the budget is met again, except for a_keepOwner's stripes a_keepFrom to a_keepTo:
+	void Trim(const CNFORenderer* a_keepOwner, size_t a_keepFrom, size_t a_keepTo);
+
+	// 64 bit builds on any platform get the bigger budgets:
+	static const size_t DEFAULT_BUDGET = (sizeof(void*) == 8 ? 768 : 384) * 1024 * 1024;
+	static const size_t DEFAULT_PACKED_BUDGET = (sizeof(void*) == 8 ? 256 : 96) * 1024 * 1024;
+
+protected:
+	CStripeCache();
+
+	typedef std::pair<CNFORenderer*, size_t> TKey;
+
+	typedef struct
+	{
+		std::list<TKey>::iterator lruPos;
+		size_t bytes;
+	} SEntry;
+
+	mutable std::mutex m_lock;
+	std::list<TKey> m_lru; // most recently used first
+	std::map<TKey, SEntry> m_entries;
+	std::atomic<size_t> m_budget;
+	size_t m_bytesUsed;
+
+	// second tier, for PACKED stripes:
+	std::list<TKey> m_packedLru;
+	std::map<TKey, SEntry> m_packedEntries;
+	std::atomic<size_t> m_packedBudget;
+	size_t m_packedBytesUsed;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+	std::atomic<uint64_t> m_packedHits;
+};
+
+#endif /* !_RENDER_POOL_H */
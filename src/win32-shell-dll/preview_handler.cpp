@@ -34,6 +34,9 @@ private:
 	RECT m_rcParent;
 	PNFOViewControl m_view;
 
+	// rows to pre-render above/below the visible part of the preview:
+	static const size_t PREVIEW_LOOK_AHEAD_ROWS = 250;
+
 public:
 	CNFOPreviewHandler()
 	{
@@ -210,6 +213,10 @@ HRESULT CNFOPreviewHandler::DoPreview()
 		PNFOViewControl l_view(l_temp);
 		PNFOData l_nfoData;
 
+		// only render what's visible right away, pre-render a bit around it:
+		l_view->SetOnDemandRendering(true);
+		l_view->SetPreRenderLookAhead(PREVIEW_LOOK_AHEAD_ROWS);
+
 		if (!LoadNFOFromStream(m_pStream, l_nfoData) || !l_view->AssignNFO(l_nfoData))
 		{
 			return E_PREVIEWHANDLER_CORRUPT;
@@ -13,7 +13,7 @@
  **/
 
 #include "stdafx.h"
-#include "nfo_renderer.h"
+#include "nfo_renderer_export.h"
 #include "shell-util.h"
 
 /************************************************************************/
@@ -105,30 +105,23 @@ IFACEMETHODIMP CNFOThumbProvider::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPH
 	}
 
 	// set up renderer:
-	CNFORenderer l_renderer;
+	CNFOThumbnailer l_renderer;
 
 	if (!l_renderer.AssignNFO(l_nfoData))
 	{
 		return E_FAIL;
 	}
 
-	// make some guesses based on the requested thumb nail size:
-	if (cx < 256)
-	{
-		l_renderer.SetBlockSize(4, 7);
-	}
+	// only renders what fits into the requested size, long NFOs are cut off and faded out:
+	cairo_surface_t* l_thumb = l_renderer.CreateThumbnail(static_cast<int>(cx), static_cast<int>(cx));
 
-	// render and copy to DIB section:
-	int l_imgWidth = (int)l_renderer.GetWidth(), l_imgHeight = (int)l_renderer.GetHeight();
-	bool l_cut = false;
-
-	if (l_imgHeight > 600)
+	if (!l_thumb)
 	{
-		// https://github.com/syndicodefront/infekt/issues/89
-		l_imgHeight = 600;
-		l_cut = true;
+		return E_FAIL;
 	}
 
+	const int l_imgWidth = cairo_image_surface_get_width(l_thumb), l_imgHeight = cairo_image_surface_get_height(l_thumb);
+
 	BITMAPINFO l_bi{};
 	l_bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
 	l_bi.bmiHeader.biWidth = l_imgWidth;
@@ -139,56 +132,31 @@ IFACEMETHODIMP CNFOThumbProvider::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPH
 
 	unsigned char* l_rawData;
 	HBITMAP l_hBitmap = CreateDIBSection(nullptr, &l_bi, DIB_RGB_COLORS, (void**)&l_rawData, nullptr, 0);
-
 	HRESULT hr = E_FAIL;
 
 	if (l_hBitmap)
 	{
 		BITMAP l_bitmap{};
 		GetObject(l_hBitmap, sizeof(BITMAP), &l_bitmap);
-		cairo_surface_t* l_surfaceOut = cairo_image_surface_create_for_data(
-			l_rawData, CAIRO_FORMAT_ARGB32, l_imgWidth, l_imgHeight, l_bitmap.bmWidthBytes);
-
-		if (l_surfaceOut)
-		{
-			if (l_renderer.DrawToSurface(l_surfaceOut, 0, 0, 0, 0, l_imgWidth, l_imgHeight))
-			{
-				// fade out:
-				if (l_cut)
-				{
-					const int FADE_HEIGHT = 100;
 
-					cairo_t* cr = cairo_create(l_surfaceOut);
-					cairo_set_line_width(cr, 1);
+		// premultiplied BGRA on both sides:
+		cairo_surface_flush(l_thumb);
 
-					for (int y = 0; y < FADE_HEIGHT; y++)
-					{
-						cairo_set_source_rgba(cr, S_COLOR_T_CAIRO(l_renderer.GetBackColor()),
-							/*alpha=*/ y / static_cast<double>(FADE_HEIGHT - l_renderer.GetPadding()));
+		const unsigned char* l_thumbData = cairo_image_surface_get_data(l_thumb);
+		const int l_thumbStride = cairo_image_surface_get_stride(l_thumb);
 
-						cairo_move_to(cr, 0, l_imgHeight - 100 + y);
-						cairo_rel_line_to(cr, l_imgWidth, 0);
-						cairo_stroke(cr);
-					}
-
-					cairo_destroy(cr);
-				}
-
-				*phbmp = l_hBitmap;
-				*pdwAlpha = WTSAT_ARGB;
-
-				hr = S_OK;
-			}
-
-			cairo_surface_destroy(l_surfaceOut);
-		}
-
-		if (!SUCCEEDED(hr))
+		for (int y = 0; y < l_imgHeight; y++)
 		{
-			DeleteObject(l_hBitmap);
+			memcpy(l_rawData + y * l_bitmap.bmWidthBytes, l_thumbData + y * l_thumbStride, l_imgWidth * 4);
 		}
+
+		*phbmp = l_hBitmap;
+		*pdwAlpha = WTSAT_ARGB;
+		hr = S_OK;
 	}
 
+	cairo_surface_destroy(l_thumb);
+
 	return hr;
 }
 
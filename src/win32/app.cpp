@@ -15,6 +15,7 @@
 #include "stdafx.h"
 #include "app.h"
 #include "default_app.h"
+#include "font_cache.h"
 #include <boost/program_options.hpp>
 
 using namespace std;
@@ -67,9 +68,22 @@ INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR wszComm
 			return HRESULT_CODE(oleInitResult);
 		}
 
+		// font calibration results are kept across runs, except in portable mode:
+		const std::wstring l_appDataDir = (theApp.InPortableMode() ? L"" : CUtilWin32::GetAppDataDir(true, L"iNFekt"));
+
+		if (!l_appDataDir.empty())
+		{
+			CFontMetricsCache::GetInstance().LoadFromFile(l_appDataDir + L"font_metrics.txt");
+		}
+
 		// Run the application:
 		int l_exitCode = theApp.Run();
 
+		if (!l_appDataDir.empty())
+		{
+			CFontMetricsCache::GetInstance().SaveToFile(l_appDataDir + L"font_metrics.txt");
+		}
+
 		OleUninitialize();
 
 		return l_exitCode;
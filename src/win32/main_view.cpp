@@ -186,7 +186,48 @@ void CViewContainer::SetWrapLines(bool a_wrap)
 
 	m_wrapLines = a_wrap;
 
-	ReloadFile();
+	if (!m_nfoData || !m_nfoData->HasData())
+	{
+		return;
+	}
+
+	// re-wrap the loaded document in place, no need to read the file again:
+	int scroll_x = 0, scroll_y = 0;
+	size_t l_sourceRow = 0, l_sourceCol = 0;
+
+	// the text-only view has a stripped copy of its own, positions are mapped through the data that is shown:
+	if (m_curViewCtrl && m_curViewCtrl->GetNfoData())
+	{
+		m_curViewCtrl->GetScrollPositions(scroll_x, scroll_y);
+		m_curViewCtrl->GetNfoData()->MapToSourcePosition(scroll_y, scroll_x, l_sourceRow, l_sourceCol);
+	}
+
+	SendMessage(WM_SETREDRAW, 0);
+
+	m_renderControl->UnAssignNFO();
+	m_classicControl->UnAssignNFO();
+	m_textOnlyControl->UnAssignNFO();
+
+	if (!m_nfoData->SetWrapLines(a_wrap))
+	{
+		SendMessage(WM_SETREDRAW, 1);
+		::RedrawWindow(GetHwnd(), nullptr, nullptr, RDW_FRAME | RDW_INVALIDATE | RDW_ALLCHILDREN);
+
+		this->MessageBox(m_nfoData->GetLastErrorDescription().c_str(), _T("Fail"), MB_ICONEXCLAMATION);
+
+		return;
+	}
+
+	if (CurAssignNfo())
+	{
+		size_t l_row = 0, l_col = 0;
+
+		m_curViewCtrl->GetNfoData()->MapFromSourcePosition(l_sourceRow, l_sourceCol, l_row, l_col);
+		m_curViewCtrl->ScrollIntoView(l_row, l_col);
+	}
+
+	SendMessage(WM_SETREDRAW, 1);
+	::RedrawWindow(GetHwnd(), nullptr, nullptr, RDW_FRAME | RDW_INVALIDATE | RDW_ALLCHILDREN);
 }
 
 
@@ -39,6 +39,9 @@ CNFOViewControl::CNFOViewControl(HINSTANCE a_hInstance, HWND a_parent, bool a_cl
 	m_leftMouseDown(false), m_movedDownMouse(false)
 {
 	ClearSelection(false);
+
+	// Ctrl+wheel zooming shows scaled old stripes until the new ones are ready:
+	SetZoomPreview(true, [this] { ::InvalidateRect(m_hwnd, nullptr, FALSE); });
 }
 
 
@@ -232,7 +235,10 @@ LRESULT CNFOViewControl::WindowProc(UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 void CNFOViewControl::SetZoom(unsigned int a_percent)
 {
-	::SetCursor(::LoadCursor(nullptr, m_cursor = IDC_WAIT));
+	if (!GetZoomPreview())
+	{
+		::SetCursor(::LoadCursor(nullptr, m_cursor = IDC_WAIT));
+	}
 
 	CNFORenderer::SetZoom(a_percent);
 
@@ -382,6 +388,12 @@ void CNFOViewControl::OnPaint()
 			m_width, m_height);
 	}
 
+	if (GetOnDemandRendering())
+	{
+		// (re-)start pre-rendering after zooming etc., no-op if it's running already:
+		PreRender();
+	}
+
 	// draw highlighted (selected) text:
 	if (l_textSelected)
 	{
@@ -477,6 +489,7 @@ bool CNFOViewControl::AssignNFO(const PNFOData& a_nfo)
 
 		if (GetOnDemandRendering())
 		{
+			SetViewportHint(0, m_height / GetBlockHeight());
 			PreRender();
 		}
 
@@ -784,6 +797,12 @@ bool CNFOViewControl::HandleScrollEvent(int a_dir, int a_event, int a_change)
 	// If the position has changed, scroll the window:
 	if (l_si.nPos != l_prevPos)
 	{
+		if (a_dir == SB_VERT)
+		{
+			// pre-render ahead of where the user is going:
+			SetViewportHint(l_si.nPos, l_si.nPos + l_si.nPage, l_si.nPos - l_prevPos);
+		}
+
 		::ScrollWindow(m_hwnd, (a_dir == SB_HORZ ? (int)GetBlockWidth() * (l_prevPos - l_si.nPos) : 0),
 			(a_dir == SB_VERT ? (int)GetBlockHeight() * (l_prevPos - l_si.nPos) : 0),
 			nullptr, nullptr);
@@ -1197,6 +1216,10 @@ void CNFOViewControl::InjectSettings(const CNFORenderSettings& ns)
 
 CNFOViewControl::~CNFOViewControl()
 {
+	// workers must not call back into a half-destroyed control:
+	StopPreRendering(true);
+	SetZoomPreview(false);
+
 	::UnregisterClass(NFOVWR_CTRL_CLASS_NAME, m_instance);
 
 	if (m_hwnd)
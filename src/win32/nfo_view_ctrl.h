@@ -83,7 +83,7 @@ public:
 	bool FindTermUp(const std::wstring& a_term, size_t& a_startRow, size_t& a_startCol);
 	bool FindAndSelectTerm(const std::wstring& a_term, bool a_up);
 
-	void SetOnDemandRendering(bool nb) { m_onDemandRendering = nb; }
+	void SetOnDemandRendering(bool nb) { m_onDemandRendering = nb; SetTiledRendering(nb); }
 	bool GetOnDemandRendering() const { return m_onDemandRendering; }
 
 	virtual void InjectSettings(const CNFORenderSettings& ns);
@@ -699,6 +699,9 @@ void CSettingsTabDialog::DoPreview()
 	{
 		m_previewSettingsBackup = new CNFORenderSettings();
 		*m_previewSettingsBackup = l_ctrl->GetSettings();
+
+		// makes trying out colors a lot quicker:
+		l_ctrl->SetCacheColorLayers(true);
 	}
 
 	if (m_beforePreviewViewType == _MAIN_VIEW_MAX)
@@ -1224,6 +1227,18 @@ void CSettingsTabDialog::PopulatePluginList()
 
 CSettingsTabDialog::~CSettingsTabDialog()
 {
+	if (m_previewSettingsBackup)
+	{
+		CViewContainer *l_view = CNFOApp::GetViewContainerInstance();
+
+		switch (m_pageId)
+		{
+		case TAB_PAGE_RENDERED: l_view->GetRenderCtrl()->SetCacheColorLayers(false); break;
+		case TAB_PAGE_CLASSIC: l_view->GetClassicCtrl()->SetCacheColorLayers(false); break;
+		case TAB_PAGE_TEXTONLY: l_view->GetTextOnlyCtrl()->SetCacheColorLayers(false); break;
+		}
+	}
+
 	delete m_viewSettings;
 	delete m_previewSettingsBackup;
 }